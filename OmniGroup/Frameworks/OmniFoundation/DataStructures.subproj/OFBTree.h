@@ -21,13 +21,15 @@ typedef void (*OFBTreeNodeDeallocator)(struct _OFBTree *tree, void *node);
 typedef int  (*OFBTreeElementComparator)(const struct _OFBTree *tree, const void *elementA, const void *elementB);
 typedef void (^OFBTreeEnumerator)(const struct _OFBTree *tree, void *element);
 
+// Declared at file scope (rather than inside struct _OFBTree) so that C++ sources can see it when they use OFBTreeCursor.
+union _OFBTreeChildPointer {
+    struct _OFBTreeNode *node;
+    struct _OFBTreeLeafNode *leaf;
+};
 
 struct _OFBTree {
     // None of these fields should be written to (although they can be read if you like)
-    union _OFBTreeChildPointer {
-        struct _OFBTreeNode *node;
-        struct _OFBTreeLeafNode *leaf;
-    } root;
+    union _OFBTreeChildPointer root;
     unsigned height;
     size_t nodeSize;
     size_t elementSize;
@@ -57,6 +59,32 @@ extern void OFBTreeDeleteAll(OFBTree *tree);
 
 extern void OFBTreeEnumerate(const OFBTree *tree, OFBTreeEnumerator enumerator);
 
+// Calls the enumerator for each element in [lowValue, highValue), in order. Either bound may be NULL to leave that end of the range open.
+extern void OFBTreeEnumerateRange(const OFBTree *tree, const void *lowValue, const void *highValue, OFBTreeEnumerator enumerator);
+
+// Fills an empty tree from 'count' elements laid out contiguously, which must already be sorted in ascending order with no duplicates. The tree is built bottom-up with packed nodes, in linear time.
+extern void OFBTreeBulkLoad(OFBTree *tree, const void *elements, size_t count);
+
+// Stock comparators for elements that begin with an unsigned integer key (in native byte order), compared numerically. Trees using one of these search within each node inline, rather than calling through the comparator for every probe.
+extern int OFBTreeCompareUInt32Keys(const OFBTree *tree, const void *elementA, const void *elementB);
+extern int OFBTreeCompareUInt64Keys(const OFBTree *tree, const void *elementA, const void *elementB);
+
+/*
+ A cursor remembers the path from the root to an element, so that stepping to the neighboring element costs amortized constant time instead of the fresh descent from the root that OFBTreeNext() and OFBTreePrevious() make. Each function returns the element the cursor ends up on, or NULL if there is none; after a NULL return the cursor has to be positioned again with OFBTreeCursorFirst(), OFBTreeCursorLast() or OFBTreeCursorSeek(). A cursor is only valid until the tree is next modified.
+ */
+typedef struct _OFBTreeCursor {
+    // Private
+    union _OFBTreeChildPointer nodeStack[10];
+    void *selectionStack[10];
+    unsigned nodeStackDepth;
+} OFBTreeCursor;
+
+extern void *OFBTreeCursorFirst(const OFBTree *tree, OFBTreeCursor *cursor);
+extern void *OFBTreeCursorLast(const OFBTree *tree, OFBTreeCursor *cursor);
+extern void *OFBTreeCursorSeek(const OFBTree *tree, OFBTreeCursor *cursor, const void *value); // Positions the cursor at the first element greater than or equal to 'value'
+extern void *OFBTreeCursorNext(const OFBTree *tree, OFBTreeCursor *cursor);
+extern void *OFBTreeCursorPrevious(const OFBTree *tree, OFBTreeCursor *cursor);
+
 // This is not a terribly efficient API but it is reliable and does what I need
 extern void *OFBTreePrevious(const OFBTree *tree, const void *value);
 extern void *OFBTreeNext(const OFBTree *tree, const void *value);
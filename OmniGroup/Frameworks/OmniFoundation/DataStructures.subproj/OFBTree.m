@@ -35,12 +35,7 @@ typedef struct _OFBTreeLeafNode {
     uint8_t contents[0];
 } OFBTreeLeafNode;
 
-/*" OFBTreeCursor holds the path from the tree's root to a location in the tree. "*/
-typedef struct _OFBTreeCursor {
-    OFBTreeChildPointer nodeStack[10];
-    void *selectionStack[10];
-    unsigned nodeStackDepth;
-} OFBTreeCursor;
+/*" OFBTreeCursor (declared in the header) holds the path from the tree's root to a location in the tree. "*/
 
 
 #ifdef DEBUG
@@ -90,7 +85,7 @@ static void _OFBTreeDeallocateChildren(OFBTree *tree, OFBTreeNode *node, unsigne
     size_t elementStep = tree->elementSize + sizeof(OFBTreeChildPointer);
     for(size_t elementIndex = 0; elementIndex <= node->elementCount; elementIndex ++) {
         OFBTreeChildPointer childNode = *(OFBTreeChildPointer *)childPointer;
-        if (height > 1) {
+        if (height > 2) { // 'height' is this node's; its children are leaves when it is 2
             _OFBTreeDeallocateChildren(tree, childNode.node, height-1);
             tree->nodeDeallocator(tree, childNode.node);
         } else {
@@ -153,6 +148,55 @@ static inline OFBTreeChildPointer _OFBTreeValueGreaterChildNode(const OFBTree *b
     return *(OFBTreeChildPointer *)(value + btree->elementSize);
 }
 
+int OFBTreeCompareUInt32Keys(const OFBTree *tree, const void *elementA, const void *elementB)
+{
+    uint32_t keyA, keyB;
+    memcpy(&keyA, elementA, sizeof(keyA));
+    memcpy(&keyB, elementB, sizeof(keyB));
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+int OFBTreeCompareUInt64Keys(const OFBTree *tree, const void *elementA, const void *elementB)
+{
+    uint64_t keyA, keyB;
+    memcpy(&keyA, elementA, sizeof(keyA));
+    memcpy(&keyB, elementB, sizeof(keyB));
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+static inline uint64_t _OFBTreeLoadKey(const void *element, size_t keySize)
+{
+    if (keySize == sizeof(uint32_t)) {
+        uint32_t key;
+        memcpy(&key, element, sizeof(key));
+        return key;
+    } else {
+        uint64_t key;
+        memcpy(&key, element, sizeof(key));
+        return key;
+    }
+}
+
+/*" The number of elements in a node whose integer key is less than 'key', for the stock comparators. Halves the range without branches until it is short, then counts the rest in a straight (unrollable, branch-free) pass, so there are no mispredicted comparisons and no calls through the comparator. "*/
+static inline NSUInteger _OFBTreeIntegerKeyLowerBound(const void *element0, ptrdiff_t stride, size_t elementCount, uint64_t key, size_t keySize)
+{
+    NSUInteger low = 0;
+    size_t remaining = elementCount;
+    
+    while (remaining > 16) {
+        size_t half = remaining / 2;
+        low = (_OFBTreeLoadKey(element0 + (low + half) * stride, keySize) < key) ? low + half : low;
+        remaining -= half;
+    }
+    
+    NSUInteger lesser = 0;
+    const void *element = element0 + low * stride;
+    for (size_t elementIndex = 0; elementIndex < remaining; elementIndex++, element += stride)
+        lesser += (_OFBTreeLoadKey(element, keySize) < key);
+    
+    return low + lesser;
+}
+
 /*" Scan a node for the closest match greater than or equal to a value.
  If a match is found, returns YES and leaves the cursor positioned at that value.
  Otherwise, returns NO and leaves the cursor positioned at the first entry greater than the value.
@@ -179,6 +223,20 @@ static BOOL _OFBTreeScan(const OFBTree *btree, OFBTreeCursor *cursor, const void
         element0 = node.node->contents;
     }
     
+    size_t keySize = 0;
+    if (btree->elementCompare == OFBTreeCompareUInt64Keys)
+        keySize = sizeof(uint64_t);
+    else if (btree->elementCompare == OFBTreeCompareUInt32Keys)
+        keySize = sizeof(uint32_t);
+    
+    if (keySize) {
+        uint64_t key = _OFBTreeLoadKey(value, keySize);
+        low = _OFBTreeIntegerKeyLowerBound(element0, stride, elementCount, key, keySize);
+        testValue = element0 + low * stride;
+        cursor->selectionStack[cursor->nodeStackDepth] = testValue;
+        return (low < elementCount && _OFBTreeLoadKey(testValue, keySize) == key);
+    }
+    
     while(elementCount >= range) // range is the lowest power of 2 > count
         range <<= 1;
 
@@ -769,7 +827,7 @@ void *OFBTreeFind(const OFBTree *btree, const void *value)
 /*"
 Calls the supplied block once for each element in the tree, passing the element.  Currently, this only does a forward enumeration of the tree.
 "*/
-// TODO:  Later we could have a version of this that takes a min element, max element (either of which can be NULL) and a direction.  We'd then find the path to the two elements that don't break the range (i.e., the given min/max elements might not actually be in the tree) and start the enumeration from the starting path, continuing until we hit the ending element.
+// See OFBTreeEnumerateRange() for a bounded version.
 
 static void _OFBTreeEnumerateNode(const OFBTree *tree, OFBTreeChildPointer p, OFBTreeEnumerator enumerator, unsigned height)
 {
@@ -1000,6 +1058,187 @@ void *OFBTreeFindNear(const OFBTree *tree, const void *value, int offset, BOOL a
     return result;
 }
 
+#pragma mark - Cursors
+
+/* Given a cursor left at a leaf by _OFBTreeFind() (whose selection may be just past the leaf's last element), moves it up to the first element at or after that position. Returns the element, or NULL if the position is past the end of the tree. */
+static void *_OFBTreeCursorSettle(const OFBTree *btree, OFBTreeCursor *cursor)
+{
+    unsigned depth = cursor->nodeStackDepth;
+    OBASSERT(_isAtLeafNode(btree, cursor));
+    
+    OFBTreeLeafNode *leaf = cursor->nodeStack[depth].leaf;
+    void *value = cursor->selectionStack[depth];
+    if (value < ELEMENT_AT_INDEX(leaf, LEAF_STRIDE(btree), leaf->elementCount))
+        return value;
+    
+    // Past the end of the leaf; the next element is the separator after it in the nearest ancestor that has one.
+    ptrdiff_t stride = NODE_STRIDE(btree);
+    while (depth > 0) {
+        depth --;
+        OFBTreeNode *parent = cursor->nodeStack[depth].node;
+        value = cursor->selectionStack[depth];
+        if (value < ELEMENT_AT_INDEX(parent, stride, parent->elementCount)) {
+            cursor->nodeStackDepth = depth;
+            return value;
+        }
+    }
+    
+    return NULL;
+}
+
+void *OFBTreeCursorFirst(const OFBTree *tree, OFBTreeCursor *cursor)
+{
+    cursor->nodeStackDepth = 0;
+    cursor->nodeStack[0] = tree->root;
+    return _OFBTreeSelectFirst(tree, cursor);
+}
+
+void *OFBTreeCursorLast(const OFBTree *tree, OFBTreeCursor *cursor)
+{
+    cursor->nodeStackDepth = 0;
+    cursor->nodeStack[0] = tree->root;
+    return _OFBTreeSelectLast(tree, cursor);
+}
+
+void *OFBTreeCursorSeek(const OFBTree *tree, OFBTreeCursor *cursor, const void *value)
+{
+    if (_OFBTreeFind(tree, cursor, value))
+        return cursor->selectionStack[cursor->nodeStackDepth];
+    return _OFBTreeCursorSettle(tree, cursor);
+}
+
+void *OFBTreeCursorNext(const OFBTree *tree, OFBTreeCursor *cursor)
+{
+    return _OFBTreeCursorGreaterValue(tree, cursor);
+}
+
+void *OFBTreeCursorPrevious(const OFBTree *tree, OFBTreeCursor *cursor)
+{
+    return _OFBTreeCursorLesserValue(tree, cursor);
+}
+
+/*"
+ Calls the supplied block once for each element from lowValue (inclusive) up to highValue (exclusive), in order. Most elements live in leaves, so whenever the cursor reaches a leaf whose last element is still below highValue, the whole run of the leaf is passed to the block without any further comparisons.
+ "*/
+void OFBTreeEnumerateRange(const OFBTree *tree, const void *lowValue, const void *highValue, OFBTreeEnumerator enumerator)
+{
+    OFBTreeCursor cursor;
+    void *element;
+    
+    if (lowValue)
+        element = OFBTreeCursorSeek(tree, &cursor, lowValue);
+    else
+        element = OFBTreeCursorFirst(tree, &cursor);
+    
+    ptrdiff_t leafStride = LEAF_STRIDE(tree);
+    while (element) {
+        if (_isAtLeafNode(tree, &cursor)) {
+            OFBTreeLeafNode *leaf = cursor.nodeStack[cursor.nodeStackDepth].leaf;
+            void *end = ELEMENT_AT_INDEX(leaf, leafStride, leaf->elementCount);
+            void *last = end - leafStride;
+            if (!highValue || tree->elementCompare(tree, last, highValue) < 0) {
+                for (; element < end; element += leafStride)
+                    enumerator(tree, element);
+                cursor.selectionStack[cursor.nodeStackDepth] = last;
+                element = _OFBTreeCursorGreaterValue(tree, &cursor);
+                continue;
+            }
+        }
+        
+        if (highValue && tree->elementCompare(tree, element, highValue) >= 0)
+            break;
+        enumerator(tree, element);
+        element = _OFBTreeCursorGreaterValue(tree, &cursor);
+    }
+}
+
+#pragma mark - Bulk loading
+
+/*"
+ Builds the tree bottom-up from sorted elements: the elements are cut into runs for the leaves with one separator element between neighboring leaves, then the separators and leaves are grouped into the internal nodes of the next level up (again promoting one separator between each pair of nodes), and so on until a single root remains. Nodes at each level get as close to equal counts as possible, which keeps every non-root node at least about half full, as the deletion code expects.
+ "*/
+void OFBTreeBulkLoad(OFBTree *btree, const void *elements, size_t count)
+{
+    OBPRECONDITION(btree->height == 1 && btree->root.leaf->elementCount == 0);
+#ifdef OMNI_ASSERTIONS_ON
+    for (size_t elementIndex = 1; elementIndex < count; elementIndex++)
+        OBPRECONDITION(btree->elementCompare(btree, elements + (elementIndex - 1) * btree->elementSize, elements + elementIndex * btree->elementSize) < 0);
+#endif
+    
+    const size_t elementSize = btree->elementSize;
+    const size_t leafCapacity = btree->elementsPerLeafNode;
+    const size_t nodeCapacity = btree->elementsPerInternalNode;
+    
+    if (count <= leafCapacity) {
+        memcpy(btree->root.leaf->contents, elements, count * elementSize);
+        btree->root.leaf->elementCount = count;
+        return;
+    }
+    
+    // Each leaf but the last is followed by a separator, so k leaves hold count - (k - 1) elements.
+    size_t childCount = (count + 1 + leafCapacity) / (leafCapacity + 1);
+    OFBTreeChildPointer *children = malloc(childCount * sizeof(*children));
+    void *separators = malloc((childCount - 1) * elementSize);
+    
+    const void *source = elements;
+    size_t leafElements = count - (childCount - 1);
+    for (size_t childIndex = 0; childIndex < childCount; childIndex++) {
+        size_t leafCount = leafElements / childCount + (childIndex < leafElements % childCount ? 1 : 0);
+        OBASSERT(leafCount > 0 && leafCount <= leafCapacity);
+        
+        OFBTreeLeafNode *leaf = btree->nodeAllocator(btree);
+        leaf->elementCount = leafCount;
+        memcpy(leaf->contents, source, leafCount * elementSize);
+        source += leafCount * elementSize;
+        children[childIndex].leaf = leaf;
+        
+        if (childIndex + 1 < childCount) {
+            memcpy(separators + childIndex * elementSize, source, elementSize);
+            source += elementSize;
+        }
+    }
+    OBASSERT(source == elements + count * elementSize);
+    unsigned height = 1;
+    
+    // Each level up groups the children into nodes of up to nodeCapacity + 1 children, consuming the separators between them and promoting the separators between the new nodes. The new level is written over the front of the old one's arrays, which it never overtakes.
+    ptrdiff_t nodeStride = NODE_STRIDE(btree);
+    while (childCount > 1) {
+        size_t parentCount = (childCount + nodeCapacity) / (nodeCapacity + 1);
+        size_t childIndex = 0, separatorIndex = 0;
+        
+        for (size_t parentIndex = 0; parentIndex < parentCount; parentIndex++) {
+            size_t nodeChildren = childCount / parentCount + (parentIndex < childCount % parentCount ? 1 : 0);
+            OBASSERT(nodeChildren >= 2 && nodeChildren <= nodeCapacity + 1);
+            
+            OFBTreeNode *node = btree->nodeAllocator(btree);
+            node->elementCount = nodeChildren - 1;
+            node->childZero = children[childIndex++];
+            for (size_t elementIndex = 0; elementIndex < nodeChildren - 1; elementIndex++) {
+                void *element = ELEMENT_AT_INDEX(node, nodeStride, elementIndex);
+                memcpy(element, separators + separatorIndex++ * elementSize, elementSize);
+                *(OFBTreeChildPointer *)(element + elementSize) = children[childIndex++];
+            }
+            
+            children[parentIndex].node = node;
+            if (parentIndex + 1 < parentCount)
+                memmove(separators + parentIndex * elementSize, separators + separatorIndex++ * elementSize, elementSize);
+        }
+        OBASSERT(childIndex == childCount);
+        OBASSERT(separatorIndex == childCount - 1);
+        
+        childCount = parentCount;
+        height ++;
+    }
+    
+    OBASSERT(height <= sizeof(((OFBTreeCursor *)NULL)->nodeStack) / sizeof(OFBTreeChildPointer));
+    btree->nodeDeallocator(btree, btree->root.leaf);
+    btree->root = children[0];
+    btree->height = height;
+    
+    free(children);
+    free(separators);
+}
+
 #ifdef DEBUG
 
 static void OFBTreeDumpElement(FILE *fp, const OFBTree *btree, const void *value)
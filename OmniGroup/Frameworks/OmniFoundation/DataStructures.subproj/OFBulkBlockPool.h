@@ -25,6 +25,8 @@
 // OFBulkBlockPool provides an optimized way to allocate a large number of fixed size blocks quickly and with very little overhead.  Currently, only double-word alignment is guaranteed (so you shouldn't attempt to store doubles or long longs in your blocks).  This works best for small blocks.  The amount of wasted space goes up proportionally to the size of the block.  The block size must be at least the size of a pointer.  In order to maximize performance, OFBulkBlockPool is not thread-safe.  The caller is responsible for providing this functionality should it be needed.
 //
 // Allocation is slightly faster than deallocation.  Free pages are not deallocated when all of the contained blocks on that pages are deallocated.  This could be implemented without too much trouble, but it would take up some small amount of space and time.
+//
+// OFConcurrentBulkBlockPool, below, is a thread-safe variant that does give empty pages back.
 
 
 typedef struct _OFBulkBlockPage {
@@ -140,3 +142,25 @@ static inline void OFBulkBlockPoolDeallocate(OFByte *block)
 #endif
 }
 
+
+//
+// OFConcurrentBulkBlockPool is a thread-safe variant of OFBulkBlockPool.  Each thread that allocates from a pool keeps a magazine (a small stack) of free blocks for it, so most allocations and deallocations touch no shared state and take no locks; magazines are refilled from, and overflow back into, the pool's pages in batches under the pool's lock.  Blocks deallocated by a thread that has never allocated from the pool go onto a lock-free list on their page instead, and the pool collects them the next time it needs free blocks.  Pages that become completely free are kept for reuse, up to 'emptyPageHighWaterMark' of them, and beyond that are given back to the system.
+//
+// Each pool uses one pthread key, so this is meant for a modest number of long-lived pools.  Blocks are pointer-aligned.
+//
+
+typedef struct _OFConcurrentBulkBlockPool OFConcurrentBulkBlockPool;
+
+extern OFConcurrentBulkBlockPool *OFConcurrentBulkBlockPoolCreate(size_t blockSize, size_t emptyPageHighWaterMark);
+
+extern void OFConcurrentBulkBlockPoolDestroy(OFConcurrentBulkBlockPool *pool);
+// Frees the pool and all of its memory, including any blocks still allocated.  No other thread may be using the pool, or use it afterwards.
+
+extern OFByte *OFConcurrentBulkBlockPoolAllocate(OFConcurrentBulkBlockPool *pool);
+// Allocates and returns a new block of memory.  The contents of the memory are indeterminant.
+
+extern void OFConcurrentBulkBlockPoolDeallocate(OFByte *block);
+// Returns a block to the pool it came from.  This may be called on any thread, not just the one that allocated the block.
+
+extern void OFConcurrentBulkBlockPoolReportStatistics(OFConcurrentBulkBlockPool *pool);
+// Prints out page usage and fragmentation, and each thread's magazine hit rates.  The per-thread counters are read without synchronization, so they are only approximate while other threads are using the pool.
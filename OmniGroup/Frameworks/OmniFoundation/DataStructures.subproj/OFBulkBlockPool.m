@@ -7,6 +7,9 @@
 
 #import <OmniFoundation/OFBulkBlockPool.h>
 
+#import <pthread.h>
+#import <libkern/OSAtomic.h>
+
 RCS_ID("$Id$")
 
 size_t _OFBulkBlockPageSize;
@@ -143,6 +146,7 @@ void OFBulkBlockPoolReportStatistics(OFBulkBlockPool *pool)
     fprintf(stderr, "  blocks per page       = %" PRIiPTR "\n", blocksPerPage);
     fprintf(stderr, "  wasted bytes per page = %" PRIiPTR "\n", (size_t)NSPageSize() - blocksPerPage * pool->blockSize);
 
+    size_t totalFreeCount = 0, partialPageCount = 0, emptyPageCount = 0;
     for (pageIndex = 0; pageIndex < pool->pageCount; pageIndex++) {
         OFBulkBlockPage *page;
         size_t freeCount;
@@ -161,9 +165,450 @@ void OFBulkBlockPoolReportStatistics(OFBulkBlockPool *pool)
         }
 
         fprintf(stderr, "  page = %p, free blocks = %" PRIiPTR ", allocated blocks = %" PRIiPTR "\n", (void *)page, freeCount, blocksPerPage - freeCount);
+
+        totalFreeCount += freeCount;
+        if (freeCount == blocksPerPage)
+            emptyPageCount++;
+        else if (freeCount)
+            partialPageCount++;
+    }
+
+    // Free blocks on partially used pages are fragmentation: the pages can't be reclaimed while any of their other blocks are live
+    size_t totalBlockCount = pool->pageCount * blocksPerPage;
+    if (totalBlockCount) {
+        fprintf(stderr, "  allocated blocks      = %" PRIiPTR " of %" PRIiPTR " (%.1f%% utilization)\n", totalBlockCount - totalFreeCount, totalBlockCount, 100.0 * (totalBlockCount - totalFreeCount) / totalBlockCount);
+        fprintf(stderr, "  partially used pages  = %" PRIiPTR ", empty pages = %" PRIiPTR "\n", partialPageCount, emptyPageCount);
+    }
+}
+
+#pragma mark - OFConcurrentBulkBlockPool
+
+// Number of blocks a thread's magazine can hold.  Refills fill it halfway, and an overflow returns the top half, so a thread that alternates between allocating and freeing doesn't bounce off the pool lock on every call.
+#define OFConcurrentBulkBlockMagazineSize (64)
+
+typedef struct _OFConcurrentBulkBlockPage {
+    OFConcurrentBulkBlockPool *pool;
+    OFByte * volatile remoteFreeList; // blocks freed by threads with no magazine; pushed without the lock, taken whole under it
+    struct _OFConcurrentBulkBlockPage * volatile nextRemotePage; // link in pool->remotePages while remoteFreeList is non-empty
+    OFByte *freeList; // protected by the pool lock, like everything below
+    size_t allocatedCount; // blocks not on freeList: in use, in a magazine or on remoteFreeList
+    size_t pageIndex; // index into pool->pages
+    struct _OFConcurrentBulkBlockPage *nextAvailable, *previousAvailable; // links in pool->availablePages while freeList is non-empty
+    OFByte *data[0];
+} OFConcurrentBulkBlockPage;
+
+typedef struct _OFConcurrentBulkBlockMagazine {
+    OFConcurrentBulkBlockPool *pool;
+    struct _OFConcurrentBulkBlockMagazine *next, *previous; // links in pool->magazines, protected by the pool lock
+    pthread_t thread;
+
+    // Only written by the owning thread
+    size_t allocationHits, allocationMisses;
+    size_t deallocationHits, deallocationOverflows;
+
+    size_t count;
+    OFByte *blocks[OFConcurrentBulkBlockMagazineSize];
+} OFConcurrentBulkBlockMagazine;
+
+struct _OFConcurrentBulkBlockPool {
+    pthread_mutex_t lock;
+    pthread_key_t magazineKey;
+
+    size_t blockSize;
+    size_t allocationSize; // blockSize rounded up to a multiple of sizeof(void *)
+    size_t blocksPerPage;
+    size_t emptyPageHighWaterMark;
+
+    OFConcurrentBulkBlockPage * volatile remotePages; // pages with blocks on their remoteFreeList; pushed without the lock
+
+    // Protected by the lock
+    OFConcurrentBulkBlockPage **pages;
+    size_t pageCount, pageCapacity;
+    OFConcurrentBulkBlockPage *availablePages;
+    size_t emptyPageCount;
+    OFConcurrentBulkBlockMagazine *magazines;
+
+    // Statistics, protected by the lock
+    size_t pagesAllocated, pagesReleased;
+    size_t remoteDeallocations; // only counted as they are collected, to keep the remote path to two atomic operations
+    size_t retiredAllocationHits, retiredAllocationMisses; // totals from magazines whose threads have exited
+    size_t retiredDeallocationHits, retiredDeallocationOverflows;
+};
+
+static inline OFConcurrentBulkBlockPage *_OFConcurrentBulkBlockPageForBlock(OFByte *block)
+{
+    OBASSERT(_OFBulkBlockPageSize);
+    return (OFConcurrentBulkBlockPage *)((uintptr_t)block & ~(uintptr_t)(_OFBulkBlockPageSize - 1));
+}
+
+static void _OFConcurrentBulkBlockPoolAddAvailablePage(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockPage *page)
+{
+    page->previousAvailable = NULL;
+    page->nextAvailable = pool->availablePages;
+    if (pool->availablePages)
+        pool->availablePages->previousAvailable = page;
+    pool->availablePages = page;
+}
+
+static void _OFConcurrentBulkBlockPoolRemoveAvailablePage(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockPage *page)
+{
+    if (page->previousAvailable)
+        page->previousAvailable->nextAvailable = page->nextAvailable;
+    else {
+        OBASSERT(pool->availablePages == page);
+        pool->availablePages = page->nextAvailable;
+    }
+    if (page->nextAvailable)
+        page->nextAvailable->previousAvailable = page->previousAvailable;
+    page->nextAvailable = page->previousAvailable = NULL;
+}
+
+static void _OFConcurrentBulkBlockPoolAllocatePage(OFConcurrentBulkBlockPool *pool)
+{
+    if (pool->pageCount == pool->pageCapacity) {
+        pool->pageCapacity = pool->pageCapacity ? 2 * pool->pageCapacity : 16;
+        if (pool->pages)
+            pool->pages = NSZoneRealloc(NSDefaultMallocZone(), pool->pages, sizeof(*pool->pages) * pool->pageCapacity);
+        else
+            pool->pages = NSZoneMalloc(NSDefaultMallocZone(), sizeof(*pool->pages) * pool->pageCapacity);
+    }
+
+    // Page-sized allocations are page-aligned, which is what lets a block find its page by masking
+    OFConcurrentBulkBlockPage *page = NSAllocateMemoryPages(_OFBulkBlockPageSize);
+    OBASSERT(((uintptr_t)page & (_OFBulkBlockPageSize - 1)) == 0);
+
+    page->pool = pool;
+    page->remoteFreeList = NULL;
+    page->nextRemotePage = NULL;
+    page->allocatedCount = 0;
+    page->pageIndex = pool->pageCount;
+    pool->pages[pool->pageCount++] = page;
+
+    OFByte *block = (OFByte *)&page->data[0];
+    page->freeList = block;
+    for (size_t blockIndex = 1; blockIndex < pool->blocksPerPage; blockIndex++) {
+        OFByte *nextBlock = block + pool->allocationSize;
+        *(OFByte **)block = nextBlock;
+        block = nextBlock;
+    }
+    *(OFByte **)block = NULL;
+    OBASSERT(block + pool->allocationSize <= (OFByte *)page + _OFBulkBlockPageSize);
+
+    _OFConcurrentBulkBlockPoolAddAvailablePage(pool, page);
+    pool->emptyPageCount++;
+    pool->pagesAllocated++;
+}
+
+static void _OFConcurrentBulkBlockPoolReleasePage(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockPage *page)
+{
+    OBPRECONDITION(page->allocatedCount == 0);
+    OBPRECONDITION(page->remoteFreeList == NULL);
+
+    _OFConcurrentBulkBlockPoolRemoveAvailablePage(pool, page);
+
+    OFConcurrentBulkBlockPage *lastPage = pool->pages[--pool->pageCount];
+    pool->pages[page->pageIndex] = lastPage;
+    lastPage->pageIndex = page->pageIndex;
+
+    NSDeallocateMemoryPages(page, _OFBulkBlockPageSize);
+    pool->emptyPageCount--;
+    pool->pagesReleased++;
+}
+
+// Puts a list of 'count' blocks, all from 'page', back on the page's free list.  Called with the lock held.
+static void _OFConcurrentBulkBlockPoolReturnBlocks(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockPage *page, OFByte *head, OFByte *tail, size_t count)
+{
+    OBPRECONDITION(page->allocatedCount >= count);
+
+    if (!page->freeList)
+        _OFConcurrentBulkBlockPoolAddAvailablePage(pool, page);
+    *(OFByte **)tail = page->freeList;
+    page->freeList = head;
+
+    page->allocatedCount -= count;
+    if (page->allocatedCount == 0) {
+        pool->emptyPageCount++;
+        if (pool->emptyPageCount > pool->emptyPageHighWaterMark)
+            _OFConcurrentBulkBlockPoolReleasePage(pool, page);
+    }
+}
+
+// Takes every page's remote free list and merges it into the page's free list.  Called with the lock held.
+static void _OFConcurrentBulkBlockPoolCollectRemoteBlocks(OFConcurrentBulkBlockPool *pool)
+{
+    OFConcurrentBulkBlockPage *page;
+    do {
+        page = pool->remotePages;
+    } while (!OSAtomicCompareAndSwapPtrBarrier(page, NULL, (void * volatile *)&pool->remotePages));
+
+    while (page) {
+        // Read the link before emptying the page's list; once the list is empty, a remote free may push the page again.
+        OFConcurrentBulkBlockPage *nextPage = page->nextRemotePage;
+
+        OFByte *head;
+        do {
+            head = page->remoteFreeList;
+        } while (!OSAtomicCompareAndSwapPtrBarrier(head, NULL, (void * volatile *)&page->remoteFreeList));
+        OBASSERT(head);
+
+        OFByte *tail = head;
+        size_t count = 1;
+        while (*(OFByte **)tail) {
+            tail = *(OFByte **)tail;
+            count++;
+        }
+        _OFConcurrentBulkBlockPoolReturnBlocks(pool, page, head, tail, count);
+        pool->remoteDeallocations += count;
+
+        page = nextPage;
+    }
+}
+
+// Fills the magazine up to 'count' blocks.  Called with the lock held.
+static void _OFConcurrentBulkBlockPoolRefillMagazine(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockMagazine *magazine, size_t count)
+{
+    // Collecting only visits pages that have remote frees, so do it every time rather than letting those blocks sit while other pages are carved up
+    if (pool->remotePages)
+        _OFConcurrentBulkBlockPoolCollectRemoteBlocks(pool);
+
+    while (magazine->count < count) {
+        OFConcurrentBulkBlockPage *page = pool->availablePages;
+        if (!page) {
+            _OFConcurrentBulkBlockPoolAllocatePage(pool);
+            continue;
+        }
+
+        if (page->allocatedCount == 0)
+            pool->emptyPageCount--;
+        while (page->freeList && magazine->count < count) {
+            OFByte *block = page->freeList;
+            page->freeList = *(OFByte **)block;
+            magazine->blocks[magazine->count++] = block;
+            page->allocatedCount++;
+        }
+        if (!page->freeList)
+            _OFConcurrentBulkBlockPoolRemoveAvailablePage(pool, page);
     }
 }
 
+// Returns magazine blocks down to 'count' to their pages.  Called with the lock held.
+static void _OFConcurrentBulkBlockPoolFlushMagazine(OFConcurrentBulkBlockPool *pool, OFConcurrentBulkBlockMagazine *magazine, size_t count)
+{
+    while (magazine->count > count) {
+        // Blocks freed together usually share a page, so hand back runs from the same page in one go
+        OFByte *head = magazine->blocks[--magazine->count];
+        OFConcurrentBulkBlockPage *page = _OFConcurrentBulkBlockPageForBlock(head);
+        OFByte *tail = head;
+        size_t runCount = 1;
+        while (magazine->count > count && _OFConcurrentBulkBlockPageForBlock(magazine->blocks[magazine->count - 1]) == page) {
+            OFByte *block = magazine->blocks[--magazine->count];
+            *(OFByte **)tail = block;
+            tail = block;
+            runCount++;
+        }
+        _OFConcurrentBulkBlockPoolReturnBlocks(pool, page, head, tail, runCount);
+    }
+}
+
+static void _OFConcurrentBulkBlockMagazineRetire(void *value)
+{
+    OFConcurrentBulkBlockMagazine *magazine = value;
+    OFConcurrentBulkBlockPool *pool = magazine->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    _OFConcurrentBulkBlockPoolFlushMagazine(pool, magazine, 0);
+
+    if (magazine->previous)
+        magazine->previous->next = magazine->next;
+    else
+        pool->magazines = magazine->next;
+    if (magazine->next)
+        magazine->next->previous = magazine->previous;
+
+    pool->retiredAllocationHits += magazine->allocationHits;
+    pool->retiredAllocationMisses += magazine->allocationMisses;
+    pool->retiredDeallocationHits += magazine->deallocationHits;
+    pool->retiredDeallocationOverflows += magazine->deallocationOverflows;
+    pthread_mutex_unlock(&pool->lock);
+
+    NSZoneFree(NSDefaultMallocZone(), magazine);
+}
+
+static OFConcurrentBulkBlockMagazine *_OFConcurrentBulkBlockPoolCreateMagazine(OFConcurrentBulkBlockPool *pool)
+{
+    OFConcurrentBulkBlockMagazine *magazine = NSZoneCalloc(NSDefaultMallocZone(), 1, sizeof(*magazine));
+    magazine->pool = pool;
+    magazine->thread = pthread_self();
+
+    pthread_mutex_lock(&pool->lock);
+    magazine->next = pool->magazines;
+    if (pool->magazines)
+        pool->magazines->previous = magazine;
+    pool->magazines = magazine;
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_setspecific(pool->magazineKey, magazine);
+    return magazine;
+}
+
+OFConcurrentBulkBlockPool *OFConcurrentBulkBlockPoolCreate(size_t blockSize, size_t emptyPageHighWaterMark)
+{
+    OBPRECONDITION(blockSize >= sizeof(void *));
+    OBPRECONDITION(blockSize <= NSPageSize() - sizeof(OFConcurrentBulkBlockPage));
+
+    // We set this each time -- doesn't really hurt anything
+    _OFBulkBlockPageSize = NSPageSize();
+
+    OFConcurrentBulkBlockPool *pool = NSZoneCalloc(NSDefaultMallocZone(), 1, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    int rc = pthread_key_create(&pool->magazineKey, _OFConcurrentBulkBlockMagazineRetire);
+    OBASSERT(rc == 0); OB_UNUSED_VALUE(rc);
+
+    pool->blockSize = blockSize;
+    pool->allocationSize = (blockSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->blocksPerPage = (_OFBulkBlockPageSize - sizeof(OFConcurrentBulkBlockPage)) / pool->allocationSize;
+    pool->emptyPageHighWaterMark = emptyPageHighWaterMark;
+
+    return pool;
+}
+
+void OFConcurrentBulkBlockPoolDestroy(OFConcurrentBulkBlockPool *pool)
+{
+    // Deleting the key first means exiting threads will no longer try to retire their magazines into this pool.
+    pthread_key_delete(pool->magazineKey);
+
+    OFConcurrentBulkBlockMagazine *magazine = pool->magazines;
+    while (magazine) {
+        OFConcurrentBulkBlockMagazine *nextMagazine = magazine->next;
+        NSZoneFree(NSDefaultMallocZone(), magazine);
+        magazine = nextMagazine;
+    }
+
+    for (size_t pageIndex = 0; pageIndex < pool->pageCount; pageIndex++)
+        NSDeallocateMemoryPages(pool->pages[pageIndex], _OFBulkBlockPageSize);
+    if (pool->pages)
+        NSZoneFree(NSDefaultMallocZone(), pool->pages);
+
+    pthread_mutex_destroy(&pool->lock);
+    NSZoneFree(NSDefaultMallocZone(), pool);
+}
+
+OFByte *OFConcurrentBulkBlockPoolAllocate(OFConcurrentBulkBlockPool *pool)
+{
+    OBPRECONDITION(pool);
+
+    OFConcurrentBulkBlockMagazine *magazine = pthread_getspecific(pool->magazineKey);
+    if (magazine && magazine->count) {
+        magazine->allocationHits++;
+        return magazine->blocks[--magazine->count];
+    }
+
+    if (!magazine)
+        magazine = _OFConcurrentBulkBlockPoolCreateMagazine(pool);
+    magazine->allocationMisses++;
+
+    pthread_mutex_lock(&pool->lock);
+    _OFConcurrentBulkBlockPoolRefillMagazine(pool, magazine, OFConcurrentBulkBlockMagazineSize / 2);
+    pthread_mutex_unlock(&pool->lock);
+
+    return magazine->blocks[--magazine->count];
+}
+
+void OFConcurrentBulkBlockPoolDeallocate(OFByte *block)
+{
+    OBPRECONDITION(block);
+
+    OFConcurrentBulkBlockPage *page = _OFConcurrentBulkBlockPageForBlock(block);
+    OFConcurrentBulkBlockPool *pool = page->pool;
+
+    OFConcurrentBulkBlockMagazine *magazine = pthread_getspecific(pool->magazineKey);
+    if (magazine) {
+        if (magazine->count == OFConcurrentBulkBlockMagazineSize) {
+            magazine->deallocationOverflows++;
+            pthread_mutex_lock(&pool->lock);
+            _OFConcurrentBulkBlockPoolFlushMagazine(pool, magazine, OFConcurrentBulkBlockMagazineSize / 2);
+            pthread_mutex_unlock(&pool->lock);
+        } else
+            magazine->deallocationHits++;
+        magazine->blocks[magazine->count++] = block;
+        return;
+    }
+
+    // This thread has never allocated from the pool (a consumer in a producer/consumer setup, say); rather than give it a magazine that would only ever fill up, push the block on its page's remote list.  The page itself goes on the pool's remote list when its list goes from empty to non-empty.  Both lists are only ever emptied whole, by swapping in NULL, so there is no ABA problem.
+    OFByte *head;
+    do {
+        head = page->remoteFreeList;
+        *(OFByte **)block = head;
+    } while (!OSAtomicCompareAndSwapPtrBarrier(head, block, (void * volatile *)&page->remoteFreeList));
+
+    if (!head) {
+        OFConcurrentBulkBlockPage *remotePage;
+        do {
+            remotePage = pool->remotePages;
+            page->nextRemotePage = remotePage;
+        } while (!OSAtomicCompareAndSwapPtrBarrier(remotePage, page, (void * volatile *)&pool->remotePages));
+    }
+}
+
+void OFConcurrentBulkBlockPoolReportStatistics(OFConcurrentBulkBlockPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    size_t freeCount = 0, partialPageCount = 0, pendingRemoteCount = 0;
+    for (size_t pageIndex = 0; pageIndex < pool->pageCount; pageIndex++) {
+        OFConcurrentBulkBlockPage *page = pool->pages[pageIndex];
+        freeCount += pool->blocksPerPage - page->allocatedCount;
+        if (page->allocatedCount && page->freeList)
+            partialPageCount++;
+        for (OFByte *block = page->remoteFreeList; block; block = *(OFByte **)block)
+            pendingRemoteCount++;
+    }
+
+    size_t magazineCount = 0, cachedCount = 0;
+    for (OFConcurrentBulkBlockMagazine *magazine = pool->magazines; magazine; magazine = magazine->next) {
+        magazineCount++;
+        cachedCount += magazine->count;
+    }
+
+    size_t totalBlockCount = pool->pageCount * pool->blocksPerPage;
+    size_t inUseCount = totalBlockCount - freeCount - cachedCount - pendingRemoteCount;
+
+    fprintf(stderr, "concurrent pool = %p\n", (void *)pool);
+    fprintf(stderr, "  bytes per block       = %" PRIiPTR " (%" PRIiPTR " allocated)\n", pool->blockSize, pool->allocationSize);
+    fprintf(stderr, "  blocks per page       = %" PRIiPTR "\n", pool->blocksPerPage);
+    fprintf(stderr, "  number of pages       = %" PRIiPTR " (%" PRIiPTR " empty, %" PRIiPTR " partially used, high-water mark %" PRIiPTR ")\n", pool->pageCount, pool->emptyPageCount, partialPageCount, pool->emptyPageHighWaterMark);
+    fprintf(stderr, "  pages allocated       = %" PRIiPTR ", released = %" PRIiPTR "\n", pool->pagesAllocated, pool->pagesReleased);
+    if (totalBlockCount) {
+        fprintf(stderr, "  blocks in use         = %" PRIiPTR " of %" PRIiPTR " (%.1f%% utilization)\n", inUseCount, totalBlockCount, 100.0 * inUseCount / totalBlockCount);
+        fprintf(stderr, "  blocks free on pages  = %" PRIiPTR ", in magazines = %" PRIiPTR ", awaiting collection = %" PRIiPTR "\n", freeCount, cachedCount, pendingRemoteCount);
+    }
+
+    size_t allocationHits = pool->retiredAllocationHits, allocationMisses = pool->retiredAllocationMisses;
+    size_t deallocationHits = pool->retiredDeallocationHits, deallocationOverflows = pool->retiredDeallocationOverflows;
+    fprintf(stderr, "  remote deallocations  = %" PRIiPTR " collected\n", pool->remoteDeallocations);
+    fprintf(stderr, "  threads               = %" PRIiPTR "\n", magazineCount);
+    for (OFConcurrentBulkBlockMagazine *magazine = pool->magazines; magazine; magazine = magazine->next) {
+        size_t allocations = magazine->allocationHits + magazine->allocationMisses;
+        size_t deallocations = magazine->deallocationHits + magazine->deallocationOverflows;
+        fprintf(stderr, "    thread %p: %" PRIiPTR " allocations (%.1f%% hits), %" PRIiPTR " deallocations (%.1f%% hits), %" PRIiPTR " cached\n",
+                (void *)magazine->thread,
+                allocations, allocations ? 100.0 * magazine->allocationHits / allocations : 0.0,
+                deallocations, deallocations ? 100.0 * magazine->deallocationHits / deallocations : 0.0,
+                magazine->count);
+
+        allocationHits += magazine->allocationHits;
+        allocationMisses += magazine->allocationMisses;
+        deallocationHits += magazine->deallocationHits;
+        deallocationOverflows += magazine->deallocationOverflows;
+    }
+    if (allocationHits + allocationMisses)
+        fprintf(stderr, "  overall allocation hit rate = %.1f%%\n", 100.0 * allocationHits / (allocationHits + allocationMisses));
+    if (deallocationHits + deallocationOverflows)
+        fprintf(stderr, "  overall deallocation hit rate = %.1f%%\n", 100.0 * deallocationHits / (deallocationHits + deallocationOverflows));
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
 #ifdef TEST
 
 static BOOL OFBulkBlockPoolCheckFreeLists(OFBulkBlockPool *pool)
@@ -11,6 +11,7 @@
 #import <OmniFoundation/OFTransformStream.h>
 
 #import <bzlib.h>
+#import <zlib.h>
 
 @interface OFBzip2DecompressTransform : NSObject <OFStreamTransformer>
 {
@@ -38,8 +39,39 @@
 
 @end
 
-@interface NSInputStream (OFStreamCompression)
+// Inflates gzip or zlib-wrapped data (the format is detected from the header), or raw deflate data if OFStreamGzipRawDeflateKey is set.
+@interface OFGzipDecompressTransform : NSObject <OFStreamTransformer>
+{
+    z_stream zlib;
+    BOOL streamInit;
+    BOOL rawDeflate;
+    BOOL inputDone;
+    BOOL outputPending;
+    
+    struct OFTransformStreamBuffer buf;
+}
+
+@end
+
+// Deflates data into the gzip format, or raw deflate data if OFStreamGzipRawDeflateKey is set.
+@interface OFGzipCompressTransform : NSObject <OFStreamTransformer>
+{
+    z_stream zlib;
+    
+    short streamState;
+    short compressionLevel;
+    BOOL rawDeflate;
+    
+    struct OFTransformStreamBuffer buf;
+}
+
+@end
 
+// Each of these returns an autoreleased OFInputTransformStream reading from the receiver, which decompresses incrementally as it is read.
+@interface NSInputStream (OFStreamCompression)
+- (NSInputStream *)inputStreamByDecompressingBzip2;
+- (NSInputStream *)inputStreamByDecompressingGzip;
+- (NSInputStream *)inputStreamByDecompressingXZ;
 @end
 
 #if 0  // TODO
@@ -51,3 +83,4 @@
 // Properties
 OmniFoundation_EXTERN NSString * const OFStreamCompressionLevelKey;    // For gzip or bzip2 streams (0=fast, 9=thorough)
 OmniFoundation_EXTERN NSString * const OFStreamBzipSmallSizeHintKey;
+OmniFoundation_EXTERN NSString * const OFStreamGzipRawDeflateKey;      // For gzip streams: no gzip or zlib wrapper, just deflate data
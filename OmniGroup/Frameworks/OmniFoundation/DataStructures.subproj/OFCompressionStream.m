@@ -10,11 +10,13 @@
 #import <Foundation/Foundation.h>
 #import <OmniBase/OmniBase.h>
 #import <OmniFoundation/OmniFoundation.h>
+#import <OmniFoundation/OFXZUtilities.h>
 
 RCS_ID("$Id$");
 
 NSString * const OFStreamCompressionLevelKey = @"OFStream Conmpression Level";
 NSString * const OFStreamBzipSmallSizeHintKey = @"OFStream bzip2 small size hint";
+NSString * const OFStreamGzipRawDeflateKey = @"OFStream gzip raw deflate";
 
 
 @implementation OFBzip2DecompressTransform
@@ -299,3 +301,335 @@ enum {
 
 
 @end
+
+
+static enum OFStreamTransformerResult _zlibTransformError(BOOL compressing, int rc, z_stream *state, NSError **outError)
+{
+    if (outError) {
+        NSString *description = compressing ? NSLocalizedStringFromTableInBundle(@"Unable to compress data.", @"OmniFoundation", OMNI_BUNDLE, @"compression error description") : NSLocalizedStringFromTableInBundle(@"Unable to decompress data.", @"OmniFoundation", OMNI_BUNDLE, @"decompression error description");
+        NSString *reason;
+        if (state && state->msg)
+            reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"zlib returned error code %d. %s.", @"OmniFoundation", OMNI_BUNDLE, @"zlib error reason"), rc, state->msg];
+        else
+            reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"zlib returned error code %d.", @"OmniFoundation", OMNI_BUNDLE, @"zlib error reason"), rc];
+        OFError(outError, compressing ? OFUnableToCompressData : OFUnableToDecompressData, description, reason);
+    }
+    return OFStreamTransformerError;
+}
+
+static id _zlibOffsetProperty(uLong totalOut)
+{
+    if (totalOut < INT_MAX) // Not UINT_MAX, because of RADAR #3513632
+        return [NSNumber numberWithUnsignedInt:(unsigned int)totalOut];
+    else
+        return [NSNumber numberWithUnsignedLongLong:totalOut];
+}
+
+@implementation OFGzipDecompressTransform
+
+- (void)dealloc
+{
+    if (streamInit) {
+        inflateEnd(&zlib);
+        streamInit = NO;
+    }
+    if (buf.ownsBuffer && buf.buffer)
+        free(buf.buffer);
+    [super dealloc];
+}
+
+- (NSArray *)allKeys
+{
+    return [NSArray arrayWithObjects:OFStreamGzipRawDeflateKey, nil];
+}
+
+- propertyForKey:(NSString *)aKey
+{
+    if ([aKey isEqualToString:NSStreamFileCurrentOffsetKey]) {
+        return _zlibOffsetProperty(zlib.total_out);
+    } else if ([aKey isEqualToString:OFStreamGzipRawDeflateKey]) {
+        return [NSNumber numberWithBool:rawDeflate];
+    }
+    
+    return nil;
+}
+
+- (void)setProperty:prop forKey:(NSString *)aKey
+{
+    if (streamInit)
+        OBRejectInvalidCall(self, _cmd, @"Stream is already open");
+    
+    if ([aKey isEqualToString:OFStreamGzipRawDeflateKey]) {
+        rawDeflate = [prop boolValue];
+        return;
+    }
+    
+    OBRejectInvalidCall(self, _cmd, @"Unknown key %@", aKey);
+}
+
+- (struct OFTransformStreamBuffer *)inputBuffer;
+{
+    return &buf;
+}
+
+- (unsigned int)goodBufferSize;
+{
+    return 64 * 1024;
+}
+
+- (int)_initStream;
+{
+    memset(&zlib, 0, sizeof(zlib));
+    // 32 added to the window size enables automatic gzip/zlib header detection; a negative window size means no header at all.
+    int rc = inflateInit2(&zlib, rawDeflate ? -MAX_WBITS : MAX_WBITS + 32);
+    if (rc == Z_OK)
+        streamInit = YES;
+    return rc;
+}
+
+- (void)open
+{
+    OBPRECONDITION(!streamInit);
+    if (streamInit)
+        return;
+    
+    [self _initStream];
+}
+
+- (void)noMoreInput
+{
+    inputDone = YES;
+}
+
+- (enum OFStreamTransformerResult)transform:(struct OFTransformStreamBuffer *)into error:(NSError **)errOut;
+{
+    int errcode;
+    
+    if (!streamInit) {
+        errcode = [self _initStream];
+        if (errcode != Z_OK)
+            return _zlibTransformError(NO, errcode, &zlib, errOut);
+    }
+    
+    unsigned bufEnd = into->dataStart + into->dataLength;
+    if (bufEnd >= into->bufferSize)
+        return OFStreamTransformerNeedOutputSpace;
+    if (buf.dataLength == 0 && !outputPending && !inputDone)
+        return OFStreamTransformerNeedInput;
+    
+    zlib.next_out = into->buffer + bufEnd;
+    zlib.avail_out = into->bufferSize - bufEnd;
+    zlib.next_in = buf.buffer + buf.dataStart;
+    zlib.avail_in = buf.dataLength;
+    
+    errcode = inflate(&zlib, Z_NO_FLUSH);
+    
+    unsigned consumed = buf.dataLength - zlib.avail_in;
+    buf.dataLength -= consumed;
+    buf.dataStart += consumed;
+    unsigned bytesProduced = (into->bufferSize - bufEnd) - zlib.avail_out;
+    into->dataLength += bytesProduced;
+    outputPending = (zlib.avail_out == 0);
+    
+    if (errcode == Z_STREAM_END)
+        return OFStreamTransformerFinished;
+    
+    // Z_BUF_ERROR just means no progress was possible; it's only fatal if there will never be more input.
+    if (errcode != Z_OK && errcode != Z_BUF_ERROR)
+        return _zlibTransformError(NO, errcode, &zlib, errOut);
+    
+    if (outputPending)
+        return OFStreamTransformerNeedOutputSpace;
+    if (buf.dataLength == 0) {
+        if (inputDone && bytesProduced == 0)
+            return _zlibTransformError(NO, Z_BUF_ERROR, &zlib, errOut); // Truncated input
+        return OFStreamTransformerNeedInput;
+    }
+    return OFStreamTransformerContinue;
+}
+
+@end
+
+
+@implementation OFGzipCompressTransform
+
+enum {
+    zcompress_Idle = 0,      // Have not initialized the compressor
+    zcompress_Running,       // Have initialized
+    zcompress_Finishing,     // No more data will be given to the compressor
+    zcompress_Ended          // No more data will be extracted from the compressor
+};
+
+- init
+{
+    if (!(self = [super init]))
+        return nil;
+    compressionLevel = 6;
+    streamState = zcompress_Idle;
+    return self;
+}
+
+- (void)dealloc
+{
+    if (streamState != zcompress_Idle) {
+        deflateEnd(&zlib);
+        streamState = zcompress_Idle;
+    }
+    if (buf.ownsBuffer && buf.buffer)
+        free(buf.buffer);
+    [super dealloc];
+}
+
+- (NSArray *)allKeys
+{
+    return [NSArray arrayWithObjects:OFStreamCompressionLevelKey, OFStreamGzipRawDeflateKey, nil];
+}
+
+- propertyForKey:(NSString *)aKey
+{
+    if ([aKey isEqualToString:NSStreamFileCurrentOffsetKey]) {
+        return _zlibOffsetProperty(zlib.total_out);
+    } else if ([aKey isEqualToString:OFStreamCompressionLevelKey]) {
+        return [NSNumber numberWithInt:compressionLevel];
+    } else if ([aKey isEqualToString:OFStreamGzipRawDeflateKey]) {
+        return [NSNumber numberWithBool:rawDeflate];
+    }
+    
+    return nil;
+}
+
+- (void)setProperty:prop forKey:(NSString *)aKey
+{
+    if (streamState != zcompress_Idle)
+        OBRejectInvalidCall(self, _cmd, @"Stream is already open");
+    
+    if ([aKey isEqualToString:OFStreamCompressionLevelKey]) {
+        int newLevel = [prop intValue];
+        if (newLevel < 0 || newLevel > 9)
+            OBRejectInvalidCall(self, _cmd, @"Gzip key \"%@\" must be in the range 0..9", OFStreamCompressionLevelKey);
+        compressionLevel = newLevel;
+        return;
+    } else if ([aKey isEqualToString:OFStreamGzipRawDeflateKey]) {
+        rawDeflate = [prop boolValue];
+        return;
+    }
+    
+    OBRejectInvalidCall(self, _cmd, @"Unknown key %@", aKey);
+}
+
+- (struct OFTransformStreamBuffer *)inputBuffer;
+{
+    return &buf;
+}
+
+- (unsigned int)goodBufferSize;
+{
+    return 64 * 1024;
+}
+
+- (int)_initStream;
+{
+    memset(&zlib, 0, sizeof(zlib));
+    // 16 added to the window size asks for a gzip header and trailer rather than a zlib one.
+    int rc = deflateInit2(&zlib, compressionLevel, Z_DEFLATED, rawDeflate ? -MAX_WBITS : MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+    if (rc == Z_OK)
+        streamState = zcompress_Running;
+    return rc;
+}
+
+- (void)open
+{
+    OBPRECONDITION(streamState == zcompress_Idle);
+    if (streamState != zcompress_Idle)
+        return;
+    
+    [self _initStream];
+}
+
+- (void)noMoreInput
+{
+    OBPRECONDITION(streamState != zcompress_Idle);
+    if (streamState == zcompress_Running)
+        streamState = zcompress_Finishing;
+}
+
+- (enum OFStreamTransformerResult)transform:(struct OFTransformStreamBuffer *)into error:(NSError **)errOut;
+{
+    int errcode;
+    
+    switch (streamState) {
+        case zcompress_Idle:
+            errcode = [self _initStream];
+            if (errcode != Z_OK)
+                return _zlibTransformError(YES, errcode, &zlib, errOut);
+            break;
+        case zcompress_Running:
+            if (buf.dataLength == 0)
+                return OFStreamTransformerNeedInput;
+            break;
+        case zcompress_Finishing:
+            break;
+        case zcompress_Ended:
+            return OFStreamTransformerFinished;
+        default:
+            OBASSERT_NOT_REACHED("OFGzipCompressTransform in invalid state");
+            return _zlibTransformError(YES, Z_STREAM_ERROR, NULL, errOut);
+    }
+    
+    unsigned bufEnd = into->dataStart + into->dataLength;
+    if (bufEnd >= into->bufferSize)
+        return OFStreamTransformerNeedOutputSpace;
+    
+    zlib.next_out = into->buffer + bufEnd;
+    zlib.avail_out = into->bufferSize - bufEnd;
+    zlib.next_in = buf.buffer + buf.dataStart;
+    zlib.avail_in = buf.dataLength;
+    
+    errcode = deflate(&zlib, streamState == zcompress_Finishing ? Z_FINISH : Z_NO_FLUSH);
+    
+    unsigned consumed = buf.dataLength - zlib.avail_in;
+    buf.dataLength -= consumed;
+    buf.dataStart += consumed;
+    into->dataLength += (into->bufferSize - bufEnd) - zlib.avail_out;
+    
+    if (errcode == Z_STREAM_END) {
+        streamState = zcompress_Ended;
+        return OFStreamTransformerFinished;
+    } else if (errcode != Z_OK && errcode != Z_BUF_ERROR) {
+        streamState = zcompress_Ended;
+        return _zlibTransformError(YES, errcode, &zlib, errOut);
+    }
+    
+    if (zlib.avail_out == 0)
+        return OFStreamTransformerNeedOutputSpace;
+    if (streamState == zcompress_Running && buf.dataLength == 0)
+        return OFStreamTransformerNeedInput;
+    return OFStreamTransformerContinue;
+}
+
+@end
+
+
+@implementation NSInputStream (OFStreamCompression)
+
+- (NSInputStream *)_inputStreamWithTransform:(id <NSObject,OFStreamTransformer>)transform;
+{
+    return [[[OFInputTransformStream alloc] initWithStream:self transform:transform] autorelease];
+}
+
+- (NSInputStream *)inputStreamByDecompressingBzip2;
+{
+    return [self _inputStreamWithTransform:[[[OFBzip2DecompressTransform alloc] init] autorelease]];
+}
+
+- (NSInputStream *)inputStreamByDecompressingGzip;
+{
+    return [self _inputStreamWithTransform:[[[OFGzipDecompressTransform alloc] init] autorelease]];
+}
+
+- (NSInputStream *)inputStreamByDecompressingXZ;
+{
+    return [self _inputStreamWithTransform:[[[OFXZDecompressTransform alloc] init] autorelease]];
+}
+
+@end
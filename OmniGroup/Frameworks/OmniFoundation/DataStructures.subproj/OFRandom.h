@@ -21,7 +21,21 @@ extern uint64_t OFRandomNextState64(OFRandomState *state);
 extern unsigned int OFRandomNextStateN(OFRandomState *state, unsigned int n);
 extern double OFRandomNextStateDouble(OFRandomState *state);
 
-// Version that use a global shared state. Not thread-safe.
+// Batch versions of the above, for filling large arrays. These produce exactly the same values, in the same order, as the corresponding number of OFRandomNextState64() calls (truncated to 32 bits, or converted to [0,1) doubles), but hand them out a whole SFMT block at a time instead of one call per value. Arrays of uint64_t that are 16-byte aligned (as malloc'd memory is) get filled without an intermediate copy.
+extern void OFRandomStateFill64(OFRandomState *state, uint64_t *values, size_t count);
+extern void OFRandomStateFill32(OFRandomState *state, uint32_t *values, size_t count);
+extern void OFRandomStateFillDouble(OFRandomState *state, double *values, size_t count);
+
+// Fills 'values' with integers uniformly distributed in [0,bound). Unlike OFRandomNextStateN(), which reduces with a modulus and so slightly favors small results when 'bound' isn't a power of two, this rejects and redraws the few raw values that would bias the result, so it can consume more than 'count' values from the state.
+extern void OFRandomStateFillBounded(OFRandomState *state, uint32_t *values, size_t count, uint32_t bound);
+
+// Skipping ahead. OFRandomStateAdvance() leaves 'state' where 'count' calls to OFRandomNextState64() would have, but for large counts takes milliseconds rather than time proportional to 'count'.
+extern void OFRandomStateAdvance(OFRandomState *state, uint64_t count);
+
+// Advances 'state' by 2^64 values. For reproducible parallel work, seed one state, then give each worker a duplicate of the previous worker's state jumped once more; every worker then draws from its own non-overlapping stretch of the same sequence.
+extern void OFRandomStateJump(OFRandomState *state);
+
+// Versions that use a per-thread state, created and seeded independently the first time each thread calls one of them. Thread-safe, and with no shared state to contend over.
 extern uint32_t OFRandomNext32(void);
 extern uint64_t OFRandomNext64(void);
 extern double OFRandomNextDouble(void);
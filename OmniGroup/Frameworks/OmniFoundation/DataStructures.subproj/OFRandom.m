@@ -9,6 +9,8 @@
 
 #import <OmniBase/system.h>
 #import <inttypes.h> // For PRIu8
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
 
 RCS_ID("$Id$")
 
@@ -22,24 +24,37 @@ RCS_ID("$Id$")
 
  most of this is for speed, but we'll turn on the defines here and add -fno-strict-aliasing as a per-file compile option.
  
- Note that we do not export the float/batch generators. There are some comments in SFMT that you have to re-seed when switching generation methods and in fact we hit assertions if we might 32 and 64 generation.  So, we always generate 64 here and truncate to 32 if that's all the caller wanted.
+ Note that we do not export SFMT's own float/batch generators. There are some comments in SFMT that you have to re-seed when switching generation methods and in fact we hit assertions if we might 32 and 64 generation.  So, we always generate 64 here and truncate to 32 if that's all the caller wanted.
+ 
+ The OFRandomStateFill*() functions are our batch generators. They hand out values straight from the state's internal block of N64 values (refilled a whole block at a time by gen_rand_all()), or have fill_array64() generate directly into the caller's array, and produce exactly the same sequence as the same number of OFRandomNextState64() calls would. On x86 the block refill uses SFMT's SSE2 recursion.
+ 
+ OFRandomStateAdvance() and OFRandomStateJump() skip ahead in the sequence without generating the values in between; see the comments by their implementation.
  */
 #ifndef DEBUG
     #define NDEBUG
 #endif
 #define MEXP 19937
 
+#if defined(__SSE2__)
+    #define HAVE_SSE2 1
+#endif
+
 // We also added this to make all the functions that would normally be extern be static.
 #define OF_EMBEDDED
 
 #include "../SFMT/SFMT.c"
 
+#if defined(BIG_ENDIAN64) && !defined(ONLY64)
+    #error "The batch generators below read the SFMT state as an array of 64-bit values"
+#endif
+
 /*
- Gathers several sources of random state, including some from /dev/urandom. If the entropy pool is low, though, that may not be great, so we gather some from the time.
+ Gathers several sources of random state, including some from /dev/urandom. If the entropy pool is low, though, that may not be great, so we gather some from the time. The time alone doesn't separate states created at the same moment (as the per-thread default states can be, when a pool of threads starts up), so we also mix in the thread and a process-wide counter.
  */
 OFRandomState *OFRandomStateCreate(void)
 {
-    uint32_t seed[4];
+    static volatile int32_t creationCount = 0;
+    uint32_t seed[6] = { 0 };
     
     FILE *urandomDevice = fopen("/dev/urandom", "r");	// use /dev/urandom instead of /dev/random because the latter can block
     if (urandomDevice != NULL) {
@@ -53,7 +68,10 @@ OFRandomState *OFRandomStateCreate(void)
     OBASSERT(sizeof(ti) == 2*sizeof(uint32_t));
     memcpy(&seed[2], &ti, sizeof(ti));
     
-    return OFRandomStateCreateWithSeed32(seed, 4);
+    seed[4] = (uint32_t)OSAtomicIncrement32Barrier(&creationCount);
+    seed[5] = (uint32_t)(uintptr_t)pthread_self();
+
+    return OFRandomStateCreateWithSeed32(seed, 6);
 }
 
 OFRandomState *OFRandomStateCreateWithSeed32(const uint32_t *seed, uint32_t count)
@@ -112,19 +130,38 @@ double OFRandomNextStateDouble(OFRandomState *state)
     return to_res53(OFRandomNextState64(state)); // same as genrand_res53, but tries to pretend we have state
 }
 
+/*
+ The functions without an explicit state use one per thread, created and seeded the first time a thread asks for a value and destroyed when the thread exits, so they need no locking and never contend.
+ */
+static pthread_key_t _OFThreadRandomStateKey;
+
+static void _OFThreadRandomStateDestroy(void *state)
+{
+    OFRandomStateDestroy((OFRandomState *)state);
+}
+
+static void _OFThreadRandomStateKeyCreate(void *context)
+{
+    int rc = pthread_key_create(&_OFThreadRandomStateKey, _OFThreadRandomStateDestroy);
+    OBASSERT(rc == 0);
+    OB_UNUSED_VALUE(rc);
+}
+
 static OFRandomState *_OFDefaultRandomState(void)
 {
-    static OFRandomState *defaultRandomState = NULL;
+    static dispatch_once_t onceToken;
+    dispatch_once_f(&onceToken, NULL, _OFThreadRandomStateKeyCreate);
 
-    // seed the default random state
-    if (!defaultRandomState)
-        defaultRandomState = OFRandomStateCreate();
+    OFRandomState *state = (OFRandomState *)pthread_getspecific(_OFThreadRandomStateKey);
+    if (!state) {
+        state = OFRandomStateCreate();
+        pthread_setspecific(_OFThreadRandomStateKey, state);
+    }
     
-    return defaultRandomState;
+    return state;
 }
 
-
-// Shared state; not thread-safe!
+// Per-thread state; see above.
 uint32_t OFRandomNext32(void)
 {
     return OFRandomNextState32(_OFDefaultRandomState());
@@ -140,34 +177,398 @@ double OFRandomNextDouble(void)
     return OFRandomNextStateDouble(_OFDefaultRandomState());
 }
 
-NSData *OFRandomStateCreateDataOfLength(OFRandomState *state, NSUInteger byteCount)
+#pragma mark - Batch generation
+
+// Takes up to 'wanted' values from the state's current block, refilling the block first if it is used up. Returns the values and how many were taken (at least one, if 'wanted' is nonzero).
+static inline const uint64_t *_OFRandomStateTake64(SFMTState *state, size_t wanted, size_t *outTaken)
 {
-#if 0 // gen_rand_array version. This doesn't seem to work the way I expect. Passing 1 for the size parameter writes to more than sizeof(w128_t) bytes and corrupts heap. The advantage of gen_rand_array() is that it will use vector instructions if available. We don't currently call this enough to warrant debugging this.
-    // Round up to a multiple of sizeof(w128_t)
-    NSUInteger roundedByteCount = ((byteCount + sizeof(w128_t) - 1) & ~(sizeof(w128_t) - 1));
-    OBASSERT((roundedByteCount % sizeof(w128_t)) == 0);
-    OBASSERT(roundedByteCount >= byteCount);
+    if (state->idx >= N32) {
+        gen_rand_all(state);
+        state->idx = 0;
+    }
     
-    w128_t *buffer = (w128_t *)malloc(roundedByteCount);
-    NSUInteger wordCount = roundedByteCount / sizeof(w128_t);
-    OBASSERT(wordCount <= INT_MAX); // SFMT takes int here.
+    size_t available = (size_t)(N32 - state->idx) / 2;
+    size_t taken = MIN(available, wanted);
+    const uint64_t *values = state->psfmt64 + state->idx / 2;
+    state->idx += (int)(2 * taken);
     
-    gen_rand_array((SFMTState *)state, buffer, (int)wordCount);
+    *outTaken = taken;
+    return values;
+}
 
-    return [[NSData alloc] initWithBytesNoCopy:buffer length:byteCount];
-#else
+void OFRandomStateFill64(OFRandomState *state_, uint64_t *values, size_t count)
+{
+    SFMTState *state = (SFMTState *)state_;
+    size_t taken;
+    
+    // Finish off the current block so that the state is at a block boundary.
+    if (count > 0 && state->idx < N32) {
+        const uint64_t *block = _OFRandomStateTake64(state, count, &taken);
+        memcpy(values, block, taken * sizeof(*values));
+        values += taken;
+        count -= taken;
+    }
+    
+    // Then let SFMT generate whole blocks directly into the caller's array if it meets fill_array64()'s requirements: at least N64 values, an even count, and (for the SIMD recursion) 16-byte alignment.
+    if (count >= N64 && ((uintptr_t)values & 15) == 0) {
+        OBASSERT(state->idx == N32);
+        size_t direct = MIN(count, (size_t)INT_MAX) & ~(size_t)1;
+        fill_array64(state, values, (int)direct);
+        values += direct;
+        count -= direct;
+    }
+    
+    while (count > 0) {
+        const uint64_t *block = _OFRandomStateTake64(state, count, &taken);
+        memcpy(values, block, taken * sizeof(*values));
+        values += taken;
+        count -= taken;
+    }
+}
+
+void OFRandomStateFill32(OFRandomState *state_, uint32_t *values, size_t count)
+{
+    SFMTState *state = (SFMTState *)state_;
+
+    while (count > 0) {
+        size_t taken;
+        const uint64_t *block = _OFRandomStateTake64(state, count, &taken);
+        for (size_t valueIndex = 0; valueIndex < taken; valueIndex++)
+            values[valueIndex] = (uint32_t)block[valueIndex]; // Truncated, as in OFRandomNextState32()
+        values += taken;
+        count -= taken;
+    }
+}
+
+void OFRandomStateFillDouble(OFRandomState *state_, double *values, size_t count)
+{
+    SFMTState *state = (SFMTState *)state_;
+    
+    while (count > 0) {
+        size_t taken;
+        const uint64_t *block = _OFRandomStateTake64(state, count, &taken);
+        for (size_t valueIndex = 0; valueIndex < taken; valueIndex++)
+            values[valueIndex] = to_res53(block[valueIndex]);
+        values += taken;
+        count -= taken;
+    }
+}
+
+void OFRandomStateFillBounded(OFRandomState *state_, uint32_t *values, size_t count, uint32_t bound)
+{
+    OBPRECONDITION(bound > 0);
+    SFMTState *state = (SFMTState *)state_;
+    
+    // Lemire's multiply-and-shift reduction, rejecting the (2^32 mod bound) low products that would otherwise make some results more likely than others.
+    uint32_t threshold = (uint32_t)(-bound) % bound;
+    
+    while (count > 0) {
+        size_t taken;
+        const uint64_t *block = _OFRandomStateTake64(state, count, &taken);
+        for (size_t valueIndex = 0; valueIndex < taken; valueIndex++) {
+            uint64_t product = (uint64_t)(uint32_t)block[valueIndex] * bound;
+            if ((uint32_t)product < threshold)
+                continue; // Rejected; the next pass around the outer loop will take another value
+            *values++ = (uint32_t)(product >> 32);
+            count--;
+        }
+    }
+}
+
+#pragma mark - Jumping ahead
+
+/*
+ SFMT is linear over GF(2): generating one more 128-bit word applies a fixed linear map T to the state, and generating k more applies T^k. If p is a polynomial with p(T) = 0, then T^k = (x^k mod p)(T), which takes at most deg(p) single steps and state additions to evaluate however large k is. This is the method of SFMT-jump (Haramoto, Matsumoto, Nishimura, Panneton and L'Ecuyer, "Efficient Jump Ahead for F2-Linear Random Number Generators").
+
+ SFMT-jump ships jump polynomials precomputed offline. We instead find p the first time it is needed, by running Berlekamp-Massey over one bit of each word of a long output stream (which yields the minimal polynomial of T, with degree at most the state size), and then build x^k mod p by repeated squaring.
+
+ Polynomials are bit vectors, with the coefficient of x^i in bit (i % 64) of word (i / 64).
+ */
+
+#define JUMP_STATE_BITS (N * 128)
+#define JUMP_POLY_WORDS (JUMP_STATE_BITS / 64 + 2) // Room for any polynomial of degree <= JUMP_STATE_BITS, plus a spare word so that shifted reads never run off the end
+#define JUMP_PRODUCT_WORDS (2 * JUMP_POLY_WORDS)
+#define JUMP_SEQUENCE_LENGTH (2 * JUMP_STATE_BITS)
+
+typedef struct {
+    unsigned int degree;
+    uint64_t coefficients[JUMP_POLY_WORDS];
+} OFRandomJumpPolynomial;
+
+static dispatch_once_t _OFRandomMinimalPolynomialOnce;
+static OFRandomJumpPolynomial *_OFRandomMinimalPolynomial;
+static uint64_t (*_OFRandomMinimalPolynomialShifted)[JUMP_POLY_WORDS]; // _OFRandomMinimalPolynomial << s, for s in [0,64)
+
+static inline unsigned int _OFRandomGetBit(const uint64_t *bits, size_t bitIndex)
+{
+    return (unsigned int)(bits[bitIndex / 64] >> (bitIndex % 64)) & 1;
+}
+
+// The 64 bits starting at 'bitIndex', which need not be word aligned. The caller makes sure the word after the last one needed exists.
+static inline uint64_t _OFRandomGetWord(const uint64_t *bits, size_t bitIndex)
+{
+    size_t wordIndex = bitIndex / 64;
+    unsigned int shift = bitIndex % 64;
+    if (shift == 0)
+        return bits[wordIndex];
+    return (bits[wordIndex] >> shift) | (bits[wordIndex + 1] << (64 - shift));
+}
+
+// dest ^= source << shift, for a source of 'sourceWords' words. The destination must have room for the shifted result.
+static void _OFRandomXorShifted(uint64_t *dest, const uint64_t *source, size_t sourceWords, size_t shift)
+{
+    size_t wordShift = shift / 64;
+    unsigned int bitShift = shift % 64;
+
+    if (bitShift == 0) {
+        for (size_t wordIndex = 0; wordIndex < sourceWords; wordIndex++)
+            dest[wordIndex + wordShift] ^= source[wordIndex];
+    } else {
+        uint64_t carry = 0;
+        for (size_t wordIndex = 0; wordIndex < sourceWords; wordIndex++) {
+            dest[wordIndex + wordShift] ^= (source[wordIndex] << bitShift) | carry;
+            carry = source[wordIndex] >> (64 - bitShift);
+        }
+        dest[sourceWords + wordShift] ^= carry;
+    }
+}
+
+// One step of the recursion on a ring of N words whose logical start is at 'start'; this is SFMT's portable do_recursion(), which isn't compiled when the SIMD version is in use.
+static void _OFRandomJumpStep(w128_t *ring, unsigned int start)
+{
+    w128_t *a = &ring[start];
+    w128_t *b = &ring[(start + POS1) % N];
+    w128_t *c = &ring[(start + N - 2) % N];
+    w128_t *d = &ring[(start + N - 1) % N];
+    w128_t x, y;
+
+    lshift128(&x, a, SL2);
+    rshift128(&y, c, SR2);
+    a->u[0] = a->u[0] ^ x.u[0] ^ ((b->u[0] >> SR1) & MSK1) ^ y.u[0] ^ (d->u[0] << SL1);
+    a->u[1] = a->u[1] ^ x.u[1] ^ ((b->u[1] >> SR1) & MSK2) ^ y.u[1] ^ (d->u[1] << SL1);
+    a->u[2] = a->u[2] ^ x.u[2] ^ ((b->u[2] >> SR1) & MSK3) ^ y.u[2] ^ (d->u[2] << SL1);
+    a->u[3] = a->u[3] ^ x.u[3] ^ ((b->u[3] >> SR1) & MSK4) ^ y.u[3] ^ (d->u[3] << SL1);
+}
+
+static void _OFRandomComputeMinimalPolynomial(void *context)
+{
+    // Collect the low bit of JUMP_SEQUENCE_LENGTH consecutive output words, stored reversed (s[n] in bit JUMP_SEQUENCE_LENGTH-1-n) so that the discrepancy below is a plain word-wise dot product.
+    uint64_t *reversed = calloc(JUMP_SEQUENCE_LENGTH / 64 + 2, sizeof(uint64_t));
+
+    uint32_t seed[4] = { 0x4f6d6e69, 0x52616e64, 0x6f6d4a75, 0x6d700000 };
+    SFMTState *state = SFMTStateCreate();
+    init_by_array(state, seed, 4);
+    for (size_t sequenceIndex = 0; sequenceIndex < JUMP_SEQUENCE_LENGTH; sequenceIndex += N) {
+        gen_rand_all(state);
+        for (size_t wordIndex = 0; wordIndex < N && sequenceIndex + wordIndex < JUMP_SEQUENCE_LENGTH; wordIndex++) {
+            if (state->sfmt[wordIndex].u[0] & 1) {
+                size_t bitIndex = JUMP_SEQUENCE_LENGTH - 1 - (sequenceIndex + wordIndex);
+                reversed[bitIndex / 64] |= (uint64_t)1 << (bitIndex % 64);
+            }
+        }
+    }
+    SFMTStateDestroy(state);
+
+    // Berlekamp-Massey. 'connection' ends up as C(x) with s[n] = sum(c[i] s[n-i], i = 1...L); it and 'previous' never exceed degree JUMP_STATE_BITS for an SFMT stream, but are sized for the worst case the algorithm could reach.
+    const size_t polyWords = JUMP_SEQUENCE_LENGTH / 64 + 2;
+    uint64_t *connection = calloc(polyWords, sizeof(uint64_t));
+    uint64_t *previous = calloc(polyWords, sizeof(uint64_t));
+    uint64_t *scratch = calloc(polyWords, sizeof(uint64_t));
+    connection[0] = previous[0] = 1;
+    size_t length = 0, gap = 1;
+
+    for (size_t n = 0; n < JUMP_SEQUENCE_LENGTH; n++) {
+        size_t offset = JUMP_SEQUENCE_LENGTH - 1 - n;
+        uint64_t discrepancy = 0;
+        for (size_t wordIndex = 0; wordIndex <= length / 64; wordIndex++)
+            discrepancy ^= connection[wordIndex] & _OFRandomGetWord(reversed, offset + 64 * wordIndex);
+
+        if (__builtin_parityll(discrepancy) == 0) {
+            gap++;
+        } else if (2 * length <= n) {
+            memcpy(scratch, connection, polyWords * sizeof(uint64_t));
+            _OFRandomXorShifted(connection, previous, length / 64 + 1, gap);
+            length = n + 1 - length;
+            memcpy(previous, scratch, polyWords * sizeof(uint64_t));
+            gap = 1;
+        } else {
+            _OFRandomXorShifted(connection, previous, length / 64 + 1, gap);
+            gap++;
+        }
+    }
+
+    // For SFMT19937 this comes out as the full 19968 bits of state, so the minimal polynomial is also the characteristic polynomial and annihilates every state, not just ones like the seed used here.
+    OBASSERT(length > MEXP && length <= JUMP_STATE_BITS);
+
+    // The characteristic polynomial of the recurrence is the reciprocal, x^L C(1/x).
+    OFRandomJumpPolynomial *minimal = calloc(1, sizeof(*minimal));
+    minimal->degree = (unsigned int)length;
+    for (size_t power = 0; power <= length; power++) {
+        if (_OFRandomGetBit(connection, length - power))
+            minimal->coefficients[power / 64] |= (uint64_t)1 << (power % 64);
+    }
+
+    uint64_t (*shifted)[JUMP_POLY_WORDS] = calloc(64, sizeof(*shifted));
+    for (unsigned int shift = 0; shift < 64; shift++)
+        _OFRandomXorShifted(shifted[shift], minimal->coefficients, JUMP_POLY_WORDS - 1, shift);
+
+    free(reversed);
+    free(connection);
+    free(previous);
+    free(scratch);
+
+    _OFRandomMinimalPolynomial = minimal;
+    _OFRandomMinimalPolynomialShifted = shifted;
+}
+
+// Reduces a polynomial of degree < 2 * JUMP_STATE_BITS modulo the minimal polynomial, in place.
+static void _OFRandomReduce(uint64_t *product)
+{
+    unsigned int degree = _OFRandomMinimalPolynomial->degree;
+
+    for (size_t power = 2 * (size_t)degree; power-- > degree; ) {
+        if (_OFRandomGetBit(product, power)) {
+            size_t shift = power - degree;
+            const uint64_t *multiple = _OFRandomMinimalPolynomialShifted[shift % 64];
+            uint64_t *dest = product + shift / 64;
+            for (size_t wordIndex = 0; wordIndex < JUMP_POLY_WORDS; wordIndex++)
+                dest[wordIndex] ^= multiple[wordIndex];
+        }
+    }
+}
+
+// Spreads the low 32 bits of 'value' out to the even bits of the result, which is how squaring works over GF(2).
+static inline uint64_t _OFRandomSpreadBits(uint64_t value)
+{
+    value &= 0xFFFFFFFFULL;
+    value = (value | (value << 16)) & 0x0000FFFF0000FFFFULL;
+    value = (value | (value << 8)) & 0x00FF00FF00FF00FFULL;
+    value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    value = (value | (value << 2)) & 0x3333333333333333ULL;
+    value = (value | (value << 1)) & 0x5555555555555555ULL;
+    return value;
+}
+
+// Fills 'jump' with x^steps mod p, with bits at or above the degree of p left clear.
+static void _OFRandomComputeJumpPolynomial(uint64_t *jump, uint64_t steps)
+{
+    uint64_t *product = calloc(JUMP_PRODUCT_WORDS, sizeof(uint64_t));
+    product[0] = 1;
+    size_t polyWords = _OFRandomMinimalPolynomial->degree / 64 + 1;
+
+    for (int bitIndex = 63; bitIndex >= 0; bitIndex--) {
+        // Square...
+        for (size_t wordIndex = polyWords; wordIndex-- > 0; ) {
+            uint64_t word = product[wordIndex];
+            product[2 * wordIndex + 1] = _OFRandomSpreadBits(word >> 32);
+            product[2 * wordIndex] = _OFRandomSpreadBits(word);
+        }
+        // ... and multiply by x if this bit of the exponent is set.
+        if ((steps >> bitIndex) & 1) {
+            for (size_t wordIndex = 2 * polyWords; wordIndex > 0; wordIndex--)
+                product[wordIndex] = (product[wordIndex] << 1) | (product[wordIndex - 1] >> 63);
+            product[0] <<= 1;
+        }
+        _OFRandomReduce(product);
+    }
+
+    memcpy(jump, product, JUMP_POLY_WORDS * sizeof(uint64_t));
+    free(product);
+}
+
+// Replaces the state with jump(T) applied to it, where 'jump' is x^k mod p; that moves the whole output sequence forward by k 128-bit words (2k 64-bit values). The read position within the current block is unchanged.
+static void _OFRandomStateApplyJump(SFMTState *state, const uint64_t *jump)
+{
+    w128_t *ring = malloc(sizeof(state->sfmt));
+    w128_t *sum = calloc(1, sizeof(state->sfmt));
+    memcpy(ring, state->sfmt, sizeof(state->sfmt));
+
+    unsigned int start = 0;
+    unsigned int degree = _OFRandomMinimalPolynomial->degree;
+    for (size_t power = 0; power < degree; power++) {
+        if (_OFRandomGetBit(jump, power)) {
+            // sum += T^power(state), where the ring holds the latter in logical order from 'start'
+            uint64_t *dest = (uint64_t *)sum;
+            const uint64_t *source = (const uint64_t *)&ring[start];
+            size_t headWords = 2 * (N - start);
+            for (size_t wordIndex = 0; wordIndex < headWords; wordIndex++)
+                dest[wordIndex] ^= source[wordIndex];
+            dest += headWords;
+            source = (const uint64_t *)ring;
+            for (size_t wordIndex = 0; wordIndex < 2 * start; wordIndex++)
+                dest[wordIndex] ^= source[wordIndex];
+        }
+
+        _OFRandomJumpStep(ring, start);
+        start = (start + 1) % N;
+    }
+
+    memcpy(state->sfmt, sum, sizeof(state->sfmt));
+    free(ring);
+    free(sum);
+}
+
+// Below this many values, OFRandomStateAdvance() steps rather than jumps. Stepping costs a nanosecond or two per value; computing and applying a jump polynomial costs a few tens of milliseconds.
+#define OFRandomStateAdvanceJumpThreshold (1ULL << 22)
+
+static void _OFRandomStateJumpWords(SFMTState *state, uint64_t steps)
+{
+    dispatch_once_f(&_OFRandomMinimalPolynomialOnce, NULL, _OFRandomComputeMinimalPolynomial);
+
+    uint64_t *jump = malloc(JUMP_POLY_WORDS * sizeof(uint64_t));
+    _OFRandomComputeJumpPolynomial(jump, steps);
+    _OFRandomStateApplyJump(state, jump);
+    free(jump);
+}
+
+void OFRandomStateAdvance(OFRandomState *state_, uint64_t count)
+{
+    SFMTState *state = (SFMTState *)state_;
+
+    // Short distances are cheaper to just step through than to jump.
+    while (count > 0 && count < OFRandomStateAdvanceJumpThreshold) {
+        size_t taken;
+        _OFRandomStateTake64(state, (size_t)count, &taken);
+        count -= taken;
+    }
+    if (count == 0)
+        return;
+
+    _OFRandomStateJumpWords(state, count / 2);
+    if (count & 1)
+        gen_rand64(state);
+}
+
+static uint64_t *_OFRandomSubstreamJump;
+
+static void _OFRandomComputeSubstreamJump(void *context)
+{
+    dispatch_once_f(&_OFRandomMinimalPolynomialOnce, NULL, _OFRandomComputeMinimalPolynomial);
+
+    _OFRandomSubstreamJump = malloc(JUMP_POLY_WORDS * sizeof(uint64_t));
+    _OFRandomComputeJumpPolynomial(_OFRandomSubstreamJump, (uint64_t)1 << 63); // 2^63 128-bit words is 2^64 64-bit values
+}
+
+void OFRandomStateJump(OFRandomState *state)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once_f(&onceToken, NULL, _OFRandomComputeSubstreamJump);
+
+    _OFRandomStateApplyJump((SFMTState *)state, _OFRandomSubstreamJump);
+}
+
+NSData *OFRandomStateCreateDataOfLength(OFRandomState *state, NSUInteger byteCount)
+{
     // Round up to a multiple of sizeof(uint64_t).
     NSUInteger roundedByteCount = ((byteCount + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
     OBASSERT((roundedByteCount % sizeof(uint64_t)) == 0);
     OBASSERT(roundedByteCount >= byteCount);
     
+    // (The earlier attempt to call gen_rand_array() here directly corrupted the heap for small sizes; it needs at least N 128-bit words. OFRandomStateFill64() only hands fill_array64() requests that meet its requirements.)
     uint64_t *buffer = (uint64_t *)malloc(roundedByteCount);
-    NSUInteger wordCount = roundedByteCount / sizeof(uint64_t);
-    for (NSUInteger wordIndex = 0; wordIndex < wordCount; wordIndex++)
-        buffer[wordIndex] = OFRandomNextState64(state);
+    OFRandomStateFill64(state, buffer, roundedByteCount / sizeof(uint64_t));
     
     return [[NSData alloc] initWithBytesNoCopy:buffer length:byteCount];
-#endif
 }
 
 NSData *OFRandomCreateDataOfLength(NSUInteger byteCount)
@@ -9,7 +9,27 @@
 
 #import <Foundation/NSData.h>
 #import <CoreFoundation/CFData.h>
+#import <OmniFoundation/OFTransformStream.h>
 
 /* This decompresses the XZ-formatted data in 'compressed' and writes it to 'fd'. All operations are performed on the given queue. When done, the completion handler is called (with nil upon success, or an NSError upon failure). It's probably called on 'queue' but might not be. */
 void OFXZDecompressToFdAsync(NSData *compressed, int fd, dispatch_queue_t queue, void(^completion_handler)(NSError *));
 
+
+/* Like OFXZDecompressToFdAsync(), but if 'compressed' is a single xz stream made of several blocks (as written by "xz -T" or "xz --block-size"), the stream index is parsed and the blocks are decoded concurrently, each with its own decoder, at most 'maximumConcurrency' at a time (zero means one per active processor). Each block's output is written at its final offset with pwrite(), so 'fd' must be a seekable file; it is closed when done. Anything else (a single block, concatenated streams, stream padding, an index we can't make sense of) falls back to the serial decoder. */
+void OFXZDecompressToFdParallelAsync(NSData *compressed, int fd, NSUInteger maximumConcurrency, dispatch_queue_t queue, void(^completion_handler)(NSError *));
+
+
+/* An OFStreamTransformer that decompresses XZ data incrementally. Use it with OFInputTransformStream (or -[NSInputStream inputStreamByDecompressingXZ]) to decompress a stream of any size in constant memory, rather than handing the whole payload to OFXZDecompressToFdAsync(). */
+struct xz_dec;
+@interface OFXZDecompressTransform : NSObject <OFStreamTransformer>
+{
+    struct xz_dec *decompressor;
+    unsigned long long totalOut;
+    BOOL inputDone;
+    BOOL outputPending;
+    BOOL finished;
+    
+    struct OFTransformStreamBuffer buf;
+}
+
+@end
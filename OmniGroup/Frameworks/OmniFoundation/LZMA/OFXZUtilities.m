@@ -9,7 +9,10 @@
 #import <OmniFoundation/NSString-OFExtensions.h>
 #import <OmniFoundation/NSMutableDictionary-OFExtensions.h>
 #import <OmniFoundation/OFErrors.h>
+#import <OmniBase/OmniBase.h>
 #import <OmniBase/rcsid.h>
+#import <libkern/OSAtomic.h>
+#import <libkern/OSByteOrder.h>
 #include "xz.h"
 
 RCS_ID("$Id$")
@@ -175,3 +178,405 @@ void OFXZDecompressToFdAsync(NSData *compressed, int fd, dispatch_queue_t queue,
     dispatch_resume((dispatch_object_t)dispatcher);
 }
 
+
+/* Block-parallel decoding.
+
+   xz-embedded only knows how to decode whole streams, so to decode one block on its own we hand a fresh decoder a synthetic stream: the real stream header, the block's bytes (straight out of the input), and a one-record index and footer that we build to describe just that block. The decoder checks the block's integrity check and the index against what it decoded, so the result is verified exactly as it would be in a serial decode. */
+
+#define XZ_STREAM_HEADER_SIZE 12
+#define XZ_STREAM_FOOTER_SIZE 12
+#define XZ_MAX_VLI_BYTES 9
+#define XZ_PARALLEL_OUT_BUF_SIZE 1u*1024u*1024u
+
+typedef struct {
+    size_t compressedOffset;    /* Where the block starts in the input */
+    size_t compressedLength;    /* Unpadded size rounded up to a multiple of four */
+    uint64_t unpaddedSize;
+    uint64_t uncompressedSize;
+    uint64_t uncompressedOffset;   /* Where the block's output goes in the file */
+} OFXZBlock;
+
+static BOOL readVLI(const uint8_t *bytes, size_t length, size_t *position, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned int byteIndex = 0; byteIndex < XZ_MAX_VLI_BYTES; byteIndex++) {
+        if (*position >= length)
+            return NO;
+        uint8_t byte = bytes[(*position)++];
+        result |= (uint64_t)(byte & 0x7F) << (7 * byteIndex);
+        if (!(byte & 0x80)) {
+            if (byte == 0 && byteIndex != 0)
+                return NO; /* Not minimally encoded */
+            *value = result;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static size_t writeVLI(uint8_t *buf, uint64_t value)
+{
+    size_t used = 0;
+    while (value >= 0x80) {
+        buf[used++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[used++] = (uint8_t)value;
+    return used;
+}
+
+/* Returns a malloc'd array describing the blocks if 'bytes' is exactly one stream whose index we can read, or NULL. */
+static OFXZBlock *copyBlocksOfSingleStream(const uint8_t *bytes, size_t length, size_t *outBlockCount)
+{
+    if (length < XZ_STREAM_HEADER_SIZE + XZ_STREAM_FOOTER_SIZE)
+        return NULL;
+    
+    /* Stream header: magic, flags, CRC32 of the flags */
+    if (memcmp(bytes, "\3757zXZ\0", 6) != 0 || xz_crc32(bytes + 6, 2, 0) != OSReadLittleInt32(bytes, 8))
+        return NULL;
+    
+    /* Stream footer: CRC32, backward size, flags (must match the header's), magic */
+    const uint8_t *footer = bytes + length - XZ_STREAM_FOOTER_SIZE;
+    if (footer[10] != 'Y' || footer[11] != 'Z' || memcmp(footer + 8, bytes + 6, 2) != 0 || xz_crc32(footer + 4, 6, 0) != OSReadLittleInt32(footer, 0))
+        return NULL;
+    
+    uint64_t indexSize = ((uint64_t)OSReadLittleInt32(footer, 4) + 1) * 4;
+    if (indexSize > length - XZ_STREAM_HEADER_SIZE - XZ_STREAM_FOOTER_SIZE)
+        return NULL;
+    size_t indexOffset = length - XZ_STREAM_FOOTER_SIZE - (size_t)indexSize;
+    const uint8_t *index = bytes + indexOffset;
+    
+    /* Index: indicator, record count, (unpadded, uncompressed) records, zero padding to four bytes, CRC32 */
+    if (index[0] != 0 || xz_crc32(index, (size_t)indexSize - 4, 0) != OSReadLittleInt32(index, (size_t)indexSize - 4))
+        return NULL;
+    
+    size_t position = 1, indexLength = (size_t)indexSize - 4;
+    uint64_t blockCount;
+    if (!readVLI(index, indexLength, &position, &blockCount) || blockCount == 0 || blockCount > indexLength / 2)
+        return NULL;
+    
+    OFXZBlock *blocks = calloc((size_t)blockCount, sizeof(*blocks));
+    size_t compressedOffset = XZ_STREAM_HEADER_SIZE;
+    uint64_t uncompressedOffset = 0;
+    
+    for (size_t blockIndex = 0; blockIndex < blockCount; blockIndex++) {
+        OFXZBlock *block = &blocks[blockIndex];
+        if (!readVLI(index, indexLength, &position, &block->unpaddedSize) || !readVLI(index, indexLength, &position, &block->uncompressedSize))
+            goto fail;
+        
+        uint64_t paddedSize = (block->unpaddedSize + 3) & ~(uint64_t)3;
+        if (block->unpaddedSize == 0 || paddedSize > indexOffset - compressedOffset)
+            goto fail;
+        
+        block->compressedOffset = compressedOffset;
+        block->compressedLength = (size_t)paddedSize;
+        block->uncompressedOffset = uncompressedOffset;
+        compressedOffset += (size_t)paddedSize;
+        uncompressedOffset += block->uncompressedSize;
+    }
+    
+    /* Everything between the header and the index must be accounted for by the blocks, and the index must be fully consumed */
+    if (compressedOffset != indexOffset)
+        goto fail;
+    while (position < indexLength) {
+        if (index[position++] != 0)
+            goto fail;
+    }
+    
+    *outBlockCount = (size_t)blockCount;
+    return blocks;
+    
+fail:
+    free(blocks);
+    return NULL;
+}
+
+/* Decodes one block, writing its output at its offset in 'fd'. Returns nil on success. */
+static NSError *decodeBlock(const uint8_t *bytes, const OFXZBlock *block, int fd, struct xz_dec *decompressor, uint8_t *out_buf)
+{
+    /* Build the one-record index and the footer that follow the block in our synthetic stream */
+    uint8_t trailer[4 + 2*XZ_MAX_VLI_BYTES + 3 + 4 + XZ_STREAM_FOOTER_SIZE];
+    size_t trailerLength = 0;
+    trailer[trailerLength++] = 0; /* index indicator */
+    trailerLength += writeVLI(trailer + trailerLength, 1);
+    trailerLength += writeVLI(trailer + trailerLength, block->unpaddedSize);
+    trailerLength += writeVLI(trailer + trailerLength, block->uncompressedSize);
+    while (trailerLength % 4)
+        trailer[trailerLength++] = 0;
+    OSWriteLittleInt32(trailer, trailerLength, xz_crc32(trailer, trailerLength, 0));
+    trailerLength += 4;
+    
+    uint8_t *footer = trailer + trailerLength;
+    OSWriteLittleInt32(footer, 4, (uint32_t)(trailerLength / 4 - 1)); /* backward size */
+    memcpy(footer + 8, bytes + 6, 2); /* stream flags */
+    OSWriteLittleInt32(footer, 0, xz_crc32(footer + 4, 6, 0));
+    footer[10] = 'Y';
+    footer[11] = 'Z';
+    trailerLength += XZ_STREAM_FOOTER_SIZE;
+    
+    const uint8_t *pieces[3] = { bytes, bytes + block->compressedOffset, trailer };
+    size_t pieceLengths[3] = { XZ_STREAM_HEADER_SIZE, block->compressedLength, trailerLength };
+    
+    xz_dec_reset(decompressor);
+    
+    off_t writeOffset = (off_t)block->uncompressedOffset;
+    enum xz_ret xzr = XZ_OK;
+    
+    for (unsigned int pieceIndex = 0; pieceIndex < 3 && xzr == XZ_OK; pieceIndex++) {
+        struct xz_buf xzbuf = {
+            .in = pieces[pieceIndex],
+            .in_pos = 0,
+            .in_size = pieceLengths[pieceIndex],
+            .out = out_buf,
+            .out_pos = 0,
+            .out_size = XZ_PARALLEL_OUT_BUF_SIZE
+        };
+        
+        do {
+            xzbuf.out_pos = 0;
+            xzr = xz_dec_run(decompressor, &xzbuf);
+            
+            if (xzr != XZ_OK && xzr != XZ_STREAM_END) {
+                NSMutableDictionary *errInfo = [NSMutableDictionary dictionary];
+                setErrorInfoFromXZRet(errInfo, xzr);
+                [errInfo setUnsignedIntegerValue:(NSUInteger)(block->compressedOffset + ((pieceIndex == 1) ? xzbuf.in_pos : 0)) forKey:@"bytesDecompressed"];
+                return [NSError errorWithDomain:OFErrorDomain code:OFUnableToDecompressData userInfo:errInfo];
+            }
+            
+            size_t written = 0;
+            while (written < xzbuf.out_pos) {
+                ssize_t wrote = pwrite(fd, out_buf + written, xzbuf.out_pos - written, writeOffset);
+                if (wrote < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return _OBErrorWithErrnoObjectsAndKeys(errno, "pwrite", nil, nil);
+                }
+                written += wrote;
+                writeOffset += wrote;
+            }
+            
+            /* Keep going while the decoder is filling the output buffer, even if all the input has been consumed */
+        } while (xzr == XZ_OK && (xzbuf.in_pos < xzbuf.in_size || xzbuf.out_pos == xzbuf.out_size));
+    }
+    
+    if (xzr != XZ_STREAM_END || writeOffset != (off_t)(block->uncompressedOffset + block->uncompressedSize)) {
+        NSMutableDictionary *errInfo = [NSMutableDictionary dictionary];
+        setErrorInfoFromXZRet(errInfo, XZ_DATA_ERROR);
+        [errInfo setUnsignedIntegerValue:block->compressedOffset forKey:@"bytesDecompressed"];
+        return [NSError errorWithDomain:OFErrorDomain code:OFUnableToDecompressData userInfo:errInfo];
+    }
+    
+    return nil;
+}
+
+void OFXZDecompressToFdParallelAsync(NSData *compressed, int fd, NSUInteger maximumConcurrency, dispatch_queue_t queue, void(^completion_handler)(NSError *))
+{
+    dispatch_once_f(&xz_crc_once, NULL, ( void (*)(void *) )xz_crc32_init);
+    
+    size_t blockCount = 0;
+    OFXZBlock *blocks = copyBlocksOfSingleStream([compressed bytes], [compressed length], &blockCount);
+    if (!blocks || blockCount < 2 || blockCount > INT32_MAX) {
+        free(blocks);
+        OFXZDecompressToFdAsync(compressed, fd, queue, completion_handler);
+        return;
+    }
+    
+    if (maximumConcurrency == 0)
+        maximumConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger workerCount = MIN(maximumConcurrency, blockCount);
+    
+    /* Size the file up front so that blocks finishing out of order don't leave it short */
+    const OFXZBlock *lastBlock = &blocks[blockCount - 1];
+    off_t totalSize = (off_t)(lastBlock->uncompressedOffset + lastBlock->uncompressedSize);
+    if (ftruncate(fd, totalSize) != 0) {
+        NSError *error = [_OBErrorWithErrnoObjectsAndKeys(errno, "ftruncate", nil, nil) retain];
+        free(blocks);
+        close(fd);
+        dispatch_async(queue, ^{
+            completion_handler(error);
+            [error release];
+        });
+        return;
+    }
+    
+    /* Workers pull the next block index from a shared counter rather than each block getting its own dispatch, so there are never more than 'workerCount' decoders (each with a dictionary of up to 64MB) alive at once */
+    NSData *dataToDecompress = [compressed retain];
+    const uint8_t *bytes = [dataToDecompress bytes];
+    int32_t __block nextBlock = 0;
+    NSError * volatile __block firstError = nil;
+    
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t workerQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    
+    for (NSUInteger workerIndex = 0; workerIndex < workerCount; workerIndex++) {
+        dispatch_group_async(group, workerQueue, ^{
+            struct xz_dec *decompressor = xz_dec_init(XZ_DYNALLOC, UINT32_MAX);
+            uint8_t *out_buf = malloc(XZ_PARALLEL_OUT_BUF_SIZE);
+            
+            while (firstError == nil) {
+                @autoreleasepool {
+                    NSError *error;
+                    if (!decompressor || !out_buf) {
+                        NSMutableDictionary *errInfo = [NSMutableDictionary dictionary];
+                        setErrorInfoFromXZRet(errInfo, XZ_MEM_ERROR);
+                        error = [NSError errorWithDomain:OFErrorDomain code:OFUnableToDecompressData userInfo:errInfo];
+                    } else {
+                        int32_t blockIndex = OSAtomicIncrement32Barrier(&nextBlock) - 1;
+                        if ((size_t)blockIndex >= blockCount)
+                            break;
+                        error = decodeBlock(bytes, &blocks[blockIndex], fd, decompressor, out_buf);
+                    }
+                    
+                    if (error) {
+                        [error retain];
+                        if (!OSAtomicCompareAndSwapPtrBarrier(nil, error, (void * volatile *)&firstError))
+                            [error release];
+                    }
+                }
+            }
+            
+            free(out_buf);
+            if (decompressor)
+                xz_dec_end(decompressor);
+        });
+    }
+    
+    dispatch_group_notify(group, queue, ^{
+        NSError *error = firstError;
+        free(blocks);
+        [dataToDecompress release];
+        close(fd);
+        completion_handler(error);
+        [error release];
+    });
+    dispatch_release(group);
+}
+
+#pragma mark - Streaming decompression
+
+@implementation OFXZDecompressTransform
+
+- (void)dealloc
+{
+    if (decompressor) {
+        xz_dec_end(decompressor);
+        decompressor = NULL;
+    }
+    if (buf.ownsBuffer && buf.buffer)
+        free(buf.buffer);
+    [super dealloc];
+}
+
+- (NSArray *)allKeys
+{
+    return nil;
+}
+
+- propertyForKey:(NSString *)aKey
+{
+    if ([aKey isEqualToString:NSStreamFileCurrentOffsetKey]) {
+        if (totalOut < INT_MAX) // Not UINT_MAX, because of RADAR #3513632
+            return [NSNumber numberWithUnsignedInt:(unsigned int)totalOut];
+        else
+            return [NSNumber numberWithUnsignedLongLong:totalOut];
+    }
+    
+    return nil;
+}
+
+- (void)setProperty:prop forKey:(NSString *)aKey
+{
+    OBRejectInvalidCall(self, _cmd, @"Unknown key %@", aKey);
+}
+
+- (struct OFTransformStreamBuffer *)inputBuffer;
+{
+    return &buf;
+}
+
+- (unsigned int)goodBufferSize;
+{
+    return 64 * 1024;
+}
+
+- (void)open
+{
+    OBPRECONDITION(decompressor == NULL);
+    if (decompressor)
+        return;
+    
+    dispatch_once_f(&xz_crc_once, NULL, ( void (*)(void *) )xz_crc32_init);
+    decompressor = xz_dec_init(XZ_DYNALLOC, UINT32_MAX);
+}
+
+- (void)noMoreInput
+{
+    inputDone = YES;
+}
+
+static enum OFStreamTransformerResult _xzTransformError(enum xz_ret xzr, unsigned long long totalOut, NSError **outError)
+{
+    if (outError) {
+        NSMutableDictionary *errInfo = [NSMutableDictionary dictionary];
+        setErrorInfoFromXZRet(errInfo, xzr);
+        [errInfo setObject:[NSNumber numberWithUnsignedLongLong:totalOut] forKey:NSStreamFileCurrentOffsetKey];
+        *outError = [NSError errorWithDomain:OFErrorDomain code:OFUnableToDecompressData userInfo:errInfo];
+    }
+    return OFStreamTransformerError;
+}
+
+- (enum OFStreamTransformerResult)transform:(struct OFTransformStreamBuffer *)into error:(NSError **)outError;
+{
+    if (finished)
+        return OFStreamTransformerFinished;
+    
+    if (!decompressor) {
+        [self open];
+        if (!decompressor)
+            return _xzTransformError(XZ_MEM_ERROR, totalOut, outError);
+    }
+    
+    unsigned bufEnd = into->dataStart + into->dataLength;
+    if (bufEnd >= into->bufferSize)
+        return OFStreamTransformerNeedOutputSpace;
+    
+    /* xz_dec_run() treats two calls in a row that make no progress as an error, so don't call it unless it has something to chew on: new input, output it couldn't fit last time, or the end of the input (which lets it either finish or notice that the stream was truncated). */
+    if (buf.dataLength == 0 && !outputPending && !inputDone)
+        return OFStreamTransformerNeedInput;
+    
+    struct xz_buf xzbuf = {
+        .in = buf.buffer ? buf.buffer + buf.dataStart : NULL,
+        .in_pos = 0,
+        .in_size = buf.dataLength,
+        
+        .out = into->buffer + bufEnd,
+        .out_pos = 0,
+        .out_size = into->bufferSize - bufEnd
+    };
+    
+    enum xz_ret xzr = xz_dec_run(decompressor, &xzbuf);
+    
+    buf.dataStart += (unsigned)xzbuf.in_pos;
+    buf.dataLength -= (unsigned)xzbuf.in_pos;
+    into->dataLength += (unsigned)xzbuf.out_pos;
+    totalOut += xzbuf.out_pos;
+    outputPending = (xzbuf.out_pos == xzbuf.out_size);
+    
+    if (xzr == XZ_STREAM_END) {
+        finished = YES;
+        return OFStreamTransformerFinished;
+    } else if (xzr != XZ_OK) {
+        return _xzTransformError(xzr, totalOut, outError);
+    }
+    
+    if (outputPending)
+        return OFStreamTransformerNeedOutputSpace;
+    if (buf.dataLength == 0) {
+        if (inputDone && xzbuf.out_pos == 0)
+            return _xzTransformError(XZ_BUF_ERROR, totalOut, outError); /* The input ended in the middle of the stream */
+        return OFStreamTransformerNeedInput;
+    }
+    return OFStreamTransformerContinue;
+}
+
+@end
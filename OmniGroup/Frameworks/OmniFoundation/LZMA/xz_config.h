@@ -5,7 +5,8 @@
 */
 #define XZ_DEC_BCJ
 #define XZ_DEC_X86
-#define XZ_EXTERN OB_HIDDEN
+#define XZ_USE_CRC64
+#define XZ_EXTERN __attribute__((visibility("hidden"))) /* OB_HIDDEN, without pulling OmniBase into these C files */
 
 #include <stdbool.h>
 #include <unistd.h>
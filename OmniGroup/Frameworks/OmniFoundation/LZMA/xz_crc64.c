@@ -0,0 +1,27 @@
+/*
+ * CRC64 using the polynomial from ECMA-182
+ *
+ * Author: Lasse Collin <lasse.collin@tukaani.org>
+ *
+ * This file has been put into the public domain.
+ * You can do whatever you want with this file.
+ */
+
+/*
+ * OmniFoundation: as with xz_crc32(), the calculation is done by
+ * OFCRC64Update() rather than a private lookup table.
+ */
+
+#include "xz_private.h"
+#include <OmniFoundation/OFCRC.h>
+
+XZ_EXTERN void xz_crc64_init(void)
+{
+	/* OFCRC64Update() sets itself up on first use. */
+	return;
+}
+
+XZ_EXTERN uint64_t xz_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	return OFCRC64Update(crc, buf, size);
+}
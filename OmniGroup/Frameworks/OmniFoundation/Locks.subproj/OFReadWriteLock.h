@@ -10,6 +10,8 @@
 #import <OmniFoundation/OFObject.h>
 #import <pthread.h>
 
+extern NSString *OFReadWriteLockUsageException;
+
 typedef struct _OFReadWriteLockTable {
     unsigned int                currentCount;
     unsigned int                maxCount;
@@ -0,0 +1,128 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#define OFSimpleLockDefined
+#define OFSimpleLockAtomic
+
+#import <pthread.h>
+#import <stdint.h>
+#import <string.h>
+#import <stdio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Uncomment this to keep contention counters in every lock (see OFSimpleLockGetStatistics() and OFSimpleLockDumpStatistics()).  When this changes, all code that uses this must be rebuilt from clean (since this is in a header and changes the size of OFSimpleLockType).  Do NOT USE 'DEBUG' here since some framework might be built with it on and some with it off, creating the possibility for memory corruption
+//#define OF_SIMPLE_LOCK_STATISTICS
+
+typedef unsigned int OFSimpleLockBoolean;
+
+#define OFSimpleLockIsNotLocked ((OFSimpleLockBoolean)0)
+#define OFSimpleLockIsLocked ((OFSimpleLockBoolean)1)
+#define OFSimpleLockIsLockedWithWaiters ((OFSimpleLockBoolean)2) // Someone may be parked; the unlocker must wake them
+
+typedef struct {
+    uint64_t acquisitionCount;
+    uint64_t contendedCount;   // Acquisitions that didn't get the lock on the first try
+    uint64_t spinCount;        // Pauses spent waiting for the lock
+    uint64_t parkCount;        // Times a thread went to sleep waiting for the lock
+    uint64_t totalHoldTime;    // Nanoseconds
+    uint64_t maximumHoldTime;
+} OFSimpleLockStatistics;
+
+typedef struct _OFSimpleLockType {
+    OFSimpleLockBoolean state; // Only touched through the __atomic builtins
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+    // All of these are only changed by the thread holding the lock
+    OFSimpleLockStatistics statistics;
+    uint64_t lockedTime;
+    const char *name;
+    struct _OFSimpleLockType *nextNamedLock;
+#endif
+} OFSimpleLockType;
+
+extern void OFSimpleLock_atomic_contentious(OFSimpleLockType *simpleLock);
+extern void OFSimpleLock_atomic_wake(OFSimpleLockType *simpleLock);
+
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+extern uint64_t OFSimpleLock_atomic_now(void);
+extern void OFSimpleLock_atomic_unregister(OFSimpleLockType *simpleLock);
+
+static inline void _OFSimpleLockNoteAcquired(OFSimpleLockType *simpleLock)
+{
+    simpleLock->statistics.acquisitionCount++;
+    simpleLock->lockedTime = OFSimpleLock_atomic_now();
+}
+
+static inline void _OFSimpleLockNoteReleasing(OFSimpleLockType *simpleLock)
+{
+    uint64_t holdTime = OFSimpleLock_atomic_now() - simpleLock->lockedTime;
+    simpleLock->statistics.totalHoldTime += holdTime;
+    if (holdTime > simpleLock->statistics.maximumHoldTime)
+        simpleLock->statistics.maximumHoldTime = holdTime;
+}
+#else
+#define _OFSimpleLockNoteAcquired(lock) /**/
+#define _OFSimpleLockNoteReleasing(lock) /**/
+#endif
+
+static inline void OFSimpleLockInit(OFSimpleLockType *simpleLock)
+{
+    __atomic_store_n(&simpleLock->state, OFSimpleLockIsNotLocked, __ATOMIC_RELAXED);
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+    memset(&simpleLock->statistics, 0, sizeof(simpleLock->statistics));
+    simpleLock->lockedTime = 0;
+    simpleLock->name = NULL;
+    simpleLock->nextNamedLock = NULL;
+#endif
+}
+
+static inline void OFSimpleLockFree(OFSimpleLockType *simpleLock)
+{
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+    if (simpleLock->name)
+        OFSimpleLock_atomic_unregister(simpleLock);
+#endif
+}
+
+static inline OFSimpleLockBoolean OFSimpleLockTry(OFSimpleLockType *simpleLock)
+{
+    OFSimpleLockBoolean expected = OFSimpleLockIsNotLocked;
+    if (!__atomic_compare_exchange_n(&simpleLock->state, &expected, OFSimpleLockIsLocked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    _OFSimpleLockNoteAcquired(simpleLock);
+    return 1;
+}
+
+static inline void OFSimpleLock(OFSimpleLockType *simpleLock)
+{
+    OFSimpleLockBoolean expected = OFSimpleLockIsNotLocked;
+    if (__builtin_expect(__atomic_compare_exchange_n(&simpleLock->state, &expected, OFSimpleLockIsLocked, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED), 1)) {
+        _OFSimpleLockNoteAcquired(simpleLock);
+        return;
+    }
+    OFSimpleLock_atomic_contentious(simpleLock);
+}
+
+static inline void OFSimpleUnlock(OFSimpleLockType *simpleLock)
+{
+    _OFSimpleLockNoteReleasing(simpleLock);
+    if (__builtin_expect(__atomic_exchange_n(&simpleLock->state, OFSimpleLockIsNotLocked, __ATOMIC_RELEASE) == OFSimpleLockIsLockedWithWaiters, 0))
+        OFSimpleLock_atomic_wake(simpleLock);
+}
+
+// These do nothing (or return zeros) unless OF_SIMPLE_LOCK_STATISTICS is defined.  Naming a lock adds it to the set that OFSimpleLockDumpStatistics() reports on, until OFSimpleLockFree() is called on it.  The name isn't copied.
+extern void OFSimpleLockSetName(OFSimpleLockType *simpleLock, const char *name);
+extern void OFSimpleLockGetStatistics(OFSimpleLockType *simpleLock, OFSimpleLockStatistics *outStatistics); // Only exact while holding the lock
+extern void OFSimpleLockDumpStatistics(FILE *file);
+
+#if defined(__cplusplus)
+} // extern "C"
+#endif
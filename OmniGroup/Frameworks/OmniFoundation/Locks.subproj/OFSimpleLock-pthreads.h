@@ -11,6 +11,7 @@
 
 #import <pthread.h>
 
+typedef unsigned int OFSimpleLockBoolean;
 typedef pthread_mutex_t OFSimpleLockType;
 
 static inline void OFSimpleLockInit(OFSimpleLockType *simpleLock)
@@ -29,9 +30,9 @@ static inline void OFSimpleLock(OFSimpleLockType *simpleLock)
     pthread_mutex_lock(simpleLock);
 }
 
-static inline void OFSimpleLockTry(OFSimpleLockType *simpleLock)
+static inline OFSimpleLockBoolean OFSimpleLockTry(OFSimpleLockType *simpleLock)
 {
-    pthread_mutex_trylock(simpleLock);
+    return pthread_mutex_trylock(simpleLock) == 0;
 }
 
 static inline void OFSimpleUnlock(OFSimpleLockType *simpleLock)
@@ -11,7 +11,8 @@
 RCS_ID("$Id$")
 
 
-#if defined(__i386__) || defined(__x86_64__) || defined(__amd64__)
+// Only for compilers without the __atomic builtins; everything else, in every language, gets OFSimpleLock-atomic.h from OFSimpleLock.h and never calls this.
+#if !defined(OFSimpleLockAtomic) && (defined(__i386__) || defined(__x86_64__) || defined(__amd64__))
 
 /*
  
@@ -37,3 +38,228 @@ void OFSimpleLock_i386_contentious(OFSimpleLockType *simpleLock)
 
 #endif
 
+#ifdef OFSimpleLockAtomic
+
+#import <pthread.h>
+#import <sched.h>
+#import <unistd.h>
+
+#ifdef __linux__
+#import <linux/futex.h>
+#import <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#import <mach/mach_time.h>
+#else
+#import <time.h>
+#endif
+
+/*
+
+ Test-and-test-and-set: contending threads spin reading the lock (so they all sit on a shared copy of its cache line) and only try to take it once it looks free, backing off exponentially between looks.  If that doesn't get the lock within a few microseconds, the holder is probably doing real work (or has been descheduled), so park until the unlock.  Parking follows Drepper's "Futexes Are Tricky": a waiter marks the lock OFSimpleLockIsLockedWithWaiters before sleeping, so that the fast unlock path only makes a system call when someone may be asleep.
+
+*/
+
+#define OFSimpleLockMaximumBackoff (64)      // Pauses between looks at the lock
+#define OFSimpleLockSpinAttemptCount (10)    // Looks before parking; 1+2+...+64+64+64+64 pauses, a few microseconds
+
+static inline void _OFSimpleLockPause(void)
+{
+#if defined(__i386__) || defined(__x86_64__) || defined(__amd64__)
+    asm volatile("pause");
+#elif defined(__arm__) || defined(__arm64__) || defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static pthread_once_t OFSimpleLockSetUpOnce = PTHREAD_ONCE_INIT;
+static OFSimpleLockBoolean OFSimpleLockShouldSpin;
+
+#ifndef __linux__
+// There's no public futex on Darwin, so park in a small table of condition variables, hashed by lock address.  Locks that share a bucket also share wakeups, which is why the unlocker broadcasts.
+#define OFSimpleLockParkingBucketCount (64)
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+} OFSimpleLockParkingBucket;
+static OFSimpleLockParkingBucket OFSimpleLockParkingBuckets[OFSimpleLockParkingBucketCount];
+
+static OFSimpleLockParkingBucket *_OFSimpleLockParkingBucket(OFSimpleLockType *simpleLock)
+{
+    uintptr_t address = (uintptr_t)simpleLock;
+    return &OFSimpleLockParkingBuckets[((address >> 4) ^ (address >> 10)) % OFSimpleLockParkingBucketCount];
+}
+#endif
+
+static void _OFSimpleLockSetUp(void)
+{
+    // Spinning only helps if the holder can be running at the same time
+    OFSimpleLockShouldSpin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+#ifndef __linux__
+    for (unsigned int bucketIndex = 0; bucketIndex < OFSimpleLockParkingBucketCount; bucketIndex++) {
+        pthread_mutex_init(&OFSimpleLockParkingBuckets[bucketIndex].mutex, NULL);
+        pthread_cond_init(&OFSimpleLockParkingBuckets[bucketIndex].condition, NULL);
+    }
+#endif
+}
+
+// Returns once the lock may have been released; the caller has to try again.
+static void _OFSimpleLockPark(OFSimpleLockType *simpleLock)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &simpleLock->state, FUTEX_WAIT_PRIVATE, OFSimpleLockIsLockedWithWaiters, NULL, NULL, 0);
+#else
+    // The unlocker clears the lock before taking the bucket's mutex to broadcast, so checking the lock under the mutex can't miss a wakeup.
+    OFSimpleLockParkingBucket *bucket = _OFSimpleLockParkingBucket(simpleLock);
+    pthread_mutex_lock(&bucket->mutex);
+    while (__atomic_load_n(&simpleLock->state, __ATOMIC_RELAXED) == OFSimpleLockIsLockedWithWaiters)
+        pthread_cond_wait(&bucket->condition, &bucket->mutex);
+    pthread_mutex_unlock(&bucket->mutex);
+#endif
+}
+
+void OFSimpleLock_atomic_wake(OFSimpleLockType *simpleLock)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &simpleLock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    OFSimpleLockParkingBucket *bucket = _OFSimpleLockParkingBucket(simpleLock);
+    pthread_mutex_lock(&bucket->mutex);
+    pthread_cond_broadcast(&bucket->condition);
+    pthread_mutex_unlock(&bucket->mutex);
+#endif
+}
+
+void OFSimpleLock_atomic_contentious(OFSimpleLockType *simpleLock)
+{
+    pthread_once(&OFSimpleLockSetUpOnce, _OFSimpleLockSetUp);
+
+    uint64_t spinCount = 0, parkCount = 0;
+
+    if (OFSimpleLockShouldSpin) {
+        unsigned int backoff = 1;
+        for (unsigned int attempt = 0; attempt < OFSimpleLockSpinAttemptCount; attempt++) {
+            for (unsigned int pause = 0; pause < backoff; pause++)
+                _OFSimpleLockPause();
+            spinCount += backoff;
+            if (backoff < OFSimpleLockMaximumBackoff)
+                backoff <<= 1;
+
+            OFSimpleLockBoolean state = __atomic_load_n(&simpleLock->state, __ATOMIC_RELAXED);
+            if (state == OFSimpleLockIsNotLocked) {
+                if (__atomic_compare_exchange_n(&simpleLock->state, &state, OFSimpleLockIsLocked, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                    goto acquired;
+            } else if (state == OFSimpleLockIsLockedWithWaiters) {
+                // Others already gave up spinning on this holder; odds are we would too.
+                break;
+            }
+        }
+    }
+
+    // Once we've marked the lock, we have to leave it marked when we get it, since we can't tell whether anyone else is still parked.
+    while (__atomic_exchange_n(&simpleLock->state, OFSimpleLockIsLockedWithWaiters, __ATOMIC_ACQUIRE) != OFSimpleLockIsNotLocked) {
+        parkCount++;
+        _OFSimpleLockPark(simpleLock);
+    }
+
+acquired:
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+    simpleLock->statistics.contendedCount++;
+    simpleLock->statistics.spinCount += spinCount;
+    simpleLock->statistics.parkCount += parkCount;
+#endif
+    _OFSimpleLockNoteAcquired(simpleLock);
+    (void)spinCount;
+    (void)parkCount;
+}
+
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+
+static pthread_mutex_t OFSimpleLockNamedLocksMutex = PTHREAD_MUTEX_INITIALIZER;
+static OFSimpleLockType *OFSimpleLockNamedLocks;
+
+uint64_t OFSimpleLock_atomic_now(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void OFSimpleLock_atomic_unregister(OFSimpleLockType *simpleLock)
+{
+    pthread_mutex_lock(&OFSimpleLockNamedLocksMutex);
+    for (OFSimpleLockType **link = &OFSimpleLockNamedLocks; *link; link = &(*link)->nextNamedLock) {
+        if (*link == simpleLock) {
+            *link = simpleLock->nextNamedLock;
+            break;
+        }
+    }
+    simpleLock->name = NULL;
+    simpleLock->nextNamedLock = NULL;
+    pthread_mutex_unlock(&OFSimpleLockNamedLocksMutex);
+}
+
+void OFSimpleLockSetName(OFSimpleLockType *simpleLock, const char *name)
+{
+    if (simpleLock->name)
+        OFSimpleLock_atomic_unregister(simpleLock);
+    if (!name)
+        return;
+
+    pthread_mutex_lock(&OFSimpleLockNamedLocksMutex);
+    simpleLock->name = name;
+    simpleLock->nextNamedLock = OFSimpleLockNamedLocks;
+    OFSimpleLockNamedLocks = simpleLock;
+    pthread_mutex_unlock(&OFSimpleLockNamedLocksMutex);
+}
+
+void OFSimpleLockGetStatistics(OFSimpleLockType *simpleLock, OFSimpleLockStatistics *outStatistics)
+{
+    *outStatistics = simpleLock->statistics;
+}
+
+void OFSimpleLockDumpStatistics(FILE *file)
+{
+    fprintf(file, "%-32s %12s %10s %14s %10s %12s %12s\n", "lock", "acquired", "contended", "spins", "parks", "mean hold ns", "max hold ns");
+
+    pthread_mutex_lock(&OFSimpleLockNamedLocksMutex);
+    for (OFSimpleLockType *simpleLock = OFSimpleLockNamedLocks; simpleLock; simpleLock = simpleLock->nextNamedLock) {
+        // Racy reads of the counters, which is fine for a report
+        OFSimpleLockStatistics statistics = simpleLock->statistics;
+        fprintf(file, "%-32s %12llu %10llu %14llu %10llu %12llu %12llu\n", simpleLock->name,
+                (unsigned long long)statistics.acquisitionCount, (unsigned long long)statistics.contendedCount,
+                (unsigned long long)statistics.spinCount, (unsigned long long)statistics.parkCount,
+                (unsigned long long)(statistics.acquisitionCount ? statistics.totalHoldTime / statistics.acquisitionCount : 0),
+                (unsigned long long)statistics.maximumHoldTime);
+    }
+    pthread_mutex_unlock(&OFSimpleLockNamedLocksMutex);
+}
+
+#else
+
+void OFSimpleLockSetName(OFSimpleLockType *simpleLock, const char *name)
+{
+}
+
+void OFSimpleLockGetStatistics(OFSimpleLockType *simpleLock, OFSimpleLockStatistics *outStatistics)
+{
+    memset(outStatistics, 0, sizeof(*outStatistics));
+}
+
+void OFSimpleLockDumpStatistics(FILE *file)
+{
+    fprintf(file, "OFSimpleLock statistics are off; define OF_SIMPLE_LOCK_STATISTICS in OFSimpleLock-atomic.h to collect them.\n");
+}
+
+#endif
+
+#endif
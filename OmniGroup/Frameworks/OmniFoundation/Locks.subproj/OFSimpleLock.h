@@ -7,6 +7,13 @@
 //
 // $Id$
 
+// The compiler's __atomic builtins where we have them, which C, Objective-C and C++ all get alike, so every file agrees on what an OFSimpleLockType is.
+#ifdef __ATOMIC_ACQUIRE
+#import <OmniFoundation/OFSimpleLock-atomic.h>
+#endif
+
+#ifndef OFSimpleLockDefined
+
 #ifdef __ppc__
 #import <OmniFoundation/OFSimpleLock-ppc.h>
 #endif
@@ -23,6 +30,8 @@
 #import <OmniFoundation/OFSimpleLock-hppa.h>
 #endif
 
+#endif
+
 
 #ifndef OFSimpleLockDefined
 #import <OmniFoundation/OFSimpleLock-pthreads.h>
@@ -0,0 +1,36 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFReadWriteLock.h>
+
+/*
+ A reader-biased OFReadWriteLocking implementation for read-mostly data.  Readers register in one of a set of cache-line-sized counters, picked by thread, so while there are no writers, readers on different processors share nothing but a glance at the writer count.  A writer first announces itself, which makes new readers wait (so a steady stream of readers can't starve it), then waits for all the counters to drain.  That makes writing dearer than with OFReadWriteLock.
+
+ With a writer waiting, a thread that takes a second read lock while holding one would deadlock, unless the lock tracks read depth per thread.  Tracking keeps each thread's depth in thread-local storage, and also catches a thread asking to write while it is reading.  The thread holding the write lock may take read locks too, as long as it releases them before unlocking for writing.
+ */
+@interface OFStripedReadWriteLock : NSObject <OFReadWriteLocking>
+{
+    struct _OFStripedReadWriteLockStripe *_stripes;
+    uint32_t _stripeMask;
+    BOOL _tracksRecursiveReads;
+
+    volatile int32_t _pendingWriterCount; // Writers waiting or writing
+    volatile pthread_t _writerThread;
+    pthread_mutex_t _writerMutex; // Held by the active writer
+    pthread_mutex_t _waitMutex;
+    pthread_cond_t _readersDrainedCondition;
+    pthread_cond_t _writersDoneCondition;
+}
+
+- initWithRecursiveReadTracking:(BOOL)tracksRecursiveReads;
+    // -init doesn't track recursive reads.
+
+- (BOOL)isWriteLocked;
+
+@end
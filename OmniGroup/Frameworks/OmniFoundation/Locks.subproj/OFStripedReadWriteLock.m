@@ -0,0 +1,282 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFStripedReadWriteLock.h>
+
+#import <OmniBase/OmniBase.h>
+#import <libkern/OSAtomic.h>
+
+RCS_ID("$Id$")
+
+#define OFStripedReadWriteLockCacheLineSize (64)
+#define OFStripedReadWriteLockMaximumStripeCount (64)
+#define OFStripedReadWriteLockWriterSpinCount (1000)
+
+typedef struct _OFStripedReadWriteLockStripe {
+    volatile int32_t readerCount;
+    char padding[OFStripedReadWriteLockCacheLineSize - sizeof(int32_t)];
+} OFStripedReadWriteLockStripe;
+
+typedef struct {
+    OFStripedReadWriteLock *lock;
+    NSUInteger depth;
+} OFStripedReadWriteLockReadDepth;
+
+// One per thread, shared by all the locks: the stripe the thread reads through, and its read depth in each lock that tracks them.
+typedef struct {
+    uint32_t stripeIndex;
+    NSUInteger readDepthCount;
+    NSUInteger readDepthCapacity;
+    OFStripedReadWriteLockReadDepth *readDepths;
+} OFStripedReadWriteLockThreadState;
+
+static pthread_key_t OFStripedReadWriteLockThreadStateKey;
+static uint32_t OFStripedReadWriteLockStripeCount;
+static volatile int32_t OFStripedReadWriteLockNextStripeIndex;
+
+static void _OFStripedReadWriteLockThreadStateDestroy(void *value)
+{
+    OFStripedReadWriteLockThreadState *state = (OFStripedReadWriteLockThreadState *)value;
+    OBASSERT(state->readDepthCount == 0); // A thread exited holding read locks
+    free(state->readDepths);
+    free(state);
+}
+
+static void _OFStripedReadWriteLockSetUp(void *context)
+{
+    int rc = pthread_key_create(&OFStripedReadWriteLockThreadStateKey, _OFStripedReadWriteLockThreadStateDestroy);
+    OBASSERT(rc == 0);
+    OB_UNUSED_VALUE(rc);
+
+    // Enough stripes that each processor's readers usually have one to themselves
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    uint32_t stripeCount = 1;
+    while (stripeCount < 2 * processorCount && stripeCount < OFStripedReadWriteLockMaximumStripeCount)
+        stripeCount <<= 1;
+    OFStripedReadWriteLockStripeCount = stripeCount;
+}
+
+static OFStripedReadWriteLockThreadState *_OFStripedReadWriteLockCurrentThreadState(void)
+{
+    OFStripedReadWriteLockThreadState *state = (OFStripedReadWriteLockThreadState *)pthread_getspecific(OFStripedReadWriteLockThreadStateKey);
+    if (!state) {
+        state = calloc(1, sizeof(*state));
+        // Round robin rather than hashing the thread, so that a handful of threads don't end up sharing a stripe.
+        state->stripeIndex = (uint32_t)OSAtomicIncrement32(&OFStripedReadWriteLockNextStripeIndex);
+        pthread_setspecific(OFStripedReadWriteLockThreadStateKey, state);
+    }
+    return state;
+}
+
+static OFStripedReadWriteLockReadDepth *_OFStripedReadWriteLockFindReadDepth(OFStripedReadWriteLockThreadState *state, OFStripedReadWriteLock *lock)
+{
+    for (NSUInteger depthIndex = 0; depthIndex < state->readDepthCount; depthIndex++) {
+        if (state->readDepths[depthIndex].lock == lock)
+            return &state->readDepths[depthIndex];
+    }
+    return NULL;
+}
+
+static void _OFStripedReadWriteLockAddReadDepth(OFStripedReadWriteLockThreadState *state, OFStripedReadWriteLock *lock)
+{
+    if (state->readDepthCount == state->readDepthCapacity) {
+        state->readDepthCapacity = MAX(state->readDepthCapacity * 2, (NSUInteger)4);
+        state->readDepths = realloc(state->readDepths, state->readDepthCapacity * sizeof(*state->readDepths));
+    }
+    state->readDepths[state->readDepthCount].lock = lock;
+    state->readDepths[state->readDepthCount].depth = 1;
+    state->readDepthCount++;
+}
+
+static void _OFStripedReadWriteLockRemoveReadDepth(OFStripedReadWriteLockThreadState *state, OFStripedReadWriteLockReadDepth *readDepth)
+{
+    state->readDepthCount--;
+    *readDepth = state->readDepths[state->readDepthCount];
+}
+
+@implementation OFStripedReadWriteLock
+
+static BOOL _OFStripedReadWriteLockReadersDrained(OFStripedReadWriteLock *self)
+{
+    for (uint32_t stripeIndex = 0; stripeIndex <= self->_stripeMask; stripeIndex++) {
+        if (self->_stripes[stripeIndex].readerCount != 0)
+            return NO;
+    }
+    return YES;
+}
+
+static void _OFStripedReadWriteLockLeaveStripe(OFStripedReadWriteLock *self, OFStripedReadWriteLockStripe *stripe)
+{
+    // Both sides use full barriers: a reader bumps its stripe and then looks for writers, while a writer bumps the writer count and then looks at the stripes, so at least one of them always sees the other.
+    OSAtomicDecrement32Barrier(&stripe->readerCount);
+    if (self->_pendingWriterCount != 0) {
+        // A writer may be waiting for the stripes to drain
+        pthread_mutex_lock(&self->_waitMutex);
+        pthread_cond_broadcast(&self->_readersDrainedCondition);
+        pthread_mutex_unlock(&self->_waitMutex);
+    }
+}
+
+- init;
+{
+    return [self initWithRecursiveReadTracking:NO];
+}
+
+- initWithRecursiveReadTracking:(BOOL)tracksRecursiveReads;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    static dispatch_once_t onceToken;
+    dispatch_once_f(&onceToken, NULL, _OFStripedReadWriteLockSetUp);
+
+    void *stripes = NULL;
+    if (posix_memalign(&stripes, OFStripedReadWriteLockCacheLineSize, OFStripedReadWriteLockStripeCount * sizeof(OFStripedReadWriteLockStripe)) != 0) {
+        [self release];
+        return nil;
+    }
+    memset(stripes, 0, OFStripedReadWriteLockStripeCount * sizeof(OFStripedReadWriteLockStripe));
+    _stripes = (OFStripedReadWriteLockStripe *)stripes;
+    _stripeMask = OFStripedReadWriteLockStripeCount - 1;
+    _tracksRecursiveReads = tracksRecursiveReads;
+
+    int rc = pthread_mutex_init(&_writerMutex, NULL);
+    if (rc)
+        perror("pthread_mutex_init");
+    rc = pthread_mutex_init(&_waitMutex, NULL);
+    if (rc)
+        perror("pthread_mutex_init");
+    rc = pthread_cond_init(&_readersDrainedCondition, NULL);
+    if (rc)
+        perror("pthread_cond_init");
+    rc = pthread_cond_init(&_writersDoneCondition, NULL);
+    if (rc)
+        perror("pthread_cond_init");
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    OBPRECONDITION(_pendingWriterCount == 0);
+    OBPRECONDITION(!_stripes || _OFStripedReadWriteLockReadersDrained(self));
+
+    if (_stripes) {
+        pthread_cond_destroy(&_readersDrainedCondition);
+        pthread_cond_destroy(&_writersDoneCondition);
+        pthread_mutex_destroy(&_waitMutex);
+        pthread_mutex_destroy(&_writerMutex);
+        free(_stripes);
+    }
+
+    [super dealloc];
+}
+
+/*" Returns YES if there is an active writer.  To make any decisions based on this, there must be a higher-level lock controlling access to the receiver, of course. "*/
+- (BOOL)isWriteLocked;
+{
+    return _writerThread != NULL;
+}
+
+#pragma mark -
+#pragma mark OFReadWriteLocking
+
+- (void)lockForReading;
+{
+    if (_writerThread == pthread_self())
+        return; // Reading inside our own write
+
+    OFStripedReadWriteLockThreadState *state = _OFStripedReadWriteLockCurrentThreadState();
+    if (_tracksRecursiveReads) {
+        OFStripedReadWriteLockReadDepth *readDepth = _OFStripedReadWriteLockFindReadDepth(state, self);
+        if (readDepth) {
+            // We're already counted, and no writer can get in until we leave.
+            readDepth->depth++;
+            return;
+        }
+    }
+
+    OFStripedReadWriteLockStripe *stripe = &_stripes[state->stripeIndex & _stripeMask];
+    while (YES) {
+        OSAtomicIncrement32Barrier(&stripe->readerCount);
+        if (_pendingWriterCount == 0)
+            break;
+
+        // A writer is waiting or writing.  Back out (in case we're what it's waiting on) and wait for it to be done.
+        _OFStripedReadWriteLockLeaveStripe(self, stripe);
+        pthread_mutex_lock(&_waitMutex);
+        while (_pendingWriterCount != 0)
+            pthread_cond_wait(&_writersDoneCondition, &_waitMutex);
+        pthread_mutex_unlock(&_waitMutex);
+    }
+
+    if (_tracksRecursiveReads)
+        _OFStripedReadWriteLockAddReadDepth(state, self);
+}
+
+- (void)unlockForReading;
+{
+    if (_writerThread == pthread_self())
+        return; // Matches a read taken inside our own write
+
+    OFStripedReadWriteLockThreadState *state = _OFStripedReadWriteLockCurrentThreadState();
+    if (_tracksRecursiveReads) {
+        OFStripedReadWriteLockReadDepth *readDepth = _OFStripedReadWriteLockFindReadDepth(state, self);
+        if (!readDepth)
+            [NSException raise:OFReadWriteLockUsageException format:@"Attempted to unlock an OFStripedReadWriteLock for reading without having locked it for reading."];
+        if (--readDepth->depth != 0)
+            return;
+        _OFStripedReadWriteLockRemoveReadDepth(state, readDepth);
+    }
+
+    OFStripedReadWriteLockStripe *stripe = &_stripes[state->stripeIndex & _stripeMask];
+    OBASSERT(stripe->readerCount > 0);
+    _OFStripedReadWriteLockLeaveStripe(self, stripe);
+}
+
+- (void)lockForWriting;
+{
+    pthread_t thread = pthread_self();
+
+    if (_tracksRecursiveReads && _OFStripedReadWriteLockFindReadDepth(_OFStripedReadWriteLockCurrentThreadState(), self))
+        [NSException raise:NSInternalInconsistencyException format:@"This thread already has a read lock, cannot obtain both types of locks in the same thread at the same time."];
+
+    // From here on, new readers wait for us (and for any writers queued behind us).
+    OSAtomicIncrement32Barrier(&_pendingWriterCount);
+    pthread_mutex_lock(&_writerMutex);
+
+    // Wait for the readers that got in ahead of us.  Their critical sections are usually short, so spin a little before sleeping.
+    unsigned int spinCount = OFStripedReadWriteLockWriterSpinCount;
+    while (!_OFStripedReadWriteLockReadersDrained(self) && spinCount--)
+        ;
+    if (!_OFStripedReadWriteLockReadersDrained(self)) {
+        pthread_mutex_lock(&_waitMutex);
+        while (!_OFStripedReadWriteLockReadersDrained(self))
+            pthread_cond_wait(&_readersDrainedCondition, &_waitMutex);
+        pthread_mutex_unlock(&_waitMutex);
+    }
+
+    _writerThread = thread;
+}
+
+- (void)unlockForWriting;
+{
+    if (_writerThread != pthread_self())
+        [NSException raise:OFReadWriteLockUsageException format:@"Attempted to unlock an OFStripedReadWriteLock for writing without having locked it for writing."];
+
+    _writerThread = NULL;
+    pthread_mutex_unlock(&_writerMutex);
+
+    if (OSAtomicDecrement32Barrier(&_pendingWriterCount) == 0) {
+        // Let in the readers that backed off for us.  If there are more writers, they go first.
+        pthread_mutex_lock(&_waitMutex);
+        pthread_cond_broadcast(&_writersDoneCondition);
+        pthread_mutex_unlock(&_waitMutex);
+    }
+}
+
+@end
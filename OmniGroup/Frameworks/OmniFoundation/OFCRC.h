@@ -0,0 +1,36 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Cyclic redundancy checks shared by the zip and xz code.
+
+ Both functions follow zlib's crc32() conventions: pass 0 as the initial crc, and pass the previous result back in to continue a checksum over more data. The final result needs no further inversion. This header is plain C so that it can be included from the minizip and xz-embedded sources.
+
+ The implementation is picked once, the first time either function is called: a carry-less multiply (PCLMULQDQ) folding kernel on x86 processors that have it, the CRC32 instructions on ARM processors that have them, and slice-by-8 tables everywhere else. All of them produce bit-identical results.
+*/
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// CRC-32 as used by zip, gzip and xz check type 1 (IEEE 802.3, reflected polynomial 0xEDB88320). Returns the same value as zlib's crc32().
+extern uint32_t OFCRC32Update(uint32_t crc, const void *bytes, size_t length);
+
+// CRC-64 as used by xz check type 4 (ECMA-182, reflected polynomial 0xC96C5795D7870F42).
+extern uint64_t OFCRC64Update(uint64_t crc, const void *bytes, size_t length);
+
+// A short description of the CRC-32 kernel selected for this processor, for benchmarks and logging.
+extern const char *OFCRC32ImplementationName(void);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,320 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFCRC.h>
+
+#import <OmniBase/rcsid.h>
+#import <dispatch/dispatch.h>
+#import <stdbool.h>
+#import <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#import <cpuid.h>
+#import <emmintrin.h>
+#import <smmintrin.h>
+#import <wmmintrin.h>
+#define OF_CRC_HAVE_PCLMUL 1
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#import <arm_acle.h>
+#endif
+
+RCS_ID("$Id$")
+
+#define CRC32_POLYNOMIAL UINT32_C(0xEDB88320)
+#define CRC64_POLYNOMIAL UINT64_C(0xC96C5795D7870F42)
+
+// Slice-by-8 tables. Table 0 is the usual byte-at-a-time table; table k gives the contribution of a byte that is followed by k more bytes in the same 8-byte word.
+static uint32_t CRC32Tables[8][256];
+static uint64_t CRC64Tables[8][256];
+
+typedef uint32_t (*CRC32Function)(uint32_t crc, const uint8_t *bytes, size_t length);
+static CRC32Function CRC32Implementation;
+static const char *CRC32Name;
+
+static dispatch_once_t CRCSetupOnce;
+
+static void _buildTables(void)
+{
+    for (unsigned int byteValue = 0; byteValue < 256; byteValue++) {
+        uint32_t crc32 = byteValue;
+        uint64_t crc64 = byteValue;
+        for (unsigned int bit = 0; bit < 8; bit++) {
+            crc32 = (crc32 >> 1) ^ (CRC32_POLYNOMIAL & (0 - (crc32 & 1)));
+            crc64 = (crc64 >> 1) ^ (CRC64_POLYNOMIAL & (0 - (crc64 & 1)));
+        }
+        CRC32Tables[0][byteValue] = crc32;
+        CRC64Tables[0][byteValue] = crc64;
+    }
+
+    for (unsigned int slice = 1; slice < 8; slice++) {
+        for (unsigned int byteValue = 0; byteValue < 256; byteValue++) {
+            uint32_t previous32 = CRC32Tables[slice - 1][byteValue];
+            uint64_t previous64 = CRC64Tables[slice - 1][byteValue];
+            CRC32Tables[slice][byteValue] = (previous32 >> 8) ^ CRC32Tables[0][previous32 & 0xFF];
+            CRC64Tables[slice][byteValue] = (previous64 >> 8) ^ CRC64Tables[0][previous64 & 0xFF];
+        }
+    }
+}
+
+#pragma mark - Portable kernels
+
+// These take and return the crc in its inverted (register) form.
+
+static inline uint32_t _crc32Bytes(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    while (length--)
+        crc = CRC32Tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t _crc32SliceBy8(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+#if defined(__LITTLE_ENDIAN__) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    // Align so the 8-byte loads below are natural.
+    size_t lead = (8 - ((uintptr_t)bytes & 7)) & 7;
+    if (lead > length)
+        lead = length;
+    crc = _crc32Bytes(crc, bytes, lead);
+    bytes += lead;
+    length -= lead;
+
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+
+        crc = CRC32Tables[7][low & 0xFF] ^
+              CRC32Tables[6][(low >> 8) & 0xFF] ^
+              CRC32Tables[5][(low >> 16) & 0xFF] ^
+              CRC32Tables[4][low >> 24] ^
+              CRC32Tables[3][high & 0xFF] ^
+              CRC32Tables[2][(high >> 8) & 0xFF] ^
+              CRC32Tables[1][(high >> 16) & 0xFF] ^
+              CRC32Tables[0][high >> 24];
+
+        bytes += 8;
+        length -= 8;
+    }
+#endif
+
+    return _crc32Bytes(crc, bytes, length);
+}
+
+static uint64_t _crc64SliceBy8(uint64_t crc, const uint8_t *bytes, size_t length)
+{
+#if defined(__LITTLE_ENDIAN__) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    while (length > 0 && ((uintptr_t)bytes & 7) != 0) {
+        crc = CRC64Tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        word ^= crc;
+
+        crc = CRC64Tables[7][word & 0xFF] ^
+              CRC64Tables[6][(word >> 8) & 0xFF] ^
+              CRC64Tables[5][(word >> 16) & 0xFF] ^
+              CRC64Tables[4][(word >> 24) & 0xFF] ^
+              CRC64Tables[3][(word >> 32) & 0xFF] ^
+              CRC64Tables[2][(word >> 40) & 0xFF] ^
+              CRC64Tables[1][(word >> 48) & 0xFF] ^
+              CRC64Tables[0][word >> 56];
+
+        bytes += 8;
+        length -= 8;
+    }
+#endif
+
+    while (length--)
+        crc = CRC64Tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#pragma mark - x86 carry-less multiply
+
+#if OF_CRC_HAVE_PCLMUL
+
+// Folds four 128-bit lanes at a time with PCLMULQDQ, then Barrett-reduces to 32 bits. See Gopal et al., "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009); the constants are the bit-reflected folding constants for the IEEE polynomial. Requires at least 64 bytes and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _crc32FoldBlocks(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { UINT64_C(0x0154442bd4), UINT64_C(0x01c6e41596) };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { UINT64_C(0x01751997d0), UINT64_C(0x00ccaa009e) };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { UINT64_C(0x0163cd6124), UINT64_C(0x0000000000) };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { UINT64_C(0x01db710641), UINT64_C(0x01f7011641) };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(bytes + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(bytes + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(bytes + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(bytes + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    bytes += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(bytes + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(bytes + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(bytes + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(bytes + 0x30)));
+
+        bytes += 64;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one.
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Any remaining 16-byte blocks.
+    while (length >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)bytes)), x5);
+
+        bytes += 16;
+        length -= 16;
+    }
+
+    // 128 bits down to 64.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t _crc32PCLMUL(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    if (length >= 64) {
+        size_t blockLength = length & ~(size_t)15;
+        crc = _crc32FoldBlocks(crc, bytes, blockLength);
+        bytes += blockLength;
+        length -= blockLength;
+    }
+    return _crc32SliceBy8(crc, bytes, length);
+}
+
+static bool _processorHasPCLMUL(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0;
+}
+
+#endif
+
+#pragma mark - ARM CRC instructions
+
+#if defined(__ARM_FEATURE_CRC32)
+
+static uint32_t _crc32ARM(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    while (length > 0 && ((uintptr_t)bytes & 7) != 0) {
+        crc = __crc32b(crc, *bytes++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc = __crc32d(crc, word);
+        bytes += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = __crc32b(crc, *bytes++);
+    return crc;
+}
+
+#endif
+
+#pragma mark - API
+
+static void _setupCRC(void)
+{
+    dispatch_once(&CRCSetupOnce, ^{
+        _buildTables();
+
+        CRC32Implementation = _crc32SliceBy8;
+        CRC32Name = "slice-by-8";
+#if defined(__ARM_FEATURE_CRC32)
+        // Compile-time feature; the compiler only defines this when every targeted processor has the instructions.
+        CRC32Implementation = _crc32ARM;
+        CRC32Name = "ARMv8 CRC32";
+#elif OF_CRC_HAVE_PCLMUL
+        if (_processorHasPCLMUL()) {
+            CRC32Implementation = _crc32PCLMUL;
+            CRC32Name = "PCLMULQDQ folding";
+        }
+#endif
+    });
+}
+
+uint32_t OFCRC32Update(uint32_t crc, const void *bytes, size_t length)
+{
+    _setupCRC();
+    return ~CRC32Implementation(~crc, bytes, length);
+}
+
+uint64_t OFCRC64Update(uint64_t crc, const void *bytes, size_t length)
+{
+    _setupCRC();
+    return ~_crc64SliceBy8(~crc, bytes, length);
+}
+
+const char *OFCRC32ImplementationName(void)
+{
+    _setupCRC();
+    return CRC32Name;
+}
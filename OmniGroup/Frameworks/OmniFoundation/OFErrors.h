@@ -53,6 +53,13 @@ enum {
     // NSFileManager(OFExtensions)
     OFCannotGetQuarantineProperties,
     OFCannotSetQuarantineProperties,
+    
+    // OFXMLBuffer
+    OFXMLBufferCannotEncodeOutput,
+
+    // OFXMLDocument (BinaryFormat)
+    OFXMLDocumentInvalidBinaryData,
+    OFXMLDocumentUnsupportedBinaryNode,
 };
 
 
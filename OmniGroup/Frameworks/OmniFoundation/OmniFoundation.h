@@ -12,6 +12,7 @@
 #import <OmniFoundation/OFBundleRegistry.h>
 #import <OmniFoundation/OFCharacterScanner.h>
 #import <OmniFoundation/OFCharacterSet.h>
+#import <OmniFoundation/OFCRC.h>
 #import <OmniFoundation/OFCompletionMatch.h>
 #import <OmniFoundation/OFDataBuffer.h>
 #import <OmniFoundation/OFErrors.h>
@@ -75,6 +76,7 @@
     #import <OmniFoundation/OFSignature.h>
     #import <OmniFoundation/OFSparseArray.h>
     #import <OmniFoundation/OFStack.h>
+    #import <OmniFoundation/OFStripedReadWriteLock.h>
     #import <OmniFoundation/OFTrie.h>
     #import <OmniFoundation/OFTrieBucket.h>
     #import <OmniFoundation/OFTrieNode.h>
@@ -83,11 +85,13 @@
 
 // XML
 #import <OmniFoundation/OFXMLCursor.h>
+#import <OmniFoundation/OFXMLDocument-BinaryFormat.h>
 #import <OmniFoundation/OFXMLDocument.h>
 #import <OmniFoundation/OFXMLElement.h>
 #import <OmniFoundation/OFXMLIdentifier.h>
 #import <OmniFoundation/OFXMLIdentifierRegistry.h>
 #import <OmniFoundation/OFXMLInternedStringTable.h>
+#import <OmniFoundation/OFXMLLazyElement.h>
 #import <OmniFoundation/OFXMLParser.h>
 #import <OmniFoundation/OFXMLQName.h>
 #import <OmniFoundation/OFXMLString.h>
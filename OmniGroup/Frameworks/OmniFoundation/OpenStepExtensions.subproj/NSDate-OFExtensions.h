@@ -46,6 +46,9 @@
 
 @end
 
+// Parses an XML Schema dateTime (as -initWithXMLString: does) from 'length' bytes that needn't be NUL terminated, without making any objects.
+extern BOOL OFXMLDateTimeGetTimeInterval(const char *bytes, size_t length, NSTimeInterval *outTimeIntervalSinceReferenceDate);
+
 #import <OmniBase/assertions.h>
 
 // For old versions of Foundation w/o -dateByAddingTimeInterval:.
@@ -92,14 +92,17 @@ RCS_ID("$Id$")
     return nil; \
 } while(0)
 
+// The string isn't necessarily NUL terminated, so anything past 'length' reads as a NUL (which fails all the digit and character checks).
+#define CHAR_AT(i) ((i) < length ? buf[(i)] : 0)
+
 #define GET_DIGIT(d, delta) do { \
-  char c = buf[offset+delta]; \
-  if (c < '0' || c > '9') BAD_INIT; \
+  char c = CHAR_AT(offset+delta); \
+  if (c < '0' || c > '9') return NO; \
   d = (c - '0'); \
 } while(0)
 
 #define READ_CHAR(c) do { \
-  if (buf[offset] != c) BAD_INIT; \
+  if (CHAR_AT(offset) != c) return NO; \
   offset++; \
 } while(0)
 
@@ -122,7 +125,7 @@ RCS_ID("$Id$")
 } while(0)
 
 /*
- Expects a string in the XML Schema / RFC 3339 / ISO 8601 format, such as YYYY-MM-ddTHH:mm:ss(.S+)(Z|[+-]HH:MM).  This doesn't attempts to be very forgiving in parsing; the goal should be to feed in a conforming string. No support is included for negative years, though XML Schema and ISO 8601 allow it (RFC 3339 doesn't). Any deviation from the supported grammar will result in a nil return value.
+ Expects a string in the XML Schema / RFC 3339 / ISO 8601 format, such as YYYY-MM-ddTHH:mm:ss(.S+)(Z|[+-]HH:MM).  This doesn't attempts to be very forgiving in parsing; the goal should be to feed in a conforming string. No support is included for negative years, though XML Schema and ISO 8601 allow it (RFC 3339 doesn't). Any deviation from the supported grammar will result in a NO return value.
  
  References:
  <http://www.w3.org/TR/xmlschema-2/#dateTime>
@@ -130,9 +133,9 @@ RCS_ID("$Id$")
  
  */
 
-static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t length)
+BOOL OFXMLDateTimeGetTimeInterval(const char *buf, size_t length, NSTimeInterval *outTimeInterval)
 {
-    // Since we read forward, we'll catch a early NUL with digit or specific character checks.
+    // Since we read forward, we'll catch a early end with digit or specific character checks.
     CFGregorianDate date;
     unsigned offset = 0;
     READ_4UINT(date.year);
@@ -151,7 +154,7 @@ static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t leng
     // Everything to this point is fixed width.
     OBASSERT(offset == 19);
     
-    if (buf[offset] == '.') {
+    if (CHAR_AT(offset) == '.') {
         offset++; // skip the decimal.
         
         // Fractional second.  There must be at least one digit.
@@ -162,7 +165,7 @@ static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t leng
         // 32-bits can hold 9 digits w/o overflow.  We've read one already.  If we get anywhere near this limit, you're using an inappropriate format.
         unsigned digitIndex;
         for (digitIndex = 1; digitIndex < 9; digitIndex++) {
-            char digitChar = buf[offset + digitIndex];
+            char digitChar = CHAR_AT(offset + digitIndex);
             if (digitChar < '0' || digitChar > '9')
                 break; // Read one digit already; non-digit just terminates this portion.
             unsigned digit = digitChar - '0';
@@ -175,13 +178,12 @@ static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t leng
         date.second += (NSTimeInterval)fractionNumerator / (NSTimeInterval)fractionDenominator;
     }
     
-    NSTimeZone *timeZone;
-    if (buf[offset] == 'Z') { // RFC 3339 allows 'z' here too, but we don't right now.
-        if (buf[offset + 1] != 0)
-            BAD_INIT; // Crud after the 'Z'.
-        timeZone = [NSDate UTCTimeZone];
-    } else if (buf[offset] == '-' || buf[offset] == '+') {
-        BOOL negate = (buf[offset] == '-');
+    NSInteger tzOffset = 0;
+    if (CHAR_AT(offset) == 'Z') { // RFC 3339 allows 'z' here too, but we don't right now.
+        if (offset + 1 != length)
+            return NO; // Crud after the 'Z'.
+    } else if (CHAR_AT(offset) == '-' || CHAR_AT(offset) == '+') {
+        BOOL negate = (CHAR_AT(offset) == '-');
         offset++;
         
         unsigned tzHour, tzMinute;
@@ -189,33 +191,46 @@ static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t leng
         READ_CHAR(':');
         READ_2UINT(tzMinute);
         
-        // This isn't going to perform as well as the Z case.
-        NSInteger tzOffset = tzHour*3600+tzMinute*60;
+        tzOffset = tzHour*3600+tzMinute*60;
         if (negate)
             tzOffset = -tzOffset;
-        
-        timeZone = [NSTimeZone timeZoneForSecondsFromGMT:tzOffset];
     } else {
         // Unrecognized cruft where the timezone should have been.
-        BAD_INIT;
+        return NO;
     }
     
     if (!CFGregorianDateIsValid(date, kCFGregorianAllUnits)) {
-        BAD_INIT;
+        return NO;
     }
         
-    // NOTE: CFCalendarComposeAbsoluteTime is not thread-safe and doesn't deal with floating-point seconds, but CFGregorianDateGetAbsoluteTime is and has nicer API for what we need.
+    // NOTE: CFCalendarComposeAbsoluteTime is not thread-safe and doesn't deal with floating-point seconds, but CFGregorianDateGetAbsoluteTime is and has nicer API for what we need.  Fixed offsets are applied by hand rather than by making a time zone for each one.
     // TODO: Leap seconds can cause the maximum allowed second value to be 58 or 60 depending on whether the adjustment is +/-1.  RFC 3339 has a table of some leap seconds up to 1998 that we could test with.
-    CFAbsoluteTime absoluteTime = CFGregorianDateGetAbsoluteTime(date, (CFTimeZoneRef)timeZone);
+    CFAbsoluteTime absoluteTime = CFGregorianDateGetAbsoluteTime(date, (CFTimeZoneRef)[NSDate UTCTimeZone]) - tzOffset;
     
     DEBUG_XML_STRING(@"absoluteTime: %f", absoluteTime);
-        
-    NSDate *result = [self initWithTimeIntervalSinceReferenceDate:absoluteTime];
+    
+    *outTimeInterval = absoluteTime;
+    return YES;
+}
+
+static NSDate *_initDateFromXMLString(NSDate *self, const char *buf, size_t length)
+{
+    NSTimeInterval timeInterval;
+    if (!OFXMLDateTimeGetTimeInterval(buf, length, &timeInterval))
+        BAD_INIT;
+    
+    NSDate *result = [self initWithTimeIntervalSinceReferenceDate:timeInterval];
     DEBUG_XML_STRING(@"result: %@ %f", result, [result timeIntervalSinceReferenceDate]);
     
     return result;
 }
 
+#undef CHAR_AT
+#undef GET_DIGIT
+#undef READ_CHAR
+#undef READ_2UINT
+#undef READ_4UINT
+
 - initWithXMLString:(NSString *)xmlString;
 {
     static const NSUInteger OFXMLDateStringMaximumLength = 100; // The true maximum isn't fixed since the fractional seconds part is variable length.  Anything hugely long will be rejected.
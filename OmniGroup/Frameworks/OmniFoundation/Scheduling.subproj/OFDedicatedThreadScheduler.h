@@ -11,12 +11,23 @@
 
 @class NSConditionLock, NSLock;
 
+typedef struct {
+    NSUInteger wakeupCount; // Times the dedicated thread woke up, whether or not anything was due
+    NSUInteger dispatchCount; // Batches of events invoked
+    NSUInteger eventCount; // Events invoked, over all the batches
+    NSUInteger maximumEventsPerDispatch;
+    NSTimeInterval totalLateness; // Summed over the events: how long after its date each one was invoked
+    NSTimeInterval maximumLateness;
+} OFDedicatedThreadSchedulerStatistics;
+
 @interface OFDedicatedThreadScheduler : OFScheduler
 {
     NSConditionLock *scheduleConditionLock;
     NSConditionLock *mainThreadSynchronizationLock;
     NSDate *wakeDate;
     NSLock *wakeDateLock;
+    NSTimeInterval timerSlack;
+    OFDedicatedThreadSchedulerStatistics statistics; // Protected by wakeDateLock
     struct {
         unsigned int invokesEventsInMainThread:1;
     } flags;
@@ -26,6 +37,10 @@
 + (OFDedicatedThreadScheduler *)dedicatedThreadSchedulerIfCreated;
 
 - (void)setInvokesEventsInMainThread:(BOOL)shouldInvokeEventsInMainThread;
+- (void)setTimerSlack:(NSTimeInterval)newTimerSlack;
+    // Lets events fire up to this much after their dates, so that the dedicated thread can wake once for everything due in the same window (and invoke it as one batch) instead of once per event.  Wakeups are rounded up to multiples of the slack, which also lines up events scheduled independently.  The default is zero: wake for each event as close to its date as possible.
+- (OFDedicatedThreadSchedulerStatistics)statistics;
+- (void)resetStatistics;
 - (void)runScheduleForeverInNewThread;
 - (void)runScheduleForeverInCurrentThread;
 
@@ -9,6 +9,7 @@
 
 #import <OmniFoundation/NSDate-OFExtensions.h>
 #import <OmniFoundation/OFObject-Queue.h>
+#import <OmniFoundation/OFScheduledEvent.h>
 
 RCS_ID("$Id$")
 
@@ -18,6 +19,8 @@ RCS_ID("$Id$")
 - (void)mainThreadInvokeScheduledEvents;
 - (void)runScheduleInCurrentThreadUntilEmpty:(BOOL)onlyUntilEmpty;
 - (void)synchronouslyInvokeScheduledEvents;
+- (void)invokeDueEvents;
+- (NSDate *)coalescedDateOfFirstEvent;
 - (NSDate *)wakeDate;
 - (void)setWakeDate:(NSDate *)newWakeDate;
 @end
@@ -92,6 +95,30 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
     flags.invokesEventsInMainThread = shouldInvokeEventsInMainThread;
 }
 
+- (void)setTimerSlack:(NSTimeInterval)newTimerSlack;
+{
+    OBPRECONDITION(newTimerSlack >= 0.0);
+    timerSlack = MAX(newTimerSlack, 0.0);
+
+    // The thread may be asleep until a date that doesn't line up with the new slack.
+    [self notifyDedicatedThreadThatItNeedsToWakeSooner];
+}
+
+- (OFDedicatedThreadSchedulerStatistics)statistics;
+{
+    [wakeDateLock lock];
+    OFDedicatedThreadSchedulerStatistics currentStatistics = statistics;
+    [wakeDateLock unlock];
+    return currentStatistics;
+}
+
+- (void)resetStatistics;
+{
+    [wakeDateLock lock];
+    memset(&statistics, 0, sizeof(statistics));
+    [wakeDateLock unlock];
+}
+
 - (void)runScheduleForeverInNewThread;
 {
     [NSThread detachNewThreadSelector:@selector(runScheduleForeverInCurrentThread) toTarget:self withObject:nil];
@@ -117,6 +144,33 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
     // No need to wake our dedicated thread, that'll just make it consume CPU sooner than it was already planning to do (when it was going to wake up to process the event).
 }
 
+- (void)invokeEvents:(NSArray *)events;
+{
+    NSUInteger eventCount = [events count];
+    if (eventCount != 0) {
+        // Termination events go out before their dates, so only lateness counts.
+        NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+        NSTimeInterval totalLateness = 0.0, maximumLateness = 0.0;
+        for (OFScheduledEvent *event in events) {
+            NSTimeInterval lateness = now - [[event date] timeIntervalSinceReferenceDate];
+            if (lateness > 0.0) {
+                totalLateness += lateness;
+                maximumLateness = MAX(maximumLateness, lateness);
+            }
+        }
+
+        [wakeDateLock lock];
+        statistics.dispatchCount++;
+        statistics.eventCount += eventCount;
+        statistics.maximumEventsPerDispatch = MAX(statistics.maximumEventsPerDispatch, eventCount);
+        statistics.totalLateness += totalLateness;
+        statistics.maximumLateness = MAX(statistics.maximumLateness, maximumLateness);
+        [wakeDateLock unlock];
+    }
+
+    [super invokeEvents:events];
+}
+
 // OBObject subclass
 
 - (NSMutableDictionary *)debugDictionary;
@@ -129,6 +183,8 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
         [debugDictionary setObject:scheduleConditionLock forKey:@"scheduleConditionLock"];
     if ((date = [self wakeDate]))
         [debugDictionary setObject:date forKey:@"wakeDate"];
+    if (timerSlack > 0.0)
+        [debugDictionary setObject:[NSNumber numberWithDouble:timerSlack] forKey:@"timerSlack"];
 
     return debugDictionary;
 }
@@ -139,12 +195,14 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
 
 - (void)notifyDedicatedThreadIfFirstEventIsSoonerThanWakeDate;
 {
-    NSDate *dateOfFirstEvent = [self dateOfFirstEvent];
+    NSDate *dateOfFirstEvent = [self coalescedDateOfFirstEvent];
     NSDate *currentWakeDate = [self wakeDate];
 
     // The first part of this condition is fairly straightforward:  if the first scheduled event is before the current wake date, we notify the dedicated thread that it needs to wake sooner.
 
     // The last condition is a little more subtle:  when the user changes the system clock, it can skip right past something which was originally scheduled to fire hours in the "future", since sleep times appear to be relative rather than absolute.  This can block new events which are supposed to fire in fractions of a second, so we test here to see if the currentWakeDate is already in the past (and if so we notify the dedicated thread that it needs to wake sooner).  A better solution would be to track system clock changes and guarantee that -notifyDedicatedThreadThatItNeedsToWakeSooner will get called whenever the system clock jumps forward.
+
+    // With timer slack, both dates are rounded up to the slack, so the events in a burst that land in the same window as the current wake date leave the thread alone instead of signalling it once each.
     if (dateOfFirstEvent != nil && (currentWakeDate == nil || [dateOfFirstEvent isBeforeDate:currentWakeDate] || [currentWakeDate timeIntervalSinceNow] < 0.0)) {
         [self notifyDedicatedThreadThatItNeedsToWakeSooner];
     }
@@ -165,7 +223,7 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
 
     [mainThreadSynchronizationLock lockWhenCondition:MAIN_THREAD_BUSY];
     NS_DURING {
-        [self invokeScheduledEvents];
+        [self invokeDueEvents];
     } NS_HANDLER {
         savedException = localException;
     } NS_ENDHANDLER;
@@ -187,7 +245,7 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
             if ([scheduleConditionLock tryLockWhenCondition:SCHEDULE_CHANGED_CONDITION]) {
                 [scheduleConditionLock unlockWithCondition:SCHEDULE_STABLE_CONDITION];
             }
-            NSDate *dateOfFirstEvent = [self dateOfFirstEvent];
+            NSDate *dateOfFirstEvent = [self coalescedDateOfFirstEvent];
             if (dateOfFirstEvent == nil) {
                 if (!onlyUntilEmpty)
                     dateOfFirstEvent = [NSDate distantFuture];
@@ -202,12 +260,17 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
                 if (OFSchedulerDebug)
                     NSLog(@"%@: Sleeping %5.3f seconds until %@", [self shortDescription], [dateOfFirstEvent timeIntervalSinceNow], [dateOfFirstEvent description]);
 
-                if ([scheduleConditionLock lockWhenCondition:SCHEDULE_CHANGED_CONDITION beforeDate:dateOfFirstEvent]) {
+                BOOL scheduleChanged = [scheduleConditionLock lockWhenCondition:SCHEDULE_CHANGED_CONDITION beforeDate:dateOfFirstEvent];
+                [wakeDateLock lock];
+                statistics.wakeupCount++;
+                [wakeDateLock unlock];
+
+                if (scheduleChanged) {
                     if (OFSchedulerDebug)
                         NSLog(@"%@: Schedule changed", [self shortDescription]);
 
                     // Schedule changed, get the updated date of first event
-                    dateOfFirstEvent = [self dateOfFirstEvent];
+                    dateOfFirstEvent = [self coalescedDateOfFirstEvent];
                     [scheduleConditionLock unlockWithCondition:SCHEDULE_STABLE_CONDITION];
 
                     if (dateOfFirstEvent != nil && [dateOfFirstEvent timeIntervalSinceNow] <= 0.0) {
@@ -253,10 +316,41 @@ static OFDedicatedThreadScheduler *dedicatedThreadSchedulerIfCreated(Class self,
         [mainThreadSynchronizationLock lockWhenCondition:MAIN_THREAD_IDLE];
         [mainThreadSynchronizationLock unlock];
     } else {
+        [self invokeDueEvents];
+    }
+}
+
+#define MAXIMUM_EXTRA_BATCHES_PER_WAKEUP 16
+
+- (void)invokeDueEvents;
+{
+    [self invokeScheduledEvents];
+
+    // With timer slack, whatever came due while that batch was going out goes out in this same wakeup (and, for the main thread, the same trip over to it), rather than after another sleep.
+    NSUInteger extraBatchCount = 0;
+    while (timerSlack > 0.0 && extraBatchCount++ < MAXIMUM_EXTRA_BATCHES_PER_WAKEUP) {
+        NSDate *dateOfFirstEvent = [self coalescedDateOfFirstEvent];
+        if (dateOfFirstEvent == nil || [dateOfFirstEvent timeIntervalSinceNow] > 0.0)
+            break;
         [self invokeScheduledEvents];
     }
 }
 
+- (NSDate *)coalescedDateOfFirstEvent;
+{
+    NSDate *dateOfFirstEvent = [self dateOfFirstEvent];
+    NSTimeInterval slack = timerSlack;
+    if (dateOfFirstEvent == nil || slack <= 0.0)
+        return dateOfFirstEvent;
+
+    // Round up to the slack grid: everything due within the same window shares this wakeup, and nothing waits longer than the slack.
+    NSTimeInterval firstEventTime = [dateOfFirstEvent timeIntervalSinceReferenceDate];
+    NSTimeInterval wakeTime = ceil(firstEventTime / slack) * slack;
+    if (wakeTime <= firstEventTime)
+        return dateOfFirstEvent;
+    return [NSDate dateWithTimeIntervalSinceReferenceDate:wakeTime];
+}
+
 - (NSDate *)wakeDate;
 {
     NSDate *savedWakeDate;
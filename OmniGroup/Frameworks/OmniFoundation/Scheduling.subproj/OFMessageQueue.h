@@ -24,6 +24,8 @@
 - (void)setDelegate:(id <OFMessageQueueDelegate>)aDelegate;
 - (void)startBackgroundProcessors:(NSUInteger)processorCount;
 - (void)setSchedulesBasedOnPriority:(BOOL)shouldScheduleBasedOnPriority;
+- (void)setUsesWorkStealing:(BOOL)shouldUseWorkStealing;
+    // Gives each background processor its own queues (one per priority band: high, medium and low) and lets idle processors take work from busy ones, instead of sharing one locked, scanned queue. Invocations still come out in priority order within a processor, but only by band across processors, and ones whose group limits its threads still go through the shared queue. Must be set before anything is queued or any processors are started.
 
 - (BOOL)hasInvocations;
 - (OFInvocation *)copyNextInvocation;
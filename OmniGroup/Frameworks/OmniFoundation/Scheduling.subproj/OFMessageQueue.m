@@ -12,7 +12,10 @@
 #import <OmniFoundation/OFMessageQueuePriorityProtocol.h>
 #import <OmniFoundation/OFQueueProcessor.h>
 #import <OmniFoundation/OFRunLoopQueueProcessor.h>
+#import <OmniFoundation/OFSimpleLock.h>
 #import <Foundation/NSOperation.h>
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
 
 RCS_ID("$Id$")
 
@@ -20,6 +23,109 @@ typedef enum {
     QUEUE_HAS_NO_SCHEDULABLE_INVOCATIONS, QUEUE_HAS_INVOCATIONS,
 } OFMessageQueueState;
 
+/*
+ In work-stealing mode, each thread that blocks in -copyNextInvocationWithBlock: (normally one of our background processors) gets a slot holding a deque per priority band. Invocations queued from a processor's own thread go on its deques; everything else goes on a shared injection queue for the band, which processors drain a small batch at a time onto their own deques. A processor with nothing of its own takes from the other processors' deques.
+
+ The deques are Chase-Lev deques, except that the owner takes from the same end as the thieves. That way a lone processor still runs invocations in the order they were queued, and the owner never races a thief for the last entry.
+
+ Invocations whose group limits how many threads may work on it at once still go through the locked, scanned 'queue', since honoring the limit means looking at what every processor is doing. Until -startBackgroundProcessors: is called we don't know how many processors there will be, so every grouped invocation goes there. And since starting more processors can make a group's limit start to matter, processors check what they take from the deques and injection queues, and move anything that is now limited over to 'queue'.
+ */
+
+#define OFMessageQueueBandCount (3)
+#define OFMessageQueueMaximumSlotCount (128) // Any further processors still work, but only through the injection queues and by stealing
+#define OFMessageQueueInitialDequeCapacity (64)
+#define OFMessageQueueMaximumBatchSize (32)
+#define OFMessageQueueOnceStripeCount (64)
+
+typedef struct _OFMessageQueueDequeArray {
+    struct _OFMessageQueueDequeArray *retired; // The array this one replaced. Thieves may still be reading it, so it lives as long as the deque does.
+    int64_t mask; // capacity - 1
+    OFInvocation *entries[];
+} OFMessageQueueDequeArray;
+
+typedef struct {
+    volatile int64_t top; // Oldest entry; advanced with compare-and-swap by whoever takes it
+    volatile int64_t bottom; // Next free position; only written by the owning processor
+    OFMessageQueueDequeArray * volatile array;
+} OFMessageQueueDeque;
+
+typedef struct {
+    OFMessageQueueDeque deques[OFMessageQueueBandCount];
+} OFMessageQueueSlot;
+
+typedef struct {
+    OFSimpleLockType lock;
+    NSMutableArray *entries;
+    volatile int32_t count; // So processors can skip an empty queue without taking the lock
+} OFMessageQueueInjectionQueue;
+
+// Counts every pending invocation (not just the ones queued 'once'), since -queueSelectorOnce: skips anything equal to a pending invocation however it was queued.
+typedef struct {
+    OFSimpleLockType lock;
+    CFMutableBagRef entries;
+} OFMessageQueueOnceStripe;
+
+static char OFMessageQueueNoSlot; // Marks threads that came along after all the slots were taken
+
+// Takes ownership of the caller's reference to 'entry'. Only the owning processor may push.
+static void _OFMessageQueueDequePush(OFMessageQueueDeque *deque, OFInvocation *entry)
+{
+    int64_t bottom = deque->bottom;
+    int64_t top = deque->top;
+    OFMessageQueueDequeArray *array = deque->array;
+
+    if (!array || bottom - top > array->mask) {
+        int64_t capacity = array ? 2 * (array->mask + 1) : OFMessageQueueInitialDequeCapacity;
+        OFMessageQueueDequeArray *grownArray = malloc(sizeof(*grownArray) + (size_t)capacity * sizeof(grownArray->entries[0]));
+        grownArray->retired = array;
+        grownArray->mask = capacity - 1;
+        for (int64_t position = top; position < bottom; position++)
+            grownArray->entries[position & grownArray->mask] = array->entries[position & array->mask];
+        OSMemoryBarrier(); // The copied entries have to be visible before the array is
+        deque->array = grownArray;
+        array = grownArray;
+    }
+
+    array->entries[bottom & array->mask] = entry;
+    OSMemoryBarrier(); // ... and the entry before the new bottom
+    deque->bottom = bottom + 1;
+}
+
+// Returns the oldest entry, with the deque's reference now belonging to the caller. Any thread may take.
+static OFInvocation *_OFMessageQueueDequeTake(OFMessageQueueDeque *deque)
+{
+    while (YES) {
+        int64_t top = deque->top;
+        OSMemoryBarrier();
+        int64_t bottom = deque->bottom;
+        if (top >= bottom)
+            return nil;
+
+        // If we see the old array here, it was replaced after 'bottom' was read, so it still holds every entry up to there.
+        OSMemoryBarrier();
+        OFMessageQueueDequeArray *array = deque->array;
+        OFInvocation *entry = array->entries[top & array->mask];
+        if (OSAtomicCompareAndSwap64Barrier(top, top + 1, &deque->top))
+            return entry;
+
+        // Someone else took it; look again
+    }
+}
+
+static void _OFMessageQueueDequeDestroy(OFMessageQueueDeque *deque)
+{
+    OFInvocation *entry;
+    while ((entry = _OFMessageQueueDequeTake(deque)))
+        [entry release];
+
+    OFMessageQueueDequeArray *array = deque->array;
+    while (array) {
+        OFMessageQueueDequeArray *retiredArray = array->retired;
+        free(array);
+        array = retiredArray;
+    }
+}
+
 @implementation OFMessageQueue
 {
     NSMutableArray *queue;
@@ -33,13 +139,57 @@ typedef enum {
     NSUInteger uncreatedProcessors;
     NSMutableArray *queueProcessors;
     
+    // Work-stealing mode
+    OFMessageQueueSlot *slots;
+    volatile int32_t slotCount; // May run past OFMessageQueueMaximumSlotCount; only that many are actually handed out
+    pthread_key_t slotKey;
+    OFMessageQueueInjectionQueue injectionQueues[OFMessageQueueBandCount];
+    OFMessageQueueOnceStripe *onceStripes;
+    volatile int64_t pendingInvocationCount;
+    volatile int32_t constrainedInvocationCount; // Those in 'queue'
+    volatile int32_t sleepingProcessors;
+    dispatch_semaphore_t wakeSemaphore;
+    NSUInteger processorLimit; // Created and uncreated processors; a group allowed at least this many threads doesn't need its count checked
+    
     struct {
         unsigned int schedulesBasedOnPriority;
+        unsigned int usesWorkStealing;
     } flags;
 }
 
 static BOOL OFMessageQueueDebug = NO;
 
+static inline NSUInteger _OFMessageQueueBandForPriority(OFMessageQueue *self, unsigned int priority)
+{
+    if (!self->flags.schedulesBasedOnPriority)
+        return 0;
+    if (priority <= OFHighPriority)
+        return 0;
+    if (priority <= OFMediumPriority)
+        return 1;
+    return 2;
+}
+
+static inline OFMessageQueueOnceStripe *_OFMessageQueueOnceStripeForEntry(OFMessageQueue *self, OFInvocation *entry)
+{
+    return &self->onceStripes[[entry hash] % OFMessageQueueOnceStripeCount];
+}
+
+// Whether the invocation's group might run out of threads, so that it has to wait where processors can see what everyone else is working on. Unlocked peek at processorLimit, which only grows.
+static inline BOOL _OFMessageQueueIsConstrained(OFMessageQueue *self, OFMessageQueueSchedulingInfo schedulingInfo)
+{
+    if (schedulingInfo.group == NULL)
+        return NO;
+    NSUInteger processorLimit = self->processorLimit;
+    return processorLimit == 0 || schedulingInfo.maximumSimultaneousThreadsInGroup < processorLimit;
+}
+
+static inline OFMessageQueueSlot *_OFMessageQueueCurrentSlot(OFMessageQueue *self)
+{
+    void *slot = pthread_getspecific(self->slotKey);
+    return (slot == &OFMessageQueueNoSlot) ? NULL : slot;
+}
+
 + (OFMessageQueue *)mainQueue;
 {
     static dispatch_once_t onceToken;
@@ -80,6 +230,8 @@ static BOOL OFMessageQueueDebug = NO;
 
 - (void)dealloc;
 {
+    if (flags.usesWorkStealing)
+        [self _tearDownWorkStealing];
     [queueProcessors release];
     [queue release];
     [queueSet release];
@@ -103,9 +255,14 @@ static BOOL OFMessageQueueDebug = NO;
 {
     [queueProcessorsLock lock];
     uncreatedProcessors += processorCount;
+    processorLimit = [queueProcessors count] + uncreatedProcessors;
     [queueProcessorsLock unlock];
 
     // Now, go ahead and start some (or all) of those processors to handle messages already queued
+    if (flags.usesWorkStealing) {
+        [self _createProcessorsForQueueSize:(NSUInteger)pendingInvocationCount];
+        return;
+    }
     [queueLock lock];
     [self _createProcessorsForQueueSize:[queue count]];
     [queueLock unlock];
@@ -116,12 +273,29 @@ static BOOL OFMessageQueueDebug = NO;
     flags.schedulesBasedOnPriority = shouldScheduleBasedOnPriority;
 }
 
+- (void)setUsesWorkStealing:(BOOL)shouldUseWorkStealing;
+{
+    OBPRECONDITION(![self hasInvocations]);
+    OBPRECONDITION([queueProcessors count] == 0);
+
+    if (shouldUseWorkStealing == (flags.usesWorkStealing != 0))
+        return;
+
+    if (shouldUseWorkStealing)
+        [self _setUpWorkStealing];
+    else
+        [self _tearDownWorkStealing];
+}
+
 //
 
 - (BOOL)hasInvocations;
 {
     BOOL hasInvocations;
 
+    if (flags.usesWorkStealing)
+        return pendingInvocationCount > 0;
+
     [queueLock lock];
     hasInvocations = [queue count] > 0;
     [queueLock unlock];
@@ -135,6 +309,13 @@ static BOOL OFMessageQueueDebug = NO;
 
 - (OFInvocation *)copyNextInvocationWithBlock:(BOOL)shouldBlock;
 {
+    if (flags.usesWorkStealing) {
+        OFInvocation *nextRetainedInvocation = [self _copyNextWorkStealingInvocationWithBlock:shouldBlock];
+        if (OFMessageQueueDebug && nextRetainedInvocation)
+            NSLog(@"[%@ nextRetainedInvocation] = %@, priority = %d", [self shortDescription], [nextRetainedInvocation shortDescription], [nextRetainedInvocation messageQueueSchedulingInfo].priority);
+        return nextRetainedInvocation;
+    }
+
     NSUInteger invocationCount;
     OFInvocation *nextRetainedInvocation = nil;
 
@@ -145,9 +326,6 @@ static BOOL OFMessageQueueDebug = NO;
         [queueLock unlockWithCondition:QUEUE_HAS_NO_SCHEDULABLE_INVOCATIONS];
            
     do {
-        NSUInteger invocationIndex;
-        NSUInteger queueProcessorIndex, queueProcessorCount;
-
         if (shouldBlock) {
             [queueProcessorsLock lock];
             idleProcessors++;
@@ -167,64 +345,7 @@ static BOOL OFMessageQueueDebug = NO;
             return nil;
         }
 
-        [queueProcessorsLock lock];
-
-        queueProcessorCount = [queueProcessors count];
-        OFMessageQueueSchedulingInfo currentGroupSchedulingInfo = OFMessageQueueSchedulingInfoDefault;
-        unsigned int currentGroupThreadCount = 0;
-
-        for (invocationIndex = 0; invocationIndex < invocationCount; invocationIndex++) {
-            BOOL useCurrentInvocation;
-
-            // get first invocation in queue
-            OFInvocation *nextInvocation = [queue objectAtIndex:invocationIndex];
-            OFMessageQueueSchedulingInfo schedulingInfo = [nextInvocation messageQueueSchedulingInfo];
-            if (schedulingInfo.group == NULL || queueProcessorCount == 0) {  // Null group is special, and can use as many threads as it wants
-                useCurrentInvocation = YES;
-#ifdef DEBUG_kc0
-                if (flags.schedulesBasedOnPriority) {
-                    NSLog(@"-[%@ %@] invocation has no group: %@", OBShortObjectDescription(self), NSStringFromSelector(_cmd), [nextInvocation shortDescription]);
-                }
-                OBASSERT(!flags.schedulesBasedOnPriority); // If a message queue schedules based on priority, its invocations really should have priorities!
-#endif
-            } else {  // Check to see if this group already has used up all its allotted threads
-                if (schedulingInfo.group != currentGroupSchedulingInfo.group) {
-                    OBASSERT(schedulingInfo.maximumSimultaneousThreadsInGroup > 0);
-                    currentGroupThreadCount = 0;
-                    if (schedulingInfo.maximumSimultaneousThreadsInGroup >= queueProcessorCount) {
-                        // This group is allowed as many threads as we have processors, so we don't need to bother counting the actual threads being spent on this group
-                    } else {
-                        for (queueProcessorIndex = 0; queueProcessorIndex < queueProcessorCount; queueProcessorIndex++) {
-                            if (currentGroupThreadCount >= schedulingInfo.maximumSimultaneousThreadsInGroup)
-                                break;
-    
-                            // Get group of object queue processer is working on
-                            OFMessageQueueSchedulingInfo processorSchedulingInfo = [[queueProcessors objectAtIndex:queueProcessorIndex] schedulingInfo];
-    
-                            if (processorSchedulingInfo.group == schedulingInfo.group)
-                                currentGroupThreadCount++;
-                        }
-                    }
-
-                    currentGroupSchedulingInfo = schedulingInfo;
-                }
-                useCurrentInvocation = currentGroupThreadCount < currentGroupSchedulingInfo.maximumSimultaneousThreadsInGroup;
-#ifdef DEBUG_kc0
-                NSLog(@"useCurrentInvocation=%d group=%d groupThreadCount=%d maximumSimultaneousThreadsInGroup=%d", useCurrentInvocation, currentGroupSchedulingInfo.group, groupThreadCount, currentGroupSchedulingInfo.maximumSimultaneousThreadsInGroup, [nextInvocation shortDescription]);
-#endif
-            }
-
-            if (useCurrentInvocation) {
-                nextRetainedInvocation = [nextInvocation retain];
-                OBASSERT([queue objectAtIndex:invocationIndex] == nextInvocation);
-                [queue removeObjectAtIndex:invocationIndex];
-                if (queueSet)
-                    [queueSet removeObject:nextInvocation];
-                break;
-            }
-        }
-
-        [queueProcessorsLock unlock];
+        nextRetainedInvocation = [self _copyFirstSchedulableQueueEntryInBand:NSNotFound];
 
         if (nextRetainedInvocation == nil || invocationCount == 1) {
             OBASSERT([queue count] == 0 || nextRetainedInvocation == nil);
@@ -257,31 +378,23 @@ static BOOL OFMessageQueueDebug = NO;
     if (OFMessageQueueDebug)
 	NSLog(@"[%@ addQueueEntry:%@]", [self shortDescription], [aQueueEntry shortDescription]);
 
+    if (flags.usesWorkStealing) {
+        OFMessageQueueOnceStripe *stripe = _OFMessageQueueOnceStripeForEntry(self, aQueueEntry);
+        OFSimpleLock(&stripe->lock);
+        CFBagAddValue(stripe->entries, aQueueEntry);
+        OFSimpleUnlock(&stripe->lock);
+
+        [self _addWorkStealingQueueEntry:aQueueEntry];
+        return;
+    }
+
     [queueLock lock];
 
     NSUInteger queueCount = [queue count];
     BOOL wasEmpty = (queueCount == 0);
     id <OFMessageQueueDelegate> strongDelegate = [_weak_delegate retain];
     
-    NSUInteger entryIndex = queueCount;
-    if (flags.schedulesBasedOnPriority) {
-        // Figure out priority
-        unsigned int priority = [aQueueEntry messageQueueSchedulingInfo].priority;
-        OBASSERT(priority != 0);
-
-        // Find spot at end of other entries with same priority
-        while (entryIndex--) {
-            OFInvocation *otherEntry;
-
-            otherEntry = [queue objectAtIndex:entryIndex];
-            if ([otherEntry messageQueueSchedulingInfo].priority <= priority)
-                break;
-        }
-        entryIndex++;
-    }
-
-    // Insert object at entryIndex
-    [queue insertObject:aQueueEntry atIndex:entryIndex];
+    [self _insertQueueEntry:aQueueEntry];
     queueCount++;
     if (queueSet)
         [queueSet addObject:aQueueEntry];
@@ -300,6 +413,20 @@ static BOOL OFMessageQueueDebug = NO;
 {
     BOOL alreadyContainsObject;
 
+    if (flags.usesWorkStealing) {
+        // Check and add under one stripe lock, so two threads queueing the same thing can't both get it in
+        OFMessageQueueOnceStripe *stripe = _OFMessageQueueOnceStripeForEntry(self, aQueueEntry);
+        OFSimpleLock(&stripe->lock);
+        alreadyContainsObject = CFBagContainsValue(stripe->entries, aQueueEntry);
+        if (!alreadyContainsObject)
+            CFBagAddValue(stripe->entries, aQueueEntry);
+        OFSimpleUnlock(&stripe->lock);
+
+        if (!alreadyContainsObject)
+            [self _addWorkStealingQueueEntry:aQueueEntry];
+        return;
+    }
+
     [queueLock lock];
     if (!queueSet)
 	queueSet = [[NSMutableSet alloc] initWithArray:queue];
@@ -454,6 +581,11 @@ static BOOL OFMessageQueueDebug = NO;
     
     debugDictionary = [super debugDictionary];
     [debugDictionary setObject:queue forKey:@"queue"];
+    if (flags.usesWorkStealing) {
+        [debugDictionary setObject:[NSNumber numberWithLongLong:pendingInvocationCount] forKey:@"pendingInvocationCount"];
+        [debugDictionary setObject:[NSNumber numberWithInt:MIN(slotCount, OFMessageQueueMaximumSlotCount)] forKey:@"slotCount"];
+        [debugDictionary setObject:[NSNumber numberWithInt:sleepingProcessors] forKey:@"sleepingProcessors"];
+    }
     [debugDictionary setObject:[NSNumber numberWithInt:idleProcessors] forKey:@"idleProcessors"];
     [debugDictionary setObject:[NSNumber numberWithUnsignedInteger:uncreatedProcessors] forKey:@"uncreatedProcessors"];
     [debugDictionary setObject:flags.schedulesBasedOnPriority ? @"YES" : @"NO" forKey:@"flags.schedulesBasedOnPriority"];
@@ -467,12 +599,106 @@ static BOOL OFMessageQueueDebug = NO;
 
 #pragma mark Private
 
+// Called with the queue lock held. Keeps 'queue' sorted by priority (when we schedule by priority), with each entry after the others of the same priority.
+- (void)_insertQueueEntry:(OFInvocation *)aQueueEntry;
+{
+    NSUInteger entryIndex = [queue count];
+    if (flags.schedulesBasedOnPriority) {
+        // Figure out priority
+        unsigned int priority = [aQueueEntry messageQueueSchedulingInfo].priority;
+        OBASSERT(priority != 0);
+
+        // Find spot at end of other entries with same priority
+        while (entryIndex--) {
+            OFInvocation *otherEntry;
+
+            otherEntry = [queue objectAtIndex:entryIndex];
+            if ([otherEntry messageQueueSchedulingInfo].priority <= priority)
+                break;
+        }
+        entryIndex++;
+    }
+
+    // Insert object at entryIndex
+    [queue insertObject:aQueueEntry atIndex:entryIndex];
+}
+
+// Called with the queue lock held. Returns the first invocation in 'queue' whose group has a thread to spare, looking only at those in 'band' unless it is NSNotFound.
+- (OFInvocation *)_copyFirstSchedulableQueueEntryInBand:(NSUInteger)band;
+{
+    NSUInteger invocationCount = [queue count];
+    OFInvocation *nextRetainedInvocation = nil;
+
+    [queueProcessorsLock lock];
+
+    NSUInteger queueProcessorCount = [queueProcessors count];
+    OFMessageQueueSchedulingInfo currentGroupSchedulingInfo = OFMessageQueueSchedulingInfoDefault;
+    unsigned int currentGroupThreadCount = 0;
+
+    for (NSUInteger invocationIndex = 0; invocationIndex < invocationCount; invocationIndex++) {
+        BOOL useCurrentInvocation;
+
+        // get first invocation in queue
+        OFInvocation *nextInvocation = [queue objectAtIndex:invocationIndex];
+        OFMessageQueueSchedulingInfo schedulingInfo = [nextInvocation messageQueueSchedulingInfo];
+        if (band != NSNotFound && _OFMessageQueueBandForPriority(self, schedulingInfo.priority) != band)
+            continue;
+        if (schedulingInfo.group == NULL || queueProcessorCount == 0) {  // Null group is special, and can use as many threads as it wants
+            useCurrentInvocation = YES;
+#ifdef DEBUG_kc0
+            if (flags.schedulesBasedOnPriority) {
+                NSLog(@"-[%@ %@] invocation has no group: %@", OBShortObjectDescription(self), NSStringFromSelector(_cmd), [nextInvocation shortDescription]);
+            }
+            OBASSERT(!flags.schedulesBasedOnPriority); // If a message queue schedules based on priority, its invocations really should have priorities!
+#endif
+        } else {  // Check to see if this group already has used up all its allotted threads
+            if (schedulingInfo.group != currentGroupSchedulingInfo.group) {
+                OBASSERT(schedulingInfo.maximumSimultaneousThreadsInGroup > 0);
+                currentGroupThreadCount = 0;
+                if (schedulingInfo.maximumSimultaneousThreadsInGroup >= queueProcessorCount) {
+                    // This group is allowed as many threads as we have processors, so we don't need to bother counting the actual threads being spent on this group
+                } else {
+                    for (NSUInteger queueProcessorIndex = 0; queueProcessorIndex < queueProcessorCount; queueProcessorIndex++) {
+                        if (currentGroupThreadCount >= schedulingInfo.maximumSimultaneousThreadsInGroup)
+                            break;
+
+                        // Get group of object queue processer is working on
+                        OFMessageQueueSchedulingInfo processorSchedulingInfo = [[queueProcessors objectAtIndex:queueProcessorIndex] schedulingInfo];
+
+                        if (processorSchedulingInfo.group == schedulingInfo.group)
+                            currentGroupThreadCount++;
+                    }
+                }
+
+                currentGroupSchedulingInfo = schedulingInfo;
+            }
+            useCurrentInvocation = currentGroupThreadCount < currentGroupSchedulingInfo.maximumSimultaneousThreadsInGroup;
+#ifdef DEBUG_kc0
+            NSLog(@"useCurrentInvocation=%d group=%d groupThreadCount=%d maximumSimultaneousThreadsInGroup=%d", useCurrentInvocation, currentGroupSchedulingInfo.group, groupThreadCount, currentGroupSchedulingInfo.maximumSimultaneousThreadsInGroup, [nextInvocation shortDescription]);
+#endif
+        }
+
+        if (useCurrentInvocation) {
+            nextRetainedInvocation = [nextInvocation retain];
+            OBASSERT([queue objectAtIndex:invocationIndex] == nextInvocation);
+            [queue removeObjectAtIndex:invocationIndex];
+            if (queueSet)
+                [queueSet removeObject:nextInvocation];
+            break;
+        }
+    }
+
+    [queueProcessorsLock unlock];
+
+    return nextRetainedInvocation;
+}
+
 - (void)_createProcessorsForQueueSize:(NSUInteger)queueCount;
 {
     unsigned int projectedIdleProcessors;
     
     [queueProcessorsLock lock];
-    projectedIdleProcessors = idleProcessors;
+    projectedIdleProcessors = flags.usesWorkStealing ? (unsigned int)MAX(sleepingProcessors, 0) : idleProcessors;
     while (projectedIdleProcessors < queueCount && uncreatedProcessors > 0) {
         OFQueueProcessor *newProcessor;
         
@@ -486,6 +712,275 @@ static BOOL OFMessageQueueDebug = NO;
     [queueProcessorsLock unlock];
 }
 
+- (void)_setUpWorkStealing;
+{
+    OBPRECONDITION(!flags.usesWorkStealing);
+
+    slots = calloc(OFMessageQueueMaximumSlotCount, sizeof(*slots));
+    slotCount = 0;
+    int rc = pthread_key_create(&slotKey, NULL);
+    OBASSERT(rc == 0); OB_UNUSED_VALUE(rc);
+
+    for (NSUInteger band = 0; band < OFMessageQueueBandCount; band++) {
+        OFSimpleLockInit(&injectionQueues[band].lock);
+        injectionQueues[band].entries = [[NSMutableArray alloc] init];
+        injectionQueues[band].count = 0;
+    }
+
+    onceStripes = calloc(OFMessageQueueOnceStripeCount, sizeof(*onceStripes));
+    for (NSUInteger stripeIndex = 0; stripeIndex < OFMessageQueueOnceStripeCount; stripeIndex++) {
+        OFSimpleLockInit(&onceStripes[stripeIndex].lock);
+        onceStripes[stripeIndex].entries = CFBagCreateMutable(kCFAllocatorDefault, 0, &kCFTypeBagCallBacks);
+    }
+
+    pendingInvocationCount = 0;
+    constrainedInvocationCount = 0;
+    sleepingProcessors = 0;
+    wakeSemaphore = dispatch_semaphore_create(0);
+
+    flags.usesWorkStealing = 1;
+}
+
+- (void)_tearDownWorkStealing;
+{
+    OBPRECONDITION(flags.usesWorkStealing);
+
+    flags.usesWorkStealing = 0;
+
+    // Deleting the key just forgets which threads had which slots; the slots themselves are ours to free
+    pthread_key_delete(slotKey);
+    for (NSUInteger slotIndex = 0; slotIndex < OFMessageQueueMaximumSlotCount; slotIndex++) {
+        for (NSUInteger band = 0; band < OFMessageQueueBandCount; band++)
+            _OFMessageQueueDequeDestroy(&slots[slotIndex].deques[band]);
+    }
+    free(slots);
+    slots = NULL;
+    slotCount = 0;
+
+    for (NSUInteger band = 0; band < OFMessageQueueBandCount; band++) {
+        [injectionQueues[band].entries release];
+        injectionQueues[band].entries = nil;
+        OFSimpleLockFree(&injectionQueues[band].lock);
+    }
+
+    for (NSUInteger stripeIndex = 0; stripeIndex < OFMessageQueueOnceStripeCount; stripeIndex++) {
+        CFRelease(onceStripes[stripeIndex].entries);
+        OFSimpleLockFree(&onceStripes[stripeIndex].lock);
+    }
+    free(onceStripes);
+    onceStripes = NULL;
+
+    dispatch_release(wakeSemaphore);
+    wakeSemaphore = NULL;
+}
+
+// The entry has already been counted in the once stripes.
+- (void)_addWorkStealingQueueEntry:(OFInvocation *)aQueueEntry;
+{
+    OFMessageQueueSchedulingInfo schedulingInfo = [aQueueEntry messageQueueSchedulingInfo];
+    OBASSERT(!flags.schedulesBasedOnPriority || schedulingInfo.priority != 0);
+
+    BOOL wasEmpty = (OSAtomicIncrement64Barrier(&pendingInvocationCount) == 1);
+
+    if (_OFMessageQueueIsConstrained(self, schedulingInfo)) {
+        [self _addConstrainedQueueEntry:aQueueEntry];
+    } else {
+        NSUInteger band = _OFMessageQueueBandForPriority(self, schedulingInfo.priority);
+        OFMessageQueueSlot *slot = _OFMessageQueueCurrentSlot(self);
+        if (slot) {
+            // Queued by an invocation running on one of our processors; keep it local unless someone else is idle enough to come get it
+            _OFMessageQueueDequePush(&slot->deques[band], [aQueueEntry retain]);
+        } else {
+            OFMessageQueueInjectionQueue *injectionQueue = &injectionQueues[band];
+            OFSimpleLock(&injectionQueue->lock);
+            [injectionQueue->entries addObject:aQueueEntry];
+            injectionQueue->count++;
+            OFSimpleUnlock(&injectionQueue->lock);
+        }
+    }
+
+    [self _wakeSleepingProcessor];
+
+    // Unlocked peek; -_createProcessorsForQueueSize: checks again under its lock
+    if (uncreatedProcessors > 0)
+        [self _createProcessorsForQueueSize:(NSUInteger)pendingInvocationCount];
+
+    if (wasEmpty) {
+        [queueLock lock];
+        id <OFMessageQueueDelegate> strongDelegate = [_weak_delegate retain];
+        [queueLock unlock];
+
+        [strongDelegate queueHasInvocations:self];
+        [strongDelegate release];
+    }
+}
+
+- (void)_addConstrainedQueueEntry:(OFInvocation *)aQueueEntry;
+{
+    [queueLock lock];
+    [self _insertQueueEntry:aQueueEntry];
+    OSAtomicIncrement32Barrier(&constrainedInvocationCount);
+    [queueLock unlock];
+}
+
+- (OFInvocation *)_copyNextWorkStealingInvocationWithBlock:(BOOL)shouldBlock;
+{
+    OFMessageQueueSlot *slot = _OFMessageQueueCurrentSlot(self);
+    if (!slot && shouldBlock && pthread_getspecific(slotKey) == NULL) {
+        // Threads that wait on us are our processors, and get a slot the first time they ask
+        int32_t slotIndex = OSAtomicIncrement32Barrier(&slotCount) - 1;
+        if (slotIndex < OFMessageQueueMaximumSlotCount) {
+            slot = &slots[slotIndex];
+            pthread_setspecific(slotKey, slot);
+        } else
+            pthread_setspecific(slotKey, &OFMessageQueueNoSlot);
+    }
+
+    while (YES) {
+        OFInvocation *nextRetainedInvocation = [self _copyWorkStealingInvocationForSlot:slot];
+        if (nextRetainedInvocation || !shouldBlock)
+            return nextRetainedInvocation;
+
+        // Count ourselves as sleeping before the last look, so that anything queued after that look will wake us
+        OSAtomicIncrement32Barrier(&sleepingProcessors);
+        nextRetainedInvocation = [self _copyWorkStealingInvocationForSlot:slot];
+        if (nextRetainedInvocation) {
+            [self _stopSleeping];
+            return nextRetainedInvocation;
+        }
+
+        dispatch_semaphore_wait(wakeSemaphore, DISPATCH_TIME_FOREVER);
+    }
+}
+
+- (OFInvocation *)_copyWorkStealingInvocationForSlot:(OFMessageQueueSlot *)slot;
+{
+    for (NSUInteger band = 0; band < OFMessageQueueBandCount; band++) {
+        OFInvocation *nextRetainedInvocation = [self _copyWorkStealingInvocationInBand:band slot:slot];
+        if (nextRetainedInvocation) {
+            OSAtomicDecrement64Barrier(&pendingInvocationCount);
+
+            OFMessageQueueOnceStripe *stripe = _OFMessageQueueOnceStripeForEntry(self, nextRetainedInvocation);
+            OFSimpleLock(&stripe->lock);
+            CFBagRemoveValue(stripe->entries, nextRetainedInvocation);
+            OFSimpleUnlock(&stripe->lock);
+
+            return nextRetainedInvocation;
+        }
+    }
+
+    return nil;
+}
+
+- (OFInvocation *)_copyWorkStealingInvocationInBand:(NSUInteger)band slot:(OFMessageQueueSlot *)slot;
+{
+    while (YES) {
+        OFInvocation *nextRetainedInvocation;
+
+        if (constrainedInvocationCount > 0) {
+            [queueLock lock];
+            nextRetainedInvocation = [self _copyFirstSchedulableQueueEntryInBand:band];
+            [queueLock unlock];
+            if (nextRetainedInvocation) {
+                OSAtomicDecrement32Barrier(&constrainedInvocationCount);
+                return nextRetainedInvocation;
+            }
+        }
+
+        nextRetainedInvocation = [self _copyUnconstrainedInvocationInBand:band slot:slot];
+        if (!nextRetainedInvocation || !_OFMessageQueueIsConstrained(self, [nextRetainedInvocation messageQueueSchedulingInfo]))
+            return nextRetainedInvocation;
+
+        // Queued before -startBackgroundProcessors: raised the processor limit past its group's; it has to take its turn in 'queue' now
+        [self _addConstrainedQueueEntry:nextRetainedInvocation];
+        [nextRetainedInvocation release];
+    }
+}
+
+- (OFInvocation *)_copyUnconstrainedInvocationInBand:(NSUInteger)band slot:(OFMessageQueueSlot *)slot;
+{
+    OFInvocation *nextRetainedInvocation;
+
+    if (slot && (nextRetainedInvocation = _OFMessageQueueDequeTake(&slot->deques[band])))
+        return nextRetainedInvocation;
+
+    if ((nextRetainedInvocation = [self _copyInjectedInvocationInBand:band slot:slot]))
+        return nextRetainedInvocation;
+
+    // Steal, starting just past our own slot so that idle processors spread out over their victims
+    int32_t stealableSlotCount = MIN(slotCount, OFMessageQueueMaximumSlotCount);
+    int32_t firstSlotIndex = slot ? (int32_t)(slot - slots) + 1 : 0;
+    for (int32_t slotOffset = 0; slotOffset < stealableSlotCount; slotOffset++) {
+        OFMessageQueueSlot *victim = &slots[(firstSlotIndex + slotOffset) % stealableSlotCount];
+        if (victim != slot && (nextRetainedInvocation = _OFMessageQueueDequeTake(&victim->deques[band])))
+            return nextRetainedInvocation;
+    }
+
+    return nil;
+}
+
+- (OFInvocation *)_copyInjectedInvocationInBand:(NSUInteger)band slot:(OFMessageQueueSlot *)slot;
+{
+    OFMessageQueueInjectionQueue *injectionQueue = &injectionQueues[band];
+    if (injectionQueue->count == 0)
+        return nil;
+
+    // A processor moves its share of the backlog onto its own deque, where the others can steal it without coming back to this lock. Threads without a slot just take one.
+    OFInvocation *batch[OFMessageQueueMaximumBatchSize];
+    NSUInteger batchSize;
+
+    OFSimpleLock(&injectionQueue->lock);
+    NSUInteger injectedCount = [injectionQueue->entries count];
+    if (slot) {
+        NSUInteger share = injectedCount / (NSUInteger)MAX(MIN(slotCount, OFMessageQueueMaximumSlotCount), 1);
+        batchSize = MIN(MAX(share, 1U), MIN(injectedCount, (NSUInteger)OFMessageQueueMaximumBatchSize));
+    } else
+        batchSize = MIN(injectedCount, 1U);
+    NSRange batchRange = NSMakeRange(0, batchSize);
+    [injectionQueue->entries getObjects:batch range:batchRange];
+    for (NSUInteger batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        [batch[batchIndex] retain];
+    [injectionQueue->entries removeObjectsInRange:batchRange];
+    injectionQueue->count = (int32_t)(injectedCount - batchSize);
+    OFSimpleUnlock(&injectionQueue->lock);
+
+    if (batchSize == 0)
+        return nil;
+
+    for (NSUInteger batchIndex = 1; batchIndex < batchSize; batchIndex++)
+        _OFMessageQueueDequePush(&slot->deques[band], batch[batchIndex]);
+    return batch[0];
+}
+
+- (void)_wakeSleepingProcessor;
+{
+    OSMemoryBarrier(); // Whatever was just queued has to be visible before we look for sleepers
+    while (YES) {
+        int32_t sleeping = sleepingProcessors;
+        if (sleeping <= 0)
+            return;
+        if (OSAtomicCompareAndSwap32Barrier(sleeping, sleeping - 1, &sleepingProcessors)) {
+            dispatch_semaphore_signal(wakeSemaphore);
+            return;
+        }
+    }
+}
+
+// For a processor that counted itself as sleeping and then found something to do after all.
+- (void)_stopSleeping;
+{
+    while (YES) {
+        int32_t sleeping = sleepingProcessors;
+        if (sleeping <= 0) {
+            // Someone has already signaled on our behalf (or on behalf of another sleeper, which comes to the same thing). Soak that up so it doesn't wake a processor later for nothing.
+            dispatch_semaphore_wait(wakeSemaphore, DISPATCH_TIME_FOREVER);
+            return;
+        }
+        if (OSAtomicCompareAndSwap32Barrier(sleeping, sleeping - 1, &sleepingProcessors))
+            return;
+    }
+}
+
 #if 0
 // Used by OFQueueFunction() / OFMainThreadPerformFunction() which are also commented out
 - (void)_callFunction:(void (*)())aFunction argument:(void *)argument;
@@ -17,6 +17,7 @@
 @interface OFScheduler : NSObject
 {
     NSMutableArray *scheduleQueue;
+    struct _OFTimerWheel *timerWheel;
     NSRecursiveLock *scheduleLock;
     BOOL terminationSignaled;
 }
@@ -31,6 +32,9 @@
 - (OFScheduler *)subscheduler;
 - (NSDate *)dateOfFirstEvent;
 
+- (void)setUsesTimerWheel:(BOOL)shouldUseTimerWheel;
+    // Keeps events in a hierarchical timer wheel rather than a sorted array, making scheduling and aborting constant time no matter how many events are waiting.  Events still fire in date order and never early, but the wheel works in milliseconds, so -dateOfFirstEvent may be up to a millisecond after the first event's date (or earlier than it, when that event is far enough out that the wheel only knows roughly when it is due).  Any events already scheduled move over.
+
 @end
 
 @interface OFScheduler (OFConvenienceMethods)
@@ -51,6 +55,8 @@
     // Subclasses override this method to schedule their events
 - (void)cancelScheduledEvents;
     // Subclasses override this method to cancel their previously scheduled events.
+- (void)invokeEvents:(NSArray *)events;
+    // Invokes a batch of events that -invokeScheduledEvents (or termination) has removed from the schedule.  Subclasses may override this to watch what fires, as long as they call super.
 @end
 
 extern BOOL OFSchedulerDebug;
@@ -19,11 +19,14 @@
 #import <OmniFoundation/OFChildScheduler.h>
 #import <OmniFoundation/OFRunLoopScheduler.h>
 
+#import "OFTimerWheel.h"
+
 RCS_ID("$Id$")
 
+#define OFSchedulerTimerWheelResolution (1e-3)
+
 @interface OFScheduler (Private)
 + (void)setDebug:(BOOL)newDebug;
-- (void)invokeEvents:(NSArray *)events;
 - (void)controllerWillTerminate:(OFController *)controller;
 @end
 
@@ -85,6 +88,8 @@ static NSLock *instanceCountLock;
 - (void)dealloc;
 {
     [scheduleQueue release];
+    if (timerWheel)
+        OFTimerWheelDestroy(timerWheel);
     [scheduleLock release];
 #ifdef DEBUG_ALLOCATIONS
     [instanceCountLock lock];
@@ -107,9 +112,20 @@ static NSLock *instanceCountLock;
     }
     
     [scheduleLock lock];
-    [scheduleQueue insertObject:event inArraySortedUsingSelector:@selector(compare:)];
-    if ([scheduleQueue objectAtIndex:0] == event) {
-        [self scheduleEvents];
+    if (timerWheel) {
+        // An empty wheel may have sat idle for a while; catching its clock up first files the event low in the wheel, rather than in a coarse slot that would need breaking down before it fires.
+        if (OFTimerWheelCount(timerWheel) == 0)
+            OFTimerWheelRemoveDue(timerWheel, [NSDate timeIntervalSinceReferenceDate], nil);
+
+        BOOL eventBecameFirst;
+        OFTimerWheelAdd(timerWheel, event, [[event date] timeIntervalSinceReferenceDate], &eventBecameFirst);
+        if (eventBecameFirst)
+            [self scheduleEvents];
+    } else {
+        [scheduleQueue insertObject:event inArraySortedUsingSelector:@selector(compare:)];
+        if ([scheduleQueue objectAtIndex:0] == event) {
+            [self scheduleEvents];
+        }
     }
     [scheduleLock unlock];
 }
@@ -124,6 +140,14 @@ static NSLock *instanceCountLock;
         return wasFound;
         
     [scheduleLock lock];
+    if (timerWheel) {
+        wasFound = OFTimerWheelRemove(timerWheel, event, &eventWasFirstInQueue);
+        if (eventWasFirstInQueue)
+            [self scheduleEvents];
+        [scheduleLock unlock];
+        return wasFound;
+    }
+
     eventWasFirstInQueue = [scheduleQueue count] != 0 && [scheduleQueue objectAtIndex:0] == event;
     if (eventWasFirstInQueue) {
         wasFound = YES;
@@ -146,6 +170,8 @@ static NSLock *instanceCountLock;
     [scheduleLock lock];
     [self cancelScheduledEvents];
     [scheduleQueue removeAllObjects];
+    if (timerWheel)
+        OFTimerWheelRemoveAll(timerWheel);
     [scheduleLock unlock];
 }
 
@@ -159,7 +185,13 @@ static NSLock *instanceCountLock;
     NSDate *dateOfFirstEvent;
 
     [scheduleLock lock];
-    if ([scheduleQueue count] != 0) {
+    if (timerWheel) {
+        NSTimeInterval firstEventTime;
+        if (OFTimerWheelGetFirstTime(timerWheel, &firstEventTime))
+            dateOfFirstEvent = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:firstEventTime];
+        else
+            dateOfFirstEvent = nil;
+    } else if ([scheduleQueue count] != 0) {
         OFScheduledEvent *firstEvent = [scheduleQueue objectAtIndex:0];
         dateOfFirstEvent = [[firstEvent date] retain];
     } else {
@@ -169,6 +201,28 @@ static NSLock *instanceCountLock;
     return [dateOfFirstEvent autorelease];
 }
 
+- (void)setUsesTimerWheel:(BOOL)shouldUseTimerWheel;
+{
+    [scheduleLock lock];
+    if (shouldUseTimerWheel && !timerWheel) {
+        timerWheel = OFTimerWheelCreate(OFSchedulerTimerWheelResolution, [NSDate timeIntervalSinceReferenceDate]);
+        for (OFScheduledEvent *event in scheduleQueue)
+            OFTimerWheelAdd(timerWheel, event, [[event date] timeIntervalSinceReferenceDate], NULL);
+        [scheduleQueue removeAllObjects];
+        if (OFTimerWheelCount(timerWheel) != 0)
+            [self scheduleEvents];
+    } else if (!shouldUseTimerWheel && timerWheel) {
+        OBASSERT([scheduleQueue count] == 0);
+        OFTimerWheelRemoveMatching(timerWheel, ^BOOL(id event) { return YES; }, scheduleQueue);
+        [scheduleQueue sortUsingSelector:@selector(compare:)];
+        OFTimerWheelDestroy(timerWheel);
+        timerWheel = NULL;
+        if ([scheduleQueue count] != 0)
+            [self scheduleEvents];
+    }
+    [scheduleLock unlock];
+}
+
 // OBObject subclass
 
 - (NSMutableDictionary *)debugDictionary;
@@ -178,6 +232,8 @@ static NSLock *instanceCountLock;
     debugDictionary = [super debugDictionary];
     if (scheduleQueue)
         [debugDictionary setObject:scheduleQueue forKey:@"scheduleQueue"];
+    if (timerWheel)
+        [debugDictionary setObject:[NSNumber numberWithUnsignedInteger:OFTimerWheelCount(timerWheel)] forKey:@"timerWheelCount"];
     if (scheduleLock)
         [debugDictionary setObject:scheduleLock forKey:@"scheduleLock"];
     return debugDictionary;
@@ -257,6 +313,11 @@ static NSLock *instanceCountLock;
 {
     NSMutableArray *eventsToInvokeNow = [[NSMutableArray alloc] init];
     [scheduleLock lock];
+    if (timerWheel) {
+        OFTimerWheelRemoveDue(timerWheel, [NSDate timeIntervalSinceReferenceDate], eventsToInvokeNow);
+        if (OFTimerWheelCount(timerWheel) != 0)
+            [self scheduleEvents];
+    }
     NSUInteger remainingEventCount = [scheduleQueue count];
     while (remainingEventCount--) {
         OFScheduledEvent *event = [scheduleQueue objectAtIndex:0];
@@ -285,15 +346,6 @@ static NSLock *instanceCountLock;
     OBRequestConcreteImplementation(self, _cmd);
 }
 
-@end
-
-@implementation OFScheduler (Private)
-
-+ (void)setDebug:(BOOL)newDebug;
-{
-    OFSchedulerDebug = newDebug;
-}
-
 - (void)invokeEvents:(NSArray *)events;
 {
     NSUInteger eventIndex, eventCount = [events count];
@@ -311,6 +363,15 @@ static NSLock *instanceCountLock;
     }
 }
 
+@end
+
+@implementation OFScheduler (Private)
+
++ (void)setDebug:(BOOL)newDebug;
+{
+    OFSchedulerDebug = newDebug;
+}
+
 - (void)controllerWillTerminate:(OFController *)controller;
 {
     terminationSignaled = YES;
@@ -320,6 +381,8 @@ static NSLock *instanceCountLock;
 
     NSMutableArray *terminationEvents = [[NSMutableArray alloc] init];
     [scheduleLock lock];
+    if (timerWheel)
+        OFTimerWheelRemoveMatching(timerWheel, ^BOOL(id event) { return [event fireOnTermination]; }, terminationEvents);
     NSUInteger remainingEventCount = [scheduleQueue count];
     while (remainingEventCount--) {
         OFScheduledEvent *event;
@@ -331,6 +394,9 @@ static NSLock *instanceCountLock;
         }
     }
     [scheduleLock unlock];
+
+    // The wheel hands its events back bucket by bucket and the array is walked backwards, so put them in date order before firing them.
+    [terminationEvents sortUsingSelector:@selector(compare:)];
     
     if (OFSchedulerDebug)
         NSLog(@"Invoking termination events: %@", terminationEvents);
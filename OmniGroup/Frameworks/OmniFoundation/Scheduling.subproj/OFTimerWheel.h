@@ -0,0 +1,39 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSDate.h> // For NSTimeInterval
+
+@class NSMutableArray;
+
+/*
+ A hashed hierarchical timing wheel: objects filed by the time they come due, with constant time adds and removes however many are waiting, and due objects collected a slot at a time rather than one at a time.  Times are seconds since the reference date, and are bucketed by the wheel's resolution.  The wheel never hands an object back before its time, but the first time it reports can be up to one resolution later than the earliest object's time (or well before it, when the earliest object is far enough out that the wheel only knows roughly when it is due).
+
+ Objects are compared by pointer and retained while they are in the wheel; the same object may be added more than once.  None of this is thread-safe: OFScheduler only touches its wheel with its schedule lock held.
+ */
+typedef struct _OFTimerWheel OFTimerWheel;
+
+// Nothing is ever due before 'startTime', which is where the wheel's clock starts.
+extern OFTimerWheel *OFTimerWheelCreate(NSTimeInterval resolution, NSTimeInterval startTime);
+extern void OFTimerWheelDestroy(OFTimerWheel *wheel);
+
+extern NSUInteger OFTimerWheelCount(OFTimerWheel *wheel);
+
+// Sets 'outBecameFirst' if adding the object moved the wheel's first time earlier.
+extern void OFTimerWheelAdd(OFTimerWheel *wheel, id object, NSTimeInterval time, BOOL *outBecameFirst);
+
+// Returns NO if the object isn't in the wheel.  Sets 'outWasFirst' if removing it moved the wheel's first time.
+extern BOOL OFTimerWheelRemove(OFTimerWheel *wheel, id object, BOOL *outWasFirst);
+extern void OFTimerWheelRemoveAll(OFTimerWheel *wheel);
+extern void OFTimerWheelRemoveMatching(OFTimerWheel *wheel, BOOL (^predicate)(id object), NSMutableArray *removedObjects);
+
+// Moves the wheel's clock up to 'now' and appends everything due by then to 'dueObjects', earliest first.  'dueObjects' may be nil when the wheel is empty, which just brings the clock up to date.
+extern void OFTimerWheelRemoveDue(OFTimerWheel *wheel, NSTimeInterval now, NSMutableArray *dueObjects);
+
+// Returns NO if the wheel is empty.  Otherwise, 'outTime' is when OFTimerWheelRemoveDue() next needs to be called.
+extern BOOL OFTimerWheelGetFirstTime(OFTimerWheel *wheel, NSTimeInterval *outTime);
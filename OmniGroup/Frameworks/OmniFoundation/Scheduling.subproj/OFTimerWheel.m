@@ -0,0 +1,477 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OFTimerWheel.h"
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$")
+
+// Six levels of 64 slots span 2^36 ticks (a bit over two years at a millisecond).  Anything further out than that waits in an overflow list until the wheel's clock gets close enough.
+#define OFTimerWheelSlotBits (6)
+#define OFTimerWheelSlotCount (1 << OFTimerWheelSlotBits)
+#define OFTimerWheelSlotMask (OFTimerWheelSlotCount - 1)
+#define OFTimerWheelLevelCount (6)
+#define OFTimerWheelOverflowLevel OFTimerWheelLevelCount
+#define OFTimerWheelSpanBits (OFTimerWheelSlotBits * OFTimerWheelLevelCount)
+
+typedef struct _OFTimerWheelEntry {
+    struct _OFTimerWheelEntry *next;
+    struct _OFTimerWheelEntry *previous;
+    struct _OFTimerWheelEntry *nextForObject; // Other entries for the same object, when it was added more than once
+    id object;
+    NSTimeInterval time;
+    uint64_t tick;
+    uint64_t sequence; // Keeps objects with the same time in the order they were added
+    unsigned int level;
+    unsigned int slot;
+} OFTimerWheelEntry;
+
+struct _OFTimerWheel {
+    NSTimeInterval resolution;
+    NSTimeInterval startTime;
+    uint64_t currentTick;
+    uint64_t nextSequence;
+    NSUInteger count;
+
+    // A level's slots each hold entries whose ticks match the current tick above that level's digit.  Level 0 never has entries behind the current digit, and the higher levels never have them at or behind it, so the lowest occupied slot of the lowest occupied level always holds the soonest entries.
+    OFTimerWheelEntry *slots[OFTimerWheelLevelCount][OFTimerWheelSlotCount];
+    uint64_t occupiedSlots[OFTimerWheelLevelCount]; // Bit n is set when slots[level][n] has entries
+
+    OFTimerWheelEntry *overflow;
+    uint64_t overflowTick; // No later than the soonest tick in the overflow list
+
+    CFMutableDictionaryRef entriesByObject; // Doesn't retain anything; the entries hold the retains
+    OFTimerWheelEntry *spareEntries;
+};
+
+static uint64_t _OFTimerWheelTickForTime(OFTimerWheel *wheel, NSTimeInterval time)
+{
+    NSTimeInterval ticks = floor((time - wheel->startTime) / wheel->resolution);
+    if (!(ticks > 0.0)) // Also catches NaN
+        return 0;
+    if (ticks >= (NSTimeInterval)(UINT64_C(1) << 62))
+        return UINT64_C(1) << 62;
+    return (uint64_t)ticks;
+}
+
+static NSTimeInterval _OFTimerWheelTimeForTick(OFTimerWheel *wheel, uint64_t tick)
+{
+    return wheel->startTime + tick * wheel->resolution;
+}
+
+static NSComparisonResult _OFTimerWheelEntryCompare(const OFTimerWheelEntry *entry, const OFTimerWheelEntry *otherEntry)
+{
+    if (entry->time != otherEntry->time)
+        return entry->time < otherEntry->time ? NSOrderedAscending : NSOrderedDescending;
+    if (entry->sequence != otherEntry->sequence)
+        return entry->sequence < otherEntry->sequence ? NSOrderedAscending : NSOrderedDescending;
+    return NSOrderedSame;
+}
+
+static int _OFTimerWheelEntryPointerCompare(const void *a, const void *b)
+{
+    return (int)_OFTimerWheelEntryCompare(*(OFTimerWheelEntry * const *)a, *(OFTimerWheelEntry * const *)b);
+}
+
+static void _OFTimerWheelLinkEntry(OFTimerWheel *wheel, OFTimerWheelEntry *entry)
+{
+    // Entries that are already due go in the current slot, which is checked by time.
+    uint64_t tick = MAX(entry->tick, wheel->currentTick);
+
+    // File the entry under the highest digit where it differs from the current tick, so that it only ever moves down as the clock catches up with it.
+    uint64_t difference = tick ^ wheel->currentTick;
+    unsigned int level = 0;
+    while (level < OFTimerWheelLevelCount && (difference >> (OFTimerWheelSlotBits * (level + 1))) != 0)
+        level++;
+
+    OFTimerWheelEntry **head;
+    if (level == OFTimerWheelOverflowLevel) {
+        entry->level = OFTimerWheelOverflowLevel;
+        entry->slot = 0;
+        head = &wheel->overflow;
+        if (tick < wheel->overflowTick)
+            wheel->overflowTick = tick;
+    } else {
+        unsigned int slot = (unsigned int)(tick >> (OFTimerWheelSlotBits * level)) & OFTimerWheelSlotMask;
+        entry->level = level;
+        entry->slot = slot;
+        head = &wheel->slots[level][slot];
+        wheel->occupiedSlots[level] |= (UINT64_C(1) << slot);
+    }
+
+    entry->previous = NULL;
+    entry->next = *head;
+    if (entry->next)
+        entry->next->previous = entry;
+    *head = entry;
+}
+
+static void _OFTimerWheelUnlinkEntry(OFTimerWheel *wheel, OFTimerWheelEntry *entry)
+{
+    if (entry->next)
+        entry->next->previous = entry->previous;
+
+    if (entry->previous)
+        entry->previous->next = entry->next;
+    else if (entry->level == OFTimerWheelOverflowLevel)
+        wheel->overflow = entry->next;
+    else {
+        wheel->slots[entry->level][entry->slot] = entry->next;
+        if (!entry->next)
+            wheel->occupiedSlots[entry->level] &= ~(UINT64_C(1) << entry->slot);
+    }
+}
+
+// Drops an unlinked entry from the object's list of entries.  The caller is responsible for the entry's retain of the object.
+static void _OFTimerWheelForgetEntry(OFTimerWheel *wheel, OFTimerWheelEntry *entry)
+{
+    OFTimerWheelEntry *objectEntry = (OFTimerWheelEntry *)CFDictionaryGetValue(wheel->entriesByObject, entry->object);
+    OBASSERT(objectEntry);
+
+    if (objectEntry == entry) {
+        if (entry->nextForObject)
+            CFDictionarySetValue(wheel->entriesByObject, entry->object, entry->nextForObject);
+        else
+            CFDictionaryRemoveValue(wheel->entriesByObject, entry->object);
+    } else {
+        while (objectEntry->nextForObject != entry)
+            objectEntry = objectEntry->nextForObject;
+        objectEntry->nextForObject = entry->nextForObject;
+    }
+
+    entry->object = nil;
+    entry->next = wheel->spareEntries;
+    wheel->spareEntries = entry;
+
+    OBASSERT(wheel->count > 0);
+    wheel->count--;
+}
+
+// Finds the slot holding the soonest entries, if there are any outside the overflow list.
+static BOOL _OFTimerWheelGetFirstSlot(OFTimerWheel *wheel, unsigned int *outLevel, unsigned int *outSlot)
+{
+    for (unsigned int level = 0; level < OFTimerWheelLevelCount; level++) {
+        uint64_t occupiedSlots = wheel->occupiedSlots[level];
+        if (!occupiedSlots)
+            continue;
+
+#ifdef OMNI_ASSERTIONS_ON
+        unsigned int digit = (unsigned int)(wheel->currentTick >> (OFTimerWheelSlotBits * level)) & OFTimerWheelSlotMask;
+        uint64_t behindMask = (UINT64_C(1) << digit) - 1;
+        if (level > 0)
+            behindMask |= (UINT64_C(1) << digit);
+        OBASSERT((occupiedSlots & behindMask) == 0);
+#endif
+
+        *outLevel = level;
+        *outSlot = __builtin_ctzll(occupiedSlots);
+        return YES;
+    }
+    return NO;
+}
+
+static uint64_t _OFTimerWheelSlotStartTick(OFTimerWheel *wheel, unsigned int level, unsigned int slot)
+{
+    unsigned int shift = OFTimerWheelSlotBits * level;
+    unsigned int aboveShift = shift + OFTimerWheelSlotBits;
+    return ((wheel->currentTick >> aboveShift) << aboveShift) | ((uint64_t)slot << shift);
+}
+
+static OFTimerWheelEntry *_OFTimerWheelFirstOverflowEntry(OFTimerWheel *wheel)
+{
+    OFTimerWheelEntry *firstEntry = NULL;
+    for (OFTimerWheelEntry *entry = wheel->overflow; entry; entry = entry->next) {
+        if (!firstEntry || _OFTimerWheelEntryCompare(entry, firstEntry) == NSOrderedAscending)
+            firstEntry = entry;
+    }
+    return firstEntry;
+}
+
+// Once the clock is within a wheel's span of the overflow list, its entries can go in the wheel proper.
+static void _OFTimerWheelPullInOverflow(OFTimerWheel *wheel)
+{
+    if (!wheel->overflow)
+        return;
+    if (wheel->overflowTick > wheel->currentTick && ((wheel->overflowTick ^ wheel->currentTick) >> OFTimerWheelSpanBits) != 0)
+        return;
+
+    OFTimerWheelEntry *entry = wheel->overflow;
+    wheel->overflow = NULL;
+    wheel->overflowTick = UINT64_MAX;
+    while (entry) {
+        OFTimerWheelEntry *nextEntry = entry->next;
+        _OFTimerWheelLinkEntry(wheel, entry);
+        entry = nextEntry;
+    }
+}
+
+OFTimerWheel *OFTimerWheelCreate(NSTimeInterval resolution, NSTimeInterval startTime)
+{
+    OBPRECONDITION(resolution > 0.0);
+
+    OFTimerWheel *wheel = calloc(1, sizeof(*wheel));
+    wheel->resolution = resolution;
+    wheel->startTime = startTime;
+    wheel->overflowTick = UINT64_MAX;
+    wheel->entriesByObject = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    return wheel;
+}
+
+void OFTimerWheelDestroy(OFTimerWheel *wheel)
+{
+    OFTimerWheelRemoveAll(wheel);
+
+    OFTimerWheelEntry *entry = wheel->spareEntries;
+    while (entry) {
+        OFTimerWheelEntry *nextEntry = entry->next;
+        free(entry);
+        entry = nextEntry;
+    }
+
+    CFRelease(wheel->entriesByObject);
+    free(wheel);
+}
+
+NSUInteger OFTimerWheelCount(OFTimerWheel *wheel)
+{
+    return wheel->count;
+}
+
+void OFTimerWheelAdd(OFTimerWheel *wheel, id object, NSTimeInterval time, BOOL *outBecameFirst)
+{
+    OBPRECONDITION(object);
+
+    unsigned int firstLevel = 0, firstSlot = 0;
+    BOOL hadFirstSlot = _OFTimerWheelGetFirstSlot(wheel, &firstLevel, &firstSlot);
+
+    OFTimerWheelEntry *entry = wheel->spareEntries;
+    if (entry)
+        wheel->spareEntries = entry->next;
+    else
+        entry = malloc(sizeof(*entry));
+
+    entry->object = [object retain];
+    entry->time = time;
+    entry->tick = _OFTimerWheelTickForTime(wheel, time);
+    entry->sequence = wheel->nextSequence++;
+    entry->nextForObject = (OFTimerWheelEntry *)CFDictionaryGetValue(wheel->entriesByObject, object);
+    CFDictionarySetValue(wheel->entriesByObject, object, entry);
+    wheel->count++;
+
+    _OFTimerWheelLinkEntry(wheel, entry);
+
+    if (outBecameFirst) {
+        if (entry->level == OFTimerWheelOverflowLevel)
+            *outBecameFirst = !hadFirstSlot && _OFTimerWheelFirstOverflowEntry(wheel) == entry;
+        else
+            // The first time only depends on which slot is first, so joining the first slot doesn't change it.
+            *outBecameFirst = !hadFirstSlot || entry->level < firstLevel || (entry->level == firstLevel && entry->slot < firstSlot);
+    }
+}
+
+BOOL OFTimerWheelRemove(OFTimerWheel *wheel, id object, BOOL *outWasFirst)
+{
+    OFTimerWheelEntry *entry = (OFTimerWheelEntry *)CFDictionaryGetValue(wheel->entriesByObject, object);
+    if (!entry) {
+        if (outWasFirst)
+            *outWasFirst = NO;
+        return NO;
+    }
+
+    BOOL wasFirst = NO;
+    if (outWasFirst) {
+        unsigned int firstLevel, firstSlot;
+        if (_OFTimerWheelGetFirstSlot(wheel, &firstLevel, &firstSlot))
+            wasFirst = (entry->level == firstLevel && entry->slot == firstSlot && !entry->previous && !entry->next);
+        else
+            wasFirst = (_OFTimerWheelFirstOverflowEntry(wheel) == entry);
+    }
+
+    _OFTimerWheelUnlinkEntry(wheel, entry);
+    _OFTimerWheelForgetEntry(wheel, entry);
+    [object release];
+
+    if (outWasFirst)
+        *outWasFirst = wasFirst;
+    return YES;
+}
+
+void OFTimerWheelRemoveAll(OFTimerWheel *wheel)
+{
+    OFTimerWheelEntry *entries = NULL;
+
+    for (unsigned int level = 0; level < OFTimerWheelLevelCount; level++) {
+        uint64_t occupiedSlots = wheel->occupiedSlots[level];
+        while (occupiedSlots) {
+            unsigned int slot = __builtin_ctzll(occupiedSlots);
+            occupiedSlots &= occupiedSlots - 1;
+
+            OFTimerWheelEntry *entry = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            while (entry) {
+                OFTimerWheelEntry *nextEntry = entry->next;
+                entry->next = entries;
+                entries = entry;
+                entry = nextEntry;
+            }
+        }
+        wheel->occupiedSlots[level] = 0;
+    }
+
+    OFTimerWheelEntry *entry = wheel->overflow;
+    while (entry) {
+        OFTimerWheelEntry *nextEntry = entry->next;
+        entry->next = entries;
+        entries = entry;
+        entry = nextEntry;
+    }
+    wheel->overflow = NULL;
+    wheel->overflowTick = UINT64_MAX;
+
+    CFDictionaryRemoveAllValues(wheel->entriesByObject);
+    wheel->count = 0;
+
+    // Release after the wheel is consistent again, in case that sets off something that looks at it.
+    while (entries) {
+        OFTimerWheelEntry *nextEntry = entries->next;
+        id object = entries->object;
+        entries->object = nil;
+        entries->next = wheel->spareEntries;
+        wheel->spareEntries = entries;
+        [object release];
+        entries = nextEntry;
+    }
+}
+
+void OFTimerWheelRemoveMatching(OFTimerWheel *wheel, BOOL (^predicate)(id object), NSMutableArray *removedObjects)
+{
+    OBPRECONDITION(predicate);
+    OBPRECONDITION(removedObjects);
+
+    for (unsigned int level = 0; level <= OFTimerWheelOverflowLevel; level++) {
+        unsigned int slotCount = (level == OFTimerWheelOverflowLevel) ? 1 : OFTimerWheelSlotCount;
+        for (unsigned int slot = 0; slot < slotCount; slot++) {
+            OFTimerWheelEntry *entry = (level == OFTimerWheelOverflowLevel) ? wheel->overflow : wheel->slots[level][slot];
+            while (entry) {
+                OFTimerWheelEntry *nextEntry = entry->next;
+                id object = entry->object;
+                if (predicate(object)) {
+                    _OFTimerWheelUnlinkEntry(wheel, entry);
+                    _OFTimerWheelForgetEntry(wheel, entry);
+                    [removedObjects addObject:object];
+                    [object release];
+                }
+                entry = nextEntry;
+            }
+        }
+    }
+}
+
+void OFTimerWheelRemoveDue(OFTimerWheel *wheel, NSTimeInterval now, NSMutableArray *dueObjects)
+{
+    OBPRECONDITION(dueObjects || wheel->count == 0);
+
+    uint64_t nowTick = _OFTimerWheelTickForTime(wheel, now);
+    OFTimerWheelEntry **dueEntries = NULL;
+    size_t dueEntryCount = 0, dueEntryCapacity = 0;
+
+    while (YES) {
+        _OFTimerWheelPullInOverflow(wheel);
+
+        unsigned int level, slot;
+        if (!_OFTimerWheelGetFirstSlot(wheel, &level, &slot)) {
+            // Nothing outside the overflow list; catch the clock up, which might bring some of that in.
+            if (nowTick <= wheel->currentTick)
+                break;
+            wheel->currentTick = nowTick;
+            continue;
+        }
+
+        uint64_t startTick = _OFTimerWheelSlotStartTick(wheel, level, slot);
+        if (level == 0 && startTick == wheel->currentTick) {
+            // The current slot can hold entries that are past due and entries later in the current tick, so it goes by time.  If anything here isn't due yet, then nothing after it is either.
+            OFTimerWheelEntry *entry = wheel->slots[0][slot];
+            while (entry) {
+                OFTimerWheelEntry *nextEntry = entry->next;
+                if (entry->time <= now) {
+                    _OFTimerWheelUnlinkEntry(wheel, entry);
+                    if (dueEntryCount == dueEntryCapacity) {
+                        dueEntryCapacity = MAX(dueEntryCapacity * 2, (size_t)16);
+                        dueEntries = realloc(dueEntries, dueEntryCapacity * sizeof(*dueEntries));
+                    }
+                    dueEntries[dueEntryCount++] = entry;
+                }
+                entry = nextEntry;
+            }
+            if (wheel->slots[0][slot])
+                break;
+            continue;
+        }
+
+        if (startTick > nowTick) {
+            // Nothing else is due, but the clock can still move up to now (and the overflow list may come closer).
+            if (nowTick <= wheel->currentTick)
+                break;
+            wheel->currentTick = nowTick;
+            continue;
+        }
+
+        wheel->currentTick = startTick;
+        if (level > 0) {
+            // Break the slot down into the levels below it; the current slot at level 0 is picked up on the next pass.
+            OFTimerWheelEntry *entry = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            wheel->occupiedSlots[level] &= ~(UINT64_C(1) << slot);
+            while (entry) {
+                OFTimerWheelEntry *nextEntry = entry->next;
+                _OFTimerWheelLinkEntry(wheel, entry);
+                OBASSERT(entry->level < level);
+                entry = nextEntry;
+            }
+        }
+    }
+
+    if (dueEntryCount == 0)
+        return;
+
+    // Each slot is unordered, so sort the batch to hand things back in the order a sorted schedule would.
+    qsort(dueEntries, dueEntryCount, sizeof(*dueEntries), _OFTimerWheelEntryPointerCompare);
+
+    for (size_t dueEntryIndex = 0; dueEntryIndex < dueEntryCount; dueEntryIndex++) {
+        OFTimerWheelEntry *entry = dueEntries[dueEntryIndex];
+        id object = entry->object;
+        _OFTimerWheelForgetEntry(wheel, entry);
+        [dueObjects addObject:object];
+        [object release];
+    }
+    free(dueEntries);
+}
+
+BOOL OFTimerWheelGetFirstTime(OFTimerWheel *wheel, NSTimeInterval *outTime)
+{
+    OBPRECONDITION(outTime);
+
+    unsigned int level, slot;
+    if (_OFTimerWheelGetFirstSlot(wheel, &level, &slot)) {
+        uint64_t startTick = _OFTimerWheelSlotStartTick(wheel, level, slot);
+        if (level == 0)
+            // Everything in the slot is due by the end of its tick.
+            *outTime = _OFTimerWheelTimeForTick(wheel, startTick + 1);
+        else
+            // The slot needs breaking down then; its soonest entries may well be later than that.
+            *outTime = _OFTimerWheelTimeForTick(wheel, startTick);
+        return YES;
+    }
+
+    OFTimerWheelEntry *firstEntry = _OFTimerWheelFirstOverflowEntry(wheel);
+    if (!firstEntry)
+        return NO;
+    *outTime = firstEntry->time;
+    return YES;
+}
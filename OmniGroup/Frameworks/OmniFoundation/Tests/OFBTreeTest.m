@@ -57,6 +57,18 @@ static int testComparator(const OFBTree *btree, const void *a, const void *b)
     return avalue - bvalue;
 }
 
+struct keyedElement {
+    uint64_t key;
+    uint64_t payload;
+};
+
+static int keyedElementComparator(const OFBTree *btree, const void *a, const void *b)
+{
+    uint64_t akey = ((const struct keyedElement *)a)->key;
+    uint64_t bkey = ((const struct keyedElement *)b)->key;
+    return (akey > bkey) - (akey < bkey);
+}
+
 static void permute(NSUInteger *numbers, NSUInteger count)
 {
     NSUInteger i, j, tmp;
@@ -196,6 +208,244 @@ struct expectedEnumeration {
     OFBTreeDestroy(&btree);
 }
 
+- (void)testCursorAndRange
+{
+    OFBTree btree;
+    const int count = 5000;
+    NSUInteger *order = malloc(sizeof(*order) * count);
+    
+    // Small nodes, so that the tree is several levels deep and the cursor has to climb and descend a lot
+    OFBTreeInit(&btree, sizeof(int) * 16, sizeof(int), mallocAllocator, mallocDeallocator, testComparator);
+    
+    // Even numbers 2...2*count, inserted in random order
+    for (int i = 0; i < count; i++)
+        order[i] = i;
+    permute(order, count);
+    for (int i = 0; i < count; i++) {
+        int value = 2 * (int)order[i] + 2;
+        OFBTreeInsert(&btree, &value);
+    }
+    
+    OFBTreeCursor cursor;
+    int expected = 2;
+    for (int *element = OFBTreeCursorFirst(&btree, &cursor); element; element = OFBTreeCursorNext(&btree, &cursor)) {
+        STAssertEquals(*element, expected, nil);
+        expected += 2;
+    }
+    STAssertEquals(expected, 2 * count + 2, nil);
+    
+    for (int *element = OFBTreeCursorLast(&btree, &cursor); element; element = OFBTreeCursorPrevious(&btree, &cursor)) {
+        expected -= 2;
+        STAssertEquals(*element, expected, nil);
+    }
+    STAssertEquals(expected, 2, nil);
+    
+    // Seeking lands on the value if present and on the next greater one if not
+    for (int value = 0; value <= 2 * count + 2; value++) {
+        int *element = OFBTreeCursorSeek(&btree, &cursor, &value);
+        if (value > 2 * count) {
+            should(element == NULL);
+            continue;
+        }
+        int least = (value < 2) ? 2 : (value + 1) / 2 * 2;
+        should(element != NULL && *element == least);
+        
+        // ... and the cursor carries on from there in both directions
+        if (least < 2 * count) {
+            int *next = OFBTreeCursorNext(&btree, &cursor);
+            should(next != NULL && *next == least + 2);
+            OFBTreeCursorPrevious(&btree, &cursor);
+        }
+        int *previous = OFBTreeCursorPrevious(&btree, &cursor);
+        if (least > 2)
+            should(previous != NULL && *previous == least - 2);
+        else
+            should(previous == NULL);
+    }
+    
+    // Half-open ranges, with bounds both on and between elements
+    int bounds[][2] = { { 0, 1 }, { 2, 3 }, { 1, 10 }, { 2, 10 }, { 3, 11 }, { 100, 100 }, { 100, 5001 }, { 9990, 20000 }, { 0, 20000 } };
+    for (unsigned int rangeIndex = 0; rangeIndex < sizeof(bounds)/sizeof(*bounds); rangeIndex++) {
+        int low = bounds[rangeIndex][0], high = bounds[rangeIndex][1];
+        __block int next = (low < 2) ? 2 : (low + 1) / 2 * 2;
+        __block BOOL inOrder = YES;
+        OFBTreeEnumerateRange(&btree, &low, &high, ^(const OFBTree *tree, void *element) {
+            if (*(int *)element != next)
+                inOrder = NO;
+            next += 2;
+        });
+        should1(inOrder, ([NSString stringWithFormat:@"Range [%d,%d)", low, high]));
+        int end = MIN(high, 2 * count + 1);
+        should1(next >= end && next < end + 2, ([NSString stringWithFormat:@"Range [%d,%d) ended before %d", low, high, next]));
+    }
+    
+    __block int total = 0;
+    OFBTreeEnumerateRange(&btree, NULL, NULL, ^(const OFBTree *tree, void *element) {
+        total ++;
+    });
+    STAssertEquals(total, count, nil);
+    
+    OFBTreeDestroy(&btree);
+    free(order);
+}
+
+- (void)testBulkLoad
+{
+    int *numbers = malloc(sizeof(*numbers) * 20000);
+    for (int i = 0; i < 20000; i++)
+        numbers[i] = 2 * i + 2;
+    
+    // Sizes around each node capacity and each change in height
+    int counts[] = { 0, 1, 13, 14, 15, 16, 29, 30, 31, 100, 227, 228, 1000, 20000 };
+    for (unsigned int countIndex = 0; countIndex < sizeof(counts)/sizeof(*counts); countIndex++) {
+        int count = counts[countIndex];
+        OFBTree btree;
+        OFBTreeInit(&btree, sizeof(int) * 16, sizeof(int), mallocAllocator, mallocDeallocator, testComparator);
+        OFBTreeBulkLoad(&btree, numbers, count);
+        
+        __block int expected = 2;
+        OFBTreeEnumerate(&btree, ^(const OFBTree *tree, void *element) {
+            if (*(int *)element == expected)
+                expected += 2;
+        });
+        STAssertEquals(expected, 2 * count + 2, @"Bulk loading %d elements", count);
+        
+        // The result has to be a proper tree for the usual operations, too
+        for (int i = 0; i < count; i++) {
+            int value = 2 * i + 1;
+            OFBTreeInsert(&btree, &value);
+            value ++;
+            should(OFBTreeDelete(&btree, &value));
+        }
+        for (int i = 0; i < count; i++) {
+            int value = 2 * i + 1;
+            int *element = OFBTreeFind(&btree, &value);
+            should(element != NULL && *element == value);
+            value ++;
+            should(OFBTreeFind(&btree, &value) == NULL);
+        }
+        
+        OFBTreeDestroy(&btree);
+    }
+    
+    free(numbers);
+}
+
+- (void)testIntegerKeys
+{
+    OFBTree keyed, generic;
+    const NSUInteger count = 50000;
+    NSUInteger *order = malloc(sizeof(*order) * count);
+    
+    OFBTreeInit(&keyed, 1024, sizeof(struct keyedElement), mallocAllocator, mallocDeallocator, OFBTreeCompareUInt64Keys);
+    OFBTreeInit(&generic, 1024, sizeof(struct keyedElement), mallocAllocator, mallocDeallocator, keyedElementComparator);
+    
+    for (NSUInteger i = 0; i < count; i++)
+        order[i] = i;
+    permute(order, count);
+    for (NSUInteger i = 0; i < count; i++) {
+        // Keys spread across the whole 64-bit range, so that a signed or truncated comparison would misorder them
+        struct keyedElement element = { .key = (uint64_t)order[i] * 0x9E3779B97F4A7C15ULL, .payload = order[i] };
+        OFBTreeInsert(&keyed, &element);
+        OFBTreeInsert(&generic, &element);
+    }
+    
+    OFBTreeCursor keyedCursor, genericCursor;
+    struct keyedElement *keyedElement = OFBTreeCursorFirst(&keyed, &keyedCursor);
+    struct keyedElement *genericElement = OFBTreeCursorFirst(&generic, &genericCursor);
+    while (keyedElement && genericElement) {
+        STAssertEquals(keyedElement->key, genericElement->key, nil);
+        STAssertEquals(keyedElement->payload, genericElement->payload, nil);
+        keyedElement = OFBTreeCursorNext(&keyed, &keyedCursor);
+        genericElement = OFBTreeCursorNext(&generic, &genericCursor);
+    }
+    should(keyedElement == NULL && genericElement == NULL);
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        struct keyedElement probe = { .key = (uint64_t)i * 0x9E3779B97F4A7C15ULL, .payload = 0 };
+        struct keyedElement *found = OFBTreeFind(&keyed, &probe);
+        should(found != NULL && found->payload == i);
+        probe.key ++;
+        should(OFBTreeFind(&keyed, &probe) == NULL);
+    }
+    
+    OFBTreeDestroy(&keyed);
+    OFBTreeDestroy(&generic);
+    
+    // 32-bit keys
+    OFBTree keyed32;
+    OFBTreeInit(&keyed32, 256, sizeof(uint32_t), mallocAllocator, mallocDeallocator, OFBTreeCompareUInt32Keys);
+    for (NSUInteger i = 0; i < count; i++) {
+        uint32_t key = (uint32_t)order[i] * 0x9E3779B9U;
+        OFBTreeInsert(&keyed32, &key);
+    }
+    __block uint32_t previous = 0;
+    __block BOOL ascending = YES;
+    __block NSUInteger seen = 0;
+    OFBTreeEnumerate(&keyed32, ^(const OFBTree *tree, void *element) {
+        uint32_t key = *(uint32_t *)element;
+        if (seen > 0 && key <= previous)
+            ascending = NO;
+        previous = key;
+        seen ++;
+    });
+    should(ascending);
+    STAssertEquals(seen, count, nil);
+    OFBTreeDestroy(&keyed32);
+    
+    free(order);
+}
+
+- (void)testRangeScanAndBulkLoadThroughput
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+#define THROUGHPUT_COUNT 10000000
+    
+    uint64_t *numbers = malloc(sizeof(*numbers) * THROUGHPUT_COUNT);
+    for (NSUInteger i = 0; i < THROUGHPUT_COUNT; i++)
+        numbers[i] = i;
+    
+    OFBTree inserted, bulk;
+    OFBTreeInit(&inserted, vm_page_size, sizeof(*numbers), pageAllocator, pageDeallocator, OFBTreeCompareUInt64Keys);
+    OFBTreeInit(&bulk, vm_page_size, sizeof(*numbers), pageAllocator, pageDeallocator, OFBTreeCompareUInt64Keys);
+    
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (NSUInteger i = 0; i < THROUGHPUT_COUNT; i++)
+        OFBTreeInsert(&inserted, &numbers[i]);
+    NSTimeInterval insertTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OFBTreeBulkLoad(&bulk, numbers, THROUGHPUT_COUNT);
+    NSTimeInterval bulkTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    __block uint64_t sum = 0;
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OFBTreeEnumerateRange(&bulk, NULL, NULL, ^(const OFBTree *tree, void *element) {
+        sum += *(uint64_t *)element;
+    });
+    NSTimeInterval rangeTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    STAssertEquals(sum, (uint64_t)THROUGHPUT_COUNT * (THROUGHPUT_COUNT - 1) / 2, nil);
+    
+    // The old way to walk a range: a fresh descent per step
+    const NSUInteger steps = THROUGHPUT_COUNT / 10;
+    start = [NSDate timeIntervalSinceReferenceDate];
+    uint64_t *element = OFBTreeFind(&bulk, &numbers[0]);
+    for (NSUInteger i = 0; i < steps && element; i++)
+        element = OFBTreeNext(&bulk, element);
+    NSTimeInterval nextTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    NSLog(@"OFBTree ns/element: OFBTreeInsert (sorted) %.1f; OFBTreeBulkLoad %.1f; OFBTreeEnumerateRange %.2f; OFBTreeNext %.1f",
+          1e9 * insertTime / THROUGHPUT_COUNT, 1e9 * bulkTime / THROUGHPUT_COUNT, 1e9 * rangeTime / THROUGHPUT_COUNT, 1e9 * nextTime / steps);
+    
+    OFBTreeDestroy(&inserted);
+    OFBTreeDestroy(&bulk);
+    free(numbers);
+}
+
 - (void)testBTreeLarge
 {
     OFBTree btree;
@@ -0,0 +1,148 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFBulkBlockPool.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+@interface OFBulkBlockPoolTests : OFTestCase
+@end
+
+#define TEST_BLOCK_SIZE (48)
+#define BLOCKS_PER_THREAD (20000)
+#define MAX_TEST_THREADS (16)
+
+typedef struct {
+    OFConcurrentBulkBlockPool *pool;
+    OFByte *blocks[BLOCKS_PER_THREAD];
+    OFByte stamp;
+} BlockBatch;
+
+static void *allocateBatch(void *context)
+{
+    BlockBatch *batch = context;
+
+    // Churn the magazine a bit first so the batch doesn't just come off fresh pages in order
+    for (unsigned int blockIndex = 0; blockIndex < BLOCKS_PER_THREAD; blockIndex++)
+        batch->blocks[blockIndex] = OFConcurrentBulkBlockPoolAllocate(batch->pool);
+    for (unsigned int blockIndex = 0; blockIndex < BLOCKS_PER_THREAD; blockIndex += 3)
+        OFConcurrentBulkBlockPoolDeallocate(batch->blocks[blockIndex]);
+    for (unsigned int blockIndex = 0; blockIndex < BLOCKS_PER_THREAD; blockIndex += 3)
+        batch->blocks[blockIndex] = OFConcurrentBulkBlockPoolAllocate(batch->pool);
+
+    for (unsigned int blockIndex = 0; blockIndex < BLOCKS_PER_THREAD; blockIndex++)
+        memset(batch->blocks[blockIndex], batch->stamp, TEST_BLOCK_SIZE);
+    return NULL;
+}
+
+static void *allocateAndDeallocate(void *context)
+{
+    OFConcurrentBulkBlockPool *pool = context;
+    OFByte *blocks[100];
+
+    for (unsigned int round = 0; round < 100000; round++) {
+        for (unsigned int blockIndex = 0; blockIndex < 100; blockIndex++)
+            blocks[blockIndex] = OFConcurrentBulkBlockPoolAllocate(pool);
+        for (unsigned int blockIndex = 0; blockIndex < 100; blockIndex++)
+            OFConcurrentBulkBlockPoolDeallocate(blocks[blockIndex]);
+    }
+    return NULL;
+}
+
+static void *mallocAndFree(void *context)
+{
+    void *blocks[100];
+
+    for (unsigned int round = 0; round < 100000; round++) {
+        for (unsigned int blockIndex = 0; blockIndex < 100; blockIndex++)
+            blocks[blockIndex] = malloc(TEST_BLOCK_SIZE);
+        for (unsigned int blockIndex = 0; blockIndex < 100; blockIndex++)
+            free(blocks[blockIndex]);
+    }
+    return NULL;
+}
+
+static int comparePointers(const void *a, const void *b)
+{
+    uintptr_t pointerA = *(const uintptr_t *)a, pointerB = *(const uintptr_t *)b;
+    return pointerA < pointerB ? -1 : (pointerA > pointerB ? 1 : 0);
+}
+
+@implementation OFBulkBlockPoolTests
+
+// Blocks handed out to different threads must never overlap, and blocks freed by a thread that never allocated (the remote path) must come back into circulation intact.
+- (void)testConcurrentAllocateAndRemoteDeallocate;
+{
+    OFConcurrentBulkBlockPool *pool = OFConcurrentBulkBlockPoolCreate(TEST_BLOCK_SIZE, 4);
+    const unsigned int threadCount = 8;
+    BlockBatch *batches = calloc(threadCount, sizeof(*batches));
+
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++) {
+            batches[threadIndex].pool = pool;
+            batches[threadIndex].stamp = (OFByte)(threadIndex + 1);
+        }
+        OFTestRunThreads(threadCount, allocateBatch, batches, sizeof(*batches));
+
+        size_t blockCount = threadCount * BLOCKS_PER_THREAD;
+        OFByte **allBlocks = malloc(blockCount * sizeof(*allBlocks));
+        BOOL stampsIntact = YES;
+        for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++) {
+            for (unsigned int blockIndex = 0; blockIndex < BLOCKS_PER_THREAD; blockIndex++) {
+                OFByte *block = batches[threadIndex].blocks[blockIndex];
+                for (unsigned int byteIndex = 0; byteIndex < TEST_BLOCK_SIZE; byteIndex++)
+                    if (block[byteIndex] != batches[threadIndex].stamp)
+                        stampsIntact = NO;
+                allBlocks[threadIndex * BLOCKS_PER_THREAD + blockIndex] = block;
+            }
+        }
+        should(stampsIntact);
+
+        qsort(allBlocks, blockCount, sizeof(*allBlocks), comparePointers);
+        BOOL overlapping = NO;
+        for (size_t blockIndex = 1; blockIndex < blockCount; blockIndex++)
+            if (allBlocks[blockIndex] - allBlocks[blockIndex - 1] < TEST_BLOCK_SIZE)
+                overlapping = YES;
+        shouldnt(overlapping);
+
+        // This thread has no magazine, so these all go through the pages' remote lists; the next pass allocates them again.
+        for (size_t blockIndex = 0; blockIndex < blockCount; blockIndex++)
+            OFConcurrentBulkBlockPoolDeallocate(allBlocks[blockIndex]);
+        free(allBlocks);
+    }
+
+    OFConcurrentBulkBlockPoolReportStatistics(pool);
+    OFConcurrentBulkBlockPoolDestroy(pool);
+    free(batches);
+}
+
+- (void)testConcurrentThroughput;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    for (unsigned int threadCount = 1; threadCount <= MAX_TEST_THREADS; threadCount *= 2) {
+        OFConcurrentBulkBlockPool *pool = OFConcurrentBulkBlockPoolCreate(TEST_BLOCK_SIZE, 4);
+        double pairs = threadCount * 100000.0 * 100.0;
+
+        NSTimeInterval poolTime = OFTestRunThreads(threadCount, allocateAndDeallocate, pool, 0);
+        NSTimeInterval mallocTime = OFTestRunThreads(threadCount, mallocAndFree, NULL, 0);
+        NSLog(@"%2u threads: OFConcurrentBulkBlockPool %.2f ns/pair; malloc %.2f ns/pair", threadCount, 1e9 * poolTime / pairs, 1e9 * mallocTime / pairs);
+
+        if (threadCount == MAX_TEST_THREADS)
+            OFConcurrentBulkBlockPoolReportStatistics(pool);
+        OFConcurrentBulkBlockPoolDestroy(pool);
+    }
+}
+
+@end
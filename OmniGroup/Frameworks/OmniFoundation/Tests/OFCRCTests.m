@@ -0,0 +1,147 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFCRC.h>
+#import <OmniFoundation/OFRandom.h>
+#import <OmniBase/OmniBase.h>
+#import <zlib.h>
+
+RCS_ID("$Id$");
+
+@interface OFCRCTests : OFTestCase
+@end
+
+// Bit-at-a-time reference implementations, straight from the definitions.
+static uint32_t referenceCRC32(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    crc = ~crc;
+    while (length--) {
+        crc ^= *bytes++;
+        for (unsigned int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320U : 0);
+    }
+    return ~crc;
+}
+
+static uint64_t referenceCRC64(uint64_t crc, const uint8_t *bytes, size_t length)
+{
+    crc = ~crc;
+    while (length--) {
+        crc ^= *bytes++;
+        for (unsigned int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xC96C5795D7870F42ULL : 0);
+    }
+    return ~crc;
+}
+
+static const uint32_t TestSeed = 0x5eed;
+
+static NSData *randomData(OFRandomState *state, NSUInteger length)
+{
+    return [OFRandomStateCreateDataOfLength(state, length) autorelease];
+}
+
+@implementation OFCRCTests
+
+- (void)testCheckValues;
+{
+    const char *check = "123456789";
+
+    STAssertEquals(OFCRC32Update(0, check, 9), (uint32_t)0xCBF43926U, nil);
+    should(OFCRC64Update(0, check, 9) == 0x995DC9BBDF1939FAULL);
+
+    STAssertEquals(OFCRC32Update(0, NULL, 0), (uint32_t)0U, nil);
+    should(OFCRC64Update(0, NULL, 0) == 0ULL);
+    STAssertEquals(OFCRC32Update(0x12345678U, check, 0), (uint32_t)0x12345678U, nil);
+}
+
+// Every implementation has a head, a bulk loop and a tail; walk lengths and alignments across all of their boundaries.
+- (void)testAgainstReference;
+{
+    OFRandomState *state = OFRandomStateCreateWithSeed32(&TestSeed, 1);
+    NSData *data = randomData(state, 4096 + 16);
+    const uint8_t *bytes = [data bytes];
+
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; length <= 4096; length += (length < 300 ? 1 : 61)) {
+            uint32_t seed32 = OFRandomNextState32(state);
+            uint64_t seed64 = ((uint64_t)OFRandomNextState32(state) << 32) | OFRandomNextState32(state);
+
+            uint32_t result32 = OFCRC32Update(seed32, bytes + offset, length);
+            if (result32 != referenceCRC32(seed32, bytes + offset, length) || result32 != crc32(seed32, bytes + offset, (uInt)length))
+                STFail(@"CRC-32 mismatch at offset %lu length %lu (%s)", offset, length, OFCRC32ImplementationName());
+
+            if (OFCRC64Update(seed64, bytes + offset, length) != referenceCRC64(seed64, bytes + offset, length))
+                STFail(@"CRC-64 mismatch at offset %lu length %lu", offset, length);
+        }
+    }
+
+    OFRandomStateDestroy(state);
+}
+
+- (void)testIncrementalUpdate;
+{
+    OFRandomState *state = OFRandomStateCreateWithSeed32(&TestSeed, 1);
+    NSData *data = randomData(state, 100000);
+    const uint8_t *bytes = [data bytes];
+    size_t length = [data length];
+
+    uint32_t whole32 = OFCRC32Update(0, bytes, length);
+    uint64_t whole64 = OFCRC64Update(0, bytes, length);
+
+    for (unsigned int trial = 0; trial < 100; trial++) {
+        size_t split = OFRandomNextState32(state) % length;
+        STAssertEquals(OFCRC32Update(OFCRC32Update(0, bytes, split), bytes + split, length - split), whole32, nil);
+        should(OFCRC64Update(OFCRC64Update(0, bytes, split), bytes + split, length - split) == whole64);
+    }
+
+    OFRandomStateDestroy(state);
+}
+
+- (void)testThroughput;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    const size_t length = 16 * 1024 * 1024;
+    const unsigned int passes = 16;
+
+    OFRandomState *state = OFRandomStateCreateWithSeed32(&TestSeed, 1);
+    NSData *data = randomData(state, length);
+    OFRandomStateDestroy(state);
+    const uint8_t *bytes = [data bytes];
+
+    uint32_t crc32Result = 0, zlibResult = 0;
+    uint64_t crc64Result = 0;
+
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned int pass = 0; pass < passes; pass++)
+        crc32Result = OFCRC32Update(crc32Result, bytes, length);
+    NSTimeInterval crc32Time = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned int pass = 0; pass < passes; pass++)
+        zlibResult = (uint32_t)crc32(zlibResult, bytes, (uInt)length);
+    NSTimeInterval zlibTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned int pass = 0; pass < passes; pass++)
+        crc64Result = OFCRC64Update(crc64Result, bytes, length);
+    NSTimeInterval crc64Time = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    STAssertEquals(crc32Result, zlibResult, nil);
+
+    double megabytes = (double)length * passes / (1024.0 * 1024.0);
+    NSLog(@"CRC-32 (%s): %.0f MB/s; zlib crc32: %.0f MB/s; CRC-64: %.0f MB/s", OFCRC32ImplementationName(), megabytes / crc32Time, megabytes / zlibTime, megabytes / crc64Time);
+}
+
+@end
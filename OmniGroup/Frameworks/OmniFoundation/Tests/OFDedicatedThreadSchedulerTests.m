@@ -0,0 +1,207 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFDedicatedThreadScheduler.h>
+#import <OmniFoundation/OFRandom.h>
+#import <OmniBase/OmniBase.h>
+#import <libkern/OSAtomic.h>
+#import <sys/resource.h>
+
+RCS_ID("$Id$");
+
+@interface OFDedicatedThreadSchedulerTests : OFTestCase
+@end
+
+// Counts its events as they fire, keeping how late each one was, and signals once it has seen all it expects.
+@interface OFDedicatedThreadSchedulerTestCounter : NSObject
+{
+@public
+    NSTimeInterval *_lateness;
+    volatile int32_t _count;
+    int32_t _expectedCount;
+    volatile int32_t _earlyCount;
+    dispatch_semaphore_t _finished;
+}
+- initWithExpectedCount:(int32_t)expectedCount;
+- (BOOL)waitUntilFinished;
+- (void)fire:(NSDate *)date;
+@end
+
+@implementation OFDedicatedThreadSchedulerTestCounter
+
+- initWithExpectedCount:(int32_t)expectedCount;
+{
+    if (!(self = [super init]))
+        return nil;
+    _expectedCount = expectedCount;
+    _lateness = calloc(expectedCount, sizeof(*_lateness));
+    _finished = dispatch_semaphore_create(0);
+    return self;
+}
+
+- (void)dealloc;
+{
+    free(_lateness);
+    dispatch_release(_finished);
+    [super dealloc];
+}
+
+- (BOOL)waitUntilFinished;
+{
+    return dispatch_semaphore_wait(_finished, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)) == 0;
+}
+
+- (void)fire:(NSDate *)date;
+{
+    NSTimeInterval lateness = -[date timeIntervalSinceNow];
+    if (lateness < 0.0)
+        OSAtomicIncrement32Barrier(&_earlyCount);
+
+    int32_t count = OSAtomicIncrement32Barrier(&_count);
+    if (count <= _expectedCount)
+        _lateness[count - 1] = lateness;
+    if (count == _expectedCount)
+        dispatch_semaphore_signal(_finished);
+}
+
+@end
+
+static OFDedicatedThreadScheduler *newRunningScheduler(NSTimeInterval timerSlack)
+{
+    // The dedicated thread never exits, so each of these keeps an idle thread around after the test.  Events are invoked on that thread, since the tests don't run the main run loop.
+    OFDedicatedThreadScheduler *scheduler = [[OFDedicatedThreadScheduler alloc] init];
+    [scheduler setInvokesEventsInMainThread:NO];
+    [scheduler setTimerSlack:timerSlack];
+    [scheduler runScheduleForeverInNewThread];
+    return scheduler;
+}
+
+static void scheduleCountedEvents(OFScheduler *scheduler, OFDedicatedThreadSchedulerTestCounter *counter, OFRandomState *randomState, NSTimeInterval start, NSTimeInterval duration)
+{
+    for (int32_t eventIndex = 0; eventIndex < counter->_expectedCount; eventIndex++) {
+        NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:start + OFRandomNextStateDouble(randomState) * duration];
+        [scheduler scheduleSelector:@selector(fire:) onObject:counter withObject:date atDate:date];
+        [date release];
+    }
+}
+
+static NSTimeInterval processCPUTime(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+@implementation OFDedicatedThreadSchedulerTests
+
+- (void)testTimerSlackCoalescesWakeups;
+{
+    OFRandomState *randomState = OFRandomStateCreate();
+    OFDedicatedThreadScheduler *scheduler = newRunningScheduler(0.05);
+    OFDedicatedThreadSchedulerTestCounter *counter = [[[OFDedicatedThreadSchedulerTestCounter alloc] initWithExpectedCount:2000] autorelease];
+
+    // 2000 events over a fifth of a second should go out in a handful of batches, all of them a little late and none early
+    [scheduler resetStatistics];
+    scheduleCountedEvents(scheduler, counter, randomState, [NSDate timeIntervalSinceReferenceDate] + 0.1, 0.2);
+    should([counter waitUntilFinished]);
+
+    OFDedicatedThreadSchedulerStatistics statistics = [scheduler statistics];
+    shouldBeEqual([NSNumber numberWithUnsignedInteger:statistics.eventCount], [NSNumber numberWithUnsignedInteger:2000]);
+    should(statistics.dispatchCount <= 20);
+    should(statistics.maximumEventsPerDispatch >= 100);
+    should(counter->_earlyCount == 0);
+
+    [scheduler release];
+    OFRandomStateDestroy(randomState);
+}
+
+- (void)testStatisticsWithoutSlack;
+{
+    OFRandomState *randomState = OFRandomStateCreate();
+    OFDedicatedThreadScheduler *scheduler = newRunningScheduler(0.0);
+    OFDedicatedThreadSchedulerTestCounter *counter = [[[OFDedicatedThreadSchedulerTestCounter alloc] initWithExpectedCount:50] autorelease];
+
+    [scheduler resetStatistics];
+    scheduleCountedEvents(scheduler, counter, randomState, [NSDate timeIntervalSinceReferenceDate] + 0.05, 0.5);
+    should([counter waitUntilFinished]);
+
+    OFDedicatedThreadSchedulerStatistics statistics = [scheduler statistics];
+    shouldBeEqual([NSNumber numberWithUnsignedInteger:statistics.eventCount], [NSNumber numberWithUnsignedInteger:50]);
+    should(statistics.dispatchCount >= 1 && statistics.dispatchCount <= statistics.eventCount);
+    should(statistics.wakeupCount >= statistics.dispatchCount);
+    should(statistics.maximumLateness >= statistics.totalLateness / statistics.eventCount);
+    should(counter->_earlyCount == 0);
+
+    [scheduler release];
+    OFRandomStateDestroy(randomState);
+}
+
+- (void)testTimerSlackStress;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    const int32_t eventCount = 50000;
+    const NSTimeInterval duration = 2.0;
+    const NSTimeInterval timerSlacks[] = {0.0, 0.001, 0.005, 0.02, 0.1};
+
+    OFRandomState *randomState = OFRandomStateCreate();
+
+    for (unsigned int slackIndex = 0; slackIndex < sizeof(timerSlacks) / sizeof(*timerSlacks); slackIndex++) {
+        NSTimeInterval timerSlack = timerSlacks[slackIndex];
+        OFDedicatedThreadScheduler *scheduler = newRunningScheduler(timerSlack);
+        OFDedicatedThreadSchedulerTestCounter *counter = [[OFDedicatedThreadSchedulerTestCounter alloc] initWithExpectedCount:eventCount];
+
+        // Thousands of near-simultaneous events, scheduled from a few threads at once
+        [scheduler resetStatistics];
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate] + 0.25;
+        NSTimeInterval cpuStart = processCPUTime();
+        dispatch_apply(4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t threadIndex) {
+            OMNI_POOL_START {
+                OFRandomState *threadRandomState;
+                @synchronized(self) {
+                    threadRandomState = OFRandomStateDuplicate(randomState);
+                    OFRandomStateJump(randomState);
+                }
+                for (int32_t eventIndex = (int32_t)threadIndex; eventIndex < eventCount; eventIndex += 4) {
+                    NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:start + OFRandomNextStateDouble(threadRandomState) * duration];
+                    [scheduler scheduleSelector:@selector(fire:) onObject:counter withObject:date atDate:date];
+                    [date release];
+                }
+                OFRandomStateDestroy(threadRandomState);
+            } OMNI_POOL_END;
+        });
+        should([counter waitUntilFinished]);
+        NSTimeInterval cpuTime = processCPUTime() - cpuStart;
+
+        // Jitter is the spread of how late the events were
+        double latenessSum = 0.0, latenessSquareSum = 0.0;
+        for (int32_t eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+            latenessSum += counter->_lateness[eventIndex];
+            latenessSquareSum += counter->_lateness[eventIndex] * counter->_lateness[eventIndex];
+        }
+        double meanLateness = latenessSum / eventCount;
+        double jitter = sqrt(MAX(latenessSquareSum / eventCount - meanLateness * meanLateness, 0.0));
+
+        OFDedicatedThreadSchedulerStatistics statistics = [scheduler statistics];
+        should(counter->_earlyCount == 0);
+        NSLog(@"slack %5.3fs: %.3fs CPU, %5lu wakeups, %5lu batches, %6.1f events/batch (max %lu), lateness mean %6.2fms max %6.2fms, jitter %6.2fms",
+              timerSlack, cpuTime, (unsigned long)statistics.wakeupCount, (unsigned long)statistics.dispatchCount, (double)statistics.eventCount / MAX(statistics.dispatchCount, (NSUInteger)1), (unsigned long)statistics.maximumEventsPerDispatch, meanLateness * 1e3, statistics.maximumLateness * 1e3, jitter * 1e3);
+
+        [counter release];
+        [scheduler release];
+    }
+
+    OFRandomStateDestroy(randomState);
+}
+
+@end
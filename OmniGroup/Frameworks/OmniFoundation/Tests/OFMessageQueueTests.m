@@ -0,0 +1,343 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFInvocation.h>
+#import <OmniFoundation/OFMessageQueue.h>
+#import <OmniFoundation/OFMessageQueuePriorityProtocol.h>
+#import <OmniBase/OmniBase.h>
+#import <libkern/OSAtomic.h>
+
+RCS_ID("$Id$");
+
+@interface OFMessageQueueTests : OFTestCase
+@end
+
+// Records the order its messages arrive in.
+@interface OFMessageQueueTestRecorder : NSObject <OFMessageQueuePriority>
+{
+    unsigned int _priority;
+    NSMutableArray *_log;
+}
+- initWithPriority:(unsigned int)priority log:(NSMutableArray *)log;
+- (void)record:(NSString *)tag;
+@end
+
+@implementation OFMessageQueueTestRecorder
+
+- initWithPriority:(unsigned int)priority log:(NSMutableArray *)log;
+{
+    if (!(self = [super init]))
+        return nil;
+    _priority = priority;
+    _log = [log retain];
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_log release];
+    [super dealloc];
+}
+
+- (OFMessageQueueSchedulingInfo)messageQueueSchedulingInfo;
+{
+    return (OFMessageQueueSchedulingInfo){.group = NULL, .priority = _priority, .maximumSimultaneousThreadsInGroup = 255};
+}
+
+- (void)record:(NSString *)tag;
+{
+    [_log addObject:tag];
+}
+
+@end
+
+// Counts its messages from however many processors, and signals when it has seen the number it's waiting for.
+@interface OFMessageQueueTestCounter : NSObject
+{
+@public
+    OFMessageQueue *_queue;
+    volatile int32_t _count;
+    int32_t _expectedCount;
+    dispatch_semaphore_t _finished;
+    volatile int32_t _activeCount, _maximumActiveCount;
+}
+- initWithQueue:(OFMessageQueue *)queue;
+- (void)expectCount:(int32_t)expectedCount;
+- (BOOL)waitUntilFinished;
+- (void)tick;
+- (void)spawn:(int)depth;
+- (void)tickAlone;
+@end
+
+@implementation OFMessageQueueTestCounter
+
+- initWithQueue:(OFMessageQueue *)queue;
+{
+    if (!(self = [super init]))
+        return nil;
+    _queue = [queue retain];
+    _finished = dispatch_semaphore_create(0);
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_queue release];
+    dispatch_release(_finished);
+    [super dealloc];
+}
+
+- (void)expectCount:(int32_t)expectedCount;
+{
+    _count = 0;
+    _expectedCount = expectedCount;
+    OSMemoryBarrier();
+}
+
+- (BOOL)waitUntilFinished;
+{
+    return dispatch_semaphore_wait(_finished, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)) == 0;
+}
+
+- (void)tick;
+{
+    if (OSAtomicIncrement32Barrier(&_count) == _expectedCount)
+        dispatch_semaphore_signal(_finished);
+}
+
+// Fans out from whichever processor is running it, which is what gives the other processors something to steal.
+- (void)spawn:(int)depth;
+{
+    if (depth > 0) {
+        [_queue queueSelector:@selector(spawn:) forObject:self withInt:depth - 1];
+        [_queue queueSelector:@selector(spawn:) forObject:self withInt:depth - 1];
+    }
+    [self tick];
+}
+
+- (void)tickAlone;
+{
+    int32_t activeCount = OSAtomicIncrement32Barrier(&_activeCount);
+    int32_t maximumActiveCount;
+    while (activeCount > (maximumActiveCount = _maximumActiveCount) && !OSAtomicCompareAndSwap32Barrier(maximumActiveCount, activeCount, &_maximumActiveCount))
+        ;
+    usleep(200);
+    OSAtomicDecrement32Barrier(&_activeCount);
+    [self tick];
+}
+
+@end
+
+// Allows only one processor at a time.
+@interface OFMessageQueueTestGroupedCounter : OFMessageQueueTestCounter <OFMessageQueuePriority>
+@end
+
+@implementation OFMessageQueueTestGroupedCounter
+
+- (OFMessageQueueSchedulingInfo)messageQueueSchedulingInfo;
+{
+    return (OFMessageQueueSchedulingInfo){.group = self, .priority = OFMediumPriority, .maximumSimultaneousThreadsInGroup = 1};
+}
+
+@end
+
+static NSUInteger drainQueue(OFMessageQueue *queue)
+{
+    NSUInteger invocationCount = 0;
+    OFInvocation *invocation;
+    while ((invocation = [queue copyNextInvocationWithBlock:NO])) {
+        [invocation invoke];
+        [invocation release];
+        invocationCount++;
+    }
+    return invocationCount;
+}
+
+@implementation OFMessageQueueTests
+
+- (void)testPriorityOrder;
+{
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+        [queue setUsesWorkStealing:(pass == 1)];
+
+        NSMutableArray *log = [NSMutableArray array];
+        OFMessageQueueTestRecorder *high = [[[OFMessageQueueTestRecorder alloc] initWithPriority:OFHighPriority log:log] autorelease];
+        OFMessageQueueTestRecorder *medium = [[[OFMessageQueueTestRecorder alloc] initWithPriority:OFMediumPriority log:log] autorelease];
+        OFMessageQueueTestRecorder *low = [[[OFMessageQueueTestRecorder alloc] initWithPriority:OFLowPriority log:log] autorelease];
+
+        [queue queueSelector:@selector(record:) forObject:low withObject:@"low"];
+        [queue queueSelector:@selector(record:) forObject:medium withObject:@"medium1"];
+        [queue queueSelector:@selector(record:) forObject:high withObject:@"high"];
+        [queue queueSelector:@selector(record:) forObject:medium withObject:@"medium2"];
+        should([queue hasInvocations]);
+
+        shouldBeEqual([NSNumber numberWithUnsignedInteger:drainQueue(queue)], [NSNumber numberWithUnsignedInteger:4]);
+        shouldBeEqual(log, ([NSArray arrayWithObjects:@"high", @"medium1", @"medium2", @"low", nil]));
+        shouldnt([queue hasInvocations]);
+
+        [queue release];
+    }
+}
+
+- (void)testWorkStealingOnce;
+{
+    OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+    [queue setUsesWorkStealing:YES];
+
+    NSMutableArray *log = [NSMutableArray array];
+    OFMessageQueueTestRecorder *recorder = [[[OFMessageQueueTestRecorder alloc] initWithPriority:OFMediumPriority log:log] autorelease];
+
+    [queue queueSelectorOnce:@selector(record:) forObject:recorder withObject:@"once"];
+    [queue queueSelectorOnce:@selector(record:) forObject:recorder withObject:@"once"];
+    [queue queueSelectorOnce:@selector(record:) forObject:recorder withObject:@"other"];
+    shouldBeEqual([NSNumber numberWithUnsignedInteger:drainQueue(queue)], [NSNumber numberWithUnsignedInteger:2]);
+
+    // Once the first has run, it can be queued again; and "once" also skips things that were queued normally.
+    [queue queueSelector:@selector(record:) forObject:recorder withObject:@"once"];
+    [queue queueSelectorOnce:@selector(record:) forObject:recorder withObject:@"once"];
+    shouldBeEqual([NSNumber numberWithUnsignedInteger:drainQueue(queue)], [NSNumber numberWithUnsignedInteger:1]);
+
+    shouldBeEqual(log, ([NSArray arrayWithObjects:@"once", @"other", @"once", nil]));
+
+    [queue release];
+}
+
+- (void)testWorkStealingProcessors;
+{
+    // Background processors never exit, and they keep the queue (and its threads) around after the test.
+    OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+    [queue setUsesWorkStealing:YES];
+    [queue startBackgroundProcessors:8];
+
+    OFMessageQueueTestCounter *counter = [[[OFMessageQueueTestCounter alloc] initWithQueue:queue] autorelease];
+
+    // Queued from outside
+    [counter expectCount:20000];
+    for (unsigned int tickIndex = 0; tickIndex < 20000; tickIndex++)
+        [queue queueSelector:@selector(tick) forObject:counter];
+    should([counter waitUntilFinished]);
+
+    // Queued from the processors themselves
+    [counter expectCount:(1 << 14) - 1];
+    [queue queueSelector:@selector(spawn:) forObject:counter withInt:13];
+    should([counter waitUntilFinished]);
+
+    shouldnt([queue hasInvocations]);
+    [queue release];
+}
+
+- (void)testWorkStealingGroupLimit;
+{
+    OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+    [queue setUsesWorkStealing:YES];
+    [queue startBackgroundProcessors:4];
+
+    OFMessageQueueTestGroupedCounter *counter = [[[OFMessageQueueTestGroupedCounter alloc] initWithQueue:queue] autorelease];
+    OFMessageQueueTestCounter *otherCounter = [[[OFMessageQueueTestCounter alloc] initWithQueue:queue] autorelease];
+
+    [counter expectCount:200];
+    [otherCounter expectCount:200];
+    for (unsigned int tickIndex = 0; tickIndex < 200; tickIndex++) {
+        [queue queueSelector:@selector(tickAlone) forObject:counter];
+        [queue queueSelector:@selector(tickAlone) forObject:otherCounter];
+    }
+    should([counter waitUntilFinished]);
+    should([otherCounter waitUntilFinished]);
+
+    shouldBeEqual([NSNumber numberWithInt:counter->_maximumActiveCount], [NSNumber numberWithInt:1]);
+
+    [queue release];
+}
+
+- (void)testWorkStealingGroupLimitQueuedBeforeStart;
+{
+    OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+    [queue setUsesWorkStealing:YES];
+
+    OFMessageQueueTestGroupedCounter *counter = [[[OFMessageQueueTestGroupedCounter alloc] initWithQueue:queue] autorelease];
+
+    // Nothing knows how many processors there will be yet
+    [counter expectCount:200];
+    for (unsigned int tickIndex = 0; tickIndex < 200; tickIndex++)
+        [queue queueSelector:@selector(tickAlone) forObject:counter];
+    [queue startBackgroundProcessors:4];
+    should([counter waitUntilFinished]);
+    shouldBeEqual([NSNumber numberWithInt:counter->_maximumActiveCount], [NSNumber numberWithInt:1]);
+
+    // With one processor the group's limit doesn't matter, until more processors show up while its invocations are still waiting
+    OFMessageQueue *growingQueue = [[OFMessageQueue alloc] init];
+    [growingQueue setUsesWorkStealing:YES];
+    [growingQueue startBackgroundProcessors:1];
+
+    OFMessageQueueTestGroupedCounter *growingCounter = [[[OFMessageQueueTestGroupedCounter alloc] initWithQueue:growingQueue] autorelease];
+    [growingCounter expectCount:200];
+    for (unsigned int tickIndex = 0; tickIndex < 200; tickIndex++)
+        [growingQueue queueSelector:@selector(tickAlone) forObject:growingCounter];
+    [growingQueue startBackgroundProcessors:3];
+    should([growingCounter waitUntilFinished]);
+    shouldBeEqual([NSNumber numberWithInt:growingCounter->_maximumActiveCount], [NSNumber numberWithInt:1]);
+
+    [growingQueue release];
+    [queue release];
+}
+
+- (void)testWorkStealingPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    const int32_t tickCount = 200000;
+    const unsigned int roundTripCount = 2000;
+
+    // Every queue here keeps its processors for the rest of the run, so this leaves a few hundred idle threads behind.
+    for (NSUInteger processorCount = 1; processorCount <= 64; processorCount *= 2) {
+        for (unsigned int pass = 0; pass < 2; pass++) {
+            BOOL usesWorkStealing = (pass == 1);
+            OFMessageQueue *queue = [[OFMessageQueue alloc] init];
+            [queue setUsesWorkStealing:usesWorkStealing];
+            [queue startBackgroundProcessors:processorCount];
+
+            OFMessageQueueTestCounter *counter = [[[OFMessageQueueTestCounter alloc] initWithQueue:queue] autorelease];
+
+            // Throughput of invocations queued from outside
+            [counter expectCount:tickCount];
+            NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+            for (int32_t tickIndex = 0; tickIndex < tickCount; tickIndex++)
+                [queue queueSelector:@selector(tick) forObject:counter];
+            should([counter waitUntilFinished]);
+            NSTimeInterval externalTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+            // Throughput of invocations the processors queue for each other
+            [counter expectCount:(1 << 17) - 1];
+            start = [NSDate timeIntervalSinceReferenceDate];
+            [queue queueSelector:@selector(spawn:) forObject:counter withInt:16];
+            should([counter waitUntilFinished]);
+            NSTimeInterval fanOutTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+            // Latency: one at a time, so every invocation has to wake an idle processor
+            start = [NSDate timeIntervalSinceReferenceDate];
+            for (unsigned int roundTrip = 0; roundTrip < roundTripCount; roundTrip++) {
+                [counter expectCount:1];
+                [queue queueSelector:@selector(tick) forObject:counter];
+                should([counter waitUntilFinished]);
+            }
+            NSTimeInterval latency = ([NSDate timeIntervalSinceReferenceDate] - start) / roundTripCount;
+
+            [queue release];
+
+            NSLog(@"%@, %2lu processors: %8.0f queued/s, %8.0f fanned out/s, %6.1f us round trip", usesWorkStealing ? @"work stealing" : @"shared queue ", (unsigned long)processorCount, tickCount / externalTime, ((1 << 17) - 1) / fanOutTime, latency * 1e6);
+        }
+    }
+}
+
+@end
@@ -0,0 +1,306 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFRandom.h>
+#import <OmniBase/OmniBase.h>
+#import <pthread.h>
+
+RCS_ID("$Id$");
+
+@interface OFRandomTests : OFTestCase
+@end
+
+static const uint32_t TestSeed[2] = { 0x5eed, 0xf00d };
+
+static BOOL statesAgree(OFRandomState *state1, OFRandomState *state2, unsigned int count)
+{
+    for (unsigned int valueIndex = 0; valueIndex < count; valueIndex++)
+        if (OFRandomNextState64(state1) != OFRandomNextState64(state2))
+            return NO;
+    return YES;
+}
+
+#define CONTENTION_VALUES_PER_THREAD (1 << 20)
+
+static OFRandomState *sharedState;
+static pthread_mutex_t sharedStateLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *drawFromThreadState(void *result)
+{
+    uint64_t sum = 0;
+    for (unsigned int valueIndex = 0; valueIndex < CONTENTION_VALUES_PER_THREAD; valueIndex++)
+        sum += OFRandomNext64();
+    *(uint64_t *)result = sum;
+    return NULL;
+}
+
+static void *drawFromLockedSharedState(void *result)
+{
+    uint64_t sum = 0;
+    for (unsigned int valueIndex = 0; valueIndex < CONTENTION_VALUES_PER_THREAD; valueIndex++) {
+        pthread_mutex_lock(&sharedStateLock);
+        sum += OFRandomNextState64(sharedState);
+        pthread_mutex_unlock(&sharedStateLock);
+    }
+    *(uint64_t *)result = sum;
+    return NULL;
+}
+
+@implementation OFRandomTests
+
+// The batch generators promise exactly the sequence the one-at-a-time functions produce, wherever in the state's block they start and whatever the alignment of the destination.
+- (void)testFillMatchesNext;
+{
+    OFRandomState *batch = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomState *single = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomState *lengths = OFRandomStateCreateWithSeed32(TestSeed, 2);
+
+    uint64_t *buffer = malloc(5001 * sizeof(uint64_t));
+
+    for (unsigned int trial = 0; trial < 200; trial++) {
+        unsigned int skip = OFRandomNextStateN(lengths, 700);
+        for (unsigned int skipIndex = 0; skipIndex < skip; skipIndex++) {
+            OFRandomNextState64(batch);
+            OFRandomNextState64(single);
+        }
+
+        size_t count = OFRandomNextStateN(lengths, 5000);
+        uint64_t *values = buffer + (trial & 1); // Alternate between 16-byte aligned and not
+        OFRandomStateFill64(batch, values, count);
+        for (size_t valueIndex = 0; valueIndex < count; valueIndex++) {
+            if (values[valueIndex] != OFRandomNextState64(single)) {
+                STFail(@"OFRandomStateFill64 diverged at value %lu of %lu (skipped %u)", valueIndex, count, skip);
+                break;
+            }
+        }
+
+        uint32_t values32[100];
+        OFRandomStateFill32(batch, values32, 100);
+        for (size_t valueIndex = 0; valueIndex < 100; valueIndex++)
+            STAssertEquals(values32[valueIndex], OFRandomNextState32(single), nil);
+
+        double doubles[77];
+        OFRandomStateFillDouble(batch, doubles, 77);
+        for (size_t valueIndex = 0; valueIndex < 77; valueIndex++)
+            STAssertEquals(doubles[valueIndex], OFRandomNextStateDouble(single), nil);
+
+        // And both states are still in step afterwards
+        STAssertEquals(OFRandomNextState64(batch), OFRandomNextState64(single), nil);
+    }
+
+    free(buffer);
+    OFRandomStateDestroy(batch);
+    OFRandomStateDestroy(single);
+    OFRandomStateDestroy(lengths);
+}
+
+- (void)testCreateDataMatchesNext;
+{
+    OFRandomState *batch = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomState *single = OFRandomStateCreateWithSeed32(TestSeed, 2);
+
+    NSData *data = OFRandomStateCreateDataOfLength(batch, 10001);
+    const uint8_t *bytes = [data bytes];
+
+    for (NSUInteger offset = 0; offset + sizeof(uint64_t) <= [data length]; offset += sizeof(uint64_t)) {
+        uint64_t expected = OFRandomNextState64(single);
+        if (memcmp(bytes + offset, &expected, sizeof(expected)) != 0) {
+            STFail(@"OFRandomStateCreateDataOfLength diverged at byte %lu", offset);
+            break;
+        }
+    }
+
+    [data release];
+    OFRandomStateDestroy(batch);
+    OFRandomStateDestroy(single);
+}
+
+- (void)testFillBounded;
+{
+    OFRandomState *state = OFRandomStateCreateWithSeed32(TestSeed, 2);
+
+    const size_t count = 300000;
+    uint32_t *values = malloc(count * sizeof(*values));
+
+    uint32_t bounds[] = { 1, 2, 3, 10, 1000, 0x80000001U, UINT32_MAX };
+    for (size_t boundIndex = 0; boundIndex < sizeof(bounds)/sizeof(*bounds); boundIndex++) {
+        uint32_t bound = bounds[boundIndex];
+        OFRandomStateFillBounded(state, values, count, bound);
+
+        for (size_t valueIndex = 0; valueIndex < count; valueIndex++) {
+            if (values[valueIndex] >= bound) {
+                STFail(@"Value %u out of range for bound %u", values[valueIndex], bound);
+                break;
+            }
+        }
+    }
+
+    // Three buckets should each get very close to a third; the standard deviation here is about 260.
+    unsigned int histogram[3] = { 0, 0, 0 };
+    OFRandomStateFillBounded(state, values, count, 3);
+    for (size_t valueIndex = 0; valueIndex < count; valueIndex++)
+        histogram[values[valueIndex]]++;
+    for (unsigned int bucket = 0; bucket < 3; bucket++)
+        should(abs((int)histogram[bucket] - (int)(count / 3)) < 2000);
+
+    free(values);
+    OFRandomStateDestroy(state);
+}
+
+// Small advances step and large ones jump; both have to land exactly where stepping would.
+- (void)testAdvanceMatchesStepping;
+{
+    OFRandomState *jumped = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomState *stepped = OFRandomStateCreateWithSeed32(TestSeed, 2);
+
+    uint64_t counts[] = { 0, 1, 2, 311, 312, 313, 10001, (1 << 22) - 1, (1 << 22), (1 << 22) + 77 };
+    for (size_t countIndex = 0; countIndex < sizeof(counts)/sizeof(*counts); countIndex++) {
+        OFRandomNextState64(jumped); // Start somewhere in the middle of a block
+        OFRandomNextState64(stepped);
+
+        OFRandomStateAdvance(jumped, counts[countIndex]);
+        for (uint64_t valueIndex = 0; valueIndex < counts[countIndex]; valueIndex++)
+            OFRandomNextState64(stepped);
+        should1(statesAgree(jumped, stepped, 1000), ([NSString stringWithFormat:@"Advancing by %llu", counts[countIndex]]));
+    }
+
+    OFRandomStateDestroy(jumped);
+    OFRandomStateDestroy(stepped);
+}
+
+// Jumps far beyond anything that can be checked by stepping still have to compose.
+- (void)testJumpsCompose;
+{
+    OFRandomState *base = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomNextState64(base);
+
+    OFRandomState *split = OFRandomStateDuplicate(base);
+    OFRandomStateAdvance(split, (1ULL << 40) + 12345);
+    OFRandomStateAdvance(split, (1ULL << 41) + 7);
+    OFRandomState *whole = OFRandomStateDuplicate(base);
+    OFRandomStateAdvance(whole, (1ULL << 40) + (1ULL << 41) + 12352);
+    should(statesAgree(split, whole, 1000));
+
+    OFRandomState *jumped = OFRandomStateDuplicate(base);
+    OFRandomStateJump(jumped);
+    OFRandomState *advanced = OFRandomStateDuplicate(base);
+    OFRandomStateAdvance(advanced, 1ULL << 63);
+    OFRandomStateAdvance(advanced, 1ULL << 63);
+    should(statesAgree(jumped, advanced, 1000));
+
+    OFRandomStateDestroy(base);
+    OFRandomStateDestroy(split);
+    OFRandomStateDestroy(whole);
+    OFRandomStateDestroy(jumped);
+    OFRandomStateDestroy(advanced);
+}
+
+- (void)testSubstreams;
+{
+    const unsigned int workerCount = 8;
+    OFRandomState *workers[workerCount];
+
+    workers[0] = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    for (unsigned int workerIndex = 1; workerIndex < workerCount; workerIndex++) {
+        workers[workerIndex] = OFRandomStateDuplicate(workers[workerIndex - 1]);
+        OFRandomStateJump(workers[workerIndex]);
+    }
+
+    // Reproducible: the same seed gives the same substreams.
+    OFRandomState *again = OFRandomStateCreateWithSeed32(TestSeed, 2);
+    OFRandomStateJump(again);
+    OFRandomStateJump(again);
+    OFRandomState *check = OFRandomStateDuplicate(workers[2]);
+    should(statesAgree(again, check, 1000));
+    OFRandomStateDestroy(again);
+    OFRandomStateDestroy(check);
+
+    uint64_t firstValues[workerCount];
+    for (unsigned int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+        firstValues[workerIndex] = OFRandomNextState64(workers[workerIndex]);
+    for (unsigned int workerIndex = 0; workerIndex < workerCount; workerIndex++) {
+        for (unsigned int otherIndex = 0; otherIndex < workerIndex; otherIndex++)
+            should(firstValues[workerIndex] != firstValues[otherIndex]);
+        OFRandomStateDestroy(workers[workerIndex]);
+    }
+}
+
+- (void)testThreadStatesAreIndependent;
+{
+    const unsigned int threadCount = 16;
+    uint64_t results[threadCount];
+    OFTestRunThreads(threadCount, drawFromThreadState, results, sizeof(*results));
+
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+        for (unsigned int otherIndex = 0; otherIndex < threadIndex; otherIndex++)
+            should(results[threadIndex] != results[otherIndex]);
+}
+
+- (void)testThreadContention;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    uint32_t seed = 0x5eed;
+    sharedState = OFRandomStateCreateWithSeed32(&seed, 1);
+
+    for (unsigned int threadCount = 1; threadCount <= 64; threadCount *= 2) {
+        uint64_t results[threadCount];
+        double values = (double)threadCount * CONTENTION_VALUES_PER_THREAD;
+        NSTimeInterval threadStateTime = OFTestRunThreads(threadCount, drawFromThreadState, results, sizeof(*results));
+        NSTimeInterval sharedStateTime = OFTestRunThreads(threadCount, drawFromLockedSharedState, results, sizeof(*results));
+
+        NSLog(@"%2u threads: OFRandomNext64 %.2f ns/value; locked shared state %.2f ns/value", threadCount, 1e9 * threadStateTime / values, 1e9 * sharedStateTime / values);
+    }
+
+    OFRandomStateDestroy(sharedState);
+    sharedState = NULL;
+}
+
+- (void)testBatchThroughput;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    const size_t count = 1 << 24;
+    uint64_t *values = malloc(count * sizeof(*values));
+    memset(values, 0, count * sizeof(*values)); // Fault the pages in before timing anything
+
+    OFRandomState *state = OFRandomStateCreateWithSeed32(TestSeed, 2);
+
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (size_t valueIndex = 0; valueIndex < count; valueIndex++)
+        values[valueIndex] = OFRandomNextState64(state);
+    NSTimeInterval singleTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OFRandomStateFill64(state, values, count);
+    NSTimeInterval batchTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OFRandomStateFill64(state, values + 1, count - 1);
+    NSTimeInterval unalignedBatchTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OFRandomStateFillBounded(state, (uint32_t *)values, count, 1000);
+    NSTimeInterval boundedTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    NSLog(@"OFRandom ns/value: OFRandomNextState64 %.2f; OFRandomStateFill64 %.2f (unaligned %.2f); OFRandomStateFillBounded %.2f",
+          1e9 * singleTime / count, 1e9 * batchTime / count, 1e9 * unalignedBatchTime / count, 1e9 * boundedTime / count);
+
+    OFRandomStateDestroy(state);
+    free(values);
+}
+
+@end
@@ -0,0 +1,225 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFRandom.h>
+#import <OmniFoundation/OFReadWriteLock.h>
+#import <OmniFoundation/OFStripedReadWriteLock.h>
+#import <OmniBase/OmniBase.h>
+#import <libkern/OSAtomic.h>
+
+RCS_ID("$Id$");
+
+@interface OFReadWriteLockTests : OFTestCase
+@end
+
+// Writers keep the two values equal.  When checking, readers and writers also count themselves in and out, to catch a writer overlapping anyone else.
+typedef struct {
+    id <OFReadWriteLocking> lock;
+    unsigned int writePercent;
+    NSUInteger operationCount;
+    BOOL checksExclusion;
+
+    volatile uint64_t firstValue;
+    volatile uint64_t secondValue;
+    volatile int32_t readerCount;
+    volatile int32_t writerCount;
+    volatile int32_t violationCount;
+    volatile int32_t writeCount;
+} OFReadWriteLockTestShared;
+
+typedef struct {
+    OFReadWriteLockTestShared *shared;
+    OFRandomState *randomState;
+    uint64_t readSum;
+} OFReadWriteLockTestThread;
+
+static void *readWriteLockTestThread(void *context)
+{
+    OFReadWriteLockTestThread *thread = (OFReadWriteLockTestThread *)context;
+    OFReadWriteLockTestShared *shared = thread->shared;
+    id <OFReadWriteLocking> lock = shared->lock;
+
+    for (NSUInteger operationIndex = 0; operationIndex < shared->operationCount; operationIndex++) {
+        if (OFRandomNextStateN(thread->randomState, 100) < shared->writePercent) {
+            [lock lockForWriting];
+            if (shared->checksExclusion) {
+                if (OSAtomicIncrement32Barrier(&shared->writerCount) != 1 || shared->readerCount != 0)
+                    OSAtomicIncrement32Barrier(&shared->violationCount);
+                OSAtomicIncrement32Barrier(&shared->writeCount);
+            }
+            shared->firstValue++;
+            shared->secondValue++;
+            if (shared->checksExclusion)
+                OSAtomicDecrement32Barrier(&shared->writerCount);
+            [lock unlockForWriting];
+        } else {
+            [lock lockForReading];
+            if (shared->checksExclusion) {
+                OSAtomicIncrement32Barrier(&shared->readerCount);
+                if (shared->writerCount != 0)
+                    OSAtomicIncrement32Barrier(&shared->violationCount);
+            }
+            uint64_t firstValue = shared->firstValue;
+            uint64_t secondValue = shared->secondValue;
+            if (firstValue != secondValue)
+                OSAtomicIncrement32Barrier(&shared->violationCount);
+            thread->readSum += firstValue;
+            if (shared->checksExclusion)
+                OSAtomicDecrement32Barrier(&shared->readerCount);
+            [lock unlockForReading];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the wall clock time it took the threads to get through their operations.
+static NSTimeInterval runReadWriteLockTestThreads(OFReadWriteLockTestShared *shared, unsigned int threadCount, OFRandomState *randomState)
+{
+    OFReadWriteLockTestThread *threads = calloc(threadCount, sizeof(*threads));
+
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++) {
+        threads[threadIndex].shared = shared;
+        threads[threadIndex].randomState = OFRandomStateDuplicate(randomState);
+        OFRandomStateJump(randomState);
+    }
+
+    NSTimeInterval elapsed = OFTestRunThreads(threadCount, readWriteLockTestThread, threads, sizeof(*threads));
+
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+        OFRandomStateDestroy(threads[threadIndex].randomState);
+    free(threads);
+
+    return elapsed;
+}
+
+static void *writeOnceThread(void *context)
+{
+    id <OFReadWriteLocking> lock = ((OFReadWriteLockTestShared *)context)->lock;
+    [lock lockForWriting];
+    OSAtomicIncrement32Barrier(&((OFReadWriteLockTestShared *)context)->writeCount);
+    [lock unlockForWriting];
+    return NULL;
+}
+
+// Plain, striped, and striped with recursive read tracking
+static NSArray *readWriteLocksToTest(void)
+{
+    return [NSArray arrayWithObjects:[[[OFReadWriteLock alloc] init] autorelease], [[[OFStripedReadWriteLock alloc] init] autorelease], [[[OFStripedReadWriteLock alloc] initWithRecursiveReadTracking:YES] autorelease], nil];
+}
+
+@implementation OFReadWriteLockTests
+
+- (void)testMutualExclusion;
+{
+    OFRandomState *randomState = OFRandomStateCreate();
+
+    for (id <OFReadWriteLocking> lock in readWriteLocksToTest()) {
+        for (unsigned int writePercent = 1; writePercent <= 50; writePercent *= 7) {
+            OFReadWriteLockTestShared shared;
+            memset(&shared, 0, sizeof(shared));
+            shared.lock = lock;
+            shared.writePercent = writePercent;
+            shared.operationCount = 20000;
+            shared.checksExclusion = YES;
+
+            runReadWriteLockTestThreads(&shared, 8, randomState);
+
+            should(shared.violationCount == 0);
+            should(shared.firstValue == (uint64_t)shared.writeCount);
+            should(shared.readerCount == 0 && shared.writerCount == 0);
+        }
+    }
+
+    OFRandomStateDestroy(randomState);
+}
+
+- (void)testReadingInsideWrite;
+{
+    OFStripedReadWriteLock *lock = [[[OFStripedReadWriteLock alloc] initWithRecursiveReadTracking:YES] autorelease];
+
+    shouldnt([lock isWriteLocked]);
+    [lock lockForWriting];
+    should([lock isWriteLocked]);
+    [lock lockForReading];
+    [lock unlockForReading];
+    should([lock isWriteLocked]);
+    [lock unlockForWriting];
+    shouldnt([lock isWriteLocked]);
+}
+
+- (void)testRecursiveReadTracking;
+{
+    OFStripedReadWriteLock *lock = [[[OFStripedReadWriteLock alloc] initWithRecursiveReadTracking:YES] autorelease];
+    OFReadWriteLockTestShared shared;
+    memset(&shared, 0, sizeof(shared));
+    shared.lock = lock;
+
+    [lock lockForReading];
+    [lock lockForReading];
+
+    // Once the writer is waiting, an untracked nested read would wait behind it forever
+    pthread_t writer;
+    pthread_create(&writer, NULL, writeOnceThread, &shared);
+    usleep(50000);
+    should(shared.writeCount == 0);
+    [lock lockForReading];
+
+    STAssertThrowsSpecificNamed([lock lockForWriting], NSException, NSInternalInconsistencyException, @"Can't write while reading");
+
+    [lock unlockForReading];
+    [lock unlockForReading];
+    should(shared.writeCount == 0);
+    [lock unlockForReading];
+
+    pthread_join(writer, NULL);
+    should(shared.writeCount == 1);
+
+    STAssertThrowsSpecificNamed([lock unlockForReading], NSException, OFReadWriteLockUsageException, @"Unbalanced unlock");
+    STAssertThrowsSpecificNamed([lock unlockForWriting], NSException, OFReadWriteLockUsageException, @"Unbalanced unlock");
+}
+
+- (void)testReadWriteRatioSweep;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    const unsigned int writePercents[] = {1, 10, 50};
+    const NSUInteger operationCount = 1000000;
+    NSArray *lockNames = [NSArray arrayWithObjects:@"OFReadWriteLock               ", @"OFStripedReadWriteLock        ", @"OFStripedReadWriteLock tracked", nil];
+    OFRandomState *randomState = OFRandomStateCreate();
+
+    // The same total work split over more and more threads, so perfect scaling would show as a flat line of wall clock times
+    for (unsigned int writePercentIndex = 0; writePercentIndex < sizeof(writePercents) / sizeof(*writePercents); writePercentIndex++) {
+        unsigned int writePercent = writePercents[writePercentIndex];
+        for (unsigned int threadCount = 1; threadCount <= 64; threadCount *= 2) {
+            NSArray *locks = readWriteLocksToTest();
+            for (NSUInteger lockIndex = 0; lockIndex < [locks count]; lockIndex++) {
+                id <OFReadWriteLocking> lock = [locks objectAtIndex:lockIndex];
+                OFReadWriteLockTestShared shared;
+                memset(&shared, 0, sizeof(shared));
+                shared.lock = lock;
+                shared.writePercent = writePercent;
+                shared.operationCount = operationCount / threadCount;
+
+                NSTimeInterval elapsed = runReadWriteLockTestThreads(&shared, threadCount, randomState);
+                should(shared.violationCount == 0);
+
+                NSLog(@"%2u/%-2u read/write, %2u threads, %@: %10.0f operations/s", 100 - writePercent, writePercent, threadCount, [lockNames objectAtIndex:lockIndex], shared.operationCount * threadCount / elapsed);
+            }
+        }
+    }
+
+    OFRandomStateDestroy(randomState);
+}
+
+@end
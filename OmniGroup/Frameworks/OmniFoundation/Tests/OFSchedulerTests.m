@@ -0,0 +1,294 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFInvocation.h>
+#import <OmniFoundation/OFRandom.h>
+#import <OmniFoundation/OFScheduledEvent.h>
+#import <OmniFoundation/OFScheduler.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+@interface OFSchedulerTests : OFTestCase
+@end
+
+@class OFController;
+@interface OFScheduler (OFSchedulerTestsPrivate)
+- (void)controllerWillTerminate:(OFController *)controller;
+@end
+
+// Never fires on its own; the tests call -invokeScheduledEvents themselves.
+@interface OFSchedulerTestScheduler : OFScheduler
+@end
+
+@implementation OFSchedulerTestScheduler
+
+- (void)scheduleEvents;
+{
+}
+
+- (void)cancelScheduledEvents;
+{
+}
+
+@end
+
+// Records the order its events fire in, and whether any fired before their dates.
+@interface OFSchedulerTestRecorder : NSObject
+{
+@public
+    NSMutableArray *_firedEvents;
+    NSUInteger _earlyCount;
+}
+- (void)fire:(NSDate *)date;
+@end
+
+@implementation OFSchedulerTestRecorder
+
+- init;
+{
+    if (!(self = [super init]))
+        return nil;
+    _firedEvents = [[NSMutableArray alloc] init];
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_firedEvents release];
+    [super dealloc];
+}
+
+- (void)fire:(NSDate *)date;
+{
+    if ([date timeIntervalSinceNow] > 0.0)
+        _earlyCount++;
+    [_firedEvents addObject:date];
+}
+
+@end
+
+static OFScheduledEvent *scheduleRecordedEvent(OFScheduler *scheduler, OFSchedulerTestRecorder *recorder, NSDate *date)
+{
+    // The recorder gets the event's own date, so that the fired dates can be checked against the schedule.
+    return [scheduler scheduleSelector:@selector(fire:) onObject:recorder withObject:date atDate:date];
+}
+
+@implementation OFSchedulerTests
+
+- (void)testPastEventsFireInOrder;
+{
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        OFSchedulerTestScheduler *scheduler = [[OFSchedulerTestScheduler alloc] init];
+        [scheduler setUsesTimerWheel:(pass == 1)];
+
+        OFSchedulerTestRecorder *recorder = [[[OFSchedulerTestRecorder alloc] init] autorelease];
+        NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+        NSMutableArray *pastDates = [NSMutableArray array];
+        for (unsigned int dateIndex = 0; dateIndex < 100; dateIndex++)
+            [pastDates addObject:[NSDate dateWithTimeIntervalSinceReferenceDate:now - 10.0 + dateIndex * 0.05]];
+        NSArray *futureDates = [NSArray arrayWithObjects:[NSDate dateWithTimeIntervalSinceReferenceDate:now + 1000.0], [NSDate dateWithTimeIntervalSinceReferenceDate:now + 1e8], [NSDate distantFuture], nil];
+
+        // Schedule in a scrambled order, aborting every tenth past event
+        NSMutableArray *expectedDates = [NSMutableArray array];
+        for (unsigned int dateIndex = 0; dateIndex < 100; dateIndex++) {
+            NSDate *date = [pastDates objectAtIndex:(dateIndex * 37) % 100];
+            OFScheduledEvent *event = scheduleRecordedEvent(scheduler, recorder, date);
+            if ((dateIndex % 10) == 3) {
+                should([scheduler abortEvent:event]);
+                shouldnt([scheduler abortEvent:event]);
+            } else
+                [expectedDates addObject:date];
+        }
+        for (NSDate *date in futureDates)
+            scheduleRecordedEvent(scheduler, recorder, date);
+        [expectedDates sortUsingSelector:@selector(compare:)];
+
+        [scheduler invokeScheduledEvents];
+        shouldBeEqual(recorder->_firedEvents, expectedDates);
+        should(recorder->_earlyCount == 0);
+
+        // The next event is the one 1000 seconds out.  The wheel only knows roughly when that is until it gets closer, but it mustn't say it's any later.
+        NSDate *dateOfFirstEvent = [scheduler dateOfFirstEvent];
+        should(dateOfFirstEvent != nil);
+        should([dateOfFirstEvent timeIntervalSinceReferenceDate] <= now + 1000.0 + 2e-3);
+        should([dateOfFirstEvent timeIntervalSinceReferenceDate] > now - 1.0);
+
+        [scheduler abortSchedule];
+        should([scheduler dateOfFirstEvent] == nil);
+        [scheduler release];
+    }
+}
+
+- (void)testTimerWheelMatchesSortedArray;
+{
+    OFRandomState *randomState = OFRandomStateCreate();
+
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        OFSchedulerTestScheduler *scheduler = [[OFSchedulerTestScheduler alloc] init];
+        [scheduler setUsesTimerWheel:(pass == 1)];
+
+        OFSchedulerTestRecorder *recorder = [[[OFSchedulerTestRecorder alloc] init] autorelease];
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+
+        // Events over the next quarter second, a third of them aborted again in a random order
+        NSMutableArray *events = [NSMutableArray array];
+        for (unsigned int eventIndex = 0; eventIndex < 3000; eventIndex++) {
+            NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:start + OFRandomNextStateDouble(randomState) * 0.25];
+            [events addObject:scheduleRecordedEvent(scheduler, recorder, date)];
+        }
+        NSMutableArray *expectedDates = [NSMutableArray array];
+        for (OFScheduledEvent *event in events) {
+            if (OFRandomNextStateN(randomState, 3) == 0)
+                should([scheduler abortEvent:event]);
+            else
+                [expectedDates addObject:[event date]];
+        }
+        [expectedDates sortUsingSelector:@selector(compare:)];
+
+        // Poll until everything has fired, checking that the scheduler never claims its first event is later than it is
+        while ([recorder->_firedEvents count] < [expectedDates count] && [NSDate timeIntervalSinceReferenceDate] - start < 5.0) {
+            NSDate *dateOfFirstEvent = [scheduler dateOfFirstEvent];
+            if (dateOfFirstEvent) {
+                NSDate *expectedFirstDate = [expectedDates objectAtIndex:[recorder->_firedEvents count]];
+                should([dateOfFirstEvent timeIntervalSinceDate:expectedFirstDate] <= 1.001e-3);
+            }
+            [scheduler invokeScheduledEvents];
+            usleep(500);
+        }
+
+        shouldBeEqual(recorder->_firedEvents, expectedDates);
+        should(recorder->_earlyCount == 0);
+        should([scheduler dateOfFirstEvent] == nil);
+        [scheduler release];
+    }
+
+    OFRandomStateDestroy(randomState);
+}
+
+- (void)testTerminationEventsFireInOrder;
+{
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        OFSchedulerTestScheduler *scheduler = [[OFSchedulerTestScheduler alloc] init];
+        [scheduler setUsesTimerWheel:(pass == 1)];
+
+        OFSchedulerTestRecorder *recorder = [[[OFSchedulerTestRecorder alloc] init] autorelease];
+        NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+        // Spread over enough of the future to land in different wheel buckets and levels, scheduled in a scrambled order; every third event is left behind at termination
+        NSMutableArray *expectedDates = [NSMutableArray array];
+        for (unsigned int dateIndex = 0; dateIndex < 60; dateIndex++) {
+            NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:now + 1.0 + ((dateIndex * 37) % 60) * 7.5];
+            BOOL fireOnTermination = (dateIndex % 3) != 0;
+            OFInvocation *invocation = [[OFInvocation alloc] initForObject:recorder selector:@selector(fire:) withObject:date];
+            OFScheduledEvent *event = [[OFScheduledEvent alloc] initWithInvocation:invocation atDate:date fireOnTermination:fireOnTermination];
+            [scheduler scheduleEvent:event];
+            [event release];
+            [invocation release];
+            if (fireOnTermination)
+                [expectedDates addObject:date];
+        }
+        [expectedDates sortUsingSelector:@selector(compare:)];
+
+        [scheduler controllerWillTerminate:nil];
+        shouldBeEqual(recorder->_firedEvents, expectedDates);
+        should([scheduler dateOfFirstEvent] != nil);
+
+        [scheduler abortSchedule];
+        [scheduler release];
+    }
+}
+
+- (void)testSwitchingBackends;
+{
+    OFSchedulerTestScheduler *scheduler = [[OFSchedulerTestScheduler alloc] init];
+    OFSchedulerTestRecorder *recorder = [[[OFSchedulerTestRecorder alloc] init] autorelease];
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    NSDate *firstDate = [NSDate dateWithTimeIntervalSinceReferenceDate:now - 2.0];
+    NSDate *secondDate = [NSDate dateWithTimeIntervalSinceReferenceDate:now - 1.0];
+    NSDate *futureDate = [NSDate dateWithTimeIntervalSinceReferenceDate:now + 60.0];
+    scheduleRecordedEvent(scheduler, recorder, secondDate);
+    OFScheduledEvent *futureEvent = scheduleRecordedEvent(scheduler, recorder, futureDate);
+
+    // Scheduled events move into the wheel, and back out again
+    [scheduler setUsesTimerWheel:YES];
+    scheduleRecordedEvent(scheduler, recorder, firstDate);
+    [scheduler setUsesTimerWheel:NO];
+    should([scheduler abortEvent:futureEvent]);
+
+    [scheduler invokeScheduledEvents];
+    shouldBeEqual(recorder->_firedEvents, ([NSArray arrayWithObjects:firstDate, secondDate, nil]));
+    should([scheduler dateOfFirstEvent] == nil);
+
+    [scheduler release];
+}
+
+- (void)testTimerWheelPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    OFRandomState *randomState = OFRandomStateCreate();
+    OFInvocation *invocation = [[OFInvocation alloc] initForObject:self selector:@selector(description)];
+
+    // Timeouts: most are aborted (in no particular order) long before they would fire.  Run with a growing number of events outstanding.
+    for (NSUInteger outstandingCount = 1000; outstandingCount <= 100000; outstandingCount *= 10) {
+        for (unsigned int pass = 0; pass < 2; pass++) {
+            BOOL usesTimerWheel = (pass == 1);
+            OFSchedulerTestScheduler *scheduler = [[OFSchedulerTestScheduler alloc] init];
+            [scheduler setUsesTimerWheel:usesTimerWheel];
+
+            NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+            NSUInteger eventCount = MAX(outstandingCount * 2, (NSUInteger)200000);
+            NSMutableArray *events = [[NSMutableArray alloc] initWithCapacity:eventCount];
+            for (NSUInteger eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+                NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:now + 1.0 + OFRandomNextStateDouble(randomState) * 60.0];
+                OFScheduledEvent *event = [[OFScheduledEvent alloc] initWithInvocation:invocation atDate:date];
+                [events addObject:event];
+                [event release];
+                [date release];
+            }
+
+            NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+            NSUInteger operationCount = 0;
+            for (NSUInteger eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+                [scheduler scheduleEvent:[events objectAtIndex:eventIndex]];
+                operationCount++;
+
+                // Once enough are outstanding, abort a random one of the outstanding events for each new one (but leave some to time out)
+                if (eventIndex >= outstandingCount && (eventIndex % 10) != 0) {
+                    NSUInteger abortIndex = eventIndex - outstandingCount + OFRandomNextStateN(randomState, (unsigned int)outstandingCount);
+                    [scheduler abortEvent:[events objectAtIndex:abortIndex]];
+                    operationCount++;
+                }
+                if ((eventIndex % 1000) == 0) {
+                    [scheduler dateOfFirstEvent];
+                    [scheduler invokeScheduledEvents];
+                }
+            }
+            NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+
+            [scheduler abortSchedule];
+            [scheduler release];
+            [events release];
+
+            NSLog(@"%@, %7lu outstanding: %9.0f schedule/abort operations/s", usesTimerWheel ? @"timer wheel " : @"sorted array", (unsigned long)outstandingCount, operationCount / elapsed);
+        }
+    }
+
+    [invocation release];
+    OFRandomStateDestroy(randomState);
+}
+
+@end
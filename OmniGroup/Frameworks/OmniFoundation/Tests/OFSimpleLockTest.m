@@ -25,6 +25,7 @@ int main(int argc, char *argv[])
     pthread_t           thread1, thread2;
     
     OFSimpleLockInit(&lock);
+    OFSimpleLockSetName(&lock, "OFSimpleLockTest");
     
     // Some really simple tests
     locked = OFSimpleLockTry(&lock);
@@ -49,7 +50,12 @@ int main(int argc, char *argv[])
     
     if (count != 2 * TEST_LIMIT)
         FAIL("Wrong count");
-        
+    
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+    OFSimpleLockDumpStatistics(stderr);
+#endif
+    OFSimpleLockFree(&lock);
+    
     return 0;
 }
 
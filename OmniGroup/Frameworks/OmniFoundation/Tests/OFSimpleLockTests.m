@@ -0,0 +1,99 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFSimpleLock.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+@interface OFSimpleLockTests : OFTestCase
+@end
+
+// The same total number of short critical sections, split over more and more contending threads.  A little work outside the lock keeps it from being a pure ping-pong of the lock's cache line.
+
+#define CONTENTION_OPERATION_COUNT (20000000)
+#define CONTENTION_MAXIMUM_THREAD_COUNT (32)
+
+typedef struct {
+    OFSimpleLockType simpleLock;
+    pthread_mutex_t mutex;
+    unsigned int operationCount;
+    unsigned int count;
+    volatile unsigned int outside;
+} OFSimpleLockTestShared;
+
+static void *simpleLockContentionThread(void *context)
+{
+    OFSimpleLockTestShared *shared = (OFSimpleLockTestShared *)context;
+
+    for (unsigned int operationIndex = 0; operationIndex < shared->operationCount; operationIndex++) {
+        OFSimpleLock(&shared->simpleLock);
+        shared->count++;
+        OFSimpleUnlock(&shared->simpleLock);
+        for (unsigned int outsideIndex = 0; outsideIndex < 20; outsideIndex++)
+            shared->outside++;
+    }
+
+    return NULL;
+}
+
+static void *mutexContentionThread(void *context)
+{
+    OFSimpleLockTestShared *shared = (OFSimpleLockTestShared *)context;
+
+    for (unsigned int operationIndex = 0; operationIndex < shared->operationCount; operationIndex++) {
+        pthread_mutex_lock(&shared->mutex);
+        shared->count++;
+        pthread_mutex_unlock(&shared->mutex);
+        for (unsigned int outsideIndex = 0; outsideIndex < 20; outsideIndex++)
+            shared->outside++;
+    }
+
+    return NULL;
+}
+
+@implementation OFSimpleLockTests
+
+- (void)testContentionSweep;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    for (unsigned int threadCount = 1; threadCount <= CONTENTION_MAXIMUM_THREAD_COUNT; threadCount *= 2) {
+        OFSimpleLockTestShared shared;
+        memset(&shared, 0, sizeof(shared));
+        OFSimpleLockInit(&shared.simpleLock);
+        pthread_mutex_init(&shared.mutex, NULL);
+        shared.operationCount = CONTENTION_OPERATION_COUNT / threadCount;
+
+        char name[64];
+        snprintf(name, sizeof(name), "OFSimpleLock, %u threads", threadCount);
+        OFSimpleLockSetName(&shared.simpleLock, name);
+
+        NSTimeInterval simpleLockTime = OFTestRunThreads(threadCount, simpleLockContentionThread, &shared, 0);
+        should(shared.count == shared.operationCount * threadCount);
+
+        shared.count = 0;
+        NSTimeInterval mutexTime = OFTestRunThreads(threadCount, mutexContentionThread, &shared, 0);
+        should(shared.count == shared.operationCount * threadCount);
+
+        NSLog(@"%2u threads: OFSimpleLock %6.2f M/s, pthread_mutex %6.2f M/s", threadCount, shared.count / simpleLockTime * 1e-6, shared.count / mutexTime * 1e-6);
+
+#ifdef OF_SIMPLE_LOCK_STATISTICS
+        OFSimpleLockDumpStatistics(stderr);
+#endif
+        OFSimpleLockFree(&shared.simpleLock);
+        pthread_mutex_destroy(&shared.mutex);
+    }
+}
+
+@end
@@ -11,6 +11,7 @@
 #import <SenTestingKit/SenTestingKit.h>
 #import <OmniFoundation/OFTransformStream.h>
 #import <OmniFoundation/OFCompressionStream.h>
+#import <OmniFoundation/OFXZUtilities.h>
 
 RCS_ID("$Id$");
 
@@ -98,6 +99,105 @@ RCS_ID("$Id$");
 @end
 
 
+// Decodes 'compressed' with OFXZDecompressToFdParallelAsync() into a scratch file and returns what ended up in it, or nil if the decoder reported an error.
+static NSData *decompressXZInParallel(NSData *compressed, NSUInteger maximumConcurrency, NSError **outError)
+{
+    char *path = strdup([[NSTemporaryDirectory() stringByAppendingPathComponent:@"OFStreamTransformTests.XXXXXX"] fileSystemRepresentation]);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        free(path);
+        return nil;
+    }
+    
+    dispatch_queue_t queue = dispatch_queue_create("com.omnigroup.OmniFoundation.OFStreamTransformTests", NULL);
+    dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+    NSError * __block decompressionError = nil;
+    OFXZDecompressToFdParallelAsync(compressed, fd, maximumConcurrency, queue, ^(NSError *error){
+        decompressionError = [error retain];
+        dispatch_semaphore_signal(finished);
+    });
+    dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+    dispatch_release(finished);
+    dispatch_release(queue);
+    
+    NSData *result = nil;
+    if (!decompressionError)
+        result = [NSData dataWithContentsOfFile:[NSString stringWithUTF8String:path]];
+    unlink(path);
+    free(path);
+    
+    if (outError)
+        *outError = [decompressionError autorelease];
+    else
+        [decompressionError release];
+    return result;
+}
+
+// "xz --block-size=1024" output for 100 lines of text, which comes out as four blocks
+static const unsigned char multiBlockXZ[] = {
+    0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x04, 0xe6, 0xd6, 0xb4,
+    0x46, 0x03, 0xc0, 0x6f, 0x80, 0x08, 0x21, 0x01, 0x16, 0x00, 0x00,
+    0x00, 0x00, 0x47, 0xff, 0x88, 0x75, 0xe0, 0x03, 0xff, 0x00, 0x67,
+    0x5d, 0x00, 0x26, 0x1a, 0x49, 0xc6, 0x67, 0x41, 0x3b, 0x27, 0x86,
+    0x82, 0x9f, 0xe8, 0x93, 0x3c, 0x40, 0x2f, 0xd2, 0x89, 0x35, 0xd7,
+    0x93, 0x76, 0x8d, 0x13, 0x69, 0x37, 0xfa, 0x3e, 0x30, 0x15, 0x84,
+    0x10, 0x45, 0x03, 0x2f, 0x46, 0x81, 0xad, 0x30, 0x7a, 0x7e, 0x2e,
+    0xb8, 0x5d, 0xbe, 0xc4, 0x04, 0x18, 0x40, 0x3b, 0x78, 0x70, 0xac,
+    0xcb, 0x09, 0xc8, 0x81, 0xff, 0x33, 0x7d, 0x78, 0x7e, 0x68, 0xd7,
+    0x79, 0x2d, 0xdc, 0xe4, 0x5e, 0xbc, 0x52, 0xa9, 0xbb, 0xf2, 0x9b,
+    0x88, 0xf6, 0x69, 0x05, 0x68, 0x3f, 0x43, 0x70, 0x32, 0x89, 0x9d,
+    0x2b, 0x9c, 0x06, 0xdd, 0xad, 0xd8, 0x53, 0xfa, 0x82, 0xa4, 0xad,
+    0xc8, 0x66, 0x39, 0x74, 0x28, 0x00, 0x00, 0x00, 0x80, 0xad, 0xc4,
+    0xba, 0xf9, 0x5f, 0xf6, 0xa7, 0x03, 0xc0, 0x6d, 0x80, 0x08, 0x21,
+    0x01, 0x16, 0x00, 0x00, 0x00, 0x00, 0x7a, 0x2f, 0x7d, 0x71, 0xe0,
+    0x03, 0xff, 0x00, 0x65, 0x5d, 0x00, 0x3a, 0x19, 0x4b, 0x78, 0x10,
+    0xc1, 0xcd, 0x47, 0x51, 0x57, 0xbe, 0x40, 0xb0, 0xac, 0xfc, 0x04,
+    0xd4, 0x36, 0x4e, 0xb2, 0x75, 0x9b, 0x1a, 0x92, 0x82, 0xc6, 0x62,
+    0x97, 0x7d, 0x7d, 0xc9, 0xfc, 0xc8, 0x3b, 0xa3, 0xee, 0x7a, 0xeb,
+    0x98, 0x88, 0x11, 0x28, 0x71, 0x92, 0x68, 0x4e, 0xa3, 0x14, 0xa0,
+    0x3e, 0x76, 0xd5, 0x14, 0x81, 0x47, 0xe1, 0xe0, 0xcc, 0x03, 0x58,
+    0xad, 0xe9, 0xe5, 0xfd, 0x0b, 0x32, 0xd1, 0x82, 0x03, 0xe3, 0x6f,
+    0x6b, 0x6c, 0x4e, 0x9e, 0x15, 0x8b, 0xad, 0x8d, 0xbc, 0xf5, 0x7f,
+    0x53, 0xa7, 0x59, 0x5b, 0x43, 0x41, 0x60, 0xd6, 0xf6, 0x60, 0x92,
+    0xe5, 0xe6, 0xfb, 0x67, 0xc0, 0x6b, 0xe6, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x9e, 0xcc, 0x87, 0xcc, 0x8f, 0x51, 0x19, 0x53, 0x03, 0xc0,
+    0x6b, 0x80, 0x08, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x00, 0x3d,
+    0x5f, 0x63, 0x7c, 0xe0, 0x03, 0xff, 0x00, 0x63, 0x5d, 0x00, 0x34,
+    0x9c, 0x89, 0xbd, 0x69, 0x99, 0x84, 0xc9, 0x11, 0x18, 0x60, 0xa0,
+    0xa7, 0x7e, 0xec, 0x00, 0xa2, 0xf6, 0xc7, 0xa8, 0x7b, 0x5f, 0x62,
+    0x46, 0x8a, 0xbf, 0x55, 0x75, 0xbd, 0x7f, 0x92, 0x43, 0x5b, 0xe8,
+    0x12, 0x08, 0x85, 0x36, 0xfd, 0xe6, 0x80, 0xa0, 0x3e, 0x62, 0x74,
+    0x98, 0x3b, 0x02, 0x13, 0xcd, 0x37, 0x1b, 0x9f, 0xd8, 0x75, 0xa0,
+    0x17, 0xb5, 0x7c, 0x0c, 0xfb, 0x8c, 0xc0, 0x29, 0xe2, 0x6e, 0x32,
+    0x7b, 0xac, 0x5c, 0xff, 0xd7, 0xb7, 0xd5, 0xa7, 0xf7, 0x31, 0x29,
+    0x7d, 0x75, 0x8f, 0x18, 0xaf, 0x55, 0x92, 0xb5, 0x8f, 0xea, 0x0d,
+    0x85, 0x5f, 0x47, 0x95, 0x38, 0xe0, 0x59, 0x27, 0x0e, 0x98, 0x00,
+    0x00, 0x8d, 0xe2, 0x58, 0xf1, 0xb1, 0x35, 0x76, 0xf9, 0x03, 0xc0,
+    0x68, 0x96, 0x07, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x00, 0x69,
+    0xcd, 0xae, 0x91, 0xe0, 0x03, 0x95, 0x00, 0x60, 0x5d, 0x00, 0x37,
+    0x19, 0x40, 0x02, 0x7b, 0x50, 0x8f, 0xe0, 0xe1, 0x6a, 0xf8, 0x56,
+    0x84, 0xc6, 0xc5, 0xa0, 0x4d, 0xb7, 0x94, 0x06, 0x4b, 0x63, 0x5c,
+    0xd0, 0xa7, 0x41, 0x88, 0xcb, 0xe9, 0x63, 0x3d, 0x38, 0xfe, 0x6e,
+    0x2b, 0x1e, 0x4e, 0x2b, 0xfb, 0xb3, 0x7b, 0x28, 0xdd, 0x65, 0x5c,
+    0x2d, 0x16, 0x39, 0x57, 0x06, 0xf1, 0x24, 0x15, 0xae, 0xdf, 0x29,
+    0x0c, 0x3a, 0x11, 0xff, 0xa2, 0x68, 0x28, 0x3d, 0x40, 0x8c, 0x69,
+    0xd4, 0x89, 0xff, 0x5c, 0x34, 0x07, 0xee, 0x80, 0x71, 0xbb, 0x6c,
+    0x6b, 0x79, 0x02, 0x9c, 0xaf, 0x64, 0xb3, 0xdb, 0x69, 0x27, 0x39,
+    0x8f, 0x9f, 0x3d, 0x4c, 0x6d, 0xb1, 0x00, 0x00, 0x27, 0xfe, 0xd3,
+    0x4a, 0x7f, 0x0d, 0xb1, 0x3d, 0x00, 0x04, 0x87, 0x01, 0x80, 0x08,
+    0x85, 0x01, 0x80, 0x08, 0x83, 0x01, 0x80, 0x08, 0x80, 0x01, 0x96,
+    0x07, 0x00, 0x00, 0x7c, 0xbe, 0x41, 0x79, 0x09, 0xf4, 0x62, 0xe6,
+    0x05, 0x00, 0x00, 0x00, 0x00, 0x04, 0x59, 0x5a
+};
+
+static NSData *multiBlockXZText(void)
+{
+    NSMutableData *text = [NSMutableData data];
+    for (unsigned int line = 0; line < 100; line++)
+        [text appendData:[[NSString stringWithFormat:@"Line %u of some fairly repetitive text.\n", line] dataUsingEncoding:NSASCIIStringEncoding]];
+    return text;
+}
+
 @implementation OFStreamTransformTests
 
 - (void)testNullTransform
@@ -184,5 +284,100 @@ RCS_ID("$Id$");
     [self testInput:noncompressedData output:compressedData transform:[[OFBzip2CompressTransform alloc] init] description:@"OFBzip2CompressTransform"];
 }
 
-@end
+- (void)testSmallXZ
+{
+    // "xz --check=crc32" and "xz --check=crc64" output for the same text as testSmallBzip2
+    const unsigned char c32[] = {
+        0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x01, 0x69, 0x22, 0xde,
+        0x36, 0x02, 0x00, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x74, 0x2f,
+        0xe5, 0xa3, 0xe0, 0x00, 0x33, 0x00, 0x31, 0x5d, 0x00, 0x2a, 0x1a,
+        0x09, 0x27, 0x64, 0x1c, 0x87, 0x8a, 0x4f, 0xc9, 0xa1, 0x22, 0x85,
+        0x60, 0x1a, 0xbd, 0xb6, 0xc0, 0x4f, 0xd4, 0x11, 0x67, 0x03, 0x52,
+        0x84, 0xa3, 0xb4, 0x8c, 0xa2, 0x0b, 0x74, 0x67, 0xd9, 0xf8, 0x9f,
+        0x12, 0x76, 0x0d, 0x1b, 0xdf, 0x67, 0xf5, 0x90, 0xbb, 0x10, 0xed,
+        0x25, 0xac, 0xe0, 0x00, 0x00, 0x00, 0x00, 0x72, 0x2d, 0x4e, 0x98,
+        0x00, 0x01, 0x49, 0x34, 0xd2, 0xb5, 0x89, 0x20, 0x90, 0x42, 0x99,
+        0x0d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x59, 0x5a
+    };
+    const unsigned char c64[] = {
+        0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x04, 0xe6, 0xd6, 0xb4,
+        0x46, 0x02, 0x00, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x74, 0x2f,
+        0xe5, 0xa3, 0xe0, 0x00, 0x33, 0x00, 0x31, 0x5d, 0x00, 0x2a, 0x1a,
+        0x09, 0x27, 0x64, 0x1c, 0x87, 0x8a, 0x4f, 0xc9, 0xa1, 0x22, 0x85,
+        0x60, 0x1a, 0xbd, 0xb6, 0xc0, 0x4f, 0xd4, 0x11, 0x67, 0x03, 0x52,
+        0x84, 0xa3, 0xb4, 0x8c, 0xa2, 0x0b, 0x74, 0x67, 0xd9, 0xf8, 0x9f,
+        0x12, 0x76, 0x0d, 0x1b, 0xdf, 0x67, 0xf5, 0x90, 0xbb, 0x10, 0xed,
+        0x25, 0xac, 0xe0, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x56, 0x37, 0xe4,
+        0x43, 0x73, 0x4a, 0xc5, 0x00, 0x01, 0x4d, 0x34, 0xd6, 0x70, 0xe5,
+        0x44, 0x1f, 0xb6, 0xf3, 0x7d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x04,
+        0x59, 0x5a
+    };
+    const char *u = "This is a longer piece of text, but not much longer.";
+    NSData *noncompressedData = [NSData dataWithBytesNoCopy:(void *)u length:strlen(u) freeWhenDone:NO];
+    
+    [self testInput:[NSData dataWithBytesNoCopy:(void *)c32 length:sizeof(c32) freeWhenDone:NO] output:noncompressedData transform:[[[OFXZDecompressTransform alloc] init] autorelease] description:@"OFXZDecompressTransform (CRC32)"];
+    [self testInput:[NSData dataWithBytesNoCopy:(void *)c64 length:sizeof(c64) freeWhenDone:NO] output:noncompressedData transform:[[[OFXZDecompressTransform alloc] init] autorelease] description:@"OFXZDecompressTransform (CRC64)"];
+    
+    // A truncated stream has to end in an error, not a short read
+    NSInputStream *ts = [[NSInputStream inputStreamWithData:[NSData dataWithBytesNoCopy:(void *)c32 length:sizeof(c32) - 8 freeWhenDone:NO]] inputStreamByDecompressingXZ];
+    [ts open];
+    for(;;) {
+        uint8_t buf[12];
+        if ([ts read:buf maxLength:sizeof(buf)] <= 0 || [ts streamStatus] != NSStreamStatusOpen)
+            break;
+    }
+    STAssertTrue([ts streamStatus] == NSStreamStatusError, @"");
+}
 
+- (void)testGzipRoundTrip
+{
+    NSMutableData *original = [NSMutableData data];
+    for (unsigned int line = 0; line < 2000; line++)
+        [original appendData:[[NSString stringWithFormat:@"Line %u of some fairly repetitive text.\n", line] dataUsingEncoding:NSASCIIStringEncoding]];
+    
+    NSInputStream *compressing = [[[OFInputTransformStream alloc] initWithStream:[NSInputStream inputStreamWithData:original] transform:[[[OFGzipCompressTransform alloc] init] autorelease]] autorelease];
+    NSInputStream *ts = [compressing inputStreamByDecompressingGzip];
+    
+    NSMutableData *o = [NSMutableData data];
+    [ts open];
+    for(;;) {
+        uint8_t buf[1000];
+        int r = [ts read:buf maxLength:sizeof(buf)];
+        [o appendBytes:buf length:r];
+        if ([ts streamStatus] != NSStreamStatusOpen)
+            break;
+    }
+    
+    STAssertTrue([ts streamStatus] == NSStreamStatusAtEnd, @"");
+    STAssertEqualObjects(o, original, @"");
+}
+
+- (void)testParallelXZMultipleBlocks
+{
+    NSData *compressed = [NSData dataWithBytesNoCopy:(void *)multiBlockXZ length:sizeof(multiBlockXZ) freeWhenDone:NO];
+    NSData *expected = multiBlockXZText();
+    
+    // One decoder taking the blocks in turn, fewer decoders than blocks, and one per processor
+    NSUInteger concurrencies[] = {1, 3, 0};
+    for (unsigned int concurrencyIndex = 0; concurrencyIndex < sizeof(concurrencies) / sizeof(*concurrencies); concurrencyIndex++) {
+        NSError *error = nil;
+        NSData *decompressed = decompressXZInParallel(compressed, concurrencies[concurrencyIndex], &error);
+        STAssertNil(error, @"maximumConcurrency %lu", (unsigned long)concurrencies[concurrencyIndex]);
+        STAssertEqualObjects(decompressed, expected, @"maximumConcurrency %lu", (unsigned long)concurrencies[concurrencyIndex]);
+    }
+}
+
+- (void)testParallelXZCorruptBlock
+{
+    // Damage the compressed data of the second block; its decoder has to notice, whichever order the blocks finish in
+    NSMutableData *compressed = [NSMutableData dataWithBytes:multiBlockXZ length:sizeof(multiBlockXZ)];
+    ((unsigned char *)[compressed mutableBytes])[184] ^= 0x55;
+    
+    NSError *error = nil;
+    NSData *decompressed = decompressXZInParallel(compressed, 0, &error);
+    STAssertNil(decompressed, @"");
+    STAssertEqualObjects([error domain], OFErrorDomain, @"");
+    STAssertEquals([error code], (NSInteger)OFUnableToDecompressData, @"");
+}
+
+@end
@@ -37,3 +37,5 @@ typedef BOOL (^OFDiffFilesPathFilter)(NSString *relativePath);
 extern BOOL OFSameFiles(SenTestCase *testCase, NSString *path1, NSString *path2, OFDiffFilesPathFilter pathFilter); // query, not required
 extern void OFDiffFiles(SenTestCase *testCase, NSString *path1, NSString *path2, OFDiffFilesPathFilter pathFilter); // fails if the files aren't the same
 
+// Runs function on threadCount new threads at once and returns the wall clock time until the last one finishes.  Thread i gets contexts + i * contextStride as its argument; pass a stride of 0 to give them all the same context.
+extern NSTimeInterval OFTestRunThreads(unsigned int threadCount, void *(*function)(void *), void *contexts, size_t contextStride);
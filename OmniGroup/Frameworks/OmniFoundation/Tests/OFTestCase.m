@@ -8,6 +8,7 @@
 #import "OFTestCase.h"
 
 #import <OmniBase/rcsid.h>
+#import <pthread.h>
 
 // This import isn't needed for this file, but serves as a test of whether the headers are properly #ifdef in OmniFoundation.h
 #import <OmniFoundation/OmniFoundation.h>
@@ -316,3 +317,17 @@ void OFDiffFiles(SenTestCase *self, NSString *path1, NSString *path2, OFDiffFile
     OFCheckFilesSame(self, path1, path2, YES/*requireSame*/, pathFilter);
 }
 
+NSTimeInterval OFTestRunThreads(unsigned int threadCount, void *(*function)(void *), void *contexts, size_t contextStride)
+{
+    pthread_t *threads = calloc(threadCount, sizeof(*threads));
+    
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+        pthread_create(&threads[threadIndex], NULL, function, (char *)contexts + threadIndex * contextStride);
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+        pthread_join(threads[threadIndex], NULL);
+    NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    free(threads);
+    return elapsed;
+}
@@ -10,14 +10,26 @@
 
 #import <OmniFoundation/OFStringDecoder.h>
 #import <OmniFoundation/OFXMLDocument.h>
+#import <OmniFoundation/OFXMLDocument-BinaryFormat.h>
+#import <OmniFoundation/OFXMLComment.h>
+#import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/OFXMLUnparsedElement.h>
 #import <OmniFoundation/OFXMLElement.h>
+#import <OmniFoundation/OFXMLLazyElement.h>
+#import <OmniFoundation/OFXMLCursor.h>
+#import <OmniFoundation/OFXMLParser.h>
 #import <OmniFoundation/OFXMLWhitespaceBehavior.h>
 #import <OmniFoundation/NSData-OFExtensions.h>
 #import <OmniFoundation/NSFileManager-OFExtensions.h>
 #import <OmniFoundation/NSObject-OFExtensions.h>
 #import <OmniFoundation/NSString-OFExtensions.h>
+#import <OmniFoundation/CFData-OFCompression.h>
+#import <OmniFoundation/OFXMLBuffer.h>
 
 #import <OmniBase/OmniBase.h>
+#import <mach/mach.h>
+#import <fcntl.h>
+#import <unistd.h>
 
 RCS_ID("$Id$");
 
@@ -472,6 +484,675 @@ static OFXMLWhitespaceBehavior *_OOXMLWhitespaceBehavior(void)
     shouldBeEqual([[rootElement children] lastObject], @"foo<wonga>blegga");
 }
 
+static NSString * const ArenaTestInput =
+    @"<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>\n"
+    @"<?my-pi foozle?>\n"
+    @"<root-element xmlns=\"http://www.example.com/default\" xmlns:x=\"http://www.example.com/x\" version=\"1\">\n"
+    @"  <s attr=\"a &amp; b\" x:other=\"&#x10000; &lt;\">a &amp; b<![CDATA[<wonga>]]>blegga</s>\n"
+    @"  <empty/>\n"
+    @"  <nested><inner>café &quot;quoted&quot;</inner>  <inner>line\r\nbreak</inner></nested>\n"
+    @"</root-element>\n";
+
+// Loading into an arena has to produce the same element tree, and write the same bytes, as the normal path.
+- (void)testArenaLoadingMatchesElementTree;
+{
+    NSData *inputData = [ArenaTestInput dataUsingEncoding:NSUTF8StringEncoding];
+    NSError *error = nil;
+
+    OFXMLDocument *elementDoc = [[[OFXMLDocument alloc] initWithData:inputData whitespaceBehavior:nil error:&error] autorelease];
+    OBShouldNotError(elementDoc != nil);
+
+    OFXMLDocument *arenaDoc = [[[OFXMLDocument alloc] initWithData:inputData whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:OFXMLDocumentLoadIntoArena error:&error] autorelease];
+    OBShouldNotError(arenaDoc != nil);
+    should([arenaDoc arenaRootElement] != NULL);
+    should([arenaDoc processingInstructionCount] == 1);
+
+    NSData *elementOutput = [elementDoc xmlData:&error];
+    OBShouldNotError(elementOutput != nil);
+    NSData *arenaOutput = [arenaDoc xmlData:&error];
+    OBShouldNotError(arenaOutput != nil);
+    shouldBeEqual(arenaOutput, elementOutput);
+
+    NSData *arenaFragment = [arenaDoc xmlDataAsFragment:&error];
+    OBShouldNotError(arenaFragment != nil);
+    shouldBeEqual(arenaFragment, [elementDoc xmlDataAsFragment:NULL]);
+
+    // Asking for the element tree builds it and retires the arena.
+    shouldBeEqual([arenaDoc rootElement], [elementDoc rootElement]);
+    should([arenaDoc arenaRootElement] == NULL);
+    shouldBeEqual([arenaDoc xmlData:NULL], elementOutput);
+}
+
+- (void)testArenaStringConcat;
+{
+    NSData *xmlData = [@"<root>a &amp; b<![CDATA[<wonga>]]>blegga</root>" dataUsingEncoding:NSUTF8StringEncoding];
+    NSError *error = nil;
+
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:xmlData whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:OFXMLDocumentLoadIntoArena error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+
+    const OFXMLArenaElement *root = [doc arenaRootElement];
+    should(root->childCount == 1);
+    should(root->children[0].element == NULL);
+
+    NSString *text = OFXMLArenaStringCopyString(root->children[0].text);
+    shouldBeEqual(text, @"a & b<wonga>blegga");
+    [text release];
+}
+
+- (void)testArenaReadingFileWithWhitespaceHandling;
+{
+    NSString *inputFile = [[self bundle] pathForResource:@"0000-CreateDocument" ofType:@"xmloutline"];
+    should(inputFile != nil);
+
+    NSData *inputData = [[[NSData alloc] initWithContentsOfFile:inputFile] autorelease];
+    NSError *error = nil;
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:inputData whitespaceBehavior:_OOXMLWhitespaceBehavior() defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:OFXMLDocumentLoadIntoArena error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+
+    NSData *outputData = [doc xmlData:&error];
+    OBShouldNotError(outputData != nil);
+    shouldBeEqual(outputData, inputData);
+}
+
+static size_t _residentSize(void)
+{
+    struct task_basic_info info;
+    mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+}
+
+static NSData *_generatedDocument(NSUInteger targetLength)
+{
+    NSMutableData *data = [NSMutableData data];
+    [data appendBytes:"<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>\n<outline>\n" length:strlen("<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>\n<outline>\n")];
+
+    NSUInteger itemIndex = 0;
+    while ([data length] < targetLength) {
+        NSString *item = [NSString stringWithFormat:@"  <item id=\"i%lu\" rank=\"%lu\" expanded=\"yes\"><values><text>Item %lu &amp; friends</text><note>Some note text for item %lu</note></values></item>\n", itemIndex, itemIndex % 17, itemIndex, itemIndex];
+        [data appendData:[item dataUsingEncoding:NSUTF8StringEncoding]];
+        itemIndex++;
+    }
+    [data appendBytes:"</outline>\n" length:strlen("</outline>\n")];
+    return data;
+}
+
+static void _timeLoading(NSData *data, OFXMLDocumentLoadOptions options, NSString *label)
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+    size_t residentBefore = _residentSize();
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    OFXMLDocument *doc = [[OFXMLDocument alloc] initWithData:data whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:options error:NULL];
+    NSTimeInterval parseTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    size_t residentAfter = _residentSize();
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    [doc release];
+    [pool drain];
+    NSTimeInterval teardownTime = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    NSLog(@"%@: %lu MB parsed in %.3fs, torn down in %.3fs, resident size grew %lu MB", label, [data length] >> 20, parseTime, teardownTime, (residentAfter - residentBefore) >> 20);
+}
+
+- (void)testArenaLoadingPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    // Set OFXMLDocumentTestsMaximumMegabytes to try bigger documents.
+    NSUInteger maximumMegabytes = 10;
+    const char *maximumEnv = getenv("OFXMLDocumentTestsMaximumMegabytes");
+    if (maximumEnv)
+        maximumMegabytes = strtoul(maximumEnv, NULL, 0);
+
+    for (NSUInteger megabytes = 10; megabytes <= maximumMegabytes; megabytes *= 10) {
+        NSData *data = _generatedDocument(megabytes << 20);
+        _timeLoading(data, OFXMLDocumentLoadOptionsNone, @"OFXMLElement tree");
+        _timeLoading(data, OFXMLDocumentLoadIntoArena, @"Arena tree");
+    }
+}
+
+static OFXMLDocument *_streamingTestDocument(CFStringEncoding encoding)
+{
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithRootElementName:DTDName dtdSystemID:dtdURL dtdPublicID:@"-//omnigroup.com//XML Document Test//EN" whitespaceBehavior:IgnoreAllWhitespace() stringEncoding:encoding error:NULL] autorelease];
+
+    // Enough to cross the default flush threshold several times, with multi-byte characters landing on every chunk boundary sooner or later.
+    for (NSUInteger itemIndex = 0; itemIndex < 20000; itemIndex++) {
+        [doc pushElement:@"item"];
+        {
+            [doc setAttribute:@"id" value:[NSString stringWithFormat:@"i%lu", itemIndex]];
+            [doc appendString:[NSString stringWithFormat:@"caf\u00e9 #%lu & \u2026 <\U0001D11E>", itemIndex]];
+        }
+        [doc popElement];
+    }
+    return doc;
+}
+
+static NSData *_streamedData(OFXMLDocument *doc, OFXMLBufferOutputOptions options, NSError **outError)
+{
+    NSOutputStream *stream = [NSOutputStream outputStreamToMemory];
+    [stream open];
+    BOOL success = [doc writeToOutputStream:stream options:options error:outError];
+    [stream close];
+    return success ? [stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey] : nil;
+}
+
+- (void)testStreamingMatchesXMLData;
+{
+    CFStringEncoding encodings[] = {kCFStringEncodingUTF8, kCFStringEncodingUTF16, kCFStringEncodingISOLatin1};
+    for (unsigned int encodingIndex = 0; encodingIndex < sizeof(encodings)/sizeof(*encodings); encodingIndex++) {
+        NSError *error = nil;
+        OFXMLDocument *doc = _streamingTestDocument(encodings[encodingIndex]);
+
+        NSData *expected = [doc xmlData:&error];
+        OBShouldNotError(expected != nil);
+
+        NSData *streamed = _streamedData(doc, OFXMLBufferOutputOptionsNone, &error);
+        OBShouldNotError(streamed != nil);
+        shouldBeEqual(streamed, expected);
+    }
+}
+
+- (void)testStreamingWithGzip;
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = _streamingTestDocument(kCFStringEncodingUTF8);
+
+    NSData *expected = [doc xmlData:&error];
+    OBShouldNotError(expected != nil);
+
+    NSData *compressed = _streamedData(doc, OFXMLBufferOutputGzip, &error);
+    OBShouldNotError(compressed != nil);
+    should([compressed length] < [expected length]);
+
+    CFErrorRef decompressionError = NULL;
+    CFDataRef decompressed = OFDataCreateDecompressedData(kCFAllocatorDefault, (CFDataRef)compressed, &decompressionError);
+    should(decompressed != NULL);
+    if (decompressed) {
+        shouldBeEqual((NSData *)decompressed, expected);
+        CFRelease(decompressed);
+    }
+    if (decompressionError)
+        CFRelease(decompressionError);
+}
+
+// Elements and frozen elements write straight into a streaming buffer; a tiny threshold forces a flush (and a UTF-8 boundary check) on nearly every append.
+- (void)testStreamingElementsToFileDescriptor;
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = _streamingTestDocument(kCFStringEncodingUTF16);
+    OFXMLElement *element = [doc rootElement];
+    NSObject *frozenElement = [[element copyFrozenElement] autorelease];
+
+    OFXMLBuffer expectedBuffer = OFXMLBufferCreate();
+    OBShouldNotError([element appendXML:expectedBuffer withParentWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve document:doc level:0 error:&error]);
+    OBShouldNotError([(id)frozenElement appendXML:expectedBuffer withParentWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve document:doc level:0 error:&error]);
+    NSData *expected = [NSMakeCollectable(OFXMLBufferCopyData(expectedBuffer, kCFStringEncodingUTF16)) autorelease];
+    OFXMLBufferDestroy(expectedBuffer);
+
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    int fd = open([path fileSystemRepresentation], O_WRONLY|O_CREAT|O_EXCL, 0600);
+    should(fd >= 0);
+
+    OFXMLBuffer streamingBuffer = OFXMLBufferCreateWithFileDescriptor(fd, kCFStringEncodingUTF16, OFXMLBufferOutputOptionsNone);
+    OFXMLBufferSetFlushThreshold(streamingBuffer, 7);
+    OBShouldNotError([element appendXML:streamingBuffer withParentWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve document:doc level:0 error:&error]);
+    OBShouldNotError([(id)frozenElement appendXML:streamingBuffer withParentWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve document:doc level:0 error:&error]);
+    OBShouldNotError(OFXMLBufferFinishOutput(streamingBuffer, &error));
+    OFXMLBufferDestroy(streamingBuffer);
+    close(fd);
+
+    shouldBeEqual([NSData dataWithContentsOfFile:path], expected);
+    unlink([path fileSystemRepresentation]);
+}
+
+- (void)testStreamingWriteToFile;
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = _streamingTestDocument(kCFStringEncodingUTF8);
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+
+    OBShouldNotError([doc writeToFile:path error:&error]);
+    shouldBeEqual([NSData dataWithContentsOfFile:path], [doc xmlData:NULL]);
+    unlink([path fileSystemRepresentation]);
+
+    NSString *missingDirectoryPath = [[path stringByAppendingPathComponent:@"missing"] stringByAppendingPathComponent:@"document.xml"];
+    shouldnt([doc writeToFile:missingDirectoryPath error:NULL]);
+
+    // Nothing is left behind when the write fails after the temporary file has been written; renaming a file over a directory fails.
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *blockedPath = [path stringByAppendingPathComponent:@"document.xml"];
+    OBShouldNotError([fileManager createDirectoryAtPath:blockedPath withIntermediateDirectories:YES attributes:nil error:&error]);
+    shouldnt([doc writeToFile:blockedPath error:NULL]);
+    shouldBeEqual([fileManager contentsOfDirectoryAtPath:path error:NULL], [NSArray arrayWithObject:@"document.xml"]);
+    [fileManager removeItemAtPath:path error:NULL];
+}
+
+static NSData *_parallelTestDocument(NSUInteger itemCount, NSString *doctype)
+{
+    NSMutableString *xml = [NSMutableString stringWithFormat:@"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n%@<?before-root a?>\n<outline xmlns=\"http://www.example.com/outline\" xmlns:x=\"http://www.example.com/x\">\n", doctype ? doctype : @""];
+    for (NSUInteger itemIndex = 0; itemIndex < itemCount; itemIndex++) {
+        [xml appendFormat:@"  <item id=\"i%lu\" x:rank=\"%lu &amp; up\"><!-- <fake> --><text>Item %lu &lt;café&gt;</text><?item-pi %lu?><![CDATA[</outline><x>]]>  <empty/></item>\n", itemIndex, itemIndex % 17, itemIndex, itemIndex];
+        if (itemIndex % 1000 == 0)
+            [xml appendString:@"  loose text between items\n"];
+    }
+    [xml appendString:@"</outline>\n<?after-root b?>\n"];
+    return [xml dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+static NSData *_loadedXMLData(NSData *input, OFXMLDocumentLoadOptions options)
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:input whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore options:options error:&error] autorelease];
+    if (!doc) {
+        NSLog(@"Error loading: %@", [error toPropertyList]);
+        return nil;
+    }
+    return [doc xmlData:NULL];
+}
+
+// A parallel load has to give the same document, whether the pieces get stitched into OFXMLElements or an arena.
+- (void)testParallelLoadingMatchesSerial;
+{
+    NSData *input = _parallelTestDocument(20000, nil);
+    NSData *expected = _loadedXMLData(input, OFXMLDocumentLoadOptionsNone);
+    should(expected != nil);
+
+    shouldBeEqual(_loadedXMLData(input, OFXMLDocumentLoadInParallel), expected);
+    shouldBeEqual(_loadedXMLData(input, OFXMLDocumentLoadInParallel|OFXMLDocumentLoadIntoArena), expected);
+
+    // Several pieces even on a machine with few processors, replayed to a raw target
+    OFXMLWhitespaceBehavior *whitespaceBehavior = [[[OFXMLWhitespaceBehavior alloc] init] autorelease];
+    OFXMLElement *serialRoot = nil;
+    for (NSUInteger concurrency = 1; concurrency <= 16; concurrency *= 2) {
+        OFXMLArenaTreeBuilder *builder = [[[OFXMLArenaTreeBuilder alloc] initWithSourceData:input] autorelease];
+        OFXMLParser *parser = [[[OFXMLParser alloc] initWithData:input whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore maximumConcurrency:concurrency target:builder error:NULL] autorelease];
+        should(parser != nil);
+
+        OFXMLElement *root = [OFXMLArenaElementCopyElement(builder.rootElement) autorelease];
+        if (concurrency == 1)
+            serialRoot = root;
+        else
+            shouldBeEqual(root, serialRoot);
+    }
+}
+
+// Documents that can't be split, or that turn out not to parse, go through the serial path and give its results.
+- (void)testParallelLoadingFallsBackToSerial;
+{
+    NSError *error = nil;
+
+    // An internal subset can declare entities used anywhere in the document.
+    NSData *withSubset = _parallelTestDocument(20000, @"<!DOCTYPE outline [ <!ENTITY thing \"a thing\"> ]>\n");
+    NSData *expected = _loadedXMLData(withSubset, OFXMLDocumentLoadOptionsNone);
+    should(expected != nil);
+    shouldBeEqual(_loadedXMLData(withSubset, OFXMLDocumentLoadInParallel), expected);
+
+    // A syntax error in a later piece still gets reported, with the line number from the whole document.
+    NSMutableData *broken = [[_parallelTestDocument(20000, nil) mutableCopy] autorelease];
+    NSRange itemRange = [[[[NSString alloc] initWithData:broken encoding:NSUTF8StringEncoding] autorelease] rangeOfString:@"<item id=\"i15000\""];
+    should(itemRange.location != NSNotFound);
+    [broken replaceBytesInRange:NSMakeRange(itemRange.location, 1) withBytes:"&" length:1];
+
+    OFXMLDocument *serialDoc = [[[OFXMLDocument alloc] initWithData:broken whitespaceBehavior:nil error:&error] autorelease];
+    should(serialDoc == nil);
+    NSError *serialError = error;
+    error = nil;
+    OFXMLDocument *parallelDoc = [[[OFXMLDocument alloc] initWithData:broken whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore options:OFXMLDocumentLoadInParallel error:&error] autorelease];
+    should(parallelDoc == nil);
+    shouldBeEqual([error localizedFailureReason], [serialError localizedFailureReason]);
+}
+
+- (void)testParallelLoadingPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    NSData *data = _generatedDocument(100 << 20);
+    OFXMLWhitespaceBehavior *whitespaceBehavior = [[[OFXMLWhitespaceBehavior alloc] init] autorelease];
+    NSTimeInterval serialTime = 0;
+
+    NSLog(@"%lu active processors", [[NSProcessInfo processInfo] activeProcessorCount]);
+    for (NSUInteger concurrency = 1; concurrency <= 16; concurrency *= 2) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        OFXMLArenaTreeBuilder *builder = [[OFXMLArenaTreeBuilder alloc] initWithSourceData:data];
+
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        OFXMLParser *parser = [[OFXMLParser alloc] initWithData:data whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore maximumConcurrency:concurrency target:builder error:NULL];
+        NSTimeInterval parseTime = [NSDate timeIntervalSinceReferenceDate] - start;
+        should(parser != nil);
+        should(builder.rootElement != NULL);
+
+        if (concurrency == 1)
+            serialTime = parseTime;
+        NSLog(@"%2lu threads: %lu MB parsed in %.3fs, %.2fx serial", concurrency, [data length] >> 20, parseTime, serialTime / parseTime);
+
+        [parser release];
+        [builder release];
+        [pool drain];
+    }
+}
+
+static NSString * const LazyTestInput =
+@"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+@"<outline xmlns=\"http://www.example.com/outline\" xmlns:x=\"http://www.example.com/x\">\n"
+@"  <head><title>Lazy  &amp; loaded</title></head>\n"
+@"  <section id='s1'>  <x:item x:rank = \"1\">café <b>bold</b> <i/> &lt;tail&gt;</x:item><![CDATA[a < b]]></section>\n"
+@"  <section id=\"s2\" xmlns:y=\"http://www.example.com/y\"><y:item><empty /></y:item></section>\n"
+@"</outline>\n";
+
+// Sections keep their whitespace, which the lazy items inside them have to inherit when they get loaded.
+static OFXMLWhitespaceBehavior *_lazyTestWhitespaceBehavior(void)
+{
+    OFXMLWhitespaceBehavior *whitespace = [[[OFXMLWhitespaceBehavior alloc] init] autorelease];
+    [whitespace setBehavior:OFXMLWhitespaceBehaviorTypePreserve forElementName:@"section"];
+    return whitespace;
+}
+
+static OFXMLDocument *_lazyTestDocument(NSData *input, NSUInteger lazyElementDepth, NSError **outError)
+{
+    return [[[OFXMLDocument alloc] initWithData:input whitespaceBehavior:_lazyTestWhitespaceBehavior() defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore options:OFXMLDocumentLoadOptionsNone lazyElementDepth:lazyElementDepth error:outError] autorelease];
+}
+
+- (void)testLazyLoadingMatchesEagerLoading;
+{
+    NSError *error = nil;
+    NSData *input = [LazyTestInput dataUsingEncoding:NSUTF8StringEncoding];
+    OFXMLDocument *eagerDoc = _lazyTestDocument(input, 0, &error);
+    OBShouldNotError(eagerDoc != nil);
+    NSString *eagerXML = [NSString stringWithData:[eagerDoc xmlData:NULL] encoding:NSUTF8StringEncoding];
+    should([eagerXML rangeOfString:@"<empty />"].location == NSNotFound);
+
+    for (NSUInteger lazyElementDepth = 1; lazyElementDepth <= 3; lazyElementDepth++) {
+        OFXMLDocument *lazyDoc = _lazyTestDocument(input, lazyElementDepth, &error);
+        OBShouldNotError(lazyDoc != nil);
+
+        // Only elements below the lazy depth are left as source ranges
+        OFXMLElement *section = [[lazyDoc rootElement] firstChildNamed:@"section"];
+        should([section isKindOfClass:[OFXMLLazyElement class]] == (lazyElementDepth == 1));
+        if (lazyElementDepth == 1)
+            shouldnt([(OFXMLLazyElement *)section isLoaded]);
+
+        // Untouched elements are written out just as they were read
+        NSData *lazyData = [lazyDoc xmlData:&error];
+        OBShouldNotError(lazyData != nil);
+        NSString *lazyXML = [NSString stringWithData:lazyData encoding:NSUTF8StringEncoding];
+        should([lazyXML rangeOfString:@"<empty />"].location != NSNotFound);
+        if (lazyElementDepth <= 2)
+            should([lazyXML rangeOfString:@"<x:item x:rank = \"1\">café <b>bold</b> <i/> &lt;tail&gt;</x:item>"].location != NSNotFound);
+
+        OFXMLDocument *reloadedDoc = _lazyTestDocument(lazyData, 0, &error);
+        OBShouldNotError(reloadedDoc != nil);
+        shouldBeEqual([reloadedDoc rootElement], [eagerDoc rootElement]);
+
+        // Looking inside loads, with the namespaces declared on the ancestors and the inherited whitespace behavior
+        OFXMLCursor *cursor = [lazyDoc cursor];
+        should([cursor openNextChildElementNamed:@"section"]);
+        shouldBeEqual([cursor attributeNamed:@"id"], @"s1");
+        if (lazyElementDepth == 1)
+            should([(OFXMLLazyElement *)section isLoaded]);
+        should([cursor openNextChildElementNamed:@"item"]);
+        shouldBeEqual([cursor attributeNamed:@"rank"], @"1");
+        shouldBeEqual([[cursor children] objectAtIndex:0], @"café ");
+
+        shouldBeEqual([lazyDoc rootElement], [eagerDoc rootElement]);
+        shouldBeEqual([_lazyTestDocument(input, lazyElementDepth, NULL) rootElement], [eagerDoc rootElement]); // Untouched on the other side of -isEqual:
+        shouldBeEqual([eagerDoc rootElement], [_lazyTestDocument(input, lazyElementDepth, NULL) rootElement]);
+
+        // Once loaded, changes are written like any other element's
+        [section setAttribute:@"id" string:@"changed"];
+        should([[NSString stringWithData:[lazyDoc xmlData:NULL] encoding:NSUTF8StringEncoding] rangeOfString:@"<section id=\"changed\">"].location != NSNotFound);
+    }
+
+    // Mapped from a file
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    OBShouldNotError([input writeToFile:path options:0 error:&error]);
+    OFXMLDocument *mappedDoc = [[[OFXMLDocument alloc] initWithContentsOfFile:path whitespaceBehavior:_lazyTestWhitespaceBehavior() lazyElementDepth:1 error:&error] autorelease];
+    OBShouldNotError(mappedDoc != nil);
+    should([[[mappedDoc rootElement] firstChildNamed:@"section"] isKindOfClass:[OFXMLLazyElement class]]);
+    shouldBeEqual([[mappedDoc rootElement] firstChildNamed:@"head"], [[eagerDoc rootElement] firstChildNamed:@"head"]);
+    unlink([path fileSystemRepresentation]);
+
+    should([[[OFXMLDocument alloc] initWithContentsOfFile:path whitespaceBehavior:nil lazyElementDepth:1 error:NULL] autorelease] == nil);
+}
+
+- (void)testLazyLoadingFallbacks;
+{
+    NSError *error = nil;
+
+    // The parser can't point into transcoded input, but lazy elements can hold the UTF-8 it converted.
+    NSData *latin1 = [@"<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n<outline><section id=\"s\">café <b/></section></outline>" dataUsingEncoding:NSISOLatin1StringEncoding];
+    OFXMLDocument *lazyDoc = _lazyTestDocument(latin1, 1, &error);
+    OBShouldNotError(lazyDoc != nil);
+    OFXMLElement *section = [[lazyDoc rootElement] firstChildNamed:@"section"];
+    should([section isKindOfClass:[OFXMLLazyElement class]]);
+    shouldBeEqual([section children], ([NSArray arrayWithObjects:@"café ", [[[OFXMLElement alloc] initWithName:@"b"] autorelease], nil]));
+
+    // Entities from an internal subset would be unknown when a piece is parsed on its own, so those documents load eagerly.
+    NSData *withSubset = [@"<?xml version=\"1.0\"?>\n<!DOCTYPE outline [ <!ENTITY thing \"a thing\"> ]>\n<outline><section>&thing;</section></outline>" dataUsingEncoding:NSUTF8StringEncoding];
+    lazyDoc = _lazyTestDocument(withSubset, 1, &error);
+    OBShouldNotError(lazyDoc != nil);
+    section = [[lazyDoc rootElement] firstChildNamed:@"section"];
+    shouldnt([section isKindOfClass:[OFXMLLazyElement class]]);
+    shouldBeEqual([section children], [NSArray arrayWithObject:@"a thing"]);
+}
+
+- (void)testLazyLoadingPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    NSError *error = nil;
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    OBShouldNotError([_generatedDocument(100 << 20) writeToFile:path options:0 error:&error]);
+
+    for (NSUInteger lazyElementDepth = 0; lazyElementDepth <= 1; lazyElementDepth++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+        size_t residentBefore = _residentSize();
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        OFXMLDocument *doc = [[OFXMLDocument alloc] initWithContentsOfFile:path whitespaceBehavior:nil lazyElementDepth:lazyElementDepth error:&error];
+        OBShouldNotError(doc != nil);
+
+        // Read the first few items, as if to show a preview
+        OFXMLCursor *cursor = [doc cursor];
+        for (NSUInteger itemIndex = 0; itemIndex < 10; itemIndex++) {
+            should([cursor openNextChildElementNamed:@"item"]);
+            should([cursor openNextChildElementNamed:@"values"]);
+            should([cursor openNextChildElementNamed:@"text"]);
+            [cursor closeElement];
+            [cursor closeElement];
+            [cursor closeElement];
+        }
+        NSTimeInterval loadTime = [NSDate timeIntervalSinceReferenceDate] - start;
+        size_t residentAfter = _residentSize();
+
+        NSLog(@"lazy element depth %lu: opened and read 10 items in %.3fs, resident size grew %lu MB", lazyElementDepth, loadTime, (residentAfter - residentBefore) >> 20);
+
+        [doc release];
+        [pool drain];
+    }
+
+    unlink([path fileSystemRepresentation]);
+}
+
+static OFXMLDocument *_binaryRoundTrip(OFXMLDocument *doc, OFXMLWhitespaceBehavior *whitespaceBehavior, OFXMLDocumentLoadOptions options)
+{
+    NSError *error = nil;
+    NSData *binaryData = [doc binaryData:&error];
+    if (!binaryData) {
+        NSLog(@"Error saving binary: %@", [error toPropertyList]);
+        return nil;
+    }
+    if (![OFXMLDocument isBinaryData:binaryData])
+        return nil;
+
+    OFXMLDocument *loadedDoc = [[[OFXMLDocument alloc] initWithBinaryData:binaryData whitespaceBehavior:whitespaceBehavior options:options error:&error] autorelease];
+    if (!loadedDoc)
+        NSLog(@"Error loading binary: %@", [error toPropertyList]);
+    return loadedDoc;
+}
+
+// Whatever goes through the binary format has to write the same XML afterwards.
+- (void)testBinaryFormatRoundTrip;
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:[ArenaTestInput dataUsingEncoding:NSUTF8StringEncoding] whitespaceBehavior:nil error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+
+    OFXMLQName *qname = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/default" name:@"raw"] autorelease];
+    NSData *rawData = [@"<raw kept=\"as is\">  <b>bytes</b></raw>" dataUsingEncoding:NSUTF8StringEncoding];
+    [[doc rootElement] appendChild:[[[OFXMLUnparsedElement alloc] initWithQName:qname identifier:@"raw-1" data:rawData] autorelease]];
+
+    OFXMLDocument *binaryDoc = _binaryRoundTrip(doc, nil, OFXMLDocumentLoadOptionsNone);
+    should(binaryDoc != nil);
+    shouldBeEqual([binaryDoc xmlData:NULL], [doc xmlData:NULL]);
+    should([binaryDoc processingInstructionCount] == 1);
+    shouldBeEqual([binaryDoc processingInstructionValueAtIndex:0], @"foozle");
+
+    OFXMLUnparsedElement *raw = [[[binaryDoc rootElement] children] lastObject];
+    should([raw isKindOfClass:[OFXMLUnparsedElement class]]);
+    shouldBeEqual(raw.identifier, @"raw-1");
+    shouldBeEqual(raw.data, rawData);
+
+    // The prolog, with a DTD
+    doc = [[[OFXMLDocument alloc] initWithRootElementName:DTDName dtdSystemID:dtdURL dtdPublicID:@"-//omnigroup.com//XML Document Test//EN" whitespaceBehavior:IgnoreAllWhitespace() stringEncoding:kCFStringEncodingUTF8 error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+    [doc appendElement:@"child" containingString:@"a < b"];
+    binaryDoc = _binaryRoundTrip(doc, IgnoreAllWhitespace(), OFXMLDocumentLoadOptionsNone);
+    should(binaryDoc != nil);
+    shouldBeEqual([binaryDoc xmlData:NULL], [doc xmlData:NULL]);
+    shouldBeEqual([binaryDoc dtdPublicID], [doc dtdPublicID]);
+}
+
+- (void)testBinaryFormatKeepsLazyElements;
+{
+    NSError *error = nil;
+    NSData *input = [LazyTestInput dataUsingEncoding:NSUTF8StringEncoding];
+    OFXMLDocument *eagerDoc = _lazyTestDocument(input, 0, &error);
+    OBShouldNotError(eagerDoc != nil);
+    OFXMLDocument *lazyDoc = _lazyTestDocument(input, 1, &error);
+    OBShouldNotError(lazyDoc != nil);
+
+    OFXMLDocument *binaryDoc = _binaryRoundTrip(lazyDoc, _lazyTestWhitespaceBehavior(), OFXMLDocumentLoadOptionsNone);
+    should(binaryDoc != nil);
+
+    // Still unloaded, and still written verbatim
+    OFXMLLazyElement *section = (OFXMLLazyElement *)[[binaryDoc rootElement] firstChildNamed:@"section"];
+    should([section isKindOfClass:[OFXMLLazyElement class]]);
+    shouldnt([section isLoaded]);
+    shouldBeEqual([binaryDoc xmlData:NULL], [lazyDoc xmlData:NULL]);
+
+    // Loading them gives the eagerly loaded tree, namespaces and whitespace included
+    shouldBeEqual([binaryDoc rootElement], [eagerDoc rootElement]);
+    should([section isLoaded]);
+}
+
+- (void)testBinaryFormatParallelLoading;
+{
+    NSData *input = _parallelTestDocument(5000, nil);
+    NSError *error = nil;
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:input whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore options:OFXMLDocumentLoadIntoArena error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+    NSData *expected = [doc xmlData:NULL];
+
+    shouldBeEqual([_binaryRoundTrip(doc, nil, OFXMLDocumentLoadOptionsNone) xmlData:NULL], expected);
+    shouldBeEqual([_binaryRoundTrip(doc, nil, OFXMLDocumentLoadInParallel) xmlData:NULL], expected);
+}
+
+- (void)testBinaryFormatErrors;
+{
+    NSError *error = nil;
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:[ArenaTestInput dataUsingEncoding:NSUTF8StringEncoding] whitespaceBehavior:nil error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+    NSData *binaryData = [doc binaryData:&error];
+    OBShouldNotError(binaryData != nil);
+
+    // XML isn't binary
+    shouldnt([OFXMLDocument isBinaryData:[ArenaTestInput dataUsingEncoding:NSUTF8StringEncoding]]);
+    error = nil;
+    should([[[OFXMLDocument alloc] initWithBinaryData:[ArenaTestInput dataUsingEncoding:NSUTF8StringEncoding] whitespaceBehavior:nil options:0 error:&error] autorelease] == nil);
+    should([error hasUnderlyingErrorDomain:OFErrorDomain code:OFXMLDocumentInvalidBinaryData]);
+
+    // Every truncation is caught by the length in the header, but the parts still have to be bounds checked, so patch the length to match.
+    for (NSUInteger length = 0; length < [binaryData length]; length++) {
+        NSMutableData *truncated = [[binaryData subdataWithRange:NSMakeRange(0, length)] mutableCopy];
+        if (length >= 48) {
+            uint64_t littleLength = CFSwapInt64HostToLittle(length);
+            [truncated replaceBytesInRange:NSMakeRange(40, sizeof(littleLength)) withBytes:&littleLength];
+        }
+        should([[[OFXMLDocument alloc] initWithBinaryData:truncated whitespaceBehavior:nil options:0 error:NULL] autorelease] == nil);
+        [truncated release];
+    }
+
+    // Damage anywhere has to fail cleanly or load something, never crash.
+    for (NSUInteger byteIndex = 0; byteIndex < [binaryData length]; byteIndex++) {
+        NSMutableData *damaged = [binaryData mutableCopy];
+        ((uint8_t *)[damaged mutableBytes])[byteIndex] ^= 0xff;
+        [[[OFXMLDocument alloc] initWithBinaryData:damaged whitespaceBehavior:nil options:0 error:NULL] release];
+        [damaged release];
+    }
+
+    // Nodes the format doesn't know about
+    OFXMLComment *comment = [[[OFXMLComment alloc] initWithString:@"note"] autorelease];
+    [[doc rootElement] appendChild:comment];
+    error = nil;
+    should([doc binaryData:&error] == nil);
+    should([error hasUnderlyingErrorDomain:OFErrorDomain code:OFXMLDocumentUnsupportedBinaryNode]);
+}
+
+- (void)testBinaryFormatPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    NSError *error = nil;
+    NSData *xmlData = _generatedDocument(50 << 20);
+    OFXMLDocument *doc = [[[OFXMLDocument alloc] initWithData:xmlData whitespaceBehavior:nil defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:OFXMLDocumentLoadOptionsNone error:&error] autorelease];
+    OBShouldNotError(doc != nil);
+
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    NSData *savedXML = [doc xmlData:&error];
+    NSTimeInterval xmlSaveTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    OBShouldNotError(savedXML != nil);
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    NSData *binaryData = [doc binaryData:&error];
+    NSTimeInterval binarySaveTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    OBShouldNotError(binaryData != nil);
+
+    NSLog(@"XML: %lu bytes, saved in %.3fs", [savedXML length], xmlSaveTime);
+    NSLog(@"Binary: %lu bytes (%.0f%% of XML), saved in %.3fs", [binaryData length], 100.0 * [binaryData length] / [savedXML length], binarySaveTime);
+
+    _timeLoading(savedXML, OFXMLDocumentLoadOptionsNone, @"XML");
+    _timeLoading(savedXML, OFXMLDocumentLoadInParallel, @"XML in parallel");
+
+    for (NSUInteger pass = 0; pass < 2; pass++) {
+        OFXMLDocumentLoadOptions options = (pass == 0) ? OFXMLDocumentLoadOptionsNone : OFXMLDocumentLoadInParallel;
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+        start = [NSDate timeIntervalSinceReferenceDate];
+        OFXMLDocument *binaryDoc = [[OFXMLDocument alloc] initWithBinaryData:binaryData whitespaceBehavior:nil options:options error:&error];
+        NSTimeInterval loadTime = [NSDate timeIntervalSinceReferenceDate] - start;
+        OBShouldNotError(binaryDoc != nil);
+        NSLog(@"Binary%@: loaded in %.3fs", (pass == 0) ? @"" : @" in parallel", loadTime);
+
+        [binaryDoc release];
+        [pool drain];
+    }
+}
+
 - (void)testNilInputData;
 {
     NSError *error = nil;
@@ -0,0 +1,224 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniFoundation/OFXMLInternedStringTable.h>
+#import <OmniFoundation/OFXMLParser.h>
+#import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/OFXMLReader.h>
+#import <OmniFoundation/OFXMLWhitespaceBehavior.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+@interface OFXMLInternedNameTableTests : OFTestCase
+@end
+
+#define CONCURRENT_NAME_COUNT (5000)
+#define CONCURRENT_THREAD_COUNT (8)
+
+typedef struct {
+    OFXMLInternedNameTable table;
+    unsigned int threadIndex;
+    OFXMLQName *names[CONCURRENT_NAME_COUNT];
+} InterningBatch;
+
+static void _nameForIndex(char *buffer, size_t bufferSize, unsigned int nameIndex)
+{
+    snprintf(buffer, bufferSize, "name-%u", nameIndex);
+}
+
+static const char *_namespaceForIndex(unsigned int nameIndex)
+{
+    return (nameIndex % 3) ? "http://www.omnigroup.com/namespace/test" : NULL;
+}
+
+static void *_internBatch(void *context)
+{
+    InterningBatch *batch = context;
+    char name[32];
+
+    // Each thread walks the names in a different order so they race to add different names.
+    for (unsigned int step = 0; step < CONCURRENT_NAME_COUNT; step++) {
+        unsigned int nameIndex = (step * 7919 + batch->threadIndex * 131) % CONCURRENT_NAME_COUNT;
+        _nameForIndex(name, sizeof(name), nameIndex);
+        batch->names[nameIndex] = OFXMLInternedNameTableGetInternedName(batch->table, _namespaceForIndex(nameIndex), name);
+    }
+    return NULL;
+}
+
+// Parser target that does nothing but hand out a name table; the parser interns every element and attribute name through it.
+@interface OFXMLInternedNameTableTestTarget : NSObject <OFXMLParserTarget>
+{
+@public
+    OFXMLInternedNameTable _nameTable;
+}
+@end
+
+@implementation OFXMLInternedNameTableTestTarget
+- (OFXMLInternedNameTable)internedNameTableForParser:(OFXMLParser *)parser;
+{
+    return _nameTable;
+}
+@end
+
+static NSArray *_generatedDocuments(NSUInteger documentCount)
+{
+    NSMutableArray *documents = [NSMutableArray array];
+    for (NSUInteger documentIndex = 0; documentIndex < documentCount; documentIndex++) {
+        NSMutableString *xml = [NSMutableString stringWithString:@"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<document xmlns=\"http://www.omnigroup.com/namespace/test\" xmlns:x=\"http://www.omnigroup.com/namespace/extra\">\n"];
+        for (NSUInteger itemIndex = 0; itemIndex < 200; itemIndex++) {
+            NSUInteger vocabularyIndex = (documentIndex * 31 + itemIndex) % 150;
+            [xml appendFormat:@"  <item-%lu x:attribute-%lu=\"%lu\" rank=\"%lu\"><x:value-%lu>text</x:value-%lu></item-%lu>\n", vocabularyIndex, vocabularyIndex % 40, itemIndex, itemIndex % 7, vocabularyIndex % 60, vocabularyIndex % 60, vocabularyIndex];
+        }
+        [xml appendString:@"</document>\n"];
+        [documents addObject:[xml dataUsingEncoding:NSUTF8StringEncoding]];
+    }
+    return documents;
+}
+
+static NSTimeInterval _parseDocuments(NSArray *documents, NSUInteger threadCount, OFXMLInternedNameTable sharedTable)
+{
+    OFXMLWhitespaceBehavior *whitespaceBehavior = [[[OFXMLWhitespaceBehavior alloc] init] autorelease];
+    NSUInteger documentCount = [documents count];
+    
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t threadIndex){
+        OFXMLInternedNameTableTestTarget *target = [[OFXMLInternedNameTableTestTarget alloc] init];
+        target->_nameTable = sharedTable; // NULL makes each parser build its own
+        
+        for (NSUInteger documentIndex = threadIndex; documentIndex < documentCount; documentIndex += threadCount) {
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            OFXMLParser *parser = [[OFXMLParser alloc] initWithData:[documents objectAtIndex:documentIndex] whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypeIgnore target:target error:NULL];
+            OBASSERT(parser);
+            [parser release];
+            [pool drain];
+        }
+        [target release];
+    });
+    return [NSDate timeIntervalSinceReferenceDate] - start;
+}
+
+@implementation OFXMLInternedNameTableTests
+
+- (void)testInterning;
+{
+    OFXMLInternedNameTable table = OFXMLInternedNameTableCreate(NULL);
+    
+    OFXMLQName *plain = OFXMLInternedNameTableGetInternedName(table, NULL, "name");
+    OFXMLQName *namespaced = OFXMLInternedNameTableGetInternedName(table, "http://www.omnigroup.com/namespace/test", "name");
+    should(plain != namespaced);
+    shouldBeEqual(plain.name, @"name");
+    shouldBeEqual(plain.namespace, @"");
+    shouldBeEqual(namespaced.namespace, @"http://www.omnigroup.com/namespace/test");
+    
+    // Equal strings at different addresses find the same instance
+    char copy[] = "name";
+    should(OFXMLInternedNameTableGetInternedName(table, NULL, copy) == plain);
+    should(OFXMLInternedNameTableGetInternedName(table, "http://www.omnigroup.com/namespace/test", copy) == namespaced);
+    
+    // Names that only differ in where the namespace ends must not collide
+    should(OFXMLInternedNameTableGetInternedName(table, "ab", "c") != OFXMLInternedNameTableGetInternedName(table, "a", "bc"));
+    
+    // Enough names to make the table grow a few times
+    char name[32];
+    for (unsigned int nameIndex = 0; nameIndex < 1000; nameIndex++) {
+        _nameForIndex(name, sizeof(name), nameIndex);
+        OFXMLInternedNameTableGetInternedName(table, NULL, name);
+    }
+    should(OFXMLInternedNameTableGetInternedName(table, NULL, "name") == plain);
+    should(OFXMLInternedNameTableGetCount(table) == 1004);
+    
+    // A copy keeps the same instances, but names added to it stay there.
+    OFXMLInternedNameTable copyTable = OFXMLInternedNameTableCreate(table);
+    should(OFXMLInternedNameTableGetCount(copyTable) == 1004);
+    should(OFXMLInternedNameTableGetInternedName(copyTable, "http://www.omnigroup.com/namespace/test", "name") == namespaced);
+    OFXMLInternedNameTableGetInternedName(copyTable, NULL, "only-in-the-copy");
+    should(OFXMLInternedNameTableGetCount(copyTable) == 1005);
+    should(OFXMLInternedNameTableGetCount(table) == 1004);
+    
+    OFXMLInternedNameTableFree(copyTable);
+    OFXMLInternedNameTableFree(table);
+}
+
+- (void)testConcurrentInterning;
+{
+    OFXMLInternedNameTable table = OFXMLInternedNameTableCreate(NULL);
+    InterningBatch *batches = calloc(CONCURRENT_THREAD_COUNT, sizeof(*batches));
+    
+    for (unsigned int threadIndex = 0; threadIndex < CONCURRENT_THREAD_COUNT; threadIndex++) {
+        batches[threadIndex].table = table;
+        batches[threadIndex].threadIndex = threadIndex;
+    }
+    OFTestRunThreads(CONCURRENT_THREAD_COUNT, _internBatch, batches, sizeof(*batches));
+    
+    should(OFXMLInternedNameTableGetCount(table) == CONCURRENT_NAME_COUNT);
+    
+    BOOL sameInstances = YES, correctNames = YES;
+    char name[32];
+    for (unsigned int nameIndex = 0; nameIndex < CONCURRENT_NAME_COUNT; nameIndex++) {
+        for (unsigned int threadIndex = 1; threadIndex < CONCURRENT_THREAD_COUNT; threadIndex++)
+            if (batches[threadIndex].names[nameIndex] != batches[0].names[nameIndex])
+                sameInstances = NO;
+        
+        _nameForIndex(name, sizeof(name), nameIndex);
+        if (strcmp([batches[0].names[nameIndex].name UTF8String], name) != 0)
+            correctNames = NO;
+    }
+    should(sameInstances);
+    should(correctNames);
+    
+    free(batches);
+    OFXMLInternedNameTableFree(table);
+}
+
+- (void)testReadersSharingNames;
+{
+    NSError *error = nil;
+    NSData *data = [@"<root xmlns=\"http://www.omnigroup.com/namespace/test\"><child/></root>" dataUsingEncoding:NSUTF8StringEncoding];
+    OFXMLInternedNameTable table = OFXMLInternedNameTableCreate(NULL);
+    
+    OFXMLReader *reader1 = [[[OFXMLReader alloc] initWithData:data sharedInternedNames:table error:&error] autorelease];
+    OBShouldNotError(reader1 != nil);
+    OFXMLReader *reader2 = [[[OFXMLReader alloc] initWithData:data sharedInternedNames:table error:&error] autorelease];
+    OBShouldNotError(reader2 != nil);
+    
+    // The readers keep the table alive
+    OFXMLInternedNameTableFree(table);
+    
+    should([reader1 elementQName] == [reader2 elementQName]);
+    OBShouldNotError([reader1 openElement:&error]);
+    OBShouldNotError([reader2 openElement:&error]);
+    should([reader1 elementQName] == [reader2 elementQName]);
+    shouldBeEqual([reader1 elementQName].name, @"child");
+}
+
+- (void)testParsingThroughputWithSharedNames;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    NSArray *documents = _generatedDocuments(1000);
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    for (NSUInteger threadCount = 1; threadCount <= processorCount; threadCount *= 2) {
+        NSTimeInterval privateTime = _parseDocuments(documents, threadCount, NULL);
+        
+        OFXMLInternedNameTable sharedTable = OFXMLInternedNameTableCreate(NULL);
+        NSTimeInterval sharedTime = _parseDocuments(documents, threadCount, sharedTable);
+        NSUInteger sharedCount = OFXMLInternedNameTableGetCount(sharedTable);
+        OFXMLInternedNameTableFree(sharedTable);
+        
+        NSLog(@"%2lu threads: %lu documents with private name tables in %.3fs, with one shared table (%lu names) in %.3fs", threadCount, [documents count], privateTime, sharedCount, sharedTime);
+    }
+}
+
+@end
@@ -10,8 +10,10 @@
 
 #import <OmniFoundation/OFXMLReader.h>
 #import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/NSDate-OFExtensions.h>
 #import <OmniBase/NSError-OBExtensions.h>
 #import <OmniBase/rcsid.h>
+#import <malloc/malloc.h>
 
 RCS_ID("$Id$")
 
@@ -349,4 +351,290 @@ static void _testReadLongContents(OFXMLReaderTests *self, SEL _cmd, NSString *in
     _testReadLongContents(self, _cmd, @"<long><![CDATA[-1]]></long>", 13, -1);
 }
 
+static NSString *_sliceString(OFXMLReaderSlice slice)
+{
+    return [[[NSString alloc] initWithBytes:slice.bytes length:slice.length encoding:NSUTF8StringEncoding] autorelease];
+}
+
+- (void)testBorrowedAttributeValues;
+{
+    NSError *error = nil;
+    NSString *xml = @"<!DOCTYPE root [ <!ENTITY thing \"a thing\"> ]><root xmlns=\"urn:default\" xmlns:x=\"urn:x\" plain=\"a &amp; b\" x:other=\"2\" entity=\"[&thing;]\" empty=\"\"><child/></root>";
+    
+    OFXMLReader *reader = [[[OFXMLReader alloc] initWithData:[xml dataUsingEncoding:NSUTF8StringEncoding] error:&error] autorelease];
+    OBShouldNotError(reader != nil);
+    
+    OFXMLReaderSlice slice;
+    OFXMLQName *plainName = [[[OFXMLQName alloc] initWithNamespace:@"urn:default" name:@"plain"] autorelease];
+    should([reader getValueOfAttribute:plainName slice:&slice]);
+    shouldBeEqual(_sliceString(slice), @"a & b");
+    
+    OFXMLQName *otherName = [[[OFXMLQName alloc] initWithNamespace:@"urn:x" name:@"other"] autorelease];
+    should([reader getValueOfAttribute:otherName slice:&slice]);
+    long value = 0;
+    should(OFXMLReaderSliceGetLong(slice, &value));
+    should(value == 2);
+    
+    OFXMLQName *entityName = [[[OFXMLQName alloc] initWithNamespace:@"" name:@"entity"] autorelease];
+    should([reader getValueOfAttribute:entityName slice:&slice]);
+    shouldBeEqual(_sliceString(slice), @"[a thing]");
+    
+    OFXMLQName *emptyName = [[[OFXMLQName alloc] initWithNamespace:@"" name:@"empty"] autorelease];
+    should([reader getValueOfAttribute:emptyName slice:&slice]);
+    should(slice.length == 0);
+    
+    OFXMLQName *missingName = [[[OFXMLQName alloc] initWithNamespace:@"" name:@"missing"] autorelease];
+    shouldnt([reader getValueOfAttribute:missingName slice:&slice]);
+    
+    // The enumeration gives what -copyAttributes:error: does.
+    NSDictionary *copiedAttributes = nil;
+    OBShouldNotError([reader copyAttributes:&copiedAttributes error:&error]);
+    [copiedAttributes autorelease];
+    
+    NSMutableDictionary *borrowedAttributes = [NSMutableDictionary dictionary];
+    [reader enumerateAttributeSlicesUsingBlock:^(OFXMLQName *name, OFXMLReaderSlice attributeValue, BOOL *stop) {
+        [borrowedAttributes setObject:_sliceString(attributeValue) forKey:name];
+    }];
+    shouldBeEqual(borrowedAttributes, copiedAttributes);
+}
+
+- (void)testBorrowedStrings;
+{
+    NSError *error = nil;
+    NSString *xml = @"<root><a>plain &lt;text&gt;</a><b>split<![CDATA[ <cdata> ]]>run</b><c/><d></d><e> 42 </e><f>after</f></root>";
+    
+    OFXMLReader *reader = [[[OFXMLReader alloc] initWithData:[xml dataUsingEncoding:NSUTF8StringEncoding] error:&error] autorelease];
+    OBShouldNotError(reader != nil);
+    OBShouldNotError([reader openElement:&error]);
+    
+    OFXMLQName *name = nil;
+    OFXMLReaderSlice slice;
+    
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    OBShouldNotError([reader borrowStringContentsOfElement:&slice error:&error]);
+    shouldBeEqual(_sliceString(slice), @"plain <text>");
+    
+    // Runs of text and CDATA come back as one value, as with -copyString:endingElement:error:
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    shouldBeEqual(name.name, @"b");
+    OBShouldNotError([reader openElement:&error]);
+    BOOL endedElement = NO;
+    OBShouldNotError([reader borrowString:&slice endingElement:&endedElement error:&error]);
+    should(endedElement);
+    shouldBeEqual(_sliceString(slice), @"split <cdata> run");
+    OBShouldNotError([reader closeElement:&error]);
+    
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    shouldBeEqual(name.name, @"c");
+    OBShouldNotError([reader borrowStringContentsOfElement:&slice error:&error]);
+    should(slice.length == 0);
+    
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    shouldBeEqual(name.name, @"d");
+    OBShouldNotError([reader borrowStringContentsOfElement:&slice error:&error]);
+    should(slice.length == 0);
+    
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    shouldBeEqual(name.name, @"e");
+    OBShouldNotError([reader borrowStringContentsOfElement:&slice error:&error]);
+    long value = 0;
+    should(OFXMLReaderSliceGetLong(slice, &value));
+    should(value == 42);
+    
+    OBShouldNotError([reader findNextElement:&name error:&error]);
+    shouldBeEqual(name.name, @"f");
+}
+
+static OFXMLReaderSlice _slice(const char *string)
+{
+    return (OFXMLReaderSlice){.bytes = string, .length = strlen(string)};
+}
+
+- (void)testSliceParsing;
+{
+    long longValue = 0;
+    should(OFXMLReaderSliceGetLong(_slice(" -17\n"), &longValue) && longValue == -17);
+    should(OFXMLReaderSliceGetLong(_slice("010"), &longValue) && longValue == 10);
+    shouldnt(OFXMLReaderSliceGetLong(_slice(""), &longValue));
+    shouldnt(OFXMLReaderSliceGetLong(_slice("12abc"), &longValue));
+    shouldnt(OFXMLReaderSliceGetLong(_slice("99999999999999999999999"), &longValue));
+    
+    // Only the given length is looked at.
+    should(OFXMLReaderSliceGetLong((OFXMLReaderSlice){.bytes = "12345", .length = 2}, &longValue) && longValue == 12);
+    
+    double doubleValue = 0;
+    should(OFXMLReaderSliceGetDouble(_slice("0.25"), &doubleValue) && doubleValue == 0.25);
+    should(OFXMLReaderSliceGetDouble(_slice("-1e3 "), &doubleValue) && doubleValue == -1000);
+    shouldnt(OFXMLReaderSliceGetDouble(_slice("1.5x"), &doubleValue));
+    
+    NSTimeInterval timeInterval = 0;
+    const char *dates[] = {"2013-04-01T12:34:56Z", "2013-04-01T12:34:56.250Z", "2013-04-01T05:34:56-07:00", "2013-04-01T18:04:56.5+05:30"};
+    for (unsigned int dateIndex = 0; dateIndex < sizeof(dates)/sizeof(*dates); dateIndex++) {
+        should(OFXMLReaderSliceGetTimeInterval(_slice(dates[dateIndex]), &timeInterval));
+        NSDate *date = [[[NSDate alloc] initWithXMLCString:dates[dateIndex]] autorelease];
+        should(timeInterval == [date timeIntervalSinceReferenceDate]);
+    }
+    should(OFXMLReaderSliceGetTimeInterval((OFXMLReaderSlice){.bytes = "2013-04-01T12:34:56Zjunk", .length = 20}, &timeInterval));
+    shouldnt(OFXMLReaderSliceGetTimeInterval((OFXMLReaderSlice){.bytes = "2013-04-01T12:34:56Z", .length = 19}, &timeInterval));
+    shouldnt(OFXMLReaderSliceGetTimeInterval(_slice("2013-02-30T12:34:56Z"), &timeInterval));
+    
+    should(OFXMLReaderSliceIsEqualToCString((OFXMLReaderSlice){.bytes = "yesno", .length = 3}, "yes"));
+    shouldnt(OFXMLReaderSliceIsEqualToCString(_slice("yes"), "yesno"));
+}
+
+// libmalloc's hook for the stack logging tools; we only count allocations with it.
+typedef void (OFXMLReaderTestsMallocLogger)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t numberOfFramesToSkip);
+extern OFXMLReaderTestsMallocLogger *malloc_logger;
+
+#define OFXMLReaderTestsMallocLogTypeAllocate (2) // MALLOC_LOG_TYPE_ALLOCATE
+static volatile uint64_t AllocationCount;
+
+static void _countAllocation(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t numberOfFramesToSkip)
+{
+    if (type & OFXMLReaderTestsMallocLogTypeAllocate)
+        AllocationCount++;
+}
+
+static NSData *_importTestDocument(NSUInteger itemCount)
+{
+    NSMutableString *xml = [NSMutableString stringWithString:@"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<outline xmlns=\"http://www.example.com/outline\">\n"];
+    for (NSUInteger itemIndex = 0; itemIndex < itemCount; itemIndex++)
+        [xml appendFormat:@"  <item id=\"i%lu\" rank=\"%lu\" progress=\"%g\" created=\"2013-04-%02luT12:%02lu:56.%03luZ\"><title>Item %lu &amp; friends</title><count>%lu</count></item>\n", itemIndex, itemIndex % 17, (itemIndex % 100) / 100.0, 1 + itemIndex % 28, itemIndex % 60, itemIndex % 1000, itemIndex, itemIndex * 3];
+    [xml appendString:@"</outline>\n"];
+    return [xml dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+typedef struct {
+    long rankTotal;
+    long countTotal;
+    double progressTotal;
+    NSTimeInterval createdTotal;
+    NSUInteger matchingTitles;
+} ImportTotals;
+
+static BOOL _importWithCopies(OFXMLReader *reader, ImportTotals *totals, NSError **outError)
+{
+    OFXMLQName *rankName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"rank"] autorelease];
+    OFXMLQName *progressName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"progress"] autorelease];
+    OFXMLQName *createdName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"created"] autorelease];
+    
+    if (![reader openElement:outError])
+        return NO;
+    
+    OFXMLQName *name = nil;
+    while ([reader findNextElement:&name error:outError] && name) {
+        NSString *string = nil;
+        
+        if (![reader copyValueOfAttribute:&string named:rankName error:outError])
+            return NO;
+        totals->rankTotal += [string integerValue];
+        [string release];
+        
+        if (![reader copyValueOfAttribute:&string named:progressName error:outError])
+            return NO;
+        totals->progressTotal += [string doubleValue];
+        [string release];
+        
+        if (![reader copyValueOfAttribute:&string named:createdName error:outError])
+            return NO;
+        NSDate *created = [[NSDate alloc] initWithXMLString:string];
+        totals->createdTotal += [created timeIntervalSinceReferenceDate];
+        [created release];
+        [string release];
+        
+        if (![reader openElement:outError] || ![reader findNextElement:&name error:outError] || ![reader copyStringContentsToEndOfElement:&string error:outError])
+            return NO;
+        if ([string hasSuffix:@"& friends"])
+            totals->matchingTitles++;
+        [string release];
+        
+        if (![reader findNextElement:&name error:outError] || ![reader copyStringContentsToEndOfElement:&string error:outError])
+            return NO;
+        totals->countTotal += [string integerValue];
+        [string release];
+        
+        if (![reader closeElement:outError])
+            return NO;
+    }
+    return YES;
+}
+
+static BOOL _importWithSlices(OFXMLReader *reader, ImportTotals *totals, NSError **outError)
+{
+    OFXMLQName *rankName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"rank"] autorelease];
+    OFXMLQName *progressName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"progress"] autorelease];
+    OFXMLQName *createdName = [[[OFXMLQName alloc] initWithNamespace:@"http://www.example.com/outline" name:@"created"] autorelease];
+    
+    if (![reader openElement:outError])
+        return NO;
+    
+    OFXMLQName *name = nil;
+    while ([reader findNextElement:&name error:outError] && name) {
+        OFXMLReaderSlice slice;
+        long longValue;
+        double doubleValue;
+        NSTimeInterval timeInterval;
+        
+        if ([reader getValueOfAttribute:rankName slice:&slice] && OFXMLReaderSliceGetLong(slice, &longValue))
+            totals->rankTotal += longValue;
+        if ([reader getValueOfAttribute:progressName slice:&slice] && OFXMLReaderSliceGetDouble(slice, &doubleValue))
+            totals->progressTotal += doubleValue;
+        if ([reader getValueOfAttribute:createdName slice:&slice] && OFXMLReaderSliceGetTimeInterval(slice, &timeInterval))
+            totals->createdTotal += timeInterval;
+        
+        if (![reader openElement:outError] || ![reader findNextElement:&name error:outError] || ![reader borrowStringContentsOfElement:&slice error:outError])
+            return NO;
+        if (slice.length >= 9 && memcmp(slice.bytes + slice.length - 9, "& friends", 9) == 0)
+            totals->matchingTitles++;
+        
+        if (![reader findNextElement:&name error:outError] || ![reader borrowStringContentsOfElement:&slice error:outError])
+            return NO;
+        if (OFXMLReaderSliceGetLong(slice, &longValue))
+            totals->countTotal += longValue;
+        
+        if (![reader closeElement:outError])
+            return NO;
+    }
+    return YES;
+}
+
+- (void)testBorrowedValueAllocations;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    // About 25 MB, the size of a big outline.
+    const NSUInteger itemCount = 200000;
+    NSData *data = _importTestDocument(itemCount);
+    ImportTotals totals[2];
+    BOOL (*importers[2])(OFXMLReader *, ImportTotals *, NSError **) = {_importWithCopies, _importWithSlices};
+    NSString *labels[2] = {@"Copied values", @"Borrowed values"};
+    
+    for (unsigned int importerIndex = 0; importerIndex < 2; importerIndex++) {
+        NSError *error = nil;
+        OFXMLReader *reader = [[OFXMLReader alloc] initWithData:data error:&error];
+        OBShouldNotError(reader != nil);
+        memset(&totals[importerIndex], 0, sizeof(totals[importerIndex]));
+        
+        AllocationCount = 0;
+        malloc_logger = _countAllocation;
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        OBShouldNotError(importers[importerIndex](reader, &totals[importerIndex], &error));
+        NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+        malloc_logger = NULL;
+        
+        NSLog(@"%@: %lu KB, %lu items in %.3fs, %.1f allocations per item", labels[importerIndex], [data length] >> 10, itemCount, elapsed, (double)AllocationCount / itemCount);
+        [reader release];
+    }
+    
+    should(totals[0].rankTotal == totals[1].rankTotal);
+    should(totals[0].countTotal == totals[1].countTotal);
+    should(totals[0].progressTotal == totals[1].progressTotal);
+    should(totals[0].createdTotal == totals[1].createdTotal);
+    should(totals[0].matchingTitles == itemCount);
+    should(totals[1].matchingTitles == itemCount);
+}
+
 @end
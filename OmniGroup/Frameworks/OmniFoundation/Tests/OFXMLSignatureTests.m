@@ -1330,6 +1330,132 @@ static int retrieveKeyAndCheckSize(SecKeychainRef keychain, const xmlChar *sigAl
     /* xmlFreeDoc(info) Freed automatically in -tearDown */
 }
 
+static xmlDoc *newManifestDocument(unsigned itemCount, NSUInteger itemLength)
+{
+    NSMutableString *xml = [NSMutableString stringWithString:@"<?xml version=\"1.0\"?>\n<manifest>\n"];
+    for (unsigned itemIndex = 0; itemIndex < itemCount; itemIndex ++) {
+        [xml appendFormat:@"<item xml:id=\"item-%u\">", itemIndex];
+        NSUInteger itemEnd = [xml length] + itemLength;
+        while ([xml length] < itemEnd)
+            [xml appendFormat:@"%u ", itemIndex];
+        [xml appendString:@"</item>\n"];
+    }
+    [xml appendString:@"</manifest>\n"];
+    
+    NSData *data = [xml dataUsingEncoding:NSUTF8StringEncoding];
+    return xmlReadMemory([data bytes], (int)[data length], NULL, "UTF-8", XML_PARSE_NONET);
+}
+
+static xmlNode *signManifestDocument(xmlDoc *manifest, unsigned itemCount, SecKeychainRef keychain)
+{
+    xmlNode *sigNode = applySigBlob(manifest, XMLPKSignaturePKCS1_v1_5, ((const xmlChar *)"http://www.w3.org/2001/10/xml-exc-c14n#"));
+    for (unsigned itemIndex = 0; itemIndex < itemCount; itemIndex ++) {
+        char uri[32];
+        snprintf(uri, sizeof(uri), "#item-%u", itemIndex);
+        addRefNode(sigNode, (const xmlChar *)uri, XMLDigestSHA256, NULL);
+    }
+    
+    NSError *error = nil;
+    OFXMLSignatureTest *sig = [[OFXMLSignatureTest alloc] initWithElement:sigNode inDocument:manifest];
+    [sig setKeySource:keyIsOnlyApplicableOneInKeychain];
+    [sig setKeychain:keychain];
+    BOOL ok = [sig computeReferenceDigests:&error] && [sig processSignatureElement:OFXMLSignature_Sign error:&error];
+    [sig release];
+    
+    if (!ok) {
+        NSLog(@"Unable to sign manifest: %@", [error toPropertyList]);
+        return NULL;
+    }
+    return sigNode;
+}
+
+- (void)testParallelReferenceVerification;
+{
+    const unsigned itemCount = 50;
+    
+    loadedDoc = newManifestDocument(itemCount, 2048);
+    xmlNode *sigNode = signManifestDocument(loadedDoc, itemCount, kc);
+    STAssertTrue(sigNode != NULL, @"Signing the manifest");
+    if (!sigNode)
+        return;
+    
+    NSError *error;
+    NSArray *sigs = [OFXMLSignatureTest signaturesInTree:loadedDoc];
+    STAssertEquals((unsigned)[sigs count], 1u, @"Should be exactly one signature node in this tree");
+    OFXMLSignatureTest *sig = [sigs objectAtIndex:0];
+    [sig setKeySource:keyIsOnlyApplicableOneInKeychain];
+    [sig setKeychain:kc];
+    OBShouldNotError([sig processSignatureElement:OFXMLSignature_Verify error:&error]);
+    STAssertEquals([sig countOfReferenceNodes], (NSUInteger)itemCount, @"One reference per item");
+    
+    NSIndexSet *allReferences = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, itemCount)];
+    OBShouldNotError([sig verifyReferencesAtIndexes:allReferences maximumConcurrency:0 error:&error]);
+    OBShouldNotError([sig verifyReferencesAtIndexes:allReferences maximumConcurrency:1 error:&error]);
+    OBShouldNotError([sig verifyReferencesAtIndexes:[NSIndexSet indexSet] maximumConcurrency:0 error:&error]);
+    
+    // Change two of the items; only the references covering them should fail, and we should hear about the first one.
+    xmlNode *items[2] = { xmlGetID(loadedDoc, (const xmlChar *)"item-31")->parent, xmlGetID(loadedDoc, (const xmlChar *)"item-7")->parent };
+    for (unsigned changeIndex = 0; changeIndex < 2; changeIndex ++)
+        xmlNodeAddContent(items[changeIndex], (const xmlChar *)"changed");
+    
+    error = nil;
+    BOOL verifiedOK = [sig verifyReferencesAtIndexes:allReferences maximumConcurrency:0 error:&error];
+    STAssertFalse(verifiedOK, @"Modified document should not pass verification");
+    if (!verifiedOK && !isExpectedBadSignatureError(error)) {
+        FailedForWrongReason(error);
+    }
+    STAssertEqualObjects([error localizedFailureReason], @"Unable to verify reference 7", @"Should report the lowest-numbered failing reference, whichever thread finished first");
+    
+    for (unsigned itemIndex = 0; itemIndex < itemCount; itemIndex ++) {
+        BOOL serialOK = [sig verifyReferenceAtIndex:itemIndex toBuffer:NULL error:NULL];
+        BOOL parallelOK = [sig verifyReferencesAtIndexes:[NSIndexSet indexSetWithIndex:itemIndex] maximumConcurrency:0 error:NULL];
+        STAssertEquals(serialOK, parallelOK, @"Serial and parallel verification should agree on reference %u", itemIndex);
+        STAssertEquals(serialOK, (BOOL)(itemIndex != 7 && itemIndex != 31), @"Only the changed items should fail (reference %u)", itemIndex);
+    }
+    
+    NSMutableIndexSet *unchangedReferences = [[allReferences mutableCopy] autorelease];
+    [unchangedReferences removeIndex:7];
+    [unchangedReferences removeIndex:31];
+    OBShouldNotError([sig verifyReferencesAtIndexes:unchangedReferences maximumConcurrency:0 error:&error]);
+    
+    /* xmlFreeDoc(loadedDoc) Freed automatically in -tearDown */
+}
+
+- (void)testParallelReferenceVerificationPerformance;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    const unsigned itemCount = 500;
+    
+    loadedDoc = newManifestDocument(itemCount, 16384);
+    xmlNode *sigNode = signManifestDocument(loadedDoc, itemCount, kc);
+    STAssertTrue(sigNode != NULL, @"Signing the manifest");
+    if (!sigNode)
+        return;
+    
+    NSError *error;
+    OFXMLSignatureTest *sig = [[OFXMLSignatureTest signaturesInTree:loadedDoc] objectAtIndex:0];
+    [sig setKeySource:keyIsOnlyApplicableOneInKeychain];
+    [sig setKeychain:kc];
+    OBShouldNotError([sig processSignatureElement:OFXMLSignature_Verify error:&error]);
+    
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned itemIndex = 0; itemIndex < itemCount; itemIndex ++)
+        OBShouldNotError([sig verifyReferenceAtIndex:itemIndex toBuffer:NULL error:&error]);
+    NSTimeInterval serialTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    start = [NSDate timeIntervalSinceReferenceDate];
+    OBShouldNotError([sig verifyReferencesAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, itemCount)] maximumConcurrency:0 error:&error]);
+    NSTimeInterval parallelTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    
+    NSLog(@"Verified %u references: %.3fs one at a time, %.3fs in parallel on %lu processors (%.1fx)", itemCount, serialTime, parallelTime, (unsigned long)[[NSProcessInfo processInfo] activeProcessorCount], serialTime / parallelTime);
+    
+    /* xmlFreeDoc(loadedDoc) Freed automatically in -tearDown */
+}
+
 - (void)testECDSA;
 {
     xmlDoc *info = [self _readDoc:@"0001-Namespaces.svg"];
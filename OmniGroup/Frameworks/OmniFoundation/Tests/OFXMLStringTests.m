@@ -9,6 +9,10 @@
 #import "OFTestCase.h"
 
 #import <OmniFoundation/OFXMLString.h>
+#import <OmniFoundation/OFXMLBuffer.h>
+#import <OmniFoundation/OFXMLDocument.h>
+#import <OmniFoundation/OFXMLElement.h>
+#import <OmniFoundation/OFRandom.h>
 #import <OmniBase/OmniBase.h>
 
 RCS_ID("$Id$");
@@ -66,4 +70,152 @@ RCS_ID("$Id$");
     QUOTE_NEWLINE(@"\na\nb\n", @"!a!b!", OFXMLHTMLWithNewlinesEntityMask, @"!");
 }
 
+// The straightforward character-at-a-time quoting the vector scanners replaced; everything should still match it exactly.
+static NSString *_referenceQuotedString(NSString *string, unsigned int entityMask, NSString *newlineReplacement)
+{
+    NSMutableString *result = [NSMutableString string];
+    NSUInteger characterCount = [string length];
+    for (NSUInteger characterIndex = 0; characterIndex < characterCount; characterIndex++) {
+        unichar c = [string characterAtIndex:characterIndex];
+        unsigned int quotOptions = (entityMask >> OFXMLQuotCharacterOptionsShift) & OFXMLCharacterOptionsMask;
+        unsigned int aposOptions = (entityMask >> OFXMLAposCharacterOptionsShift) & OFXMLCharacterOptionsMask;
+
+        if (c == '&')
+            [result appendString:@"&amp;"];
+        else if (c == '<')
+            [result appendString:@"&lt;"];
+        else if (c == '>' && (entityMask & OFXMLGtEntityMask))
+            [result appendString:@"&gt;"];
+        else if (c == '\"' && quotOptions != OFXMLCharacterFlagWriteUnquotedCharacter)
+            [result appendString:quotOptions == OFXMLCharacterFlagWriteNamedEntity ? @"&quot;" : @"&#34;"];
+        else if (c == '\'' && aposOptions != OFXMLCharacterFlagWriteUnquotedCharacter)
+            [result appendString:aposOptions == OFXMLCharacterFlagWriteNamedEntity ? @"&apos;" : @"&#39;"];
+        else if (c == '\n' && newlineReplacement && (entityMask & OFXMLNewlineEntityMask))
+            [result appendString:newlineReplacement];
+        else if (c < 0x20 && c != '\t' && c != '\n' && c != '\r')
+            continue; // not allowed in XML; dropped
+        else
+            [result appendFormat:@"%C", c];
+    }
+    return result;
+}
+
+// Mostly plain text with the interesting characters sprinkled in at random offsets, so they land in every position within a vector.
+static NSString *_randomQuotingString(OFRandomState *state, NSUInteger length)
+{
+    static const unichar interesting[] = {'&', '<', '>', '\"', '\'', '\n', '\t', '\r', 0x00, 0x01, 0x1F, 0x20, 0x7F, 0xE9, 0x2026, 0x8000, 0xFFFD};
+    unsigned int density = OFRandomNextStateN(state, 40) + 1;
+
+    NSMutableString *string = [NSMutableString string];
+    while ([string length] < length) {
+        if (OFRandomNextStateN(state, density) == 0)
+            [string appendFormat:@"%C", interesting[OFRandomNextStateN(state, sizeof(interesting)/sizeof(*interesting))]];
+        else if (OFRandomNextStateN(state, 50) == 0)
+            [string appendString:@"\U0001D11E"]; // a surrogate pair
+        else
+            [string appendFormat:@"%C", (unichar)('a' + OFRandomNextStateN(state, 26))];
+    }
+    return string;
+}
+
+- (void)testQuotingMatchesReference;
+{
+    uint32_t seed = 1234;
+    OFRandomState *state = OFRandomStateCreateWithSeed32(&seed, 1);
+
+    unsigned int masks[] = {
+        OFXMLBasicEntityMask,
+        OFXMLHTMLEntityMask,
+        OFXMLBasicWithNewlinesEntityMask,
+        OFXMLMinimalEntityMask,
+        (OFXMLCharacterFlagWriteUnquotedCharacter << OFXMLAposCharacterOptionsShift) | (OFXMLCharacterFlagWriteCharacterEntity << OFXMLQuotCharacterOptionsShift),
+    };
+
+    for (unsigned int trial = 0; trial < 2000; trial++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSString *string = _randomQuotingString(state, OFRandomNextStateN(state, 200));
+
+        for (unsigned int maskIndex = 0; maskIndex < sizeof(masks)/sizeof(*masks); maskIndex++) {
+            NSString *quoted = OFXMLCreateStringWithEntityReferencesInCFEncoding(string, masks[maskIndex], @"<br/>", kCFStringEncodingUTF8);
+            shouldBeEqual(quoted, _referenceQuotedString(string, masks[maskIndex], @"<br/>"));
+            [quoted release];
+        }
+
+        NSString *expected = _referenceQuotedString(string, OFXMLBasicEntityMask, nil);
+
+        OFXMLBuffer buffer = OFXMLBufferCreate();
+        OFXMLBufferAppendQuotedString(buffer, (CFStringRef)string, kCFStringEncodingUTF8);
+        NSString *bufferString = (NSString *)OFXMLBufferCopyString(buffer);
+        shouldBeEqual(bufferString, expected);
+        [bufferString release];
+        OFXMLBufferDestroy(buffer);
+
+        NSData *utf8 = [string dataUsingEncoding:NSUTF8StringEncoding];
+        buffer = OFXMLBufferCreate();
+        OFXMLBufferAppendQuotedUTF8Bytes(buffer, [utf8 bytes], [utf8 length]);
+        NSData *bufferData = (NSData *)OFXMLBufferCopyData(buffer, kCFStringEncodingUTF8);
+        shouldBeEqual(bufferData, [expected dataUsingEncoding:NSUTF8StringEncoding]);
+        [bufferData release];
+        OFXMLBufferDestroy(buffer);
+
+        [pool drain];
+    }
+
+    OFRandomStateDestroy(state);
+}
+
+// Non-UTF encodings still need character references for what they can't represent.
+- (void)testQuotingIntoLimitedEncoding;
+{
+    NSString *string = @"café & … <\U0001D11E>";
+    NSString *expected = OFXMLCreateStringWithEntityReferencesInCFEncoding(string, OFXMLBasicEntityMask, nil, kCFStringEncodingASCII);
+
+    OFXMLBuffer buffer = OFXMLBufferCreate();
+    OFXMLBufferAppendQuotedString(buffer, (CFStringRef)string, kCFStringEncodingASCII);
+    NSString *bufferString = (NSString *)OFXMLBufferCopyString(buffer);
+    OFXMLBufferDestroy(buffer);
+
+    shouldBeEqual(bufferString, expected);
+    shouldBeEqual(bufferString, @"caf&#233; &amp; &#8230; &lt;&#119070;&gt;");
+    [bufferString release];
+    [expected release];
+}
+
+- (void)testSerializerThroughput;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+
+    NSString *text = @"Plain running text, long enough to be worth scanning a vector at a time, with the odd \"quoted\" word & an <angle>.\n";
+    NSData *textUTF8 = [text dataUsingEncoding:NSUTF8StringEncoding];
+
+    OFXMLBuffer buffer = OFXMLBufferCreate();
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    for (unsigned int round = 0; round < 1000000; round++)
+        OFXMLBufferAppendQuotedUTF8Bytes(buffer, [textUTF8 bytes], [textUTF8 length]);
+    NSTimeInterval quoteTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    OFXMLBufferDestroy(buffer);
+    NSLog(@"OFXMLBufferAppendQuotedUTF8Bytes (%s): %.1f MB/s", OFXMLBufferQuotingImplementationName(), 1e6 * [textUTF8 length] / quoteTime / (1 << 20));
+
+    NSError *error = nil;
+    OFXMLDocument *doc = [[OFXMLDocument alloc] initWithRootElementName:@"root" namespaceURL:nil whitespaceBehavior:nil stringEncoding:kCFStringEncodingUTF8 error:&error];
+    OBShouldNotError(doc != nil);
+    for (unsigned int itemIndex = 0; itemIndex < 100000; itemIndex++) {
+        OFXMLElement *item = [doc pushElement:@"item"];
+        [item setAttribute:@"title" string:text];
+        [doc appendString:text];
+        [doc popElement];
+    }
+
+    start = [NSDate timeIntervalSinceReferenceDate];
+    NSData *xmlData = [doc xmlData:&error];
+    NSTimeInterval writeTime = [NSDate timeIntervalSinceReferenceDate] - start;
+    OBShouldNotError(xmlData != nil);
+    NSLog(@"-[OFXMLDocument xmlData:]: %lu bytes in %.3fs, %.1f MB/s", [xmlData length], writeTime, [xmlData length] / writeTime / (1 << 20));
+
+    [doc release];
+}
+
 @end
@@ -0,0 +1,79 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+
+#import <OmniFoundation/OFXMLBuffer.h>
+#import <OmniFoundation/OFXMLInternedStringTable.h>
+#import <OmniFoundation/OFXMLParserTarget.h>
+#import <OmniFoundation/OFXMLWhitespaceBehavior.h>
+
+@class NSData, NSError;
+@class OFXMLDocument, OFXMLElement, OFXMLQName;
+
+// A bump allocator.  Memory comes out of large chunks and is only given back all at once, when the arena is destroyed.  Not thread-safe.
+typedef struct _OFXMLArena *OFXMLArena;
+
+extern OFXMLArena OFXMLArenaCreate(size_t chunkSize); // 0 for the default
+extern void OFXMLArenaDestroy(OFXMLArena arena);
+extern void *OFXMLArenaAllocate(OFXMLArena arena, size_t size); // pointer-aligned
+extern size_t OFXMLArenaGetAllocatedSize(OFXMLArena arena); // bytes requested from the system, including unused chunk tails
+
+/*
+ A read-only element tree laid out in an arena.  Element and attribute names are interned OFXMLQNames from the builder's name table; text and attribute values are UTF-8 slices that point either into the parsed source data (when the parser didn't have to rewrite them) or into the arena.  Text children follow the same merging rules as OFXMLDocument's object tree, so materializing one gives the same children.
+ */
+
+typedef struct {
+    const char *bytes; // UTF-8, not NUL terminated
+    size_t length;
+} OFXMLArenaString;
+
+typedef struct {
+    OFXMLQName *qname;
+    OFXMLArenaString value;
+} OFXMLArenaAttribute;
+
+typedef struct _OFXMLArenaElement OFXMLArenaElement;
+
+typedef struct {
+    const OFXMLArenaElement *element; // NULL for a text node
+    OFXMLArenaString text;
+} OFXMLArenaNode;
+
+struct _OFXMLArenaElement {
+    OFXMLQName *qname;
+    uint32_t attributeCount;
+    uint32_t childCount;
+    const OFXMLArenaAttribute *attributes;
+    const OFXMLArenaNode *children;
+};
+
+// The attribute name OFXMLElement uses for this attribute: the local name, or "xmlns"/"xmlns:prefix" for namespace declarations.
+extern NSString *OFXMLArenaAttributeCopyKey(const OFXMLArenaAttribute *attribute) NS_RETURNS_RETAINED;
+extern NSString *OFXMLArenaStringCopyString(OFXMLArenaString string) NS_RETURNS_RETAINED;
+
+// Builds an equivalent, mutable OFXMLElement tree.
+extern OFXMLElement *OFXMLArenaElementCopyElement(const OFXMLArenaElement *element) NS_RETURNS_RETAINED;
+
+// Writes the element the same way -[OFXMLElement appendXML:withParentWhiteSpaceBehavior:document:level:error:] would write its materialized form.
+extern void OFXMLArenaElementAppendXML(const OFXMLArenaElement *element, OFXMLBuffer xml, OFXMLWhitespaceBehaviorType parentBehavior, OFXMLDocument *doc, unsigned int level);
+
+/*
+ Parser target that builds an arena tree using the parser's raw callbacks, so no per-element objects are created.  The builder owns the arena, the interned name table and a reference to the source data; -rootElement stays valid as long as the builder does.  Doctype and processing instruction callbacks are forwarded to 'forwardingTarget', if set.
+ */
+@interface OFXMLArenaTreeBuilder : OFObject <OFXMLParserTarget>
+
+- (id)initWithSourceData:(NSData *)sourceData;
+
+@property(nonatomic,assign) NSObject <OFXMLParserTarget> *forwardingTarget;
+
+@property(nonatomic,readonly) OFXMLArena arena;
+@property(nonatomic,readonly) const OFXMLArenaElement *rootElement;
+
+@end
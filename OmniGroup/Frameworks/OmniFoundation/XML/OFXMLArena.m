@@ -0,0 +1,459 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFXMLArena.h>
+
+#import <Foundation/Foundation.h>
+
+#import <OmniFoundation/OFNull.h>
+#import <OmniFoundation/OFXMLDocument.h>
+#import <OmniFoundation/OFXMLElement.h>
+#import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/OFXMLString.h>
+#import <OmniFoundation/NSString-OFSimpleMatching.h>
+
+#import <OmniBase/rcsid.h>
+#import <OmniBase/assertions.h>
+
+RCS_ID("$Id$");
+
+#pragma mark - Arena
+
+#define OFXMLArenaDefaultChunkSize (1024 * 1024)
+
+typedef struct _OFXMLArenaChunk {
+    struct _OFXMLArenaChunk *next;
+    size_t size;
+} OFXMLArenaChunk;
+
+struct _OFXMLArena {
+    size_t chunkSize;
+    char *next; // free space in the current chunk
+    char *end;
+    OFXMLArenaChunk *chunks;
+    size_t allocatedSize;
+};
+
+OFXMLArena OFXMLArenaCreate(size_t chunkSize)
+{
+    OFXMLArena arena = calloc(1, sizeof(*arena));
+    arena->chunkSize = chunkSize ? chunkSize : OFXMLArenaDefaultChunkSize;
+    return arena;
+}
+
+void OFXMLArenaDestroy(OFXMLArena arena)
+{
+    OFXMLArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        OFXMLArenaChunk *nextChunk = chunk->next;
+        free(chunk);
+        chunk = nextChunk;
+    }
+    free(arena);
+}
+
+static void *_OFXMLArenaAllocateSlow(OFXMLArena arena, size_t size)
+{
+    // Keep the header size a multiple of the alignment so the first allocation in a chunk is aligned too
+    size_t headerSize = (sizeof(OFXMLArenaChunk) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    // Big requests get a chunk of their own rather than throwing away the rest of the current one
+    BOOL dedicated = (size > arena->chunkSize / 4);
+    size_t chunkSize = headerSize + (dedicated ? size : arena->chunkSize);
+
+    OFXMLArenaChunk *chunk = malloc(chunkSize);
+    chunk->size = chunkSize;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->allocatedSize += chunkSize;
+
+    char *block = (char *)chunk + headerSize;
+    if (!dedicated) {
+        arena->next = block + size;
+        arena->end = (char *)chunk + chunkSize;
+    }
+    return block;
+}
+
+void *OFXMLArenaAllocate(OFXMLArena arena, size_t size)
+{
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size > (size_t)(arena->end - arena->next))
+        return _OFXMLArenaAllocateSlow(arena, size);
+
+    void *block = arena->next;
+    arena->next += size;
+    return block;
+}
+
+size_t OFXMLArenaGetAllocatedSize(OFXMLArena arena)
+{
+    return arena->allocatedSize;
+}
+
+static OFXMLArenaString _OFXMLArenaCopyBytes(OFXMLArena arena, const char *bytes, size_t length)
+{
+    char *copy = OFXMLArenaAllocate(arena, length);
+    memcpy(copy, bytes, length);
+    return (OFXMLArenaString){.bytes = copy, .length = length};
+}
+
+#pragma mark - Tree access
+
+static BOOL _OFXMLArenaAttributeIsNamespace(const OFXMLArenaAttribute *attribute)
+{
+    return OFISEQUAL(attribute->qname.namespace, OFXMLNamespaceXMLNS);
+}
+
+NSString *OFXMLArenaAttributeCopyKey(const OFXMLArenaAttribute *attribute)
+{
+    // Matches -[OFXMLDocument parser:startElementWithQName:attributeQNames:attributeValues:], which keeps the xmlns prefix for namespace attributes so they survive round-trips.
+    NSString *name = attribute->qname.name;
+    if (_OFXMLArenaAttributeIsNamespace(attribute)) {
+        if ([NSString isEmptyString:name]) // Default namespace
+            return @"xmlns";
+        return [[NSString alloc] initWithFormat:@"xmlns:%@", name];
+    }
+    return [name retain];
+}
+
+NSString *OFXMLArenaStringCopyString(OFXMLArenaString string)
+{
+    return [[NSString alloc] initWithBytes:string.bytes length:string.length encoding:NSUTF8StringEncoding];
+}
+
+OFXMLElement *OFXMLArenaElementCopyElement(const OFXMLArenaElement *element)
+{
+    NSMutableArray *attributeOrder = nil;
+    NSMutableDictionary *attributeDictionary = nil;
+    if (element->attributeCount) {
+        attributeOrder = [[NSMutableArray alloc] initWithCapacity:element->attributeCount];
+        attributeDictionary = [[NSMutableDictionary alloc] initWithCapacity:element->attributeCount];
+        for (uint32_t attributeIndex = 0; attributeIndex < element->attributeCount; attributeIndex++) {
+            const OFXMLArenaAttribute *attribute = &element->attributes[attributeIndex];
+            NSString *key = OFXMLArenaAttributeCopyKey(attribute);
+            NSString *value = OFXMLArenaStringCopyString(attribute->value);
+            [attributeOrder addObject:key];
+            [attributeDictionary setObject:value forKey:key];
+            [key release];
+            [value release];
+        }
+    }
+
+    OFXMLElement *result = [[OFXMLElement alloc] initWithName:element->qname.name attributeOrder:attributeOrder attributes:attributeDictionary];
+    [attributeOrder release];
+    [attributeDictionary release];
+
+    for (uint32_t childIndex = 0; childIndex < element->childCount; childIndex++) {
+        const OFXMLArenaNode *child = &element->children[childIndex];
+        id childObject;
+        if (child->element)
+            childObject = OFXMLArenaElementCopyElement(child->element);
+        else
+            childObject = OFXMLArenaStringCopyString(child->text);
+        [result appendChild:childObject];
+        [childObject release];
+    }
+
+    return result;
+}
+
+#pragma mark - Writing
+
+static void _OFXMLArenaAppendQuotedString(OFXMLBuffer xml, OFXMLArenaString string, CFStringEncoding encoding)
+{
+    // When every character survives the final conversion, quoting the UTF-8 directly gives the same bytes as OFXMLCreateStringWithEntityReferencesInCFEncoding() with OFXMLBasicEntityMask; otherwise we need it to write character references.
+    if (OFXMLEncodingCanRepresentAllCharacters(encoding)) {
+        OFXMLBufferAppendQuotedUTF8Bytes(xml, string.bytes, string.length);
+        return;
+    }
+
+    NSString *unquotedString = OFXMLArenaStringCopyString(string);
+    NSString *quotedString = OFXMLCreateStringWithEntityReferencesInCFEncoding(unquotedString, OFXMLBasicEntityMask, nil, encoding);
+    OFXMLBufferAppendString(xml, (CFStringRef)quotedString);
+    [quotedString release];
+    [unquotedString release];
+}
+
+// This mirrors -[OFXMLElement appendXML:withParentWhiteSpaceBehavior:document:level:error:]; keep them in sync.
+void OFXMLArenaElementAppendXML(const OFXMLArenaElement *element, OFXMLBuffer xml, OFXMLWhitespaceBehaviorType parentBehavior, OFXMLDocument *doc, unsigned int level)
+{
+    NSString *name = element->qname.name;
+
+    OFXMLWhitespaceBehaviorType whitespaceBehavior = [[doc whitespaceBehavior] behaviorForElementName:name];
+    if (whitespaceBehavior == OFXMLWhitespaceBehaviorTypeAuto)
+        whitespaceBehavior = parentBehavior;
+
+    CFStringEncoding encoding = [doc stringEncoding];
+
+    OFXMLBufferAppendUTF8CString(xml, "<");
+    OFXMLBufferAppendString(xml, (CFStringRef)name);
+
+    for (uint32_t attributeIndex = 0; attributeIndex < element->attributeCount; attributeIndex++) {
+        const OFXMLArenaAttribute *attribute = &element->attributes[attributeIndex];
+        NSString *attributeName = attribute->qname.name;
+
+        OFXMLBufferAppendUTF8CString(xml, " ");
+        if (_OFXMLArenaAttributeIsNamespace(attribute)) {
+            OFXMLBufferAppendUTF8CString(xml, "xmlns");
+            if (![NSString isEmptyString:attributeName]) {
+                OFXMLBufferAppendUTF8CString(xml, ":");
+                OFXMLBufferAppendString(xml, (CFStringRef)attributeName);
+            }
+        } else
+            OFXMLBufferAppendString(xml, (CFStringRef)attributeName);
+
+        OFXMLBufferAppendUTF8CString(xml, "=\"");
+        _OFXMLArenaAppendQuotedString(xml, attribute->value, encoding);
+        OFXMLBufferAppendUTF8CString(xml, "\"");
+    }
+
+    BOOL hasWrittenChild = NO;
+    BOOL doIndenting = NO;
+
+    for (uint32_t childIndex = 0; childIndex < element->childCount; childIndex++) {
+        const OFXMLArenaNode *child = &element->children[childIndex];
+
+        if (whitespaceBehavior == OFXMLWhitespaceBehaviorTypeIgnore)
+            doIndenting = (child->element != NULL);
+
+        // Close off the parent tag if this is the first child
+        if (!hasWrittenChild)
+            OFXMLBufferAppendUTF8CString(xml, ">");
+
+        if (doIndenting) {
+            OFXMLBufferAppendUTF8CString(xml, "\n");
+            OFXMLBufferAppendSpaces(xml, 2*(level + 1));
+        }
+
+        if (child->element)
+            OFXMLArenaElementAppendXML(child->element, xml, whitespaceBehavior, doc, level + 1);
+        else
+            _OFXMLArenaAppendQuotedString(xml, child->text, encoding);
+
+        hasWrittenChild = YES;
+    }
+
+    if (doIndenting) {
+        OFXMLBufferAppendUTF8CString(xml, "\n");
+        OFXMLBufferAppendSpaces(xml, 2*level);
+    }
+
+    if (hasWrittenChild) {
+        OFXMLBufferAppendUTF8CString(xml, "</");
+        OFXMLBufferAppendString(xml, (CFStringRef)name);
+        OFXMLBufferAppendUTF8CString(xml, ">");
+    } else
+        OFXMLBufferAppendUTF8CString(xml, "/>");
+}
+
+#pragma mark - Building
+
+typedef struct {
+    OFXMLArenaElement *element;
+    NSUInteger firstChildNode; // index into the builder's node stack
+} OFXMLArenaBuilderFrame;
+
+@implementation OFXMLArenaTreeBuilder
+{
+    NSData *_sourceData;
+    OFXMLArena _arena;
+    OFXMLInternedNameTable _nameTable;
+    const OFXMLArenaElement *_rootElement;
+
+    // The open elements, and the children gathered so far for all of them on one shared stack.  Each element's children are copied into the arena in one piece when it closes.
+    OFXMLArenaBuilderFrame *_frames;
+    NSUInteger _frameCount, _frameCapacity;
+    OFXMLArenaNode *_nodes;
+    NSUInteger _nodeCount, _nodeCapacity;
+
+    // A text child that is still being added to.  As long as its pieces are adjacent in the source it is just a range; otherwise it is gathered in _textBuffer and copied into the arena when finished.
+    BOOL _hasText;
+    BOOL _textInSource;
+    const char *_textSourceBytes;
+    size_t _textLength;
+    char *_textBuffer;
+    size_t _textBufferSize;
+}
+
+- (id)initWithSourceData:(NSData *)sourceData;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    _sourceData = [sourceData retain];
+    _arena = OFXMLArenaCreate(0);
+    _nameTable = OFXMLInternedNameTableCreate(NULL);
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_sourceData release];
+    OFXMLArenaDestroy(_arena);
+    OFXMLInternedNameTableFree(_nameTable);
+    free(_frames);
+    free(_nodes);
+    free(_textBuffer);
+    [super dealloc];
+}
+
+@synthesize forwardingTarget = _forwardingTarget;
+@synthesize arena = _arena;
+@synthesize rootElement = _rootElement;
+
+static void _OFXMLArenaTreeBuilderPushNode(OFXMLArenaTreeBuilder *self, OFXMLArenaNode node)
+{
+    if (self->_nodeCount == self->_nodeCapacity) {
+        self->_nodeCapacity = self->_nodeCapacity ? 2 * self->_nodeCapacity : 64;
+        self->_nodes = realloc(self->_nodes, self->_nodeCapacity * sizeof(*self->_nodes));
+    }
+    self->_nodes[self->_nodeCount++] = node;
+}
+
+static void _OFXMLArenaTreeBuilderAppendTextToBuffer(OFXMLArenaTreeBuilder *self, const char *bytes, size_t length)
+{
+    if (self->_textLength + length > self->_textBufferSize) {
+        self->_textBufferSize = 2 * (self->_textLength + length);
+        self->_textBuffer = realloc(self->_textBuffer, self->_textBufferSize);
+    }
+    memcpy(self->_textBuffer + self->_textLength, bytes, length);
+    self->_textLength += length;
+}
+
+static void _OFXMLArenaTreeBuilderFinishText(OFXMLArenaTreeBuilder *self)
+{
+    if (!self->_hasText)
+        return;
+
+    OFXMLArenaNode node = {.element = NULL};
+    if (self->_textInSource)
+        node.text = (OFXMLArenaString){.bytes = self->_textSourceBytes, .length = self->_textLength};
+    else
+        node.text = _OFXMLArenaCopyBytes(self->_arena, self->_textBuffer, self->_textLength);
+    _OFXMLArenaTreeBuilderPushNode(self, node);
+
+    self->_hasText = NO;
+    self->_textLength = 0;
+}
+
+#pragma mark OFXMLParserTarget
+
+- (OFXMLInternedNameTable)internedNameTableForParser:(OFXMLParser *)parser;
+{
+    return _nameTable;
+}
+
+- (void)parser:(OFXMLParser *)parser setSystemID:(NSURL *)systemID publicID:(NSString *)publicID;
+{
+    if ([_forwardingTarget respondsToSelector:_cmd])
+        [_forwardingTarget parser:parser setSystemID:systemID publicID:publicID];
+}
+
+- (void)parser:(OFXMLParser *)parser addProcessingInstructionNamed:(NSString *)piName value:(NSString *)piValue;
+{
+    if ([_forwardingTarget respondsToSelector:_cmd])
+        [_forwardingTarget parser:parser addProcessingInstructionNamed:piName value:piValue];
+}
+
+- (void)parser:(OFXMLParser *)parser startElementWithQName:(OFXMLQName *)qname attributeCount:(NSUInteger)attributeCount attributes:(const OFXMLParserAttribute *)attributes;
+{
+    OBPRECONDITION(!_rootElement); // Only one root
+    OBPRECONDITION(attributeCount <= UINT32_MAX);
+
+    _OFXMLArenaTreeBuilderFinishText(self);
+
+    OFXMLArenaElement *element = OFXMLArenaAllocate(_arena, sizeof(*element));
+    element->qname = qname;
+    element->attributeCount = (uint32_t)attributeCount;
+    element->childCount = 0;
+    element->children = NULL;
+
+    if (attributeCount) {
+        OFXMLArenaAttribute *elementAttributes = OFXMLArenaAllocate(_arena, attributeCount * sizeof(*elementAttributes));
+        for (NSUInteger attributeIndex = 0; attributeIndex < attributeCount; attributeIndex++) {
+            const OFXMLParserAttribute *attribute = &attributes[attributeIndex];
+            elementAttributes[attributeIndex].qname = attribute->qname;
+            if (attribute->inSource)
+                elementAttributes[attributeIndex].value = (OFXMLArenaString){.bytes = attribute->value, .length = attribute->length};
+            else
+                elementAttributes[attributeIndex].value = _OFXMLArenaCopyBytes(_arena, attribute->value, attribute->length);
+        }
+        element->attributes = elementAttributes;
+    } else
+        element->attributes = NULL;
+
+    if (_frameCount)
+        _OFXMLArenaTreeBuilderPushNode(self, (OFXMLArenaNode){.element = element});
+
+    if (_frameCount == _frameCapacity) {
+        _frameCapacity = _frameCapacity ? 2 * _frameCapacity : 32;
+        _frames = realloc(_frames, _frameCapacity * sizeof(*_frames));
+    }
+    _frames[_frameCount++] = (OFXMLArenaBuilderFrame){.element = element, .firstChildNode = _nodeCount};
+}
+
+- (void)parser:(OFXMLParser *)parser addCharacters:(const char *)characters length:(size_t)length inSource:(BOOL)inSource whitespace:(BOOL)whitespace;
+{
+    OBPRECONDITION(_frameCount > 0);
+
+    // Same merging as OFXMLDocument: reported whitespace starts a new child, which later non-whitespace text is appended to.
+    if (whitespace)
+        _OFXMLArenaTreeBuilderFinishText(self);
+
+    if (!_hasText) {
+        _hasText = YES;
+        _textInSource = inSource;
+        _textLength = 0;
+        if (inSource) {
+            _textSourceBytes = characters;
+            _textLength = length;
+        } else
+            _OFXMLArenaTreeBuilderAppendTextToBuffer(self, characters, length);
+        return;
+    }
+
+    if (_textInSource) {
+        if (inSource && _textSourceBytes + _textLength == characters) {
+            _textLength += length;
+            return;
+        }
+
+        // No longer a single range of the source; switch to gathering a copy.
+        size_t sourceLength = _textLength;
+        _textInSource = NO;
+        _textLength = 0;
+        _OFXMLArenaTreeBuilderAppendTextToBuffer(self, _textSourceBytes, sourceLength);
+    }
+    _OFXMLArenaTreeBuilderAppendTextToBuffer(self, characters, length);
+}
+
+- (void)parserEndElement:(OFXMLParser *)parser;
+{
+    OBPRECONDITION(_frameCount > 0);
+
+    _OFXMLArenaTreeBuilderFinishText(self);
+
+    OFXMLArenaBuilderFrame *frame = &_frames[--_frameCount];
+    OFXMLArenaElement *element = frame->element;
+
+    NSUInteger childCount = _nodeCount - frame->firstChildNode;
+    OBASSERT(childCount <= UINT32_MAX);
+    if (childCount) {
+        OFXMLArenaNode *children = OFXMLArenaAllocate(_arena, childCount * sizeof(*children));
+        memcpy(children, &_nodes[frame->firstChildNode], childCount * sizeof(*children));
+        element->children = children;
+        element->childCount = (uint32_t)childCount;
+    }
+    _nodeCount = frame->firstChildNode;
+
+    if (_frameCount == 0)
+        _rootElement = element;
+}
+
+@end
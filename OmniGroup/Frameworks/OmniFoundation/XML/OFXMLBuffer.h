@@ -10,6 +10,8 @@
 #import <Foundation/NSObject.h>
 #import <CoreFoundation/CFString.h>
 
+@class NSError, NSOutputStream;
+
 typedef struct _OFXMLBuffer *OFXMLBuffer;
 
 extern OFXMLBuffer OFXMLBufferCreate(void);
@@ -18,6 +20,14 @@ extern void OFXMLBufferDestroy(OFXMLBuffer buf);
 extern void OFXMLBufferAppendString(OFXMLBuffer buf, CFStringRef str);
 extern void OFXMLBufferAppendUTF8CString(OFXMLBuffer buf, const char *str);
 extern void OFXMLBufferAppendQuotedUTF8CString(OFXMLBuffer buf, const char *unquotedString);
+extern void OFXMLBufferAppendQuotedUTF8Bytes(OFXMLBuffer buf, const char *unquotedBytes, size_t byteCount);
+extern void OFXMLBufferAppendQuotedString(OFXMLBuffer buf, CFStringRef unquotedString, CFStringEncoding encoding);
+
+// YES for the UTF encodings, where quoting never needs character references.
+extern BOOL OFXMLEncodingCanRepresentAllCharacters(CFStringEncoding encoding);
+
+// The vector scanner the quoting functions picked for this processor, for benchmarks and logging.
+extern const char *OFXMLBufferQuotingImplementationName(void);
 
 extern void OFXMLBufferAppendUTF8Bytes(OFXMLBuffer buf, const char *str, size_t byteCount);
 extern void OFXMLBufferAppendSpaces(OFXMLBuffer buf, CFIndex count);
@@ -26,3 +36,19 @@ extern void OFXMLBufferAppendUTF8Data(OFXMLBuffer buf, CFDataRef data);
 
 extern CFDataRef OFXMLBufferCopyData(OFXMLBuffer buf, CFStringEncoding encoding);
 extern CFStringRef OFXMLBufferCopyString(OFXMLBuffer buf);
+
+/*
+ Streaming buffers.  Rather than holding the whole document, these convert their contents to 'encoding' and write them out (gzip compressed, if asked) whenever more than the flush threshold (256KB by default) has built up, so memory use stays about the same however large the document is.  Everything that appends to an OFXMLBuffer works unchanged, including -appendXML:withParentWhiteSpaceBehavior:document:level:error: on elements.  OFXMLBufferCopyData() and OFXMLBufferCopyString() aren't available on them.
+
+ Call OFXMLBufferFinishOutput() once everything is appended; it writes what is left, ends the compressed stream and reports the first error, if any write failed along the way.  The file descriptor isn't closed and the stream must already be open.
+ */
+enum {
+    OFXMLBufferOutputOptionsNone = 0,
+    OFXMLBufferOutputGzip = (1 << 0),
+};
+typedef NSUInteger OFXMLBufferOutputOptions;
+
+extern OFXMLBuffer OFXMLBufferCreateWithFileDescriptor(int fd, CFStringEncoding encoding, OFXMLBufferOutputOptions options);
+extern OFXMLBuffer OFXMLBufferCreateWithOutputStream(NSOutputStream *stream, CFStringEncoding encoding, OFXMLBufferOutputOptions options);
+extern void OFXMLBufferSetFlushThreshold(OFXMLBuffer buf, size_t flushThreshold);
+extern BOOL OFXMLBufferFinishOutput(OFXMLBuffer buf, NSError **outError);
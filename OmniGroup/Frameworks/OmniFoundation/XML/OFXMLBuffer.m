@@ -7,19 +7,71 @@
 
 #import <OmniFoundation/OFXMLBuffer.h>
 
+#import <Foundation/Foundation.h>
 #import <OmniFoundation/OFErrors.h>
+#import <OmniFoundation/OFXMLString.h>
 #import <OmniBase/rcsid.h>
 #import <OmniBase/assertions.h>
+#import <OmniBase/macros.h>
+#import <OmniBase/NSError-OBUtilities.h>
+#import <OmniBase/OBUtilities.h>
+#import <dispatch/dispatch.h>
+#import <errno.h>
+#import <unistd.h>
+#import <zlib.h>
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#define OF_XML_QUOTE_HAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__)
+#import <cpuid.h>
+#import <immintrin.h>
+#define OF_XML_QUOTE_HAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#define OF_XML_QUOTE_HAVE_NEON 1
+#endif
 
 RCS_ID("$Id$");
 
+#define OFXMLBufferDefaultFlushThreshold (256 * 1024)
+#define OFXMLBufferCompressedChunkSize (64 * 1024)
+
+// Where a streaming buffer sends its contents.  Only one of 'fd' and 'stream' is used.
+typedef struct {
+    int fd;
+    NSOutputStream *stream;
+
+    CFStringEncoding encoding;
+    size_t flushThreshold;
+    BOOL wroteBytes; // The first chunk gets the byte order mark, if the encoding has one
+
+    // Conversion out of UTF-8, for other encodings
+    uint8_t *encodedBytes;
+    size_t encodedSize;
+
+    BOOL compress;
+    z_stream zlib;
+    uint8_t *compressedBytes;
+
+    NSError *error; // The first failure; nothing more is written after it
+} OFXMLBufferOutput;
+
 // Store a buffer of UTF-8 encoded characters.
 struct _OFXMLBuffer {
     size_t used;
     size_t size;
     uint8_t *utf8;
+
+    OFXMLBufferOutput *output; // NULL unless the buffer is streaming
 };
 
+static void _OFXMLBufferFlush(OFXMLBuffer buf, BOOL finishing);
+
 OFXMLBuffer OFXMLBufferCreate(void)
 {
     return calloc(1, sizeof(struct _OFXMLBuffer));
@@ -29,15 +81,38 @@ void OFXMLBufferDestroy(OFXMLBuffer buf)
 {
     if (buf->utf8)
         free(buf->utf8);
+
+    OFXMLBufferOutput *output = buf->output;
+    if (output) {
+        [output->stream release];
+        free(output->encodedBytes);
+        if (output->compress)
+            deflateEnd(&output->zlib);
+        free(output->compressedBytes);
+        [output->error release];
+        free(output);
+    }
+
     free(buf);
 }
 
-static inline void _OFXMLBufferEnsureSpace(OFXMLBuffer buf, size_t additionalLength)
+static void _OFXMLBufferGrow(OFXMLBuffer buf, size_t additionalLength)
 {
-    if (buf->used + additionalLength > buf->size) {
-        buf->size = 2 * (buf->used + additionalLength);
-        buf->utf8 = (uint8_t *)realloc(buf->utf8, sizeof(*buf->utf8) * buf->size);
+    // A streaming buffer hands off what it has before growing past its threshold.
+    if (buf->output && buf->used >= buf->output->flushThreshold) {
+        _OFXMLBufferFlush(buf, NO);
+        if (buf->used + additionalLength <= buf->size)
+            return;
     }
+
+    buf->size = 2 * (buf->used + additionalLength);
+    buf->utf8 = (uint8_t *)realloc(buf->utf8, sizeof(*buf->utf8) * buf->size);
+}
+
+static inline void _OFXMLBufferEnsureSpace(OFXMLBuffer buf, size_t additionalLength)
+{
+    if (buf->used + additionalLength > buf->size)
+        _OFXMLBufferGrow(buf, additionalLength);
 }
 
 void OFXMLBufferAppendString(OFXMLBuffer buf, CFStringRef str)
@@ -65,52 +140,247 @@ void OFXMLBufferAppendString(OFXMLBuffer buf, CFStringRef str)
     buf->used += usedBufLen;
 }
 
-// TODO: Should probably make callers pass the length (or at least add a variant where they can)
 void OFXMLBufferAppendUTF8CString(OFXMLBuffer buf, const char *str)
 {
-    char c;
-    while ((c = *str++)) {
-        _OFXMLBufferEnsureSpace(buf, 1);
-        buf->utf8[buf->used] = c;
-        buf->used++;
+    OFXMLBufferAppendUTF8Bytes(buf, str, strlen(str));
+}
+
+#pragma mark - Quoting
+
+/*
+ Quoting spends nearly all its time looking at bytes that get copied through unchanged, so we find the next byte that needs attention a vector at a time and copy the run before it in one go.  A byte needs attention if it is one of &<>"' or a control character other than tab, newline and return (those aren't allowed in XML at all and get dropped).  Bytes of multi-byte UTF-8 sequences are all >= 0x80 and are copied through.
+
+ The scanner is picked once: AVX2 on x86 processors that have it, SSE2 on other x86 processors, NEON on 64-bit ARM and a table lookup everywhere else.  They all return the same position.
+ */
+
+typedef const uint8_t *(*OFXMLQuoteScanner)(const uint8_t *bytes, const uint8_t *end);
+static OFXMLQuoteScanner QuoteScanner;
+static const char *QuoteScannerName;
+static dispatch_once_t QuoteScannerOnce;
+
+static const uint8_t QuoteByteNeedsAttention[256] = {
+    [0x00 ... 0x1F] = 1,
+    ['\t'] = 0, ['\n'] = 0, ['\r'] = 0,
+    ['&'] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 1, ['\''] = 1,
+};
+
+static const uint8_t *_OFXMLQuoteScanScalar(const uint8_t *bytes, const uint8_t *end)
+{
+    while (bytes < end && !QuoteByteNeedsAttention[*bytes])
+        bytes++;
+    return bytes;
+}
+
+#if OF_XML_QUOTE_HAVE_SSE2
+
+static inline __m128i _OFXMLQuoteSpecialBytesSSE2(__m128i v)
+{
+    // Unsigned v <= 0x1F is a saturating subtract that comes out zero; SSE2 has no unsigned byte compare.
+    __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(v, _mm_set1_epi8(0x1F)), _mm_setzero_si128());
+    __m128i allowedControl = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    __m128i markup = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')), _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')), _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+    return _mm_or_si128(_mm_andnot_si128(allowedControl, control), markup);
+}
+
+static const uint8_t *_OFXMLQuoteScanSSE2(const uint8_t *bytes, const uint8_t *end)
+{
+    while (end - bytes >= 16) {
+        int mask = _mm_movemask_epi8(_OFXMLQuoteSpecialBytesSSE2(_mm_loadu_si128((const __m128i *)bytes)));
+        if (mask)
+            return bytes + __builtin_ctz(mask);
+        bytes += 16;
     }
+    return _OFXMLQuoteScanScalar(bytes, end);
+}
+
+#endif
+
+#if OF_XML_QUOTE_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static const uint8_t *_OFXMLQuoteScanAVX2(const uint8_t *bytes, const uint8_t *end)
+{
+    while (end - bytes >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)bytes);
+        __m256i control = _mm256_cmpeq_epi8(_mm256_subs_epu8(v, _mm256_set1_epi8(0x1F)), _mm256_setzero_si256());
+        __m256i allowedControl = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        __m256i markup = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'))),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')), _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')))));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_andnot_si256(allowedControl, control), markup));
+        if (mask)
+            return bytes + __builtin_ctz(mask);
+        bytes += 32;
+    }
+    return _OFXMLQuoteScanSSE2(bytes, end);
+}
+
+static BOOL _processorHasAVX2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return NO;
+    if ((ecx & bit_OSXSAVE) == 0 || (ecx & bit_AVX) == 0)
+        return NO;
+
+    // The OS has to be saving the YMM registers across context switches, too.
+    uint32_t xcr0Low, xcr0High;
+    __asm__ ("xgetbv" : "=a" (xcr0Low), "=d" (xcr0High) : "c" (0));
+    if ((xcr0Low & 0x6) != 0x6)
+        return NO;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return NO;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+
+#endif
+
+#if OF_XML_QUOTE_HAVE_NEON
+
+static const uint8_t *_OFXMLQuoteScanNEON(const uint8_t *bytes, const uint8_t *end)
+{
+    while (end - bytes >= 16) {
+        uint8x16_t v = vld1q_u8(bytes);
+        uint8x16_t control = vcltq_u8(v, vdupq_n_u8(0x20));
+        uint8x16_t allowedControl = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\t')), vceqq_u8(v, vdupq_n_u8('\n'))), vceqq_u8(v, vdupq_n_u8('\r')));
+        uint8x16_t markup = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('&')), vceqq_u8(v, vdupq_n_u8('<'))),
+                                     vorrq_u8(vceqq_u8(v, vdupq_n_u8('>')), vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\'')))));
+        // NEON has no movemask; once we know this block has a hit, the table finds it.
+        if (vmaxvq_u8(vorrq_u8(vbicq_u8(control, allowedControl), markup)))
+            return _OFXMLQuoteScanScalar(bytes, bytes + 16);
+        bytes += 16;
+    }
+    return _OFXMLQuoteScanScalar(bytes, end);
+}
+
+#endif
+
+static void _OFXMLQuoteSetup(void)
+{
+    dispatch_once(&QuoteScannerOnce, ^{
+        QuoteScanner = _OFXMLQuoteScanScalar;
+        QuoteScannerName = "scalar";
+#if OF_XML_QUOTE_HAVE_NEON
+        QuoteScanner = _OFXMLQuoteScanNEON;
+        QuoteScannerName = "NEON";
+#elif OF_XML_QUOTE_HAVE_SSE2
+        QuoteScanner = _OFXMLQuoteScanSSE2;
+        QuoteScannerName = "SSE2";
+#if OF_XML_QUOTE_HAVE_AVX2
+        if (_processorHasAVX2()) {
+            QuoteScanner = _OFXMLQuoteScanAVX2;
+            QuoteScannerName = "AVX2";
+        }
+#endif
+#endif
+    });
+}
+
+const char *OFXMLBufferQuotingImplementationName(void)
+{
+    _OFXMLQuoteSetup();
+    return QuoteScannerName;
 }
 
 // Appends the quoted form of the given unquoted string.  We assume the input is valid UTF-8, is NUL terminated and is not already quoted.  This is intended to operate like OFXMLCreateStringWithEntityReferencesInCFEncoding, given a mask of OFXMLBasicEntityMask and an encoding of kCFStringEncodingUTF8. We could use that, except we want to avoid creating temporary objects on this path since it is used to capture sub-element data on the iPhone.
 void OFXMLBufferAppendQuotedUTF8CString(OFXMLBuffer buf, const char *unquotedString)
 {
-    char c;
-    while ((c = *unquotedString++)) {
-        if ((c & 0x80) == 0) {
-            // A 7-bit character.  XML doesn't allow low ASCII characters (see _OFXMLCreateStringWithEntityReferences) other than some specific entries.
-            switch (c) {
+    OFXMLBufferAppendQuotedUTF8Bytes(buf, unquotedString, strlen(unquotedString));
+}
+
+// As above, but for a run of bytes that needn't be NUL terminated.
+void OFXMLBufferAppendQuotedUTF8Bytes(OFXMLBuffer buf, const char *unquotedBytes, size_t byteCount)
+{
+    _OFXMLQuoteSetup();
+
+    // Usually little or nothing needs quoting, so make room for the whole run up front.
+    _OFXMLBufferEnsureSpace(buf, byteCount);
+
+    const uint8_t *bytes = (const uint8_t *)unquotedBytes;
+    const uint8_t *end = bytes + byteCount;
+    while (bytes < end) {
+        const uint8_t *special = QuoteScanner(bytes, end);
+        if (special != bytes)
+            OFXMLBufferAppendUTF8Bytes(buf, (const char *)bytes, special - bytes);
+        if (special == end)
+            break;
+
+        switch (*special) {
 #define QUOTE_WITH(s) OFXMLBufferAppendUTF8Bytes(buf, s, strlen(s)); break
-                case '&': QUOTE_WITH("&amp;");
-                case '<': QUOTE_WITH("&lt;");
-                case '>': QUOTE_WITH("&gt;");
-                case '\'': QUOTE_WITH("&apos;");
-                case '"': QUOTE_WITH("&quot;");
+            case '&': QUOTE_WITH("&amp;");
+            case '<': QUOTE_WITH("&lt;");
+            case '>': QUOTE_WITH("&gt;");
+            case '\'': QUOTE_WITH("&apos;");
+            case '"': QUOTE_WITH("&quot;");
 #undef QUOTE_WITH
-                default:
-                    if (c >= 0x20 || c == '\n' || c == '\t' || c == '\r') {
-                        _OFXMLBufferEnsureSpace(buf, 1);
-                        buf->utf8[buf->used] = c;
-                        buf->used++;
-                    } else {
-                        // This is a low-ascii, non-whitespace byte and isn't allowed in XML character at all.  Drop it.
-                        OBASSERT(c < 0x20 && c != 0x9 && c != 0xA && c != 0xD);
-                    }
-                    break;
-            }
-        } else {
-            // Part of a UTF-8 sequence.  We assume these are valid and just pass them through.
-            _OFXMLBufferEnsureSpace(buf, 1);
-            buf->utf8[buf->used] = c;
-            buf->used++;
+            default:
+                // This is a low-ascii, non-whitespace byte and isn't allowed in XML character at all.  Drop it.
+                OBASSERT(*special < 0x20 && *special != 0x9 && *special != 0xA && *special != 0xD);
+                break;
         }
+        bytes = special + 1;
+    }
+}
+
+#define QUOTED_STRING_STACK_BUFFER_SIZE (1024)
+
+BOOL OFXMLEncodingCanRepresentAllCharacters(CFStringEncoding encoding)
+{
+    switch (encoding) {
+        case kCFStringEncodingUTF8:
+        case kCFStringEncodingUnicode:
+        case kCFStringEncodingUTF16BE:
+        case kCFStringEncodingUTF16LE:
+        case kCFStringEncodingUTF32:
+        case kCFStringEncodingUTF32BE:
+        case kCFStringEncodingUTF32LE:
+            return YES;
+        default:
+            return NO;
     }
 }
 
+// Same output as appending OFXMLCreateStringWithEntityReferencesInCFEncoding(unquotedString, OFXMLBasicEntityMask, nil, encoding), without the intermediate strings when the encoding can represent everything.
+void OFXMLBufferAppendQuotedString(OFXMLBuffer buf, CFStringRef unquotedString, CFStringEncoding encoding)
+{
+    OBPRECONDITION(unquotedString);
+    if (!unquotedString)
+        return;
+
+    if (OFXMLEncodingCanRepresentAllCharacters(encoding)) {
+        CFIndex characterCount = CFStringGetLength(unquotedString);
+
+        // CF only hands out a UTF-8 pointer for strings it stores as ASCII, so the byte count is the character count (and embedded NULs are counted, unlike with strlen()).
+        const char *utf8 = CFStringGetCStringPtr(unquotedString, kCFStringEncodingUTF8);
+        if (utf8) {
+            OFXMLBufferAppendQuotedUTF8Bytes(buf, utf8, characterCount);
+            return;
+        }
+
+        CFIndex maximumLength = CFStringGetMaximumSizeForEncoding(characterCount, kCFStringEncodingUTF8);
+        char stackBuffer[QUOTED_STRING_STACK_BUFFER_SIZE];
+        char *utf8Buffer = maximumLength <= QUOTED_STRING_STACK_BUFFER_SIZE ? stackBuffer : malloc(maximumLength);
+
+        CFIndex usedLength = 0;
+        CFIndex charactersConverted = CFStringGetBytes(unquotedString, CFRangeMake(0, characterCount), kCFStringEncodingUTF8, 0/*lossByte; loss not allowed*/, false/*isExternalRepresentation*/,
+                                                       (UInt8 *)utf8Buffer, maximumLength, &usedLength);
+        if (charactersConverted == characterCount)
+            OFXMLBufferAppendQuotedUTF8Bytes(buf, utf8Buffer, usedLength);
+
+        if (utf8Buffer != stackBuffer)
+            free(utf8Buffer);
+        if (charactersConverted == characterCount)
+            return;
+        // Otherwise, something unconvertable like an unpaired surrogate; let the general path decide what to do with it.
+    }
+
+    NSString *quotedString = OFXMLCreateStringWithEntityReferencesInCFEncoding((NSString *)unquotedString, OFXMLBasicEntityMask, nil, encoding);
+    OFXMLBufferAppendString(buf, (CFStringRef)quotedString);
+    [quotedString release];
+}
+
 void OFXMLBufferAppendUTF8Bytes(OFXMLBuffer buf, const char *str, size_t byteCount)
 {
     _OFXMLBufferEnsureSpace(buf, byteCount);
@@ -134,6 +404,8 @@ void OFXMLBufferAppendUTF8Data(OFXMLBuffer buf, CFDataRef data)
 
 CFDataRef OFXMLBufferCopyData(OFXMLBuffer buf, CFStringEncoding encoding)
 {
+    OBPRECONDITION(!buf->output); // Streaming buffers don't hold on to what they've written
+    
     if (encoding == kCFStringEncodingUTF8)
         return CFDataCreate(kCFAllocatorDefault, buf->utf8, buf->used);
     
@@ -147,5 +419,194 @@ CFDataRef OFXMLBufferCopyData(OFXMLBuffer buf, CFStringEncoding encoding)
 
 CFStringRef OFXMLBufferCopyString(OFXMLBuffer buf)
 {
+    OBPRECONDITION(!buf->output);
     return CFStringCreateWithBytes(kCFAllocatorDefault, buf->utf8, buf->used, kCFStringEncodingUTF8, false/*isExternalRepresentation*/);
 }
+
+#pragma mark - Streaming output
+
+static OFXMLBuffer _OFXMLBufferCreateWithOutput(int fd, NSOutputStream *stream, CFStringEncoding encoding, OFXMLBufferOutputOptions options)
+{
+    OFXMLBuffer buf = OFXMLBufferCreate();
+
+    OFXMLBufferOutput *output = calloc(1, sizeof(*output));
+    output->fd = fd;
+    output->stream = [stream retain];
+    output->encoding = encoding;
+    output->flushThreshold = OFXMLBufferDefaultFlushThreshold;
+
+    if (options & OFXMLBufferOutputGzip) {
+        // MAX_WBITS + 16 asks zlib for the gzip wrapper, as in OFGzipCompressTransform.
+        if (deflateInit2(&output->zlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            output->compress = YES;
+            output->compressedBytes = malloc(OFXMLBufferCompressedChunkSize);
+        } else {
+            NSError *error = nil;
+            OFError(&error, OFUnableToCompressData, NSLocalizedStringFromTableInBundle(@"Unable to compress data.", @"OmniFoundation", OMNI_BUNDLE, @"compression error description"), output->zlib.msg ? [NSString stringWithUTF8String:output->zlib.msg] : nil);
+            output->error = [error retain];
+        }
+    }
+
+    buf->output = output;
+    return buf;
+}
+
+OFXMLBuffer OFXMLBufferCreateWithFileDescriptor(int fd, CFStringEncoding encoding, OFXMLBufferOutputOptions options)
+{
+    OBPRECONDITION(fd >= 0);
+    return _OFXMLBufferCreateWithOutput(fd, nil, encoding, options);
+}
+
+OFXMLBuffer OFXMLBufferCreateWithOutputStream(NSOutputStream *stream, CFStringEncoding encoding, OFXMLBufferOutputOptions options)
+{
+    OBPRECONDITION(stream);
+    return _OFXMLBufferCreateWithOutput(-1, stream, encoding, options);
+}
+
+void OFXMLBufferSetFlushThreshold(OFXMLBuffer buf, size_t flushThreshold)
+{
+    OBPRECONDITION(buf->output);
+    OBPRECONDITION(flushThreshold > 0);
+    if (buf->output)
+        buf->output->flushThreshold = flushThreshold;
+}
+
+static BOOL _OFXMLBufferOutputWriteRaw(OFXMLBufferOutput *output, const uint8_t *bytes, size_t length)
+{
+    while (length > 0) {
+        if (output->stream) {
+            NSInteger written = [output->stream write:bytes maxLength:length];
+            if (written <= 0) {
+                NSError *streamError = [output->stream streamError];
+                if (!streamError) {
+                    // Zero means the stream is at capacity; we have no way to wait for room, so treat it as a failure.
+                    OBErrorWithErrno(&streamError, ENOSPC, "write", nil, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
+                }
+                output->error = [streamError retain];
+                return NO;
+            }
+            bytes += written;
+            length -= written;
+        } else {
+            ssize_t written = write(output->fd, bytes, length);
+            if (written < 0) {
+                if (OMNI_ERRNO() == EINTR)
+                    continue;
+                NSError *error = nil;
+                OBErrorWithErrno(&error, OMNI_ERRNO(), "write", nil, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
+                output->error = [error retain];
+                return NO;
+            }
+            bytes += written;
+            length -= written;
+        }
+    }
+    return YES;
+}
+
+static BOOL _OFXMLBufferOutputCompress(OFXMLBufferOutput *output, const uint8_t *bytes, size_t length, BOOL finishing)
+{
+    z_stream *zlib = &output->zlib;
+    zlib->next_in = (Bytef *)bytes;
+    zlib->avail_in = (uInt)length;
+
+    while (YES) {
+        zlib->next_out = output->compressedBytes;
+        zlib->avail_out = OFXMLBufferCompressedChunkSize;
+
+        int rc = deflate(zlib, finishing ? Z_FINISH : Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            NSError *error = nil;
+            OFError(&error, OFUnableToCompressData, NSLocalizedStringFromTableInBundle(@"Unable to compress data.", @"OmniFoundation", OMNI_BUNDLE, @"compression error description"), zlib->msg ? [NSString stringWithUTF8String:zlib->msg] : nil);
+            output->error = [error retain];
+            return NO;
+        }
+
+        size_t compressedLength = OFXMLBufferCompressedChunkSize - zlib->avail_out;
+        if (compressedLength && !_OFXMLBufferOutputWriteRaw(output, output->compressedBytes, compressedLength))
+            return NO;
+
+        if (finishing ? (rc == Z_STREAM_END) : (zlib->avail_in == 0 && zlib->avail_out != 0))
+            return YES;
+    }
+}
+
+static BOOL _OFXMLBufferOutputWrite(OFXMLBufferOutput *output, const uint8_t *bytes, size_t length, BOOL finishing)
+{
+    if (output->encoding != kCFStringEncodingUTF8 && length > 0) {
+        // Convert just this chunk.  Only the first one gets a byte order mark, just as it would from CFStringCreateExternalRepresentation() on the whole document.
+        CFStringRef string = CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, bytes, length, kCFStringEncodingUTF8, false/*isExternalRepresentation*/, kCFAllocatorNull/*no free*/);
+        CFIndex characterCount = string ? CFStringGetLength(string) : 0;
+        CFIndex maximumLength = CFStringGetMaximumSizeForEncoding(characterCount, output->encoding) + 4/*byte order mark*/;
+        if (output->encodedSize < (size_t)maximumLength) {
+            output->encodedSize = maximumLength;
+            output->encodedBytes = realloc(output->encodedBytes, output->encodedSize);
+        }
+
+        CFIndex encodedLength = 0;
+        CFIndex charactersConverted = string ? CFStringGetBytes(string, CFRangeMake(0, characterCount), output->encoding, 0/*lossByte*/, !output->wroteBytes/*isExternalRepresentation*/, output->encodedBytes, maximumLength, &encodedLength) : 0;
+        if (string)
+            CFRelease(string);
+
+        if (!string || charactersConverted != characterCount) {
+            NSError *error = nil;
+            OFError(&error, OFXMLBufferCannotEncodeOutput, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"), NSLocalizedStringFromTableInBundle(@"The text could not be converted to the document's encoding.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"));
+            output->error = [error retain];
+            return NO;
+        }
+        bytes = output->encodedBytes;
+        length = encodedLength;
+    }
+    output->wroteBytes = YES;
+
+    if (output->compress)
+        return _OFXMLBufferOutputCompress(output, bytes, length, finishing);
+    return _OFXMLBufferOutputWriteRaw(output, bytes, length);
+}
+
+// The length of the longest prefix of 'bytes' that doesn't end partway through a UTF-8 sequence, so each chunk converts on its own.  Appends are almost always whole characters anyway; this is for the odd raw byte append.
+static size_t _OFXMLCompleteUTF8Length(const uint8_t *bytes, size_t length)
+{
+    size_t sequenceStart = length;
+    while (sequenceStart > 0 && length - sequenceStart < 4) {
+        uint8_t c = bytes[sequenceStart - 1];
+        if ((c & 0xC0) != 0x80) {
+            // Found the lead (or ASCII) byte of the last sequence
+            size_t sequenceLength = (c < 0x80) ? 1 : (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+            return (length - (sequenceStart - 1) >= sequenceLength) ? length : sequenceStart - 1;
+        }
+        sequenceStart--;
+    }
+    return length; // Not UTF-8; let the conversion complain about it
+}
+
+static void _OFXMLBufferFlush(OFXMLBuffer buf, BOOL finishing)
+{
+    OFXMLBufferOutput *output = buf->output;
+    size_t length = finishing ? buf->used : _OFXMLCompleteUTF8Length(buf->utf8, buf->used);
+
+    // After a failure we keep throwing output away so that memory stays bounded; the caller hears about it from OFXMLBufferFinishOutput().
+    if (!output->error && (length > 0 || finishing))
+        _OFXMLBufferOutputWrite(output, buf->utf8, length, finishing);
+
+    if (length < buf->used)
+        memmove(buf->utf8, buf->utf8 + length, buf->used - length);
+    buf->used -= length;
+}
+
+BOOL OFXMLBufferFinishOutput(OFXMLBuffer buf, NSError **outError)
+{
+    OBPRECONDITION(buf->output);
+    if (!buf->output)
+        return YES;
+
+    _OFXMLBufferFlush(buf, YES);
+
+    NSError *error = buf->output->error;
+    if (error) {
+        if (outError)
+            *outError = [[error retain] autorelease];
+        return NO;
+    }
+    return YES;
+}
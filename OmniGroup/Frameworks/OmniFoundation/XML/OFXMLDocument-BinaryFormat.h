@@ -0,0 +1,29 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFXMLDocument.h>
+
+/*
+ A compact binary form of a document, for caches and other files that only we read back.  Element and attribute names are stored once, in a name table, and referred to by index; counts and lengths are varints and text is length-prefixed UTF-8, so loading is a single pass over the bytes with no tokenizing or entity handling.  Writing the loaded document out as XML gives the same bytes as writing the original.
+
+ Elements, strings and OFXMLUnparsedElements are stored.  An OFXMLLazyElement that was never loaded is stored as its source bytes and comes back as an OFXMLLazyElement pointing into the binary data.  Anything else in the tree (OFXMLString, OFXMLComment, frozen elements, ...) makes -binaryData: fail.  User objects aren't stored.
+ */
+@interface OFXMLDocument (BinaryFormat)
+
++ (BOOL)isBinaryData:(NSData *)data; // Just checks the header
+
+// With OFXMLDocumentLoadInParallel, the children of the root element are decoded on several threads (the format keeps an index of where each one starts).  Other options are ignored.  The data must not change while the document is alive, since lazy elements refer into it.
+- initWithBinaryData:(NSData *)binaryData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+
+// Maps the file rather than reading it.
+- initWithContentsOfBinaryFile:(NSString *)path whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+
+- (NSData *)binaryData:(NSError **)outError;
+
+@end
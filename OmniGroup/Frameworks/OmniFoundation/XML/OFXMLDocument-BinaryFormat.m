@@ -0,0 +1,836 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFXMLDocument-BinaryFormat.h>
+
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+
+#import <OmniFoundation/OFErrors.h>
+#import <OmniFoundation/OFXMLElement.h>
+#import <OmniFoundation/OFXMLInternedStringTable.h>
+#import <OmniFoundation/OFXMLLazyElement.h>
+#import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/OFXMLUnparsedElement.h>
+#import <OmniFoundation/OFXMLWhitespaceBehavior.h>
+
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$")
+
+/*
+ Layout.  Fixed width integers are little-endian; a "varint" is unsigned LEB128 (seven bits per byte, low bits first, high bit set on all but the last byte).
+
+   Header (48 bytes): "OFXMLBIN", uint32 format version, uint32 reserved (zero), then uint64 offsets of the tree, the name table and the index, and uint64 total length.
+   Document info, right after the header: varint string encoding, a standalone byte, optional strings for the XML version, DTD system ID and DTD public ID, then a varint processing instruction count and a name and value string for each.
+   Tree: the root element's node.
+   Name table: varint count, then for each name a varint byte count, the UTF-8 bytes and a NUL.
+   Index: varint count of the root element's stored children, then the varint offset of each one's node.
+
+ A string is a varint byte count followed by UTF-8.  An optional string stores its byte count plus one, with zero for nil.  Each node starts with a kind byte:
+   element: varint name index, varint attribute count, a varint name index and value string per attribute, varint child count, the child nodes
+   text: string
+   unparsed element: optional namespace string, name string, optional identifier string, varint data length and the data
+   lazy element: varint name index, varint parent whitespace behavior, varint namespace declaration count, a key and URI string per declaration, varint source length and the source bytes
+ */
+
+static const char OFXMLBinaryFormatMagic[8] = {'O', 'F', 'X', 'M', 'L', 'B', 'I', 'N'};
+
+enum {
+    OFXMLBinaryFormatVersion = 1,
+    OFXMLBinaryFormatHeaderLength = 48,
+
+    // Deeper than any document we'd write, but shallow enough that corrupt data can't run us out of stack.
+    OFXMLBinaryFormatMaximumDepth = 4096,
+
+    // Below this, handing the root element's children out to other threads costs more than it saves.
+    OFXMLBinaryFormatMinimumParallelChildCount = 64,
+};
+
+enum {
+    OFXMLBinaryNodeElement = 1,
+    OFXMLBinaryNodeText,
+    OFXMLBinaryNodeUnparsedElement,
+    OFXMLBinaryNodeLazyElement,
+};
+
+static NSString *_OFXMLBinaryFormatReadErrorDescription(void)
+{
+    return NSLocalizedStringFromTableInBundle(@"Unable to read binary XML document.", @"OmniFoundation", OMNI_BUNDLE, @"error description");
+}
+
+#pragma mark -
+#pragma mark Writing
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+
+    CFMutableDictionaryRef nameIndexes; // NSString -> index + 1
+    NSMutableArray *names;
+
+    uint64_t *rootChildOffsets;
+    NSUInteger rootChildCount;
+} OFXMLBinaryWriter;
+
+static uint8_t *_OFXMLBinaryWriterReserve(OFXMLBinaryWriter *writer, size_t count)
+{
+    if (writer->capacity - writer->length < count) {
+        size_t capacity = MAX(2 * writer->capacity, writer->length + count);
+        capacity = MAX(capacity, (size_t)16384);
+        writer->bytes = reallocf(writer->bytes, capacity);
+        if (!writer->bytes)
+            [NSException raise:NSMallocException format:@"Unable to allocate %zu bytes for binary XML", capacity];
+        writer->capacity = capacity;
+    }
+    return writer->bytes + writer->length;
+}
+
+static void _OFXMLBinaryWriterAppendBytes(OFXMLBinaryWriter *writer, const void *bytes, size_t count)
+{
+    memcpy(_OFXMLBinaryWriterReserve(writer, count), bytes, count);
+    writer->length += count;
+}
+
+static void _OFXMLBinaryWriterAppendByte(OFXMLBinaryWriter *writer, uint8_t byte)
+{
+    *_OFXMLBinaryWriterReserve(writer, 1) = byte;
+    writer->length++;
+}
+
+static void _OFXMLBinaryWriterAppendVarint(OFXMLBinaryWriter *writer, uint64_t value)
+{
+    uint8_t *bytes = _OFXMLBinaryWriterReserve(writer, 10);
+    size_t count = 0;
+    while (value >= 0x80) {
+        bytes[count++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    bytes[count++] = (uint8_t)value;
+    writer->length += count;
+}
+
+// The byte count gets 'bias' added, so optional strings can reserve zero for nil.
+static void _OFXMLBinaryWriterAppendStringWithBias(OFXMLBinaryWriter *writer, NSString *string, uint64_t bias)
+{
+    CFRange range = CFRangeMake(0, CFStringGetLength((CFStringRef)string));
+    CFIndex byteCount = 0;
+    CFStringGetBytes((CFStringRef)string, range, kCFStringEncodingUTF8, 0/*lossByte*/, false/*isExternalRepresentation*/, NULL, 0, &byteCount);
+
+    _OFXMLBinaryWriterAppendVarint(writer, (uint64_t)byteCount + bias);
+    uint8_t *bytes = _OFXMLBinaryWriterReserve(writer, byteCount);
+    CFStringGetBytes((CFStringRef)string, range, kCFStringEncodingUTF8, 0/*lossByte*/, false/*isExternalRepresentation*/, bytes, byteCount, NULL);
+    writer->length += byteCount;
+}
+
+static void _OFXMLBinaryWriterAppendString(OFXMLBinaryWriter *writer, NSString *string)
+{
+    OBPRECONDITION(string);
+    _OFXMLBinaryWriterAppendStringWithBias(writer, string ? string : @"", 0);
+}
+
+static void _OFXMLBinaryWriterAppendOptionalString(OFXMLBinaryWriter *writer, NSString *string)
+{
+    if (string)
+        _OFXMLBinaryWriterAppendStringWithBias(writer, string, 1);
+    else
+        _OFXMLBinaryWriterAppendVarint(writer, 0);
+}
+
+static void _OFXMLBinaryWriterAppendName(OFXMLBinaryWriter *writer, NSString *name)
+{
+    uintptr_t indexPlusOne = (uintptr_t)CFDictionaryGetValue(writer->nameIndexes, name);
+    if (indexPlusOne == 0) {
+        [writer->names addObject:name];
+        indexPlusOne = [writer->names count];
+        CFDictionarySetValue(writer->nameIndexes, name, (const void *)indexPlusOne);
+    }
+    _OFXMLBinaryWriterAppendVarint(writer, indexPlusOne - 1);
+}
+
+static BOOL _OFXMLBinaryShouldWriteChild(id child)
+{
+    // Matches the children -[OFXMLElement appendXML:...] skips.
+    if ([child respondsToSelector:@selector(shouldIgnore)] && [child shouldIgnore])
+        return NO;
+    return YES;
+}
+
+static BOOL _OFXMLBinaryWriterAppendNode(OFXMLBinaryWriter *writer, id node, BOOL isRoot, NSError **outError);
+
+static BOOL _OFXMLBinaryWriterAppendElement(OFXMLBinaryWriter *writer, OFXMLElement *element, BOOL isRoot, NSError **outError)
+{
+    _OFXMLBinaryWriterAppendByte(writer, OFXMLBinaryNodeElement);
+    _OFXMLBinaryWriterAppendName(writer, [element name]);
+
+    // Attributes without values aren't written as XML either.
+    NSArray *attributeNames = [element attributeNames];
+    NSUInteger attributeCount = 0;
+    for (NSString *attributeName in attributeNames) {
+        if ([element attributeNamed:attributeName])
+            attributeCount++;
+    }
+    _OFXMLBinaryWriterAppendVarint(writer, attributeCount);
+    for (NSString *attributeName in attributeNames) {
+        NSString *value = [element attributeNamed:attributeName];
+        if (!value)
+            continue;
+        _OFXMLBinaryWriterAppendName(writer, attributeName);
+        _OFXMLBinaryWriterAppendString(writer, value);
+    }
+
+    NSArray *children = [element children];
+    NSUInteger childCount = 0;
+    for (id child in children) {
+        if (_OFXMLBinaryShouldWriteChild(child))
+            childCount++;
+    }
+    _OFXMLBinaryWriterAppendVarint(writer, childCount);
+
+    if (isRoot) {
+        OBASSERT(writer->rootChildOffsets == NULL);
+        writer->rootChildOffsets = malloc(MAX(childCount, 1U) * sizeof(*writer->rootChildOffsets));
+        writer->rootChildCount = childCount;
+    }
+
+    NSUInteger childIndex = 0;
+    for (id child in children) {
+        if (!_OFXMLBinaryShouldWriteChild(child))
+            continue;
+        if (isRoot)
+            writer->rootChildOffsets[childIndex] = writer->length;
+        childIndex++;
+        if (!_OFXMLBinaryWriterAppendNode(writer, child, NO, outError))
+            return NO;
+    }
+    OBASSERT(childIndex == childCount);
+
+    return YES;
+}
+
+static BOOL _OFXMLBinaryWriterAppendNode(OFXMLBinaryWriter *writer, id node, BOOL isRoot, NSError **outError)
+{
+    if ([node isKindOfClass:[NSString class]]) {
+        _OFXMLBinaryWriterAppendByte(writer, OFXMLBinaryNodeText);
+        _OFXMLBinaryWriterAppendString(writer, node);
+        return YES;
+    }
+
+    if ([node isKindOfClass:[OFXMLLazyElement class]] && ![node isLoaded]) {
+        OFXMLLazyElement *lazyElement = node;
+        _OFXMLBinaryWriterAppendByte(writer, OFXMLBinaryNodeLazyElement);
+        _OFXMLBinaryWriterAppendName(writer, [lazyElement name]);
+        _OFXMLBinaryWriterAppendVarint(writer, lazyElement.parentWhitespaceBehavior);
+
+        NSDictionary *namespaceDeclarations = lazyElement.namespaceDeclarations;
+        _OFXMLBinaryWriterAppendVarint(writer, [namespaceDeclarations count]);
+        [namespaceDeclarations enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSString *namespaceURI, BOOL *stop) {
+            _OFXMLBinaryWriterAppendString(writer, key);
+            _OFXMLBinaryWriterAppendString(writer, namespaceURI);
+        }];
+
+        NSRange sourceRange = lazyElement.sourceRange;
+        _OFXMLBinaryWriterAppendVarint(writer, sourceRange.length);
+        _OFXMLBinaryWriterAppendBytes(writer, (const uint8_t *)[lazyElement.sourceData bytes] + sourceRange.location, sourceRange.length);
+        return YES;
+    }
+
+    if ([node isKindOfClass:[OFXMLElement class]])
+        return _OFXMLBinaryWriterAppendElement(writer, node, isRoot, outError);
+
+    if ([node isKindOfClass:[OFXMLUnparsedElement class]]) {
+        OFXMLUnparsedElement *unparsedElement = node;
+        OFXMLQName *qname = unparsedElement.qname;
+        NSData *data = unparsedElement.data;
+
+        _OFXMLBinaryWriterAppendByte(writer, OFXMLBinaryNodeUnparsedElement);
+        _OFXMLBinaryWriterAppendOptionalString(writer, qname.namespace);
+        _OFXMLBinaryWriterAppendString(writer, qname.name);
+        _OFXMLBinaryWriterAppendOptionalString(writer, unparsedElement.identifier);
+        _OFXMLBinaryWriterAppendVarint(writer, [data length]);
+        _OFXMLBinaryWriterAppendBytes(writer, [data bytes], [data length]);
+        return YES;
+    }
+
+    NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to write binary XML document.", @"OmniFoundation", OMNI_BUNDLE, @"error description");
+    NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"The binary XML format cannot store a %@.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"), NSStringFromClass([node class])];
+    OFError(outError, OFXMLDocumentUnsupportedBinaryNode, description, reason);
+    return NO;
+}
+
+static void _OFXMLBinaryStoreUInt32(uint8_t *bytes, uint32_t value)
+{
+    value = CFSwapInt32HostToLittle(value);
+    memcpy(bytes, &value, sizeof(value));
+}
+
+static void _OFXMLBinaryStoreUInt64(uint8_t *bytes, uint64_t value)
+{
+    value = CFSwapInt64HostToLittle(value);
+    memcpy(bytes, &value, sizeof(value));
+}
+
+#pragma mark -
+#pragma mark Reading
+
+typedef struct {
+    const uint8_t *bytes;
+    size_t length;
+    size_t offset;
+    BOOL failed; // Set on the first out-of-bounds or malformed read; everything after that reads as zero/nil.
+} OFXMLBinaryReader;
+
+typedef struct {
+    NSData *data;
+    NSString **names;
+    uint64_t nameCount;
+    OFXMLWhitespaceBehavior *whitespaceBehavior;
+} OFXMLBinaryDecoder;
+
+static uint64_t _OFXMLBinaryLoadUInt64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt64LittleToHost(value);
+}
+
+static uint32_t _OFXMLBinaryLoadUInt32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt32LittleToHost(value);
+}
+
+static inline size_t _OFXMLBinaryReaderRemaining(const OFXMLBinaryReader *reader)
+{
+    return reader->length - reader->offset;
+}
+
+static uint64_t _OFXMLBinaryReaderReadVarint(OFXMLBinaryReader *reader)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64 && reader->offset < reader->length; shift += 7) {
+        uint8_t byte = reader->bytes[reader->offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    reader->failed = YES;
+    return 0;
+}
+
+static const uint8_t *_OFXMLBinaryReaderReadBytes(OFXMLBinaryReader *reader, uint64_t count)
+{
+    if (reader->failed || count > _OFXMLBinaryReaderRemaining(reader)) {
+        reader->failed = YES;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+static uint8_t _OFXMLBinaryReaderReadByte(OFXMLBinaryReader *reader)
+{
+    const uint8_t *byte = _OFXMLBinaryReaderReadBytes(reader, 1);
+    return byte ? *byte : 0;
+}
+
+// Counts of things that take at least a byte each can't be more than what's left; checking up front keeps corrupt counts from turning into huge allocations.
+static uint64_t _OFXMLBinaryReaderReadCount(OFXMLBinaryReader *reader)
+{
+    uint64_t count = _OFXMLBinaryReaderReadVarint(reader);
+    if (count > _OFXMLBinaryReaderRemaining(reader)) {
+        reader->failed = YES;
+        return 0;
+    }
+    return count;
+}
+
+static NSString *_OFXMLBinaryReaderCopyStringOfLength(OFXMLBinaryReader *reader, uint64_t length)
+{
+    const uint8_t *bytes = _OFXMLBinaryReaderReadBytes(reader, length);
+    if (!bytes)
+        return nil;
+
+    NSString *string = (NSString *)CFStringCreateWithBytes(kCFAllocatorDefault, bytes, (CFIndex)length, kCFStringEncodingUTF8, false/*isExternalRepresentation*/);
+    if (!string)
+        reader->failed = YES;
+    return string;
+}
+
+static NSString *_OFXMLBinaryReaderCopyString(OFXMLBinaryReader *reader)
+{
+    uint64_t length = _OFXMLBinaryReaderReadVarint(reader);
+    return _OFXMLBinaryReaderCopyStringOfLength(reader, length);
+}
+
+static NSString *_OFXMLBinaryReaderCopyOptionalString(OFXMLBinaryReader *reader)
+{
+    uint64_t biasedLength = _OFXMLBinaryReaderReadVarint(reader);
+    if (biasedLength == 0)
+        return nil;
+    return _OFXMLBinaryReaderCopyStringOfLength(reader, biasedLength - 1);
+}
+
+static NSString *_OFXMLBinaryReaderReadName(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder)
+{
+    uint64_t nameIndex = _OFXMLBinaryReaderReadVarint(reader);
+    if (reader->failed || nameIndex >= decoder->nameCount) {
+        reader->failed = YES;
+        return nil;
+    }
+    return decoder->names[nameIndex];
+}
+
+static id _OFXMLBinaryReaderCopyNode(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder, unsigned int depth) NS_RETURNS_RETAINED;
+
+// Reads an element's name and attributes, leaving the reader at its children.
+static OFXMLElement *_OFXMLBinaryReaderCopyElementStart(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder, uint64_t *outChildCount) NS_RETURNS_RETAINED;
+static OFXMLElement *_OFXMLBinaryReaderCopyElementStart(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder, uint64_t *outChildCount)
+{
+    NSString *name = _OFXMLBinaryReaderReadName(reader, decoder);
+
+    NSMutableArray *attributeOrder = nil;
+    NSMutableDictionary *attributes = nil;
+    uint64_t attributeCount = _OFXMLBinaryReaderReadCount(reader);
+    if (attributeCount > 0) {
+        attributeOrder = [[NSMutableArray alloc] initWithCapacity:attributeCount];
+        attributes = [[NSMutableDictionary alloc] initWithCapacity:attributeCount];
+        for (uint64_t attributeIndex = 0; attributeIndex < attributeCount && !reader->failed; attributeIndex++) {
+            NSString *attributeName = _OFXMLBinaryReaderReadName(reader, decoder);
+            NSString *value = _OFXMLBinaryReaderCopyString(reader);
+            if (value && [attributes objectForKey:attributeName] == nil) {
+                [attributeOrder addObject:attributeName];
+                [attributes setObject:value forKey:attributeName];
+            } else
+                reader->failed = YES;
+            [value release];
+        }
+    }
+    *outChildCount = _OFXMLBinaryReaderReadCount(reader);
+
+    OFXMLElement *element = nil;
+    if (!reader->failed)
+        element = [[OFXMLElement alloc] initWithName:name attributeOrder:attributeOrder attributes:attributes];
+    [attributeOrder release];
+    [attributes release];
+    return element;
+}
+
+static BOOL _OFXMLBinaryReaderAppendChildren(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder, OFXMLElement *element, uint64_t childCount, unsigned int depth)
+{
+    for (uint64_t childIndex = 0; childIndex < childCount && !reader->failed; childIndex++) {
+        id child = _OFXMLBinaryReaderCopyNode(reader, decoder, depth + 1);
+        if (child) {
+            [element appendChild:child];
+            [child release];
+        }
+    }
+    return !reader->failed;
+}
+
+static id _OFXMLBinaryReaderCopyNode(OFXMLBinaryReader *reader, const OFXMLBinaryDecoder *decoder, unsigned int depth)
+{
+    if (depth > OFXMLBinaryFormatMaximumDepth) {
+        reader->failed = YES;
+        return nil;
+    }
+
+    uint8_t kind = _OFXMLBinaryReaderReadByte(reader);
+    switch (kind) {
+        case OFXMLBinaryNodeElement: {
+            uint64_t childCount = 0;
+            OFXMLElement *element = _OFXMLBinaryReaderCopyElementStart(reader, decoder, &childCount);
+            if (element && !_OFXMLBinaryReaderAppendChildren(reader, decoder, element, childCount, depth)) {
+                [element release];
+                element = nil;
+            }
+            return element;
+        }
+
+        case OFXMLBinaryNodeText:
+            return _OFXMLBinaryReaderCopyString(reader);
+
+        case OFXMLBinaryNodeUnparsedElement: {
+            NSString *namespace = _OFXMLBinaryReaderCopyOptionalString(reader);
+            NSString *name = _OFXMLBinaryReaderCopyString(reader);
+            NSString *identifier = _OFXMLBinaryReaderCopyOptionalString(reader);
+            uint64_t dataLength = _OFXMLBinaryReaderReadVarint(reader);
+            const uint8_t *dataBytes = _OFXMLBinaryReaderReadBytes(reader, dataLength);
+
+            OFXMLUnparsedElement *unparsedElement = nil;
+            if (!reader->failed) {
+                // Copied, since the element may well outlive a mapped file.
+                NSData *data = [[NSData alloc] initWithBytes:dataBytes length:dataLength];
+                OFXMLQName *qname = [[OFXMLQName alloc] initWithNamespace:namespace name:name];
+                unparsedElement = [[OFXMLUnparsedElement alloc] initWithQName:qname identifier:identifier data:data];
+                [qname release];
+                [data release];
+            }
+            [namespace release];
+            [name release];
+            [identifier release];
+            return unparsedElement;
+        }
+
+        case OFXMLBinaryNodeLazyElement: {
+            NSString *name = _OFXMLBinaryReaderReadName(reader, decoder);
+            uint64_t parentWhitespaceBehavior = _OFXMLBinaryReaderReadVarint(reader);
+            if (parentWhitespaceBehavior > OFXMLWhitespaceBehaviorTypePreserve)
+                reader->failed = YES;
+
+            NSMutableDictionary *namespaceDeclarations = [[NSMutableDictionary alloc] init];
+            uint64_t declarationCount = _OFXMLBinaryReaderReadCount(reader);
+            for (uint64_t declarationIndex = 0; declarationIndex < declarationCount && !reader->failed; declarationIndex++) {
+                NSString *key = _OFXMLBinaryReaderCopyString(reader);
+                NSString *namespaceURI = _OFXMLBinaryReaderCopyString(reader);
+                if (key && namespaceURI)
+                    [namespaceDeclarations setObject:namespaceURI forKey:key];
+                [key release];
+                [namespaceURI release];
+            }
+
+            uint64_t sourceLength = _OFXMLBinaryReaderReadVarint(reader);
+            const uint8_t *sourceBytes = _OFXMLBinaryReaderReadBytes(reader, sourceLength);
+
+            OFXMLLazyElement *lazyElement = nil;
+            if (!reader->failed) {
+                // Refers into the binary data, so nothing is copied until the element is loaded.
+                NSRange sourceRange = NSMakeRange(sourceBytes - (const uint8_t *)[decoder->data bytes], (NSUInteger)sourceLength);
+                lazyElement = [[OFXMLLazyElement alloc] initWithName:name sourceData:decoder->data range:sourceRange namespaceDeclarations:namespaceDeclarations whitespaceBehavior:decoder->whitespaceBehavior parentWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)parentWhitespaceBehavior];
+            }
+            [namespaceDeclarations release];
+            return lazyElement;
+        }
+
+        default:
+            reader->failed = YES;
+            return nil;
+    }
+}
+
+// The interned name table assumes its input is valid, so check names before handing them over.
+static BOOL _OFXMLBinaryIsValidUTF8(const uint8_t *bytes, size_t length)
+{
+    CFStringRef string = CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, bytes, (CFIndex)length, kCFStringEncodingUTF8, false/*isExternalRepresentation*/, kCFAllocatorNull);
+    if (!string)
+        return NO;
+    CFRelease(string);
+    return YES;
+}
+
+// Returns the offsets of the root element's children, or NULL if the index doesn't match the tree or run exactly to the end of the data.
+static uint64_t *_OFXMLBinaryCopyIndex(NSData *data, uint64_t childCount, size_t treeStart, size_t treeEnd, size_t indexOffset)
+{
+    OFXMLBinaryReader indexReader = {[data bytes], [data length], indexOffset, NO};
+    if (_OFXMLBinaryReaderReadCount(&indexReader) != childCount || indexReader.failed)
+        return NULL;
+
+    uint64_t *offsets = malloc(MAX(childCount, 1ULL) * sizeof(*offsets));
+    uint64_t previousOffset = treeStart;
+    for (uint64_t childIndex = 0; childIndex < childCount && !indexReader.failed; childIndex++) {
+        offsets[childIndex] = _OFXMLBinaryReaderReadVarint(&indexReader);
+        if (offsets[childIndex] <= previousOffset || offsets[childIndex] >= treeEnd)
+            indexReader.failed = YES;
+        previousOffset = offsets[childIndex];
+    }
+    if (indexReader.failed || indexReader.offset != indexReader.length) {
+        free(offsets);
+        return NULL;
+    }
+    return offsets;
+}
+
+// Decodes each of the root element's children on its own reader, several threads at a time.
+static BOOL _OFXMLBinaryDecodeRootChildrenInParallel(OFXMLElement *rootElement, uint64_t childCount, const uint64_t *offsets, const OFXMLBinaryDecoder *decoder, size_t treeEnd)
+{
+    const uint8_t *bytes = [decoder->data bytes];
+    id *children = calloc(MAX(childCount, 1ULL), sizeof(*children));
+    NSUInteger stripeCount = MIN((NSUInteger)childCount, 4 * [[NSProcessInfo processInfo] activeProcessorCount]);
+
+    dispatch_apply(stripeCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t stripeIndex){
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        uint64_t firstChild = childCount * stripeIndex / stripeCount;
+        uint64_t endChild = childCount * (stripeIndex + 1) / stripeCount;
+        for (uint64_t childIndex = firstChild; childIndex < endChild; childIndex++) {
+            // Each child has to end exactly where the next one starts.
+            size_t childEnd = (childIndex + 1 < childCount) ? (size_t)offsets[childIndex + 1] : treeEnd;
+            OFXMLBinaryReader childReader = {bytes, childEnd, (size_t)offsets[childIndex], NO};
+            id child = _OFXMLBinaryReaderCopyNode(&childReader, decoder, 2);
+            if (child && childReader.offset != childEnd) {
+                [child release];
+                child = nil;
+            }
+            children[childIndex] = child;
+            if (!child)
+                break;
+        }
+        [pool drain];
+    });
+
+    BOOL decoded = YES;
+    for (uint64_t childIndex = 0; childIndex < childCount; childIndex++) {
+        id child = children[childIndex];
+        if (!child)
+            decoded = NO;
+        else {
+            if (decoded)
+                [rootElement appendChild:child];
+            [child release];
+        }
+    }
+
+    free(children);
+    return decoded;
+}
+
+#pragma mark -
+
+@implementation OFXMLDocument (BinaryFormat)
+
++ (BOOL)isBinaryData:(NSData *)data;
+{
+    return [data length] >= OFXMLBinaryFormatHeaderLength && memcmp([data bytes], OFXMLBinaryFormatMagic, sizeof(OFXMLBinaryFormatMagic)) == 0;
+}
+
+- initWithBinaryData:(NSData *)binaryData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+{
+    OBPRECONDITION(binaryData);
+
+    if (!whitespaceBehavior)
+        whitespaceBehavior = [OFXMLWhitespaceBehavior autoWhitespaceBehavior];
+
+    const uint8_t *bytes = [binaryData bytes];
+    size_t length = [binaryData length];
+
+    if (![[self class] isBinaryData:binaryData]) {
+        OFError(outError, OFXMLDocumentInvalidBinaryData, _OFXMLBinaryFormatReadErrorDescription(), NSLocalizedStringFromTableInBundle(@"The data is not a binary XML document.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"));
+        [self release];
+        return nil;
+    }
+
+    uint32_t version = _OFXMLBinaryLoadUInt32(bytes + 8);
+    if (version != OFXMLBinaryFormatVersion) {
+        NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"The document uses version %u of the binary XML format, which is not supported.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"), version];
+        OFError(outError, OFXMLDocumentInvalidBinaryData, _OFXMLBinaryFormatReadErrorDescription(), reason);
+        [self release];
+        return nil;
+    }
+
+    uint64_t treeOffset = _OFXMLBinaryLoadUInt64(bytes + 16);
+    uint64_t nameTableOffset = _OFXMLBinaryLoadUInt64(bytes + 24);
+    uint64_t indexOffset = _OFXMLBinaryLoadUInt64(bytes + 32);
+    uint64_t totalLength = _OFXMLBinaryLoadUInt64(bytes + 40);
+    if (totalLength != length || treeOffset < OFXMLBinaryFormatHeaderLength || treeOffset > nameTableOffset || nameTableOffset > indexOffset || indexOffset > length) {
+        OFError(outError, OFXMLDocumentInvalidBinaryData, _OFXMLBinaryFormatReadErrorDescription(), NSLocalizedStringFromTableInBundle(@"The binary XML document is truncated or damaged.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"));
+        [self release];
+        return nil;
+    }
+
+    OFXMLBinaryDecoder decoder = {binaryData, NULL, 0, whitespaceBehavior};
+    OFXMLElement *rootElement = nil;
+    NSString *versionString = nil, *dtdSystemIDString = nil, *dtdPublicID = nil;
+    NSMutableArray *processingInstructions = [[NSMutableArray alloc] init];
+    CFStringEncoding stringEncoding = kCFStringEncodingUTF8;
+    BOOL standalone = NO;
+    BOOL failed = NO;
+
+    // Names; the table ends with NULs so the interned name table can take the bytes as they are.
+    {
+        OFXMLBinaryReader reader = {bytes, (size_t)indexOffset, (size_t)nameTableOffset, NO};
+        decoder.nameCount = _OFXMLBinaryReaderReadCount(&reader);
+        decoder.names = calloc(MAX(decoder.nameCount, 1ULL), sizeof(*decoder.names));
+
+        OFXMLInternedNameTable nameTable = OFXMLInternedNameTableCreate(NULL);
+        for (uint64_t nameIndex = 0; nameIndex < decoder.nameCount && !reader.failed; nameIndex++) {
+            uint64_t nameLength = _OFXMLBinaryReaderReadVarint(&reader);
+            const uint8_t *nameBytes = (nameLength < _OFXMLBinaryReaderRemaining(&reader)) ? _OFXMLBinaryReaderReadBytes(&reader, nameLength + 1) : NULL;
+            if (!nameBytes || nameLength == 0 || nameBytes[nameLength] != 0 || memchr(nameBytes, 0, nameLength) != NULL || !_OFXMLBinaryIsValidUTF8(nameBytes, nameLength)) {
+                reader.failed = YES;
+                break;
+            }
+            NSString *name = OFXMLInternedNameTableGetInternedName(nameTable, "", (const char *)nameBytes).name;
+            if (!name)
+                reader.failed = YES;
+            decoder.names[nameIndex] = [name retain];
+        }
+        OFXMLInternedNameTableFree(nameTable);
+        failed = reader.failed || reader.offset != reader.length;
+    }
+
+    // Document info
+    if (!failed) {
+        OFXMLBinaryReader reader = {bytes, (size_t)treeOffset, OFXMLBinaryFormatHeaderLength, NO};
+        uint64_t encodingValue = _OFXMLBinaryReaderReadVarint(&reader);
+        stringEncoding = (CFStringEncoding)encodingValue;
+        if (encodingValue != stringEncoding || CFStringConvertEncodingToIANACharSetName(stringEncoding) == NULL)
+            reader.failed = YES;
+        standalone = (_OFXMLBinaryReaderReadByte(&reader) != 0);
+        versionString = _OFXMLBinaryReaderCopyOptionalString(&reader);
+        dtdSystemIDString = _OFXMLBinaryReaderCopyOptionalString(&reader);
+        dtdPublicID = _OFXMLBinaryReaderCopyOptionalString(&reader);
+
+        uint64_t piCount = _OFXMLBinaryReaderReadCount(&reader);
+        for (uint64_t piIndex = 0; piIndex < piCount && !reader.failed; piIndex++) {
+            NSString *piName = _OFXMLBinaryReaderCopyString(&reader);
+            NSString *piValue = _OFXMLBinaryReaderCopyString(&reader);
+            if (piName && piValue) {
+                NSArray *pi = [[NSArray alloc] initWithObjects:piName, piValue, nil];
+                [processingInstructions addObject:pi];
+                [pi release];
+            }
+            [piName release];
+            [piValue release];
+        }
+        failed = reader.failed || reader.offset != reader.length;
+    }
+
+    // Tree
+    if (!failed) {
+        OFXMLBinaryReader reader = {bytes, (size_t)nameTableOffset, (size_t)treeOffset, NO};
+        BOOL decoded = NO;
+        if (_OFXMLBinaryReaderReadByte(&reader) == OFXMLBinaryNodeElement) {
+            uint64_t childCount = 0;
+            rootElement = _OFXMLBinaryReaderCopyElementStart(&reader, &decoder, &childCount);
+            uint64_t *childOffsets = rootElement ? _OFXMLBinaryCopyIndex(binaryData, childCount, (size_t)treeOffset, (size_t)nameTableOffset, (size_t)indexOffset) : NULL;
+            if (childOffsets) {
+                if ((options & OFXMLDocumentLoadInParallel) && childCount >= OFXMLBinaryFormatMinimumParallelChildCount)
+                    decoded = _OFXMLBinaryDecodeRootChildrenInParallel(rootElement, childCount, childOffsets, &decoder, (size_t)nameTableOffset);
+                else {
+                    // Each child has to start where the index says, and the last has to end at the name table.
+                    decoded = YES;
+                    for (uint64_t childIndex = 0; childIndex < childCount && decoded; childIndex++) {
+                        decoded = (reader.offset == childOffsets[childIndex]);
+                        if (decoded)
+                            decoded = _OFXMLBinaryReaderAppendChildren(&reader, &decoder, rootElement, 1, 1);
+                    }
+                    decoded = decoded && (reader.offset == reader.length);
+                }
+                free(childOffsets);
+            }
+        }
+        failed = !decoded;
+    }
+
+    for (uint64_t nameIndex = 0; nameIndex < decoder.nameCount; nameIndex++)
+        [decoder.names[nameIndex] release];
+    free(decoder.names);
+
+    if (failed) {
+        [rootElement release];
+        [versionString release];
+        [dtdSystemIDString release];
+        [dtdPublicID release];
+        [processingInstructions release];
+        OFError(outError, OFXMLDocumentInvalidBinaryData, _OFXMLBinaryFormatReadErrorDescription(), NSLocalizedStringFromTableInBundle(@"The binary XML document is truncated or damaged.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"));
+        [self release];
+        return nil;
+    }
+
+    CFURLRef dtdSystemID = dtdSystemIDString ? CFURLCreateWithString(kCFAllocatorDefault, (CFStringRef)dtdSystemIDString, NULL) : NULL;
+    self = [self initWithRootElement:rootElement dtdSystemID:dtdSystemID dtdPublicID:dtdPublicID whitespaceBehavior:whitespaceBehavior stringEncoding:stringEncoding error:outError];
+    if (dtdSystemID)
+        CFRelease(dtdSystemID);
+    [rootElement release];
+    [dtdSystemIDString release];
+    [dtdPublicID release];
+
+    if (self) {
+        [_versionString release];
+        _versionString = versionString ? versionString : [@"1.0" retain];
+        _standalone = standalone;
+        [_processingInstructions addObjectsFromArray:processingInstructions];
+    } else
+        [versionString release];
+    [processingInstructions release];
+
+    return self;
+}
+
+- initWithContentsOfBinaryFile:(NSString *)path whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+{
+    NSData *binaryData = [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:outError];
+    if (!binaryData) {
+        [self release];
+        return nil;
+    }
+
+    self = [self initWithBinaryData:binaryData whitespaceBehavior:whitespaceBehavior options:options error:outError];
+    [binaryData release];
+    return self;
+}
+
+- (NSData *)binaryData:(NSError **)outError;
+{
+    OFXMLElement *rootElement = [self rootElement];
+    if (!rootElement) {
+        OFError(outError, OFXMLDocumentUnsupportedBinaryNode, NSLocalizedStringFromTableInBundle(@"Unable to write binary XML document.", @"OmniFoundation", OMNI_BUNDLE, @"error description"), NSLocalizedStringFromTableInBundle(@"The document has no root element.", @"OmniFoundation", OMNI_BUNDLE, @"error reason"));
+        return nil;
+    }
+
+    OFXMLBinaryWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.nameIndexes = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    writer.names = [[NSMutableArray alloc] init];
+
+    // Header, filled in at the end
+    memset(_OFXMLBinaryWriterReserve(&writer, OFXMLBinaryFormatHeaderLength), 0, OFXMLBinaryFormatHeaderLength);
+    writer.length = OFXMLBinaryFormatHeaderLength;
+
+    // Document info
+    _OFXMLBinaryWriterAppendVarint(&writer, _stringEncoding);
+    _OFXMLBinaryWriterAppendByte(&writer, _standalone ? 1 : 0);
+    _OFXMLBinaryWriterAppendOptionalString(&writer, _versionString);
+    _OFXMLBinaryWriterAppendOptionalString(&writer, _dtdSystemID ? (NSString *)CFURLGetString(_dtdSystemID) : nil);
+    _OFXMLBinaryWriterAppendOptionalString(&writer, _dtdPublicID);
+    NSUInteger piCount = [self processingInstructionCount];
+    _OFXMLBinaryWriterAppendVarint(&writer, piCount);
+    for (NSUInteger piIndex = 0; piIndex < piCount; piIndex++) {
+        _OFXMLBinaryWriterAppendString(&writer, [self processingInstructionNameAtIndex:piIndex]);
+        _OFXMLBinaryWriterAppendString(&writer, [self processingInstructionValueAtIndex:piIndex]);
+    }
+
+    uint64_t treeOffset = writer.length;
+    BOOL success = _OFXMLBinaryWriterAppendNode(&writer, rootElement, YES, outError);
+
+    NSData *data = nil;
+    if (success) {
+        uint64_t nameTableOffset = writer.length;
+        _OFXMLBinaryWriterAppendVarint(&writer, [writer.names count]);
+        for (NSString *name in writer.names) {
+            _OFXMLBinaryWriterAppendString(&writer, name);
+            _OFXMLBinaryWriterAppendByte(&writer, 0);
+        }
+
+        uint64_t indexOffset = writer.length;
+        _OFXMLBinaryWriterAppendVarint(&writer, writer.rootChildCount);
+        for (NSUInteger childIndex = 0; childIndex < writer.rootChildCount; childIndex++)
+            _OFXMLBinaryWriterAppendVarint(&writer, writer.rootChildOffsets[childIndex]);
+
+        uint8_t *header = writer.bytes;
+        memcpy(header, OFXMLBinaryFormatMagic, sizeof(OFXMLBinaryFormatMagic));
+        _OFXMLBinaryStoreUInt32(header + 8, OFXMLBinaryFormatVersion);
+        _OFXMLBinaryStoreUInt32(header + 12, 0);
+        _OFXMLBinaryStoreUInt64(header + 16, treeOffset);
+        _OFXMLBinaryStoreUInt64(header + 24, nameTableOffset);
+        _OFXMLBinaryStoreUInt64(header + 32, indexOffset);
+        _OFXMLBinaryStoreUInt64(header + 40, writer.length);
+
+        data = [NSData dataWithBytesNoCopy:writer.bytes length:writer.length freeWhenDone:YES];
+    } else
+        free(writer.bytes);
+
+    free(writer.rootChildOffsets);
+    [writer.names release];
+    CFRelease(writer.nameIndexes);
+
+    return data;
+}
+
+@end
@@ -12,9 +12,21 @@
 #import <CoreFoundation/CFURL.h>
 #import <OmniFoundation/OFXMLWhitespaceBehavior.h>
 #import <OmniFoundation/OFXMLParserTarget.h>
+#import <OmniFoundation/OFXMLArena.h>
 
 @class OFXMLCursor, OFXMLElement, OFXMLWhitespaceBehavior;
-@class NSArray, NSMutableArray, NSDate, NSData, NSURL, NSError;
+@class NSArray, NSMutableArray, NSDate, NSData, NSURL, NSError, NSOutputStream;
+
+enum {
+    OFXMLDocumentLoadOptionsNone = 0,
+
+    // Build the parsed tree in an arena (see OFXMLArena.h) instead of as OFXMLElements.  -xmlData: and friends write the arena tree directly; the OFXMLElement tree is only built if something asks for it (-rootElement, -topElement, -cursor, ...).  Ignored by subclasses that override the parser target methods, since they expect to see each element.
+    OFXMLDocumentLoadIntoArena = (1 << 0),
+
+    // Let the parser split a large document between children of the root element and parse the pieces on several threads (see -[OFXMLParser initWithData:...maximumConcurrency:...]).  Target callbacks still happen in order on the loading thread.
+    OFXMLDocumentLoadInParallel = (1 << 1),
+};
+typedef NSUInteger OFXMLDocumentLoadOptions;
 
 @interface OFXMLDocument : OFXMLIdentifierRegistry <OFXMLParserTarget>
 {
@@ -32,6 +44,7 @@
     
     // Main document content
     OFXMLElement *_rootElement;
+    OFXMLArenaTreeBuilder *_arenaTreeBuilder; // Holds the loaded tree until _rootElement is built from it
     
     // Building
     NSMutableArray *_elementStack;
@@ -70,6 +83,15 @@
 
 - initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior error:(NSError **)outError;
 - initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior error:(NSError **)outError;
+- initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+
+/*
+ With a non-zero 'lazyElementDepth', elements deeper than that (the root element is at depth one) aren't parsed into objects while loading.  Each is left as an OFXMLLazyElement holding its byte range of 'xmlData', which is parsed the first time its attributes or children are asked for (through -children, an OFXMLCursor, etc.), and written back out verbatim if that never happens.  The data must not change while the document is alive.  The whole document is still checked for well-formedness up front.  OFXMLDocumentLoadIntoArena is ignored when loading lazily, as is OFXMLDocumentLoadInParallel.  Subclasses implementing the raw parser target callbacks load eagerly.
+ */
+- initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
+
+// Maps the file rather than reading it, so a lazy document only pages in the parts that get loaded.
+- initWithContentsOfFile:(NSString *)path whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
 
 - (OFXMLWhitespaceBehavior *) whitespaceBehavior;
 - (CFURLRef) dtdSystemID;
@@ -86,12 +108,17 @@
 
 - (BOOL)writeToFile:(NSString *)path error:(NSError **)outError;
 
+// Write the document in chunks as it is serialized (see OFXMLBufferCreateWithFileDescriptor()), so memory use doesn't grow with the size of the document.  Neither closes its destination.
+- (BOOL)writeToFileDescriptor:(int)fd options:(OFXMLBufferOutputOptions)options error:(NSError **)outError;
+- (BOOL)writeToOutputStream:(NSOutputStream *)stream options:(OFXMLBufferOutputOptions)options error:(NSError **)outError;
+
 - (NSUInteger)processingInstructionCount;
 - (NSString *)processingInstructionNameAtIndex:(NSUInteger)piIndex;
 - (NSString *)processingInstructionValueAtIndex:(NSUInteger)piIndex;
 - (void)addProcessingInstructionNamed:(NSString *)piName value:(NSString *)piValue;
 
 - (OFXMLElement *) rootElement;
+- (const OFXMLArenaElement *)arenaRootElement; // NULL unless loaded with OFXMLDocumentLoadIntoArena and the OFXMLElement tree hasn't been built yet
 
 // User objects
 - (id)userObjectForKey:(NSString *)key;
@@ -15,22 +15,52 @@
 #import <OmniFoundation/OFXMLString.h>
 #import <OmniFoundation/OFXMLBuffer.h>
 #import <OmniFoundation/OFXMLUnparsedElement.h>
+#import <OmniFoundation/OFXMLLazyElement.h>
 #import <OmniFoundation/OFXMLQName.h>
+#import <OmniFoundation/OFXMLArena.h>
 
 #import <OmniFoundation/OFErrors.h>
 #import <OmniFoundation/OFNull.h>
+#import <OmniFoundation/CFArray-OFExtensions.h>
 #import <OmniFoundation/NSString-OFSimpleMatching.h>
 
 #import <OmniBase/rcsid.h>
 #import <OmniBase/assertions.h>
 #import <OmniBase/OBUtilities.h>
+#import <OmniBase/NSError-OBUtilities.h>
+#import <OmniBase/macros.h>
+#import <fcntl.h>
+#import <unistd.h>
 
 RCS_ID("$Id$");
 
 @interface OFXMLDocument (/*Private*/)
 - (void)_preInit;
 - (id)_initCommonSuffix:(NSError **)outError;
-- (BOOL)_parseData:(NSData *)xmlData defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior error:(NSError **)outError;
+- (BOOL)_parseData:(NSData *)xmlData defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
+- (BOOL)_appendXMLForElements:(NSArray *)elements arenaElement:(const OFXMLArenaElement *)arenaElement asFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior startingLevel:(unsigned int)level toBuffer:(OFXMLBuffer)xml error:(NSError **)outError;
+- (BOOL)_appendXMLForRootElementToBuffer:(OFXMLBuffer)xml error:(NSError **)outError;
+- (NSData *)_xmlDataForElements:(NSArray *)elements arenaElement:(const OFXMLArenaElement *)arenaElement asFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior startingLevel:(unsigned int)level error:(NSError **)outError;
+- (NSData *)_xmlDataForRootElementAsFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior error:(NSError **)outError;
+- (void)_materializeArenaTree;
+@end
+
+/*
+ Parser target for a lazy load.  Everything is passed through to the document, except that elements deeper than the lazy depth are left unparsed and given to it as OFXMLLazyElements.  It keeps track of the namespace declarations and whitespace behavior in effect so that each of those can be parsed later on its own.
+ */
+@interface OFXMLDocumentLazyLoader : OFObject <OFXMLParserTarget>
+{
+@private
+    OFXMLDocument *_document; // not retained
+    NSData *_sourceData;
+    NSUInteger _lazyElementDepth;
+    OFXMLWhitespaceBehavior *_whitespaceBehavior;
+    NSMutableArray *_whitespaceBehaviorStack;
+    NSMutableArray *_namespaceDeclarationsStack;
+    BOOL _documentChoosesBehavior;
+    BOOL _leavingElementLazy;
+}
+- initWithDocument:(OFXMLDocument *)document sourceData:(NSData *)sourceData lazyElementDepth:(NSUInteger)lazyElementDepth defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior;
 @end
 
 @implementation OFXMLDocument
@@ -110,6 +140,19 @@ RCS_ID("$Id$");
     return [self initWithData:[NSData dataWithContentsOfFile:path] whitespaceBehavior:whitespaceBehavior error:outError];
 }
 
+- initWithContentsOfFile:(NSString *)path whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
+{
+    NSData *xmlData = [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:outError];
+    if (!xmlData) {
+        [self release];
+        return nil;
+    }
+    
+    self = [self initWithData:xmlData whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:OFXMLWhitespaceBehaviorTypePreserve options:OFXMLDocumentLoadOptionsNone lazyElementDepth:lazyElementDepth error:outError];
+    [xmlData release];
+    return self;
+}
+
 - initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior error:(NSError **)outError;
 {
     // Preserve whitespace by default
@@ -117,6 +160,16 @@ RCS_ID("$Id$");
 }
 
 - initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior error:(NSError **)outError;
+{
+    return [self initWithData:xmlData whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:defaultWhitespaceBehavior options:OFXMLDocumentLoadOptionsNone error:outError];
+}
+
+- initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options error:(NSError **)outError;
+{
+    return [self initWithData:xmlData whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:defaultWhitespaceBehavior options:options lazyElementDepth:0 error:outError];
+}
+
+- initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
 {
     if (!(self = [super init]))
         return nil;
@@ -127,7 +180,7 @@ RCS_ID("$Id$");
 
     _whitespaceBehavior = [whitespaceBehavior retain];
 
-    if (![self _parseData:xmlData defaultWhitespaceBehavior:defaultWhitespaceBehavior error:outError]) {
+    if (![self _parseData:xmlData defaultWhitespaceBehavior:defaultWhitespaceBehavior options:options lazyElementDepth:lazyElementDepth error:outError]) {
         [self release];
         return nil;
     }
@@ -143,6 +196,7 @@ RCS_ID("$Id$");
         CFRelease(_dtdSystemID);
     [_dtdPublicID release];
     [_rootElement release];
+    [_arenaTreeBuilder release];
     [_loadWarnings release];
     [_elementStack release];
     [_whitespaceBehavior release];
@@ -177,17 +231,17 @@ RCS_ID("$Id$");
 
 - (NSData *)xmlData:(NSError **)outError;
 {
-    return [self xmlDataForElements:[NSArray arrayWithObjects: _rootElement, nil] asFragment:NO error:outError];
+    return [self _xmlDataForRootElementAsFragment:NO defaultWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve error:outError];
 }
 
 - (NSData *)xmlDataWithDefaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior error:(NSError **)outError;
 {
-    return [self xmlDataForElements:[NSArray arrayWithObjects: _rootElement, nil] asFragment:NO defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior startingLevel:0 error:outError];
+    return [self _xmlDataForRootElementAsFragment:NO defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior error:outError];
 }
 
 - (NSData *)xmlDataAsFragment:(NSError **)outError;
 {
-    return [self xmlDataForElements:[NSArray arrayWithObjects: _rootElement, nil] asFragment:YES error:outError];
+    return [self _xmlDataForRootElementAsFragment:YES defaultWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve error:outError];
 }
 
 - (NSData *)xmlDataForElements:(NSArray *)elements asFragment:(BOOL)asFragment error:(NSError **)outError;
@@ -196,15 +250,18 @@ RCS_ID("$Id$");
 }
 
 - (NSData *)xmlDataForElements:(NSArray *)elements asFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior startingLevel:(unsigned int)level error:(NSError **)outError;
+{
+    return [self _xmlDataForElements:elements arenaElement:NULL asFragment:asFragment defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior startingLevel:level error:outError];
+}
+
+- (BOOL)_appendXMLForElements:(NSArray *)elements arenaElement:(const OFXMLArenaElement *)arenaElement asFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior startingLevel:(unsigned int)level toBuffer:(OFXMLBuffer)xml error:(NSError **)outError;
 {
     // This is not true if we are on 10.3, and Keynote files don't have a DOCTYPE definition
     //OBPRECONDITION(asFragment || (_dtdSystemID && _dtdPublicID)); // Otherwise CFXMLParser will generate an error on load (which we'll ignore, but still...)
-    OBPRECONDITION([_elementStack count] == 1); // should just have the root element -- i.e., all nested push/pops have finished
+    OBPRECONDITION([_elementStack count] == (_arenaTreeBuilder ? 0U : 1U)); // should just have the root element -- i.e., all nested push/pops have finished (or nothing, if the root is still in the arena)
     
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
 
-    OFXMLBuffer xml = OFXMLBufferCreate();
-    
     if (!asFragment) {
         
         // The initial <?xml...?> PI isn't in the _processingInstructions; it's stored as other ivars
@@ -247,7 +304,7 @@ RCS_ID("$Id$");
 
 	if (_dtdPublicID || _dtdSystemID) {
 	    OFXMLBufferAppendUTF8CString(xml, "<!DOCTYPE ");
-	    OFXMLBufferAppendString(xml, (CFStringRef)[_rootElement name]);
+	    OFXMLBufferAppendString(xml, (CFStringRef)(_rootElement ? [_rootElement name] : _arenaTreeBuilder.rootElement->qname.name));
 	    if (_dtdPublicID) { // Both required in this case; TODO: Raise if _dtdSystemID isn't set in this case
 		OFXMLBufferAppendUTF8CString(xml, " PUBLIC \"");
 		OFXMLBufferAppendString(xml, (CFStringRef)_dtdPublicID);
@@ -271,27 +328,98 @@ RCS_ID("$Id$");
             [pool drain];
             if (outError)
                 [*outError autorelease];
-            return nil;
+            return NO;
         }
     }
+    if (arenaElement)
+        OFXMLArenaElementAppendXML(arenaElement, xml, defaultWhiteSpaceBehavior, self, level);
 
     if (!asFragment)
         OFXMLBufferAppendUTF8CString(xml, "\n");
 
+    [pool drain];
+    return YES;
+}
+
+- (NSData *)_xmlDataForElements:(NSArray *)elements arenaElement:(const OFXMLArenaElement *)arenaElement asFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior startingLevel:(unsigned int)level error:(NSError **)outError;
+{
+    OFXMLBuffer xml = OFXMLBufferCreate();
+    if (![self _appendXMLForElements:elements arenaElement:arenaElement asFragment:asFragment defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior startingLevel:level toBuffer:xml error:outError]) {
+        OFXMLBufferDestroy(xml);
+        return nil;
+    }
+
     CFDataRef data = OFXMLBufferCopyData(xml, _stringEncoding);
     OFXMLBufferDestroy(xml);
-    
-    [pool drain];
     return [NSMakeCollectable(data) autorelease];
 }
 
+- (NSData *)_xmlDataForRootElementAsFragment:(BOOL)asFragment defaultWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhiteSpaceBehavior error:(NSError **)outError;
+{
+    // Write a tree we loaded into an arena straight from there; no need to build OFXMLElements just to throw them away.
+    if (_arenaTreeBuilder)
+        return [self _xmlDataForElements:nil arenaElement:_arenaTreeBuilder.rootElement asFragment:asFragment defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior startingLevel:0 error:outError];
+    return [self _xmlDataForElements:[NSArray arrayWithObjects: _rootElement, nil] arenaElement:NULL asFragment:asFragment defaultWhiteSpaceBehavior:defaultWhiteSpaceBehavior startingLevel:0 error:outError];
+}
+
+- (BOOL)_appendXMLForRootElementToBuffer:(OFXMLBuffer)xml error:(NSError **)outError;
+{
+    BOOL success;
+    if (_arenaTreeBuilder)
+        success = [self _appendXMLForElements:nil arenaElement:_arenaTreeBuilder.rootElement asFragment:NO defaultWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve startingLevel:0 toBuffer:xml error:outError];
+    else
+        success = [self _appendXMLForElements:[NSArray arrayWithObjects: _rootElement, nil] arenaElement:NULL asFragment:NO defaultWhiteSpaceBehavior:OFXMLWhitespaceBehaviorTypePreserve startingLevel:0 toBuffer:xml error:outError];
+
+    // Always finish, even after a failure, so that a compressed stream is closed off and the buffer's error (if any) is reported.
+    NSError *outputError = nil;
+    if (!OFXMLBufferFinishOutput(xml, &outputError)) {
+        if (success && outError)
+            *outError = outputError;
+        success = NO;
+    }
+    return success;
+}
+
+- (BOOL)writeToFileDescriptor:(int)fd options:(OFXMLBufferOutputOptions)options error:(NSError **)outError;
+{
+    OFXMLBuffer xml = OFXMLBufferCreateWithFileDescriptor(fd, _stringEncoding, options);
+    BOOL success = [self _appendXMLForRootElementToBuffer:xml error:outError];
+    OFXMLBufferDestroy(xml);
+    return success;
+}
+
+- (BOOL)writeToOutputStream:(NSOutputStream *)stream options:(OFXMLBufferOutputOptions)options error:(NSError **)outError;
+{
+    OFXMLBuffer xml = OFXMLBufferCreateWithOutputStream(stream, _stringEncoding, options);
+    BOOL success = [self _appendXMLForRootElementToBuffer:xml error:outError];
+    OFXMLBufferDestroy(xml);
+    return success;
+}
+
 - (BOOL)writeToFile:(NSString *)path error:(NSError **)outError;
 {
-    NSData *data = [self xmlData:outError];
-    if (!data)
+    // Stream into a temporary file beside the destination and then rename it into place, so this is still atomic without holding the whole document in memory.
+    NSString *temporaryPath = [path stringByAppendingFormat:@".%@", [[NSProcessInfo processInfo] globallyUniqueString]];
+    const char *temporaryFileSystemPath = [temporaryPath fileSystemRepresentation];
+
+    int fd = open(temporaryFileSystemPath, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fd < 0) {
+        OBErrorWithErrno(outError, OMNI_ERRNO(), "open", temporaryPath, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
         return NO;
-    
-    return [data writeToFile:path options:NSAtomicWrite error:outError];
+    }
+
+    BOOL success = [self writeToFileDescriptor:fd options:OFXMLBufferOutputOptionsNone error:outError];
+    if (close(fd) < 0 && success) {
+        OBErrorWithErrno(outError, OMNI_ERRNO(), "close", temporaryPath, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
+        success = NO;
+    }
+    if (success && rename(temporaryFileSystemPath, [path fileSystemRepresentation]) < 0) {
+        OBErrorWithErrno(outError, OMNI_ERRNO(), "rename", path, NSLocalizedStringFromTableInBundle(@"Unable to write XML.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
+        success = NO;
+    }
+    if (!success)
+        unlink(temporaryFileSystemPath);
+    return success;
 }
 
 - (NSUInteger)processingInstructionCount;
@@ -322,9 +450,16 @@ RCS_ID("$Id$");
 
 - (OFXMLElement *) rootElement;
 {
+    if (_arenaTreeBuilder)
+        [self _materializeArenaTree];
     return _rootElement;
 }
 
+- (const OFXMLArenaElement *)arenaRootElement;
+{
+    return _arenaTreeBuilder.rootElement;
+}
+
 //
 // User objects
 //
@@ -351,7 +486,7 @@ RCS_ID("$Id$");
     OFXMLElement *child, *top;
 
     child  = [[OFXMLElement alloc] initWithName: elementName];
-    top = [_elementStack lastObject];
+    top = [self topElement];
     OBASSERT([top isKindOfClass: [OFXMLElement class]]);
     [top appendChild: child];
     [_elementStack addObject: child];
@@ -375,6 +510,8 @@ RCS_ID("$Id$");
 
 - (OFXMLElement *) topElement;
 {
+    if (_arenaTreeBuilder)
+        [self _materializeArenaTree];
     return [_elementStack lastObject];
 }
 
@@ -623,7 +760,10 @@ RCS_ID("$Id$");
     // Really only want the element addresses to be displayed here.
     [debugDictionary setObject: _elementStack forKey: @"_elementStack"];
 
-    [debugDictionary setObject: _rootElement forKey: @"_rootElement"];
+    if (_rootElement)
+        [debugDictionary setObject: _rootElement forKey: @"_rootElement"];
+    if (_arenaTreeBuilder)
+        [debugDictionary setObject: _arenaTreeBuilder forKey: @"_arenaTreeBuilder"];
 
     [debugDictionary setObject: [NSString stringWithFormat: @"0x%08lx", (unsigned long)_stringEncoding] forKey: @"_stringEncoding"];
 
@@ -645,24 +785,89 @@ RCS_ID("$Id$");
 
 - (id)_initCommonSuffix:(NSError **)outError;
 {
-    if (!_rootElement) {
+    if (!_rootElement && !_arenaTreeBuilder.rootElement) {
         OFError(outError, OFXMLDocumentNoRootElementError, NSLocalizedStringFromTableInBundle(@"No root element was found", @"OmniFoundation", OMNI_BUNDLE, @"error reason"), nil);
         [self release];
         return nil;
     }
     
-    OBASSERT([_elementStack count] == 1);
-    OBASSERT([_elementStack objectAtIndex: 0] == _rootElement);
+    OBASSERT([_elementStack count] == (_arenaTreeBuilder ? 0U : 1U));
+    OBASSERT(_arenaTreeBuilder || [_elementStack objectAtIndex: 0] == _rootElement);
     return self;
 }
 
-- (BOOL)_parseData:(NSData *)xmlData defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior error:(NSError **)outError;
+// The arena builder only sees raw parser callbacks, so it can't be used if a subclass wants to see the elements go by.
+static BOOL _OFXMLDocumentClassCanLoadIntoArena(Class cls)
+{
+    Class documentClass = [OFXMLDocument class];
+    if (cls == documentClass)
+        return YES;
+
+    SEL overridableSelectors[] = {
+        @selector(parser:setSystemID:publicID:),
+        @selector(parser:addProcessingInstructionNamed:value:),
+        @selector(parser:startElementWithQName:attributeQNames:attributeValues:),
+        @selector(parser:addWhitespace:),
+        @selector(parser:addString:),
+        @selector(parserEndElement:),
+        @selector(parser:endUnparsedElementWithQName:identifier:contents:),
+        @selector(addProcessingInstructionNamed:value:),
+    };
+    for (NSUInteger selectorIndex = 0; selectorIndex < sizeof(overridableSelectors)/sizeof(*overridableSelectors); selectorIndex++) {
+        SEL sel = overridableSelectors[selectorIndex];
+        if ([cls instanceMethodForSelector:sel] != [documentClass instanceMethodForSelector:sel])
+            return NO;
+    }
+
+    if ([cls instancesRespondToSelector:@selector(internedNameTableForParser:)] ||
+        [cls instancesRespondToSelector:@selector(parser:behaviorForElementWithQName:attributeQNames:attributeValues:)] ||
+        [cls instancesRespondToSelector:@selector(parser:startElementWithQName:attributeCount:attributes:)] ||
+        [cls instancesRespondToSelector:@selector(parser:addCharacters:length:inSource:whitespace:)])
+        return NO;
+
+    return YES;
+}
+
+// The lazy loader passes the object-based callbacks through, but not the raw ones.
+static BOOL _OFXMLDocumentClassCanLoadLazily(Class cls)
 {
-    OFXMLParser *parser = [[OFXMLParser alloc] initWithData:xmlData whitespaceBehavior:[self whitespaceBehavior] defaultWhitespaceBehavior:defaultWhitespaceBehavior target:self error:outError];
+    return ![cls instancesRespondToSelector:@selector(parser:startElementWithQName:attributeCount:attributes:)] &&
+        ![cls instancesRespondToSelector:@selector(parser:addCharacters:length:inSource:whitespace:)];
+}
+
+- (void)_materializeArenaTree;
+{
+    OBPRECONDITION(_arenaTreeBuilder);
+    OBPRECONDITION(!_rootElement);
+    OBPRECONDITION([_elementStack count] == 0);
+
+    _rootElement = OFXMLArenaElementCopyElement(_arenaTreeBuilder.rootElement);
+    [_elementStack addObject:_rootElement];
+
+    // The element tree is the real one from here on; drop the arena (and our reference to the source data).
+    [_arenaTreeBuilder release];
+    _arenaTreeBuilder = nil;
+}
+
+- (BOOL)_parseData:(NSData *)xmlData defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior options:(OFXMLDocumentLoadOptions)options lazyElementDepth:(NSUInteger)lazyElementDepth error:(NSError **)outError;
+{
+    NSObject <OFXMLParserTarget> *target = self;
+    OFXMLDocumentLazyLoader *lazyLoader = nil;
+    if (lazyElementDepth > 0 && _OFXMLDocumentClassCanLoadLazily([self class])) {
+        lazyLoader = [[OFXMLDocumentLazyLoader alloc] initWithDocument:self sourceData:xmlData lazyElementDepth:lazyElementDepth defaultWhitespaceBehavior:defaultWhitespaceBehavior];
+        target = lazyLoader;
+    } else if ((options & OFXMLDocumentLoadIntoArena) && _OFXMLDocumentClassCanLoadIntoArena([self class])) {
+        _arenaTreeBuilder = [[OFXMLArenaTreeBuilder alloc] initWithSourceData:xmlData];
+        _arenaTreeBuilder.forwardingTarget = self;
+        target = _arenaTreeBuilder;
+    }
+
+    OFXMLParser *parser = [[OFXMLParser alloc] initWithData:xmlData whitespaceBehavior:[self whitespaceBehavior] defaultWhitespaceBehavior:defaultWhitespaceBehavior maximumConcurrency:(options & OFXMLDocumentLoadInParallel) ? 0 : 1 target:target error:outError];
+    [lazyLoader release];
     if (!parser)
         return NO;
     
-    OBASSERT(_rootElement);
+    OBASSERT(_rootElement || _arenaTreeBuilder.rootElement);
     
     _stringEncoding = parser.encoding;
     
@@ -681,3 +886,151 @@ RCS_ID("$Id$");
 }
 
 @end
+
+@implementation OFXMLDocumentLazyLoader
+
+- initWithDocument:(OFXMLDocument *)document sourceData:(NSData *)sourceData lazyElementDepth:(NSUInteger)lazyElementDepth defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior;
+{
+    OBPRECONDITION(document);
+    OBPRECONDITION(lazyElementDepth > 0);
+    
+    if (!(self = [super init]))
+        return nil;
+    
+    _document = document;
+    _sourceData = [sourceData retain];
+    _lazyElementDepth = lazyElementDepth;
+    _whitespaceBehavior = [[document whitespaceBehavior] retain];
+    
+    _whitespaceBehaviorStack = (NSMutableArray *)OFCreateIntegerArray();
+    [_whitespaceBehaviorStack addObject:(id)defaultWhitespaceBehavior];
+    _namespaceDeclarationsStack = [[NSMutableArray alloc] initWithObjects:[NSDictionary dictionary], nil];
+    
+    _documentChoosesBehavior = [document respondsToSelector:@selector(parser:behaviorForElementWithQName:attributeQNames:attributeValues:)];
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_sourceData release];
+    [_whitespaceBehavior release];
+    [_whitespaceBehaviorStack release];
+    [_namespaceDeclarationsStack release];
+    [super dealloc];
+}
+
+- (void)_addLazyElementWithQName:(OFXMLQName *)qname sourceData:(NSData *)sourceData range:(NSRange)sourceRange;
+{
+    OFXMLLazyElement *element = [[OFXMLLazyElement alloc] initWithName:qname.name sourceData:sourceData range:sourceRange namespaceDeclarations:[_namespaceDeclarationsStack lastObject] whitespaceBehavior:_whitespaceBehavior parentWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)[_whitespaceBehaviorStack lastObject]];
+    [[_document topElement] appendChild:element];
+    [element release];
+}
+
+#pragma mark OFXMLParserTarget
+
+- (OFXMLInternedNameTable)internedNameTableForParser:(OFXMLParser *)parser;
+{
+    if ([_document respondsToSelector:_cmd])
+        return [_document internedNameTableForParser:parser];
+    return NULL;
+}
+
+- (void)parser:(OFXMLParser *)parser setSystemID:(NSURL *)systemID publicID:(NSString *)publicID;
+{
+    [_document parser:parser setSystemID:systemID publicID:publicID];
+}
+
+- (void)parser:(OFXMLParser *)parser addProcessingInstructionNamed:(NSString *)piName value:(NSString *)piValue;
+{
+    [_document parser:parser addProcessingInstructionNamed:piName value:piValue];
+}
+
+- (OFXMLParserElementBehavior)parser:(OFXMLParser *)parser behaviorForElementWithQName:(OFXMLQName *)name attributeQNames:(NSMutableArray *)attributeQNames attributeValues:(NSMutableArray *)attributeValues;
+{
+    _leavingElementLazy = NO;
+    
+    if (_documentChoosesBehavior) {
+        OFXMLParserElementBehavior behavior = [_document parser:parser behaviorForElementWithQName:name attributeQNames:attributeQNames attributeValues:attributeValues];
+        if (behavior != OFXMLParserElementBehaviorParse)
+            return behavior;
+    }
+    
+    // The element will be one deeper than the parser is now.  Entities declared in an internal subset wouldn't be known when the element is parsed on its own later, so those documents are loaded eagerly.
+    if (parser.elementDepth >= _lazyElementDepth && !parser.hasInternalSubset) {
+        _leavingElementLazy = YES;
+        return OFXMLParserElementBehaviorUnparsed;
+    }
+    
+    return OFXMLParserElementBehaviorParse;
+}
+
+- (void)parser:(OFXMLParser *)parser startElementWithQName:(OFXMLQName *)qname attributeQNames:(NSMutableArray *)attributeQNames attributeValues:(NSMutableArray *)attributeValues;
+{
+    // Namespaces declared here are in scope for everything inside; elements without declarations share their parent's dictionary.
+    NSDictionary *namespaceDeclarations = [_namespaceDeclarationsStack lastObject];
+    NSMutableDictionary *updatedDeclarations = nil;
+    NSUInteger attributeIndex, attributeCount = [attributeQNames count];
+    for (attributeIndex = 0; attributeIndex < attributeCount; attributeIndex++) {
+        OFXMLQName *attributeQName = [attributeQNames objectAtIndex:attributeIndex];
+        if (OFNOTEQUAL(attributeQName.namespace, OFXMLNamespaceXMLNS))
+            continue;
+        
+        if (!updatedDeclarations)
+            updatedDeclarations = [namespaceDeclarations mutableCopy];
+        
+        NSString *prefix = attributeQName.name;
+        NSString *key = [NSString isEmptyString:prefix] ? @"xmlns" : [@"xmlns:" stringByAppendingString:prefix];
+        [updatedDeclarations setObject:[attributeValues objectAtIndex:attributeIndex] forKey:key];
+    }
+    [_namespaceDeclarationsStack addObject:updatedDeclarations ? updatedDeclarations : namespaceDeclarations];
+    [updatedDeclarations release];
+    
+    OFXMLWhitespaceBehaviorType whitespaceBehavior = [_whitespaceBehavior behaviorForElementName:qname.name];
+    if (whitespaceBehavior == OFXMLWhitespaceBehaviorTypeAuto)
+        whitespaceBehavior = (OFXMLWhitespaceBehaviorType)[_whitespaceBehaviorStack lastObject];
+    [_whitespaceBehaviorStack addObject:(id)whitespaceBehavior];
+    
+    [_document parser:parser startElementWithQName:qname attributeQNames:attributeQNames attributeValues:attributeValues];
+}
+
+- (void)parserEndElement:(OFXMLParser *)parser;
+{
+    [_namespaceDeclarationsStack removeLastObject];
+    [_whitespaceBehaviorStack removeLastObject];
+    
+    [_document parserEndElement:parser];
+}
+
+- (void)parser:(OFXMLParser *)parser endUnparsedElementWithQName:(OFXMLQName *)qname identifier:(NSString *)identifier sourceRange:(NSRange)sourceRange;
+{
+    if (_leavingElementLazy) {
+        _leavingElementLazy = NO;
+        [self _addLazyElementWithQName:qname sourceData:_sourceData range:sourceRange];
+    } else {
+        NSData *contents = [_sourceData subdataWithRange:sourceRange];
+        [_document parser:parser endUnparsedElementWithQName:qname identifier:identifier contents:contents];
+    }
+}
+
+- (void)parser:(OFXMLParser *)parser endUnparsedElementWithQName:(OFXMLQName *)qname identifier:(NSString *)identifier contents:(NSData *)contents;
+{
+    if (_leavingElementLazy) {
+        // The input wasn't UTF-8, so the parser couldn't point us at the source.  What it gave us has been converted, though, so the lazy element can hold on to that instead.
+        _leavingElementLazy = NO;
+        [self _addLazyElementWithQName:qname sourceData:contents range:NSMakeRange(0, [contents length])];
+    } else
+        [_document parser:parser endUnparsedElementWithQName:qname identifier:identifier contents:contents];
+}
+
+- (void)parser:(OFXMLParser *)parser addWhitespace:(NSString *)whitespace;
+{
+    [_document parser:parser addWhitespace:whitespace];
+}
+
+- (void)parser:(OFXMLParser *)parser addString:(NSString *)string;
+{
+    [_document parser:parser addString:string];
+}
+
+@end
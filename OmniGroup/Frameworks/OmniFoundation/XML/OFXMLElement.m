@@ -19,6 +19,7 @@
 
 #import <OmniFoundation/OFXMLBuffer.h>
 #import <OmniFoundation/OFXMLFrozenElement.h>
+#import <OmniFoundation/OFXMLLazyElement.h>
 
 #import <OmniBase/OmniBase.h>
 
@@ -462,9 +463,7 @@ RCS_ID("$Id$");
             
             if (value) {
                 OFXMLBufferAppendUTF8CString(xml, "=\"");
-                NSString *quotedString = OFXMLCreateStringWithEntityReferencesInCFEncoding(value, OFXMLBasicEntityMask, nil, encoding);
-                OFXMLBufferAppendString(xml, (CFStringRef)quotedString);
-                [quotedString release];
+                OFXMLBufferAppendQuotedString(xml, (CFStringRef)value, encoding);
                 OFXMLBufferAppendUTF8CString(xml, "\"");
             }
         }
@@ -535,6 +534,10 @@ RCS_ID("$Id$");
     if (![otherObject isKindOfClass:[OFXMLElement class]])
         return NO;
     
+    // Lazy elements have to load before their instance variables mean anything.
+    if ([otherObject isKindOfClass:[OFXMLLazyElement class]] && ![self isKindOfClass:[OFXMLLazyElement class]])
+        return [otherObject isEqual:self];
+    
     OFXMLElement *otherElement = otherObject;
     
     if (OFNOTEQUAL(_name, otherElement->_name))
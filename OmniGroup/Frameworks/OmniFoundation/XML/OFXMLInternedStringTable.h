@@ -16,8 +16,11 @@ extern void OFXMLInternedStringTableFree(OFXMLInternedStringTable table);
 extern NSString *OFXMLInternedStringTableGetInternedString(OFXMLInternedStringTable table, const char *str);
 
 // (const char *, const char *) -> OFXMLQName
+// Name tables are safe to share between threads, so many parsers and readers running at once can use one table instead of each interning the same names again.  Lookups of names already in the table don't take a lock; adding a name does.  Tables are reference counted: OFXMLInternedNameTableFree() drops a reference.
 @class OFXMLQName;
 typedef struct _OFXMLInternedNameTable *OFXMLInternedNameTable;
 extern OFXMLInternedNameTable OFXMLInternedNameTableCreate(OFXMLInternedNameTable startingQNameTable);
+extern OFXMLInternedNameTable OFXMLInternedNameTableRetain(OFXMLInternedNameTable table);
 extern void OFXMLInternedNameTableFree(OFXMLInternedNameTable table);
 extern OFXMLQName *OFXMLInternedNameTableGetInternedName(OFXMLInternedNameTable table, const char *_namespace, const char *name);
+extern NSUInteger OFXMLInternedNameTableGetCount(OFXMLInternedNameTable table);
@@ -13,6 +13,8 @@
 #import <OmniBase/OBUtilities.h>
 
 #import <Foundation/Foundation.h>
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
 #include <libxml/xmlstring.h>
 
 RCS_ID("$Id$");
@@ -96,81 +98,261 @@ NSString *OFXMLInternedStringTableGetInternedString(OFXMLInternedStringTable tab
 
 #pragma mark -
 
+/*
+ The name table is an open addressed hash table of pointers to immutable entries.  Readers never lock: they load the current slot array and probe it, and since an entry is fully built before a barrier and the store that publishes it, anything they find is complete.  Writers serialize on a mutex, look again (the name may have been added since the reader missed) and then either fill an empty slot or, when the table gets half full, build a larger slot array and publish that.  A reader may still be probing the old array, so replaced arrays are kept until the table is destroyed; they add up to less than the final array.
+ */
+
 static const char * const EmptyString = "";
 
 typedef struct {
+    uint64_t hash;
     const char *namespace;
+    size_t namespaceLength;
     const char *name;
-} QNameKey;
+    size_t nameLength;
+    OFXMLQName *qname;
+} InternedNameEntry;
+
+typedef struct _InternedNameSlots {
+    struct _InternedNameSlots *previous; // Replaced arrays, freed along with the table
+    NSUInteger mask;
+    InternedNameEntry * volatile entries[];
+} InternedNameSlots;
+
+struct _OFXMLInternedNameTable {
+    InternedNameSlots * volatile slots;
+    NSUInteger count;
+    pthread_mutex_t insertLock;
+    volatile int32_t referenceCount;
+};
+
+#define InternedNameTableInitialCapacity (64)
+
+// A wyhash-style hash over the raw bytes, reading eight (or four) bytes at a time.  Names are short, so the tail handling matters more than the bulk loop.
+static const uint64_t NameHashSecret0 = 0xa0761d6478bd642fULL, NameHashSecret1 = 0xe7037ed1a0b428dbULL;
 
-static void QNameRelease(CFAllocatorRef allocator, const void *value)
+static inline void _nameHashMultiply(uint64_t *a, uint64_t *b)
 {
-    QNameKey *qname = (QNameKey *)value;
-    
-    if (qname->namespace != EmptyString)
-        free((char *)qname->namespace);
-    if (qname->name != EmptyString)
-        free((char *)qname->name);
-    
-    free(qname);
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
 }
 
-static Boolean QNameKeyEqual(const void *value1, const void *value2)
+static inline uint64_t _nameHashMix(uint64_t a, uint64_t b)
 {
-    const QNameKey *key1 = value1;
-    const QNameKey *key2 = value2;
-    
-    // We upgrade NULL to EmptyString to make this easier.
-    return (strcmp(key1->name, key2->name) == 0) && (strcmp(key1->namespace, key2->namespace) == 0);
+    _nameHashMultiply(&a, &b);
+    return a ^ b;
 }
 
-static CFHashCode QNameKeyHash(const void *value)
+static inline uint64_t _nameHashRead64(const uint8_t *p)
 {
-    const QNameKey *key = value;
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t _nameHashRead32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t _nameHash(const char *str, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)str;
+    uint64_t a, b;
+
+    seed ^= _nameHashMix(seed ^ NameHashSecret0, NameHashSecret1);
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (_nameHashRead32(p) << 32) | _nameHashRead32(p + middle);
+            b = (_nameHashRead32(p + length - 4) << 32) | _nameHashRead32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else
+            a = b = 0;
+    } else {
+        size_t remaining = length;
+        while (remaining > 16) {
+            seed = _nameHashMix(_nameHashRead64(p) ^ NameHashSecret1, _nameHashRead64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = _nameHashRead64(p + remaining - 16);
+        b = _nameHashRead64(p + remaining - 8);
+    }
+
+    a ^= NameHashSecret1;
+    b ^= seed;
+    _nameHashMultiply(&a, &b);
+    return _nameHashMix(a ^ NameHashSecret0 ^ length, b ^ NameHashSecret1);
+}
+
+static inline uint64_t _qnameHash(const char *namespace, size_t namespaceLength, const char *name, size_t nameLength)
+{
+    return _nameHash(name, nameLength, _nameHash(namespace, namespaceLength, 0));
+}
+
+static inline BOOL _entryMatches(const InternedNameEntry *entry, uint64_t hash, const char *namespace, size_t namespaceLength, const char *name, size_t nameLength)
+{
+    return entry->hash == hash &&
+        entry->nameLength == nameLength && entry->namespaceLength == namespaceLength &&
+        memcmp(entry->name, name, nameLength) == 0 && memcmp(entry->namespace, namespace, namespaceLength) == 0;
+}
+
+static OFXMLQName *_lookUpName(InternedNameSlots *slots, uint64_t hash, const char *namespace, size_t namespaceLength, const char *name, size_t nameLength)
+{
+    NSUInteger mask = slots->mask;
+    NSUInteger slotIndex = (NSUInteger)hash & mask;
+
+    while (YES) {
+        InternedNameEntry *entry = slots->entries[slotIndex];
+        if (!entry)
+            return nil;
+        if (_entryMatches(entry, hash, namespace, namespaceLength, name, nameLength))
+            return entry->qname;
+        slotIndex = (slotIndex + 1) & mask;
+    }
+}
+
+static InternedNameSlots *_createSlots(NSUInteger capacity)
+{
+    OBPRECONDITION((capacity & (capacity - 1)) == 0);
+
+    InternedNameSlots *slots = calloc(1, sizeof(*slots) + capacity * sizeof(slots->entries[0]));
+    slots->mask = capacity - 1;
+    return slots;
+}
+
+static void _placeEntry(InternedNameSlots *slots, InternedNameEntry *entry)
+{
+    NSUInteger slotIndex = (NSUInteger)entry->hash & slots->mask;
+    while (slots->entries[slotIndex])
+        slotIndex = (slotIndex + 1) & slots->mask;
     
-    // We upgrade NULL to EmptyString to make this easier.
-    return _stringHash(key->name) ^ _stringHash(key->namespace);
+    // Make sure the entry's contents are visible before the pointer to it is.
+    OSMemoryBarrier();
+    slots->entries[slotIndex] = entry;
 }
 
-static const char *_personalizeString(const char *str)
+static const char *_personalizeString(const char *str, size_t length)
 {
-    if (!str || !*str)
+    if (length == 0)
         return EmptyString;
-    return strdup(str);
+
+    char *copy = malloc(length + 1);
+    memcpy(copy, str, length + 1);
+    return copy;
+}
+
+// Called with the insert lock held.
+static void _insertEntry(OFXMLInternedNameTable table, uint64_t hash, const char *namespace, size_t namespaceLength, const char *name, size_t nameLength, OFXMLQName *qname)
+{
+    InternedNameSlots *slots = table->slots;
+
+    if (2 * (table->count + 1) > slots->mask + 1) {
+        InternedNameSlots *grownSlots = _createSlots(2 * (slots->mask + 1));
+        for (NSUInteger slotIndex = 0; slotIndex <= slots->mask; slotIndex++) {
+            InternedNameEntry *entry = slots->entries[slotIndex];
+            if (entry)
+                _placeEntry(grownSlots, entry);
+        }
+        grownSlots->previous = slots;
+
+        OSMemoryBarrier();
+        table->slots = grownSlots;
+        slots = grownSlots;
+    }
+
+    // TODO: This could lead to a number of repeated copies of namespace names. Enough to care?
+    InternedNameEntry *entry = malloc(sizeof(*entry));
+    entry->hash = hash;
+    entry->namespace = _personalizeString(namespace, namespaceLength);
+    entry->namespaceLength = namespaceLength;
+    entry->name = _personalizeString(name, nameLength);
+    entry->nameLength = nameLength;
+    entry->qname = [qname retain];
+
+    _placeEntry(slots, entry);
+    table->count++;
 }
 
 OFXMLInternedNameTable OFXMLInternedNameTableCreate(OFXMLInternedNameTable startingQNameTable)
 {
     // Map a tuple of NUL terminated UTF-8 byte strings to OFXMLQName instances that wrap them to avoid creating lots of copies of the same string.
-    CFDictionaryKeyCallBacks keyCallbacks;
-    memset(&keyCallbacks, 0, sizeof(keyCallbacks));
-    keyCallbacks.release = QNameRelease;
-    keyCallbacks.equal = QNameKeyEqual;
-    keyCallbacks.hash = QNameKeyHash;
-    
-    // Lie about the type.  There is no such struct.
-    OFXMLInternedNameTable table = (struct _OFXMLInternedNameTable *)CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &keyCallbacks, &OFNSObjectDictionaryValueCallbacks);
-    
-    // We should point at *exactly* these name instances so that users can use == comparison.
-    for (OFXMLQName *qname in [(NSDictionary *)startingQNameTable allValues]) {
-        QNameKey *key = malloc(sizeof(*key));
+    OFXMLInternedNameTable table = calloc(1, sizeof(*table));
+    table->referenceCount = 1;
+    pthread_mutex_init(&table->insertLock, NULL);
+
+    NSUInteger capacity = InternedNameTableInitialCapacity;
+    if (startingQNameTable) {
+        pthread_mutex_lock(&startingQNameTable->insertLock);
         
-        // TODO: We are potentially making lots of copies of the same namespace string, one per attribute/element in that namespace.
-        key->namespace = _personalizeString([qname.namespace UTF8String]);
-        key->name = _personalizeString([qname.name UTF8String]);
+        while (capacity < 2 * startingQNameTable->count)
+            capacity *= 2;
+        table->slots = _createSlots(capacity);
         
-        OBASSERT(CFDictionaryGetValue(TABLE, key) == NULL);
-        CFDictionarySetValue(TABLE, key, qname);
-    }
+        // We should point at *exactly* these name instances so that users can use == comparison.
+        InternedNameSlots *startingSlots = startingQNameTable->slots;
+        for (NSUInteger slotIndex = 0; slotIndex <= startingSlots->mask; slotIndex++) {
+            InternedNameEntry *entry = startingSlots->entries[slotIndex];
+            if (entry)
+                _insertEntry(table, entry->hash, entry->namespace, entry->namespaceLength, entry->name, entry->nameLength, entry->qname);
+        }
+        
+        pthread_mutex_unlock(&startingQNameTable->insertLock);
+    } else
+        table->slots = _createSlots(capacity);
     
     return table;
 }
 
+OFXMLInternedNameTable OFXMLInternedNameTableRetain(OFXMLInternedNameTable table)
+{
+    OBPRECONDITION(table);
+    OSAtomicIncrement32Barrier(&table->referenceCount);
+    return table;
+}
+
 void OFXMLInternedNameTableFree(OFXMLInternedNameTable table)
 {
     OBPRECONDITION(table);
-    if (TABLE)
-        CFRelease(TABLE);
+    if (!table || OSAtomicDecrement32Barrier(&table->referenceCount) > 0)
+        return;
+
+    InternedNameSlots *slots = table->slots;
+    for (NSUInteger slotIndex = 0; slotIndex <= slots->mask; slotIndex++) {
+        InternedNameEntry *entry = slots->entries[slotIndex];
+        if (!entry)
+            continue;
+        if (entry->namespace != EmptyString)
+            free((char *)entry->namespace);
+        if (entry->name != EmptyString)
+            free((char *)entry->name);
+        [entry->qname release];
+        free(entry);
+    }
+    while (slots) {
+        InternedNameSlots *previous = slots->previous;
+        free(slots);
+        slots = previous;
+    }
+
+    pthread_mutex_destroy(&table->insertLock);
+    free(table);
 }
 
 OFXMLQName *OFXMLInternedNameTableGetInternedName(OFXMLInternedNameTable table, const char *namespace, const char *name)
@@ -184,27 +366,36 @@ OFXMLQName *OFXMLInternedNameTableGetInternedName(OFXMLInternedNameTable table,
     if (!name)
         name = EmptyString;
     
-    QNameKey proto = {.namespace = namespace, .name = name};
+    size_t namespaceLength = strlen(namespace), nameLength = strlen(name);
+    uint64_t hash = _qnameHash(namespace, namespaceLength, name, nameLength);
     
-    OFXMLQName *interned = (OFXMLQName *)CFDictionaryGetValue(TABLE, &proto);
+    OFXMLQName *interned = _lookUpName(table->slots, hash, namespace, namespaceLength, name, nameLength);
     if (interned)
         return interned;
     
-    // TODO: This could lead to a number of repeated copies of namespace names. Enough to care?
-    QNameKey *key = malloc(sizeof(*key));
-    key->namespace = _personalizeString(namespace);
-    key->name = _personalizeString(name);
-
-    NSString *namespaceString = (namespace != EmptyString) ? [[NSString alloc] initWithCString:namespace encoding:NSUTF8StringEncoding] : @"";
-    NSString *nameString = (name != EmptyString) ? [[NSString alloc] initWithCString:name encoding:NSUTF8StringEncoding] : @"";
-    interned = [[OFXMLQName alloc] initWithNamespace:namespaceString name:nameString];
-    [namespaceString release];
-    [nameString release];
+    pthread_mutex_lock(&table->insertLock);
     
-    CFDictionarySetValue(TABLE, key, interned);
-    [interned release];
+    // Another thread may have added it since we looked.
+    interned = _lookUpName(table->slots, hash, namespace, namespaceLength, name, nameLength);
+    if (!interned) {
+        NSString *namespaceString = (namespace != EmptyString) ? [[NSString alloc] initWithCString:namespace encoding:NSUTF8StringEncoding] : @"";
+        NSString *nameString = (name != EmptyString) ? [[NSString alloc] initWithCString:name encoding:NSUTF8StringEncoding] : @"";
+        interned = [[OFXMLQName alloc] initWithNamespace:namespaceString name:nameString];
+        [namespaceString release];
+        [nameString release];
+        
+        _insertEntry(table, hash, namespace, namespaceLength, name, nameLength, interned);
+        [interned release];
+        
+        //NSLog(@"XML: Interned qname '%@'", [interned shortDescription]);
+    }
     
-    //NSLog(@"XML: Interned qname '%@'", [interned shortDescription]);
+    pthread_mutex_unlock(&table->insertLock);
     
     return interned;
 }
+
+NSUInteger OFXMLInternedNameTableGetCount(OFXMLInternedNameTable table)
+{
+    return table->count;
+}
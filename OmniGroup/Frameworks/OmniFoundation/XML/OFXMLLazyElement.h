@@ -0,0 +1,38 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFXMLElement.h>
+
+@class NSData, NSDictionary;
+@class OFXMLWhitespaceBehavior;
+
+/*
+ An element that is only a range of UTF-8 source bytes until something looks inside it.  The first call that needs its attributes or children parses the range (wrapped in the namespace declarations that were in effect around it in the source) and from then on it is an ordinary OFXMLElement.  Until then, writing it out copies the source bytes verbatim rather than reformatting them.  OFXMLDocument makes these when loading with a lazy element depth.
+ */
+@interface OFXMLLazyElement : OFXMLElement
+{
+    NSData *_sourceData;
+    NSRange _sourceRange;
+    NSDictionary *_namespaceDeclarations;
+    OFXMLWhitespaceBehavior *_whitespaceBehavior;
+    OFXMLWhitespaceBehaviorType _parentWhitespaceBehavior;
+}
+
+// 'namespaceDeclarations' maps "xmlns" or "xmlns:prefix" to the namespace URI for each prefix in scope at the element.  'parentWhitespaceBehavior' is the resolved behavior of the element's parent.
+- initWithName:(NSString *)name sourceData:(NSData *)sourceData range:(NSRange)sourceRange namespaceDeclarations:(NSDictionary *)namespaceDeclarations whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior parentWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)parentWhitespaceBehavior;
+
+@property(nonatomic,readonly,getter=isLoaded) BOOL loaded;
+
+// What the element was created with; only meaningful until it is loaded (the data and declarations are nil after that).
+@property(nonatomic,readonly) NSData *sourceData;
+@property(nonatomic,readonly) NSRange sourceRange;
+@property(nonatomic,readonly) NSDictionary *namespaceDeclarations;
+@property(nonatomic,readonly) OFXMLWhitespaceBehaviorType parentWhitespaceBehavior;
+
+@end
@@ -0,0 +1,303 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFXMLLazyElement.h>
+
+#import <Foundation/Foundation.h>
+
+#import <OmniFoundation/OFXMLBuffer.h>
+#import <OmniFoundation/OFXMLDocument.h>
+#import <OmniFoundation/OFXMLWhitespaceBehavior.h>
+
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$")
+
+@interface OFXMLLazyElement (/*Private*/)
+- (void)_load;
+@end
+
+static inline void _OFXMLLazyElementLoad(OFXMLLazyElement *self)
+{
+    if (self->_sourceData)
+        [self _load];
+}
+
+@implementation OFXMLLazyElement
+
+- initWithName:(NSString *)name sourceData:(NSData *)sourceData range:(NSRange)sourceRange namespaceDeclarations:(NSDictionary *)namespaceDeclarations whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior parentWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)parentWhitespaceBehavior;
+{
+    OBPRECONDITION(sourceData);
+    OBPRECONDITION(NSMaxRange(sourceRange) <= [sourceData length]);
+    OBPRECONDITION(whitespaceBehavior);
+
+    if (!(self = [super initWithName:name]))
+        return nil;
+
+    _sourceData = [sourceData retain];
+    _sourceRange = sourceRange;
+    _namespaceDeclarations = [namespaceDeclarations copy];
+    _whitespaceBehavior = [whitespaceBehavior retain];
+    _parentWhitespaceBehavior = parentWhitespaceBehavior;
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_sourceData release];
+    [_namespaceDeclarations release];
+    [_whitespaceBehavior release];
+    [super dealloc];
+}
+
+- (BOOL)isLoaded;
+{
+    return _sourceData == nil;
+}
+
+@synthesize sourceData = _sourceData;
+@synthesize sourceRange = _sourceRange;
+@synthesize namespaceDeclarations = _namespaceDeclarations;
+@synthesize parentWhitespaceBehavior = _parentWhitespaceBehavior;
+
+#pragma mark -
+#pragma mark OFXMLElement subclass
+
+- (OFXMLElement *)deepCopyWithName:(NSString *)name;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super deepCopyWithName:name];
+}
+
+- (NSArray *)children;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super children];
+}
+
+- (NSUInteger)childrenCount;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super childrenCount];
+}
+
+- (id)childAtIndex:(NSUInteger)childIndex;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super childAtIndex:childIndex];
+}
+
+- (id)lastChild;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super lastChild];
+}
+
+- (NSUInteger)indexOfChildIdenticalTo:(id)child;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super indexOfChildIdenticalTo:child];
+}
+
+- (void)insertChild:(id)child atIndex:(NSUInteger)childIndex;
+{
+    _OFXMLLazyElementLoad(self);
+    [super insertChild:child atIndex:childIndex];
+}
+
+- (void)appendChild:(id)child;
+{
+    _OFXMLLazyElementLoad(self);
+    [super appendChild:child];
+}
+
+- (void)removeChild:(id)child;
+{
+    _OFXMLLazyElementLoad(self);
+    [super removeChild:child];
+}
+
+- (void)removeChildAtIndex:(NSUInteger)childIndex;
+{
+    _OFXMLLazyElementLoad(self);
+    [super removeChildAtIndex:childIndex];
+}
+
+- (void)removeAllChildren;
+{
+    _OFXMLLazyElementLoad(self);
+    [super removeAllChildren];
+}
+
+- (void)setChildren:(NSArray *)children;
+{
+    _OFXMLLazyElementLoad(self);
+    [super setChildren:children];
+}
+
+- (void)sortChildrenUsingFunction:(NSComparisonResult (*)(id, id, void *))comparator context:(void *)context;
+{
+    _OFXMLLazyElementLoad(self);
+    [super sortChildrenUsingFunction:comparator context:context];
+}
+
+- (OFXMLElement *)firstChildNamed:(NSString *)childName;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super firstChildNamed:childName];
+}
+
+- (OFXMLElement *)firstChildWithAttribute:(NSString *)attributeName value:(NSString *)value;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super firstChildWithAttribute:attributeName value:value];
+}
+
+- (NSArray *)attributeNames;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super attributeNames];
+}
+
+- (NSString *)attributeNamed:(NSString *)name;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super attributeNamed:name];
+}
+
+- (void)setAttribute:(NSString *)name string:(NSString *)value;
+{
+    _OFXMLLazyElementLoad(self);
+    [super setAttribute:name string:value];
+}
+
+- (void)removeAttributeNamed:(NSString *)name;
+{
+    _OFXMLLazyElementLoad(self);
+    [super removeAttributeNamed:name];
+}
+
+- (void)sortAttributesUsingFunction:(NSComparisonResult (*)(id, id, void *))comparator context:(void *)context;
+{
+    _OFXMLLazyElementLoad(self);
+    [super sortAttributesUsingFunction:comparator context:context];
+}
+
+- (void)sortAttributesUsingSelector:(SEL)comparator;
+{
+    _OFXMLLazyElementLoad(self);
+    [super sortAttributesUsingSelector:comparator];
+}
+
+- (void)applyFunction:(OFXMLElementApplier)applier context:(void *)context;
+{
+    _OFXMLLazyElementLoad(self);
+    [super applyFunction:applier context:context];
+}
+
+- (BOOL)appendXML:(struct _OFXMLBuffer *)xml withParentWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)parentBehavior document:(OFXMLDocument *)doc level:(unsigned int)level error:(NSError **)outError;
+{
+    if (!_sourceData)
+        return [super appendXML:xml withParentWhiteSpaceBehavior:parentBehavior document:doc level:level error:outError];
+
+    if ([self shouldIgnore])
+        return YES; // trivial success
+
+    // Never looked at, so the source is still exactly right (and we skip reformatting it).
+    OFXMLBufferAppendUTF8Bytes(xml, (const char *)[_sourceData bytes] + _sourceRange.location, _sourceRange.length);
+    return YES;
+}
+
+- (NSObject *)copyFrozenElement;
+{
+    _OFXMLLazyElementLoad(self);
+    return [super copyFrozenElement];
+}
+
+#pragma mark -
+#pragma mark Comparison
+
+- (BOOL)isEqual:(id)otherObject;
+{
+    _OFXMLLazyElementLoad(self);
+    if ([otherObject isKindOfClass:[OFXMLLazyElement class]])
+        _OFXMLLazyElementLoad(otherObject);
+    return [super isEqual:otherObject];
+}
+
+#pragma mark -
+#pragma mark Debugging
+
+- (NSMutableDictionary *)debugDictionary;
+{
+    NSMutableDictionary *debugDictionary = [super debugDictionary];
+    if (_sourceData)
+        [debugDictionary setObject:NSStringFromRange(_sourceRange) forKey:@"_sourceRange"];
+    return debugDictionary;
+}
+
+#pragma mark -
+#pragma mark Private
+
+- (void)_load;
+{
+    OBPRECONDITION(_sourceData);
+    OBPRECONDITION(_children == nil);
+    OBPRECONDITION(_attributeOrder == nil);
+
+    // The range was well-formed when the whole document was parsed, but prefixes it uses may be declared on its ancestors, so give it a parent that declares them again.  The wrapper is parsed with our parent's whitespace behavior as the default, so it doesn't change how our text is treated.
+    OFXMLBuffer xml = OFXMLBufferCreate();
+    OFXMLBufferAppendUTF8CString(xml, "<OFXMLLazyElement");
+    [_namespaceDeclarations enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSString *namespaceURI, BOOL *stop) {
+        OFXMLBufferAppendUTF8CString(xml, " ");
+        OFXMLBufferAppendString(xml, (CFStringRef)key);
+        OFXMLBufferAppendUTF8CString(xml, "=\"");
+        OFXMLBufferAppendQuotedString(xml, (CFStringRef)namespaceURI, kCFStringEncodingUTF8);
+        OFXMLBufferAppendUTF8CString(xml, "\"");
+    }];
+    OFXMLBufferAppendUTF8CString(xml, ">");
+    OFXMLBufferAppendUTF8Bytes(xml, (const char *)[_sourceData bytes] + _sourceRange.location, _sourceRange.length);
+    OFXMLBufferAppendUTF8CString(xml, "</OFXMLLazyElement>");
+
+    NSData *wrappedData = (NSData *)OFXMLBufferCopyData(xml, kCFStringEncodingUTF8);
+    OFXMLBufferDestroy(xml);
+
+    // Drop the source first so that anything we do from here on sees a loaded element.
+    [_sourceData release];
+    _sourceData = nil;
+
+    NSError *error = nil;
+    OFXMLDocument *document = [[OFXMLDocument alloc] initWithData:wrappedData whitespaceBehavior:_whitespaceBehavior defaultWhitespaceBehavior:_parentWhitespaceBehavior error:&error];
+    [wrappedData release];
+
+    OFXMLElement *element = [[document rootElement] firstChildNamed:_name];
+    if (!element) {
+        OBASSERT_NOT_REACHED("The whole document parsed, so this piece of it should too");
+        NSLog(@"Unable to load lazy element <%@>: %@", _name, [error toPropertyList]);
+    } else {
+        NSArray *attributeNames = [element attributeNames];
+        if (attributeNames) {
+            _attributeOrder = [[NSMutableArray alloc] initWithArray:attributeNames];
+            _attributes = [[NSMutableDictionary alloc] init];
+            for (NSString *attributeName in attributeNames)
+                [_attributes setObject:[element attributeNamed:attributeName] forKey:attributeName];
+        }
+
+        NSArray *children = [element children];
+        if (children)
+            _children = [[NSMutableArray alloc] initWithArray:children];
+    }
+    [document release];
+
+    [_namespaceDeclarations release];
+    _namespaceDeclarations = nil;
+    [_whitespaceBehavior release];
+    _whitespaceBehavior = nil;
+}
+
+@end
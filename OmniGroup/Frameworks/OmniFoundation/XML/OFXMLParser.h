@@ -20,11 +20,19 @@
 
 - (id)initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior target:(NSObject <OFXMLParserTarget> *)target error:(NSError **)outError;
 
+/*
+ With a 'maximumConcurrency' other than 1 (zero means one per active processor), large documents are split between children of the root element and the pieces are parsed on that many threads at once.  The element and attribute names all come from the one interned name table, and once every piece is done the target gets the same callbacks, in the same order, on the calling thread, as it would from a serial parse.  Load warnings from later pieces have line numbers relative to their piece.
+
+ Documents are parsed serially if they are small, aren't UTF-8, have an internal DTD subset (it might declare entities the later pieces need), or have no children of the root to split at; so is everything if the target implements -parser:behaviorForElementWithQName:attributeQNames:attributeValues:, since unparsed blocks are cut out of the source by offset.  If any piece fails to parse, the whole document is parsed again serially so the error is the one a serial parse would report.
+ */
+- (id)initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior maximumConcurrency:(NSUInteger)maximumConcurrency target:(NSObject <OFXMLParserTarget> *)target error:(NSError **)outError;
+
 @property(nonatomic,readonly) CFStringEncoding encoding;
 @property(nonatomic,readonly) NSString *versionString;
 @property(nonatomic,readonly) BOOL standalone;
 @property(nonatomic,readonly) NSArray *loadWarnings;
 
 @property(nonatomic,readonly) NSUInteger elementDepth;
+@property(nonatomic,readonly) BOOL hasInternalSubset; // Set once a DOCTYPE with an internal subset has been read; entities it declares are only known to this parse
 
 @end
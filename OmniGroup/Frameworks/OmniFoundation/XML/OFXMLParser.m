@@ -11,10 +11,12 @@
 #import <libxml/parser.h>
 #import <OmniFoundation/CFArray-OFExtensions.h>
 #import <OmniFoundation/OFErrors.h>
+#import <OmniFoundation/OFXMLArena.h>
 #import <OmniFoundation/OFXMLError.h>
 #import <OmniFoundation/OFXMLInternedStringTable.h>
 #import <OmniFoundation/OFXMLQName.h>
 #import <OmniBase/assertions.h>
+#import <dispatch/dispatch.h>
 
 RCS_ID("$Id$");
 
@@ -32,13 +34,22 @@ typedef struct _OFMLParserState {
         
         void (*endElement)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser);
         void (*endUnparsedElementWithQName)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, OFXMLQName *elementName, NSString *identifier, NSData *contents);
+        void (*endUnparsedElementWithSourceRange)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, OFXMLQName *elementName, NSString *identifier, NSRange sourceRange);
         
         void (*addWhitespace)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, NSString *whitespace);
         void (*addString)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, NSString *string);
+
+        void (*startElementWithQNameRaw)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, OFXMLQName *elementQName, NSUInteger attributeCount, const OFXMLParserAttribute *attributes);
+        void (*addCharacters)(NSObject <OFXMLParserTarget> *target, SEL _cmd, OFXMLParser *parser, const char *characters, size_t length, BOOL inSource, BOOL whitespace);
     } targetImp;
     
     NSUInteger elementDepth;
     BOOL rootElementFinished;
+    BOOL hasInternalSubset;
+
+    // The input, so we can hand raw targets pointers into it rather than into libxml's buffers
+    const char *sourceBytes;
+    size_t sourceLength;
 
     NSCharacterSet *nonWhitespaceCharacterSet;
     OFXMLWhitespaceBehavior *whitespaceBehavior;
@@ -53,6 +64,7 @@ typedef struct _OFMLParserState {
     // Support for unparsed/skipped blocks
     OFXMLParserElementBehavior unparsedBlockBehavior;
     off_t unparsedBlockStart; // < 0 if we aren't in an unparsed block.
+    size_t unparsedBlockSourceStart; // Offset into the source data, if the input isn't being transcoded
     unsigned int unparsedBlockElementNesting;
     NSString *unparsedElementID; // The value of the xml:id attribute, if any
 } OFMLParserState;
@@ -61,6 +73,11 @@ typedef struct _OFMLParserState {
 static void _internalSubsetSAXFunc(void *ctx, const xmlChar *name, const xmlChar *ExternalID, const xmlChar *SystemID)
 {
     //NSLog(@"_internalSubsetSAXFunc name:'%s' ExternalID:'%s' SystemID:'%s'", name, ExternalID, SystemID);
+
+    // libxml2 calls this after skipping the blanks following the external ID, so the input is at the '[' if there are declarations to come.
+    OFMLParserState *state = ctx;
+    if (*state->ctxt->input->cur == '[')
+        state->hasInternalSubset = YES;
 }
 
 static void _externalSubsetSAXFunc(void *ctx, const xmlChar *name, const xmlChar *ExternalID, const xmlChar *SystemID)
@@ -94,6 +111,93 @@ static void _externalSubsetSAXFunc(void *ctx, const xmlChar *name, const xmlChar
     }
 }
 
+// If the given bytes from libxml's input buffer are an unmodified copy of the corresponding range of our source data, returns the address of that range.  libxml shrinks its buffer as it goes, so the source offset is what it has consumed so far plus the offset into what remains.  Transcoded input, or parser-generated content like entity replacements, fails the comparison.
+static const char *_OFMLParserStateSourceBytes(OFMLParserState *state, const xmlChar *bytes, size_t length)
+{
+    xmlParserInputPtr input = state->ctxt->input;
+    if (!input || bytes < input->base || bytes + length > input->end)
+        return NULL;
+
+    size_t offset = input->consumed + (bytes - input->base);
+    if (offset > state->sourceLength || length > state->sourceLength - offset)
+        return NULL;
+
+    const char *source = state->sourceBytes + offset;
+    if (memcmp(source, bytes, length) != 0)
+        return NULL;
+    return source;
+}
+
+// When libxml2 isn't transcoding, its input is the source data byte for byte, so a position in its buffer maps directly to a source offset.
+static BOOL _OFMLParserStateGetSourceOffset(OFMLParserState *state, const xmlChar *position, size_t *outOffset)
+{
+    xmlParserInputPtr input = state->ctxt->input;
+    if (!input || !input->buf || input->buf->encoder || position < input->base || position > input->end)
+        return NO;
+
+    size_t offset = input->consumed + (position - input->base);
+    if (offset > state->sourceLength)
+        return NO;
+    *outOffset = offset;
+    return YES;
+}
+
+static void _OFMLParserStatePushWhitespaceBehavior(OFMLParserState *state, OFXMLQName *elementQName)
+{
+    // TODO: Make OFXMLWhitespaceBehaviorType QName aware.
+    OFXMLWhitespaceBehaviorType oldBehavior = (OFXMLWhitespaceBehaviorType)[state->whitespaceBehaviorStack lastObject];
+    OFXMLWhitespaceBehaviorType newBehavior = [state->whitespaceBehavior behaviorForElementName:elementQName.name];
+    
+    if (newBehavior == OFXMLWhitespaceBehaviorTypeAuto)
+        newBehavior = oldBehavior;
+    
+    [state->whitespaceBehaviorStack addObject:(id)newBehavior];
+}
+
+#define RAW_ATTRIBUTE_STACK_COUNT (32)
+
+static void _startElementRaw(OFMLParserState *state, const xmlChar *localname, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, const xmlChar **attributes)
+{
+    OFXMLParserAttribute attributeBuffer[RAW_ATTRIBUTE_STACK_COUNT];
+    NSUInteger attributeCapacity = nb_namespaces + nb_attributes;
+    OFXMLParserAttribute *rawAttributes = attributeCapacity <= RAW_ATTRIBUTE_STACK_COUNT ? attributeBuffer : malloc(attributeCapacity * sizeof(*rawAttributes));
+    NSUInteger attributeCount = 0;
+
+    // Same mapping as the object-based path: namespaces first, as attributes in the xmlns namespace.
+    for (int namespaceIndex = 0; namespaceIndex < nb_namespaces; namespaceIndex++, namespaces += 2) {
+        if (!namespaces[1]) {
+            NSLog(@"Bogus namespace; no URI string");
+            continue;
+        }
+        OFXMLParserAttribute *attribute = &rawAttributes[attributeCount++];
+        attribute->qname = OFXMLInternedNameTableGetInternedName(state->nameTable, OFXMLNamespaceXMLNSCString, (const char *)namespaces[0]);
+        attribute->value = (const char *)namespaces[1];
+        attribute->length = strlen(attribute->value);
+        attribute->inSource = NO;
+    }
+
+    // Each attribute is given by 5 elements, localname, prefix, URI, value start and value end.
+    for (int attributeIndex = 0; attributeIndex < nb_attributes; attributeIndex++, attributes += 5) {
+        OFXMLParserAttribute *attribute = &rawAttributes[attributeCount++];
+        attribute->qname = OFXMLInternedNameTableGetInternedName(state->nameTable, (const char *)attributes[2], (const char *)attributes[0]);
+        attribute->length = attributes[4] - attributes[3];
+
+        const char *source = _OFMLParserStateSourceBytes(state, attributes[3], attribute->length);
+        attribute->value = source ? source : (const char *)attributes[3];
+        attribute->inSource = (source != NULL);
+    }
+
+    OFXMLQName *elementQName = OFXMLInternedNameTableGetInternedName(state->nameTable, (const char *)URI, (const char *)localname);
+
+    state->elementDepth++;
+    state->targetImp.startElementWithQNameRaw(state->target, @selector(parser:startElementWithQName:attributeCount:attributes:), state->parser, elementQName, attributeCount, rawAttributes);
+
+    if (rawAttributes != attributeBuffer)
+        free(rawAttributes);
+
+    _OFMLParserStatePushWhitespaceBehavior(state, elementQName);
+}
+
 static void _startElementNsSAX2Func(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes)
 {
     OFMLParserState *state = ctx;
@@ -109,6 +213,12 @@ static void _startElementNsSAX2Func(void *ctx, const xmlChar *localname, const x
         return;
     }
     
+    if (state->targetImp.startElementWithQNameRaw) {
+        _startElementRaw(state, localname, URI, nb_namespaces, namespaces, nb_attributes, attributes);
+        OBINVARIANT([state->whitespaceBehaviorStack count] == state->elementDepth + 1); // always have the default behavior on the stack!
+        return;
+    }
+    
     NSMutableArray *attributeQNames = nil;
     NSMutableArray *attributeValues = nil;
     
@@ -120,7 +230,7 @@ static void _startElementNsSAX2Func(void *ctx, const xmlChar *localname, const x
             attributeValues = [[NSMutableArray alloc] init];
         
         int namespaceIndex;
-        for (namespaceIndex = 0; namespaceIndex < nb_namespaces; namespaceIndex++) {
+        for (namespaceIndex = 0; namespaceIndex < nb_namespaces; namespaceIndex++, namespaces += 2) {
             // Each namespace is given by two elements, a prefix and URI.
             
             OFXMLQName *qname = OFXMLInternedNameTableGetInternedName(state->nameTable, OFXMLNamespaceXMLNSCString, (const char *)namespaces[0]);
@@ -198,6 +308,8 @@ static void _startElementNsSAX2Func(void *ctx, const xmlChar *localname, const x
             state->unparsedBlockBehavior = behavior;
             state->unparsedBlockStart = p - base;
             state->unparsedBlockElementNesting = 0;
+            if (!_OFMLParserStateGetSourceOffset(state, p, &state->unparsedBlockSourceStart))
+                state->unparsedBlockSourceStart = SIZE_MAX;
             //fprintf(stderr, "unparsed element '%s' starts at offset %qd\n", localname, state->unparsedBlockStart);
             
             // Store the xml:id of the element, if it has one, so we can pass it to the end hook.  We could pass the entire set of attributes, but I only need the id right now.
@@ -228,16 +340,7 @@ static void _startElementNsSAX2Func(void *ctx, const xmlChar *localname, const x
     [attributeQNames release];
     [attributeValues release];
     
-    
-    // TODO: Make OFXMLWhitespaceBehaviorType QName aware.
-    OFXMLWhitespaceBehaviorType oldBehavior = (OFXMLWhitespaceBehaviorType)[state->whitespaceBehaviorStack lastObject];
-    OFXMLWhitespaceBehaviorType newBehavior = [state->whitespaceBehavior behaviorForElementName:elementQName.name];
-    
-    if (newBehavior == OFXMLWhitespaceBehaviorTypeAuto)
-        newBehavior = oldBehavior;
-    
-    [state->whitespaceBehaviorStack addObject:(id)newBehavior];
-    
+    _OFMLParserStatePushWhitespaceBehavior(state, elementQName);
     
     OBINVARIANT([state->whitespaceBehaviorStack count] == state->elementDepth + 1); // always have the default behavior on the stack!
         
@@ -271,7 +374,7 @@ static void _endElementNsSAX2Func(void *ctx, const xmlChar *localname, const xml
     if (state->unparsedBlockStart >= 0) {
         if (state->unparsedBlockElementNesting == 0) {
             // Don't call back (or create the contents data) if we just wanted to skip it.
-            if ((state->unparsedBlockBehavior == OFXMLParserElementBehaviorUnparsed || state->unparsedBlockBehavior == OFXMLParserElementBehaviorUnparsedReturnContentsOnly) && state->targetImp.endUnparsedElementWithQName) {
+            if ((state->unparsedBlockBehavior == OFXMLParserElementBehaviorUnparsed || state->unparsedBlockBehavior == OFXMLParserElementBehaviorUnparsedReturnContentsOnly) && (state->targetImp.endUnparsedElementWithQName || state->targetImp.endUnparsedElementWithSourceRange)) {
                 // This gets called right after the closing '>'.  This is the end of our unparsed block.
                 const xmlChar *p = state->ctxt->input->cur;
                 const xmlChar *base = state->ctxt->input->base;
@@ -293,16 +396,22 @@ static void _endElementNsSAX2Func(void *ctx, const xmlChar *localname, const xml
                 
                 OBASSERT(end > (typeof(end))state->unparsedBlockStart); // signed vs. unsigned, but we checked unparsedBlockStart >= 0 above, so the cast is safe
                 size_t length = (size_t)(end - state->unparsedBlockStart);
-                
-                NSData *data = [[NSData alloc] initWithBytes:state->ctxt->input->base + state->unparsedBlockStart length:length];
                 OFXMLQName *qname = OFXMLInternedNameTableGetInternedName(state->nameTable, (const char *)URI, (const char *)localname);
                 
-                state->targetImp.endUnparsedElementWithQName(state->target, @selector(parser:endUnparsedElementWithQName:identifier:contents:), parser, qname, state->unparsedElementID, data);
+                // Targets that can take a range of the source get one if the block is there verbatim and can be parsed again on its own (no internal subset entities).
+                size_t sourceEnd;
+                if (state->targetImp.endUnparsedElementWithSourceRange && !state->hasInternalSubset &&
+                    state->unparsedBlockSourceStart != SIZE_MAX && _OFMLParserStateGetSourceOffset(state, p, &sourceEnd) && sourceEnd - state->unparsedBlockSourceStart == length) {
+                    NSRange sourceRange = NSMakeRange(state->unparsedBlockSourceStart, length);
+                    state->targetImp.endUnparsedElementWithSourceRange(state->target, @selector(parser:endUnparsedElementWithQName:identifier:sourceRange:), parser, qname, state->unparsedElementID, sourceRange);
+                } else if (state->targetImp.endUnparsedElementWithQName) {
+                    NSData *data = [[NSData alloc] initWithBytes:state->ctxt->input->base + state->unparsedBlockStart length:length];
+                    state->targetImp.endUnparsedElementWithQName(state->target, @selector(parser:endUnparsedElementWithQName:identifier:contents:), parser, qname, state->unparsedElementID, data);
+                    [data release];
+                }
 
                 [state->unparsedElementID release];
                 state->unparsedElementID = nil;
-                
-                [data release];            
             }
             
             state->unparsedBlockStart = -1; // end of the unparsed block
@@ -331,6 +440,34 @@ static void _endElementNsSAX2Func(void *ctx, const xmlChar *localname, const xml
     OBINVARIANT([state->whitespaceBehaviorStack count] == state->elementDepth + 1); // always have the default behavior on the stack!
 }
 
+static void _charactersRaw(OFMLParserState *state, const xmlChar *ch, int len)
+{
+    // Same test as the NSString path below, without making a string in the common case: the ASCII members of the whitespace-and-newline set are space and \t through \r.  Anything non-ASCII gets the real check.
+    BOOL whitespace = YES;
+    for (int characterIndex = 0; characterIndex < len; characterIndex++) {
+        xmlChar c = ch[characterIndex];
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            continue;
+        if (c < 0x80)
+            whitespace = NO;
+        else {
+            NSString *str = [[NSString alloc] initWithBytes:ch length:len encoding:NSUTF8StringEncoding];
+            whitespace = ([str rangeOfCharacterFromSet:state->nonWhitespaceCharacterSet].length == 0);
+            [str release];
+        }
+        break;
+    }
+    
+    if (whitespace) {
+        OBINVARIANT([state->whitespaceBehaviorStack count] == state->elementDepth + 1); // always have the default behavior on the stack!
+        if ((OFXMLWhitespaceBehaviorType)[state->whitespaceBehaviorStack lastObject] != OFXMLWhitespaceBehaviorTypePreserve)
+            return;
+    }
+    
+    const char *source = _OFMLParserStateSourceBytes(state, ch, len);
+    state->targetImp.addCharacters(state->target, @selector(parser:addCharacters:length:inSource:whitespace:), state->parser, source ? source : (const char *)ch, len, source != NULL, whitespace);
+}
+
 static void _charactersSAXFunc(void *ctx, const xmlChar *ch, int len)
 {
     OFMLParserState *state = ctx;
@@ -344,6 +481,11 @@ static void _charactersSAXFunc(void *ctx, const xmlChar *ch, int len)
     if (state->elementDepth == 0)
         return;
     
+    if (state->targetImp.addCharacters) {
+        _charactersRaw(state, ch, len);
+        return;
+    }
+    
     NSString *str = [[NSString alloc] initWithBytes:ch length:len encoding:NSUTF8StringEncoding];
     //NSLog(@"characters: '%@'", str);
     
@@ -419,12 +561,413 @@ static void _OFMLParserStateCleanUp(OFMLParserState *state)
     memset(state, 0, sizeof(*state));
 }
 
+#pragma mark - Parallel parsing
+
+/*
+ A parallel parse splits the document between children of the root element.  Each piece is wrapped in a copy of the root's start tag (so namespace declarations, xml:space and the like are in effect) and a matching end tag, parsed on its own thread by a serial OFXMLParser into an OFXMLParserChunkRecorder, and then the recorded callbacks are replayed to the real target in order, skipping the copied root elements.  The first piece keeps the real prolog and the last the real end of the document.
+ */
+
+#define OFXMLParserMinimumParallelChunkLength (64 * 1024)
+
+typedef struct {
+    size_t rootStart;    // The '<' of the root element's start tag
+    size_t rootStartEnd; // Just past its '>'
+    size_t rootEnd;      // The '<' of its end tag
+    size_t nameLength;   // Of the root's qualified name, which starts at rootStart + 1
+    NSUInteger splitCount;
+    size_t *splits;      // The '<' of each child of the root that starts a new piece, ascending
+} OFXMLParserChunkLayout;
+
+static BOOL _OFXMLDeclarationAllowsSplitting(const uint8_t *declaration, const uint8_t *end)
+{
+    // Only UTF-8 (the default); other encodings would need the declaration copied into every piece, and the ASCII-compatible ones aren't worth the trouble.
+    const uint8_t *p = memmem(declaration, end - declaration, "encoding", 8);
+    if (!p)
+        return YES;
+    
+    p += 8;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == '='))
+        p++;
+    if (p >= end || (*p != '"' && *p != '\''))
+        return NO;
+    
+    uint8_t quote = *p++;
+    const uint8_t *valueEnd = memchr(p, quote, end - p);
+    if (!valueEnd)
+        return NO;
+    
+    size_t valueLength = valueEnd - p;
+    return (valueLength == 5 && strncasecmp((const char *)p, "utf-8", 5) == 0) || (valueLength == 4 && strncasecmp((const char *)p, "utf8", 4) == 0);
+}
+
+// Returns just past the '>' that closes the tag whose contents start at 'p', honoring quoted attribute values, or NULL.
+static const uint8_t *_OFXMLSkipTag(const uint8_t *p, const uint8_t *end, BOOL *outEmpty)
+{
+    while (p < end) {
+        uint8_t c = *p;
+        if (c == '"' || c == '\'') {
+            p = memchr(p + 1, c, end - p - 1);
+            if (!p)
+                return NULL;
+        } else if (c == '>') {
+            *outEmpty = (p[-1] == '/');
+            return p + 1;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// A quick scan for the root element and the children of it to split at, aiming for 'chunkCount' pieces of about the same length.  This isn't a full parse; anything it doesn't follow makes it give up, and anything it follows wrongly makes a piece fail to parse, which sends us back to a serial parse.
+static BOOL _OFXMLParserFindChunks(const uint8_t *bytes, size_t length, NSUInteger chunkCount, OFXMLParserChunkLayout *layout)
+{
+    const uint8_t *end = bytes + length, *p = bytes;
+    
+    memset(layout, 0, sizeof(*layout));
+    
+    if (length >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF)
+        p += 3; // UTF-8 byte order mark
+    else if (length >= 2 && (p[0] == 0xFE || p[0] == 0xFF || p[0] == 0 || p[1] == 0))
+        return NO; // UTF-16 or UTF-32
+    const uint8_t *documentStart = p;
+    
+    layout->splits = malloc((chunkCount - 1) * sizeof(*layout->splits));
+    size_t targetChunkLength = length / chunkCount, chunkStart = 0;
+    NSUInteger depth = 0;
+    
+    while ((p = memchr(p, '<', end - p))) {
+        const uint8_t *tag = p;
+        size_t remaining = end - p;
+        
+        if (remaining >= 4 && memcmp(p, "<!--", 4) == 0) {
+            p = memmem(p + 4, remaining - 4, "-->", 3);
+            if (!p)
+                goto fail;
+            p += 3;
+        } else if (remaining >= 2 && p[1] == '?') {
+            const uint8_t *close = memmem(p + 2, remaining - 2, "?>", 2);
+            if (!close)
+                goto fail;
+            if (tag == documentStart && remaining >= 6 && memcmp(p, "<?xml", 5) == 0 && (p[5] == ' ' || p[5] == '\t' || p[5] == '\r' || p[5] == '\n') && !_OFXMLDeclarationAllowsSplitting(p, close))
+                goto fail;
+            p = close + 2;
+        } else if (remaining >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+            p = memmem(p + 9, remaining - 9, "]]>", 3);
+            if (!p)
+                goto fail;
+            p += 3;
+        } else if (remaining >= 2 && p[1] == '!') {
+            // A DOCTYPE.  An internal subset can declare entities that only the first piece would see.
+            if (depth > 0)
+                goto fail;
+            for (p += 2; p < end && *p != '>'; p++) {
+                if (*p == '[')
+                    goto fail;
+                if (*p == '"' || *p == '\'') {
+                    p = memchr(p + 1, *p, end - p - 1);
+                    if (!p)
+                        goto fail;
+                }
+            }
+            if (p >= end)
+                goto fail;
+            p++;
+        } else if (remaining >= 2 && p[1] == '/') {
+            if (depth == 0)
+                goto fail;
+            if (--depth == 0) {
+                layout->rootEnd = tag - bytes;
+                break;
+            }
+            p = memchr(p, '>', remaining);
+            if (!p)
+                goto fail;
+            p++;
+        } else {
+            BOOL empty = NO;
+            p = _OFXMLSkipTag(p + 1, end, &empty);
+            if (!p)
+                goto fail;
+            
+            if (depth == 0) {
+                if (empty)
+                    goto fail; // Nothing to split
+                layout->rootStart = tag - bytes;
+                layout->rootStartEnd = p - bytes;
+                
+                const uint8_t *name = tag + 1;
+                while (name < p && *name != ' ' && *name != '\t' && *name != '\r' && *name != '\n' && *name != '/' && *name != '>')
+                    name++;
+                layout->nameLength = name - (tag + 1);
+                chunkStart = layout->rootStartEnd;
+            } else if (depth == 1 && layout->splitCount + 1 < chunkCount && (size_t)(tag - bytes) - chunkStart >= targetChunkLength) {
+                chunkStart = tag - bytes;
+                layout->splits[layout->splitCount++] = chunkStart;
+            }
+            
+            if (!empty)
+                depth++;
+        }
+    }
+    
+    if (layout->rootEnd == 0 || layout->splitCount == 0 || layout->nameLength == 0)
+        goto fail;
+    return YES;
+    
+fail:
+    free(layout->splits);
+    layout->splits = NULL;
+    return NO;
+}
+
+typedef enum {
+    OFXMLParserChunkEventSystemID,
+    OFXMLParserChunkEventProcessingInstruction,
+    OFXMLParserChunkEventStartElement,
+    OFXMLParserChunkEventEndElement,
+    OFXMLParserChunkEventCharacters,
+} OFXMLParserChunkEventType;
+
+typedef struct {
+    OFXMLParserChunkEventType type;
+    BOOL inSource;
+    BOOL whitespace;
+    OFXMLQName *qname; // Held by the name table
+    id object1, object2; // Retained; the system and public IDs or the processing instruction name and value
+    NSUInteger count; // Attributes or bytes of characters
+    const void *data;
+} OFXMLParserChunkEvent;
+
+// A range of a piece's bytes that is a copy of part of the source.
+typedef struct {
+    size_t chunkOffset;
+    size_t length;
+    const char *source;
+} OFXMLParserChunkSegment;
+
+// Records the callbacks from parsing one piece.  Text and attribute values that came straight from the source are recorded as pointers into the original data (so raw targets still see them as in the source); anything else is copied into an arena.
+@interface OFXMLParserChunkRecorder : OFObject <OFXMLParserTarget>
+{
+@public
+    OFXMLInternedNameTable _nameTable;
+    const char *_chunkBytes;
+    OFXMLParserChunkSegment _segments[3];
+    NSUInteger _segmentCount;
+
+    OFXMLArena _arena;
+    OFXMLParserChunkEvent *_events;
+    NSUInteger _eventCount;
+    NSUInteger _eventCapacity;
+}
+@end
+
+@implementation OFXMLParserChunkRecorder
+
+- initWithNameTable:(OFXMLInternedNameTable)nameTable chunkBytes:(const char *)chunkBytes;
+{
+    if (!(self = [super init]))
+        return nil;
+    
+    _nameTable = nameTable;
+    _chunkBytes = chunkBytes;
+    _arena = OFXMLArenaCreate(0);
+    return self;
+}
+
+- (void)dealloc;
+{
+    for (NSUInteger eventIndex = 0; eventIndex < _eventCount; eventIndex++) {
+        [_events[eventIndex].object1 release];
+        [_events[eventIndex].object2 release];
+    }
+    free(_events);
+    OFXMLArenaDestroy(_arena);
+    [super dealloc];
+}
+
+static void _OFXMLParserChunkRecorderMapSegment(OFXMLParserChunkRecorder *self, size_t chunkOffset, size_t length, const char *source)
+{
+    OBPRECONDITION(self->_segmentCount < sizeof(self->_segments)/sizeof(*self->_segments));
+    self->_segments[self->_segmentCount++] = (OFXMLParserChunkSegment){.chunkOffset = chunkOffset, .length = length, .source = source};
+}
+
+static OFXMLParserChunkEvent *_OFXMLParserChunkRecorderAddEvent(OFXMLParserChunkRecorder *self, OFXMLParserChunkEventType type)
+{
+    if (self->_eventCount == self->_eventCapacity) {
+        self->_eventCapacity = MAX(1024U, 2 * self->_eventCapacity);
+        self->_events = realloc(self->_events, self->_eventCapacity * sizeof(*self->_events));
+    }
+    
+    OFXMLParserChunkEvent *event = &self->_events[self->_eventCount++];
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    return event;
+}
+
+static const char *_OFXMLParserChunkRecorderKeepBytes(OFXMLParserChunkRecorder *self, const char *bytes, size_t length, BOOL inChunk, BOOL *outInSource)
+{
+    if (inChunk) {
+        size_t offset = bytes - self->_chunkBytes;
+        for (NSUInteger segmentIndex = 0; segmentIndex < self->_segmentCount; segmentIndex++) {
+            const OFXMLParserChunkSegment *segment = &self->_segments[segmentIndex];
+            if (offset >= segment->chunkOffset && offset - segment->chunkOffset + length <= segment->length) {
+                *outInSource = YES;
+                return segment->source + (offset - segment->chunkOffset);
+            }
+        }
+    }
+    
+    *outInSource = NO;
+    char *copy = OFXMLArenaAllocate(self->_arena, length);
+    memcpy(copy, bytes, length);
+    return copy;
+}
+
+- (OFXMLInternedNameTable)internedNameTableForParser:(OFXMLParser *)parser;
+{
+    return _nameTable;
+}
+
+- (void)parser:(OFXMLParser *)parser setSystemID:(NSURL *)systemID publicID:(NSString *)publicID;
+{
+    OFXMLParserChunkEvent *event = _OFXMLParserChunkRecorderAddEvent(self, OFXMLParserChunkEventSystemID);
+    event->object1 = [systemID retain];
+    event->object2 = [publicID retain];
+}
+
+- (void)parser:(OFXMLParser *)parser addProcessingInstructionNamed:(NSString *)piName value:(NSString *)piValue;
+{
+    OFXMLParserChunkEvent *event = _OFXMLParserChunkRecorderAddEvent(self, OFXMLParserChunkEventProcessingInstruction);
+    event->object1 = [piName retain];
+    event->object2 = [piValue retain];
+}
+
+- (void)parser:(OFXMLParser *)parser startElementWithQName:(OFXMLQName *)qname attributeCount:(NSUInteger)attributeCount attributes:(const OFXMLParserAttribute *)attributes;
+{
+    OFXMLParserChunkEvent *event = _OFXMLParserChunkRecorderAddEvent(self, OFXMLParserChunkEventStartElement);
+    event->qname = qname;
+    event->count = attributeCount;
+    
+    if (attributeCount > 0) {
+        OFXMLParserAttribute *recordedAttributes = OFXMLArenaAllocate(_arena, attributeCount * sizeof(*recordedAttributes));
+        for (NSUInteger attributeIndex = 0; attributeIndex < attributeCount; attributeIndex++) {
+            const OFXMLParserAttribute *attribute = &attributes[attributeIndex];
+            OFXMLParserAttribute *recorded = &recordedAttributes[attributeIndex];
+            recorded->qname = attribute->qname;
+            recorded->length = attribute->length;
+            recorded->value = _OFXMLParserChunkRecorderKeepBytes(self, attribute->value, attribute->length, attribute->inSource, &recorded->inSource);
+        }
+        event->data = recordedAttributes;
+    }
+}
+
+- (void)parserEndElement:(OFXMLParser *)parser;
+{
+    _OFXMLParserChunkRecorderAddEvent(self, OFXMLParserChunkEventEndElement);
+}
+
+- (void)parser:(OFXMLParser *)parser addCharacters:(const char *)characters length:(size_t)length inSource:(BOOL)inSource whitespace:(BOOL)whitespace;
+{
+    OFXMLParserChunkEvent *event = _OFXMLParserChunkRecorderAddEvent(self, OFXMLParserChunkEventCharacters);
+    event->whitespace = whitespace;
+    event->count = length;
+    event->data = _OFXMLParserChunkRecorderKeepBytes(self, characters, length, inSource, &event->inSource);
+}
+
+@end
+
+// Makes the same target calls the SAX callbacks above would have for the recorded events.  Whitespace was already filtered by the piece's parser, which had the same behaviors in effect.
+static void _OFMLParserStateReplayEvents(OFMLParserState *state, const OFXMLParserChunkEvent *events, NSUInteger eventCount)
+{
+    OFXMLParser *parser = state->parser;
+    NSObject <OFXMLParserTarget> *target = state->target;
+    
+    for (NSUInteger eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+        const OFXMLParserChunkEvent *event = &events[eventIndex];
+        
+        switch (event->type) {
+            case OFXMLParserChunkEventSystemID:
+                if (state->targetImp.setSystemID)
+                    state->targetImp.setSystemID(target, @selector(parser:setSystemID:publicID:), parser, event->object1, event->object2);
+                break;
+                
+            case OFXMLParserChunkEventProcessingInstruction:
+                if (state->targetImp.addProcessingInstruction)
+                    state->targetImp.addProcessingInstruction(target, @selector(parser:addProcessingInstructionNamed:value:), parser, event->object1, event->object2);
+                break;
+                
+            case OFXMLParserChunkEventStartElement: {
+                state->elementDepth++;
+                
+                if (state->targetImp.startElementWithQNameRaw) {
+                    state->targetImp.startElementWithQNameRaw(target, @selector(parser:startElementWithQName:attributeCount:attributes:), parser, event->qname, event->count, event->data);
+                } else if (state->targetImp.startElementWithQName) {
+                    NSMutableArray *attributeQNames = nil;
+                    NSMutableArray *attributeValues = nil;
+                    
+                    if (event->count > 0) {
+                        attributeQNames = [[NSMutableArray alloc] initWithCapacity:event->count];
+                        attributeValues = [[NSMutableArray alloc] initWithCapacity:event->count];
+                        
+                        const OFXMLParserAttribute *attributes = event->data;
+                        for (NSUInteger attributeIndex = 0; attributeIndex < event->count; attributeIndex++) {
+                            NSString *value = [[NSString alloc] initWithBytes:attributes[attributeIndex].value length:attributes[attributeIndex].length encoding:NSUTF8StringEncoding];
+                            [attributeQNames addObject:attributes[attributeIndex].qname];
+                            [attributeValues addObject:value];
+                            [value release];
+                        }
+                    }
+                    
+                    state->targetImp.startElementWithQName(target, @selector(parser:startElementWithQName:attributeQNames:attributeValues:), parser, event->qname, attributeQNames, attributeValues);
+                    [attributeQNames release];
+                    [attributeValues release];
+                }
+                break;
+            }
+                
+            case OFXMLParserChunkEventEndElement:
+                OBASSERT(state->elementDepth > 0);
+                if (state->elementDepth > 0) {
+                    state->elementDepth--;
+                    if (state->elementDepth == 0)
+                        state->rootElementFinished = YES;
+                }
+                if (state->targetImp.endElement)
+                    state->targetImp.endElement(target, @selector(parserEndElement:), parser);
+                break;
+                
+            case OFXMLParserChunkEventCharacters:
+                if (state->targetImp.addCharacters) {
+                    state->targetImp.addCharacters(target, @selector(parser:addCharacters:length:inSource:whitespace:), parser, event->data, event->count, event->inSource, event->whitespace);
+                } else if (event->whitespace ? (state->targetImp.addWhitespace != NULL) : (state->targetImp.addString != NULL)) {
+                    NSString *str = [[NSString alloc] initWithBytes:event->data length:event->count encoding:NSUTF8StringEncoding];
+                    if (event->whitespace)
+                        state->targetImp.addWhitespace(target, @selector(parser:addWhitespace:), parser, str);
+                    else
+                        state->targetImp.addString(target, @selector(parser:addString:), parser, str);
+                    [str release];
+                }
+                break;
+        }
+    }
+}
+
+@interface OFXMLParser (/*Private*/)
+- (BOOL)_parseSerially:(NSData *)xmlData state:(OFMLParserState *)state error:(NSError **)outError;
+- (BOOL)_parseInParallel:(NSData *)xmlData state:(OFMLParserState *)state maximumConcurrency:(NSUInteger)maximumConcurrency;
+@end
+
 @implementation OFXMLParser
 {
     struct _OFMLParserState *_state; // Only set while parsing.
 }
 
 - (id)initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior target:(NSObject <OFXMLParserTarget> *)target error:(NSError **)outError;
+{
+    return [self initWithData:xmlData whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:defaultWhitespaceBehavior maximumConcurrency:1 target:target error:outError];
+}
+
+- (id)initWithData:(NSData *)xmlData whitespaceBehavior:(OFXMLWhitespaceBehavior *)whitespaceBehavior defaultWhitespaceBehavior:(OFXMLWhitespaceBehaviorType)defaultWhitespaceBehavior maximumConcurrency:(NSUInteger)maximumConcurrency target:(NSObject <OFXMLParserTarget> *)target error:(NSError **)outError;
 {
     if (!(self = [super init]))
         return nil;
@@ -464,8 +1007,12 @@ static void _OFMLParserStateCleanUp(OFMLParserState *state)
     GET_IMP(startElementWithQName, @selector(parser:startElementWithQName:attributeQNames:attributeValues:));
     GET_IMP(endElement, @selector(parserEndElement:));
     GET_IMP(endUnparsedElementWithQName, @selector(parser:endUnparsedElementWithQName:identifier:contents:));
+    GET_IMP(endUnparsedElementWithSourceRange, @selector(parser:endUnparsedElementWithQName:identifier:sourceRange:));
     GET_IMP(addWhitespace, @selector(parser:addWhitespace:));
     GET_IMP(addString, @selector(parser:addString:));
+    GET_IMP(addCharacters, @selector(parser:addCharacters:length:inSource:whitespace:));
+    if (!state.targetImp.behaviorForElementWithQName)
+        GET_IMP(startElementWithQNameRaw, @selector(parser:startElementWithQName:attributeCount:attributes:));
 #undef GET_IMP
 
     if ([target respondsToSelector:@selector(internedNameTableForParser:)]) {
@@ -482,7 +1029,25 @@ static void _OFMLParserStateCleanUp(OFMLParserState *state)
     // Set up default whitespace behavior
     [state.whitespaceBehaviorStack addObject:(id)defaultWhitespaceBehavior];
     
+    // Unparsed blocks are cut out of the source by offset, which the pieces of a parallel parse don't know.
+    BOOL result;
+    if (maximumConcurrency != 1 && !state.targetImp.behaviorForElementWithQName && [self _parseInParallel:xmlData state:&state maximumConcurrency:maximumConcurrency])
+        result = YES;
+    else
+        result = [self _parseSerially:xmlData state:&state error:outError];
     
+    _OFMLParserStateCleanUp(&state);
+    _state = NULL;
+    
+    if (!result) {
+        [self release];
+        return nil;
+    }
+    return self;
+}
+
+- (BOOL)_parseSerially:(NSData *)xmlData state:(OFMLParserState *)state error:(NSError **)outError;
+{
     // TODO: Add support for passing along the source URL
     // We want whitespace reported since we may or may not keep it depending on our whitespaceBehavior input.
     
@@ -503,69 +1068,183 @@ static void _OFMLParserStateCleanUp(OFMLParserState *state)
     NSUInteger xmlLength = [xmlData length];
     OBASSERT(xmlLength < INT_MAX); // Need a different API for super-long XML.
     
-    state.ctxt = xmlCreatePushParserCtxt(&sax, &state/*user data*/, [xmlData bytes], (int)xmlLength, NULL);
+    state->sourceBytes = [xmlData bytes];
+    state->sourceLength = xmlLength;
+    
+    state->ctxt = xmlCreatePushParserCtxt(&sax, state/*user data*/, [xmlData bytes], (int)xmlLength, NULL);
     
     int options = XML_PARSE_NOENT; // Turn entities into content
     options |= XML_PARSE_NONET; // don't allow network access
     options |= XML_PARSE_NSCLEAN; // remove redundant namespace declarations
     options |= XML_PARSE_NOCDATA; // merge CDATA as text nodes
-    options = xmlCtxtUseOptions(state.ctxt, options);
+    options = xmlCtxtUseOptions(state->ctxt, options);
     if (options != 0)
         NSLog(@"unsupported options %d", options);
     
     // Encoding isn't set until after the terminate.
-    int rc = xmlParseChunk(state.ctxt, NULL, 0, TRUE/*terminate*/);
+    int rc = xmlParseChunk(state->ctxt, NULL, 0, TRUE/*terminate*/);
     
-    OBASSERT((rc == 0) == (state.error == nil));
+    OBASSERT((rc == 0) == (state->error == nil));
     
     BOOL result = YES;
-    if (rc != 0 || state.error) {
+    if (rc != 0 || state->error) {
         if (outError)
-            *outError = state.error;
-        [state.error autorelease];
-        state.error = nil; // we've dealt with cleaning up the error portion of the state
+            *outError = state->error;
+        [state->error autorelease];
+        state->error = nil; // we've dealt with cleaning up the error portion of the state
         result = NO;
     } else {
         CFStringEncoding encoding = kCFStringEncodingUTF8;
-        if (state.ctxt->encoding) {
-            CFStringRef encodingName = CFStringCreateWithCString(kCFAllocatorDefault, (const char *)state.ctxt->encoding, kCFStringEncodingUTF8);
+        if (state->ctxt->encoding) {
+            CFStringRef encodingName = CFStringCreateWithCString(kCFAllocatorDefault, (const char *)state->ctxt->encoding, kCFStringEncodingUTF8);
             CFStringEncoding parsedEncoding = CFStringConvertIANACharSetNameToEncoding(encodingName);
             CFRelease(encodingName);
             if (parsedEncoding == kCFStringEncodingInvalidId) {
 #ifdef DEBUG
-                NSLog(@"No string encoding found for '%s'.", state.ctxt->encoding);
+                NSLog(@"No string encoding found for '%s'.", state->ctxt->encoding);
 #endif
             } else
                 encoding = parsedEncoding;
         }
         _encoding = encoding;
-        if (state.loadWarnings)
-            _loadWarnings = [[NSArray alloc] initWithArray:state.loadWarnings];
+        if (state->loadWarnings)
+            _loadWarnings = [[NSArray alloc] initWithArray:state->loadWarnings];
         
         // CFXML reports the <?xml...?> as a PI, but libxml2 doesn't.  It has the information we need in the context structure.  But, if there were other PIs, they'll be first in the list now.  So, we store this information out of the PIs now.
-        if (state.ctxt->version && *state.ctxt->version)
-            _versionString = [[NSString alloc] initWithUTF8String:(const char *)state.ctxt->version];
+        if (state->ctxt->version && *state->ctxt->version)
+            _versionString = [[NSString alloc] initWithUTF8String:(const char *)state->ctxt->version];
         else
             _versionString = @"1.0";
-        _standalone = state.ctxt->standalone;
+        _standalone = state->ctxt->standalone;
         
-        OBASSERT(state.elementDepth == 0); // should have finished the root element.
-        OBASSERT(state.rootElementFinished);
-        OBASSERT([state.whitespaceBehaviorStack count] == 1); // The default one should be one the stack.
+        OBASSERT(state->elementDepth == 0); // should have finished the root element.
+        OBASSERT(state->rootElementFinished);
+        OBASSERT([state->whitespaceBehaviorStack count] == 1); // The default one should be one the stack.
         OBASSERT(![NSString isEmptyString:_versionString]);
     }
     
-    xmlFreeParserCtxt(state.ctxt);
-    state.ctxt = NULL;
+    xmlFreeParserCtxt(state->ctxt);
+    state->ctxt = NULL;
     
-    _OFMLParserStateCleanUp(&state);
-    _state = NULL;
+    return result;
+}
+
+// Returns NO, without having called the target, if the document can't be split or a piece didn't parse.
+- (BOOL)_parseInParallel:(NSData *)xmlData state:(OFMLParserState *)state maximumConcurrency:(NSUInteger)maximumConcurrency;
+{
+    if (maximumConcurrency == 0)
+        maximumConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    const uint8_t *bytes = [xmlData bytes];
+    size_t length = [xmlData length];
+    NSUInteger chunkCount = MIN(maximumConcurrency, length / OFXMLParserMinimumParallelChunkLength);
+    if (chunkCount < 2)
+        return NO;
+    
+    OFXMLParserChunkLayout layout;
+    if (!_OFXMLParserFindChunks(bytes, length, chunkCount, &layout))
+        return NO;
+    chunkCount = layout.splitCount + 1;
+    
+    OFXMLWhitespaceBehavior *whitespaceBehavior = state->whitespaceBehavior;
+    OFXMLWhitespaceBehaviorType defaultWhitespaceBehavior = (OFXMLWhitespaceBehaviorType)[state->whitespaceBehaviorStack objectAtIndex:0];
+    OFXMLInternedNameTable nameTable = state->nameTable;
+    OFXMLParserChunkRecorder **recorders = calloc(chunkCount, sizeof(*recorders));
+    OFXMLParser **chunkParsers = calloc(chunkCount, sizeof(*chunkParsers));
+    
+    xmlInitParser(); // Before several threads want libxml's globals at once
+    
+    dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunkIndex){
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        BOOL firstChunk = (chunkIndex == 0), lastChunk = (chunkIndex == chunkCount - 1);
+        
+        // The first piece has the real prolog and root start tag, and the last the real root end tag and whatever follows it; the rest get copies.
+        size_t prefixStart = firstChunk ? 0 : layout.rootStart;
+        size_t prefixLength = layout.rootStartEnd - prefixStart;
+        size_t bodyStart = firstChunk ? layout.rootStartEnd : layout.splits[chunkIndex - 1];
+        size_t bodyLength = (lastChunk ? layout.rootEnd : layout.splits[chunkIndex]) - bodyStart;
+        size_t suffixLength = lastChunk ? length - layout.rootEnd : layout.nameLength + 3;
+        size_t chunkLength = prefixLength + bodyLength + suffixLength;
+        
+        char *chunkBytes = malloc(chunkLength);
+        memcpy(chunkBytes, bytes + prefixStart, prefixLength);
+        memcpy(chunkBytes + prefixLength, bytes + bodyStart, bodyLength);
+        char *suffix = chunkBytes + prefixLength + bodyLength;
+        if (lastChunk)
+            memcpy(suffix, bytes + layout.rootEnd, suffixLength);
+        else {
+            suffix[0] = '<';
+            suffix[1] = '/';
+            memcpy(suffix + 2, bytes + layout.rootStart + 1, layout.nameLength);
+            suffix[suffixLength - 1] = '>';
+        }
+        
+        OFXMLParserChunkRecorder *recorder = [[OFXMLParserChunkRecorder alloc] initWithNameTable:nameTable chunkBytes:chunkBytes];
+        _OFXMLParserChunkRecorderMapSegment(recorder, 0, prefixLength, (const char *)bytes + prefixStart);
+        _OFXMLParserChunkRecorderMapSegment(recorder, prefixLength, bodyLength, (const char *)bytes + bodyStart);
+        if (lastChunk)
+            _OFXMLParserChunkRecorderMapSegment(recorder, prefixLength + bodyLength, suffixLength, (const char *)bytes + layout.rootEnd);
+        
+        NSData *chunkData = [[NSData alloc] initWithBytesNoCopy:chunkBytes length:chunkLength freeWhenDone:YES];
+        chunkParsers[chunkIndex] = [[OFXMLParser alloc] initWithData:chunkData whitespaceBehavior:whitespaceBehavior defaultWhitespaceBehavior:defaultWhitespaceBehavior target:recorder error:NULL];
+        [chunkData release];
+        
+        recorders[chunkIndex] = recorder;
+        [pool drain];
+    });
+    
+    BOOL parsed = YES;
+    for (NSUInteger chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++) {
+        if (!chunkParsers[chunkIndex])
+            parsed = NO;
+    }
     
-    if (!result) {
-        [self release];
-        return nil;
+    if (parsed) {
+        NSMutableArray *loadWarnings = [[NSMutableArray alloc] init];
+        
+        for (NSUInteger chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++) {
+            OFXMLParserChunkRecorder *recorder = recorders[chunkIndex];
+            const OFXMLParserChunkEvent *events = recorder->_events;
+            NSUInteger firstEvent = 0, eventCount = recorder->_eventCount;
+            
+            // Leave out the copies of the root element.
+            if (chunkIndex > 0) {
+                while (firstEvent < eventCount && events[firstEvent].type != OFXMLParserChunkEventStartElement)
+                    firstEvent++;
+                firstEvent++;
+            }
+            if (chunkIndex < chunkCount - 1) {
+                while (eventCount > firstEvent && events[eventCount - 1].type != OFXMLParserChunkEventEndElement)
+                    eventCount--;
+                eventCount--;
+            }
+            OBASSERT(firstEvent <= eventCount);
+            
+            if (firstEvent < eventCount)
+                _OFMLParserStateReplayEvents(state, events + firstEvent, eventCount - firstEvent);
+            [loadWarnings addObjectsFromArray:chunkParsers[chunkIndex].loadWarnings];
+        }
+        
+        OFXMLParser *firstParser = chunkParsers[0];
+        _encoding = firstParser.encoding;
+        _versionString = [firstParser.versionString copy];
+        _standalone = firstParser.standalone;
+        _loadWarnings = [[NSArray alloc] initWithArray:loadWarnings];
+        [loadWarnings release];
+        
+        OBASSERT(state->elementDepth == 0); // should have finished the root element.
+        OBASSERT(state->rootElementFinished);
     }
-    return self;
+    
+    for (NSUInteger chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++) {
+        [recorders[chunkIndex] release];
+        [chunkParsers[chunkIndex] release];
+    }
+    free(recorders);
+    free(chunkParsers);
+    free(layout.splits);
+    
+    return parsed;
 }
 
 - (void)dealloc;
@@ -580,4 +1259,9 @@ static void _OFMLParserStateCleanUp(OFMLParserState *state)
     return _state ? _state->elementDepth : 0;
 }
 
+- (BOOL)hasInternalSubset;
+{
+    return _state ? _state->hasInternalSubset : NO;
+}
+
 @end
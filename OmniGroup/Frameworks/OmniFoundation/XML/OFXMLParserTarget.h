@@ -19,10 +19,18 @@ typedef enum {
     OFXMLParserElementBehaviorSkip, // Skip this entire element.  No start/end callbacks will occur.
 } OFXMLParserElementBehavior;
 
+// Passed to the raw start element callback below.  'value' is UTF-8 and not NUL terminated.  If 'inSource' is set, it points into the bytes of the NSData being parsed (entities and line endings didn't change it) and so lives as long as that data does; otherwise it is only valid for the duration of the callback.
+typedef struct {
+    OFXMLQName *qname;
+    const char *value;
+    size_t length;
+    BOOL inSource;
+} OFXMLParserAttribute;
+
 @protocol OFXMLParserTarget
 @optional
 
-// If this returns NULL, the parser will create and free its own.  Otherwise, it will use this and not free it.
+// If this returns NULL, the parser will create and free its own.  Otherwise, it will use this and not free it.  Name tables are thread-safe, so targets of parsers running on different threads can hand out the same one.
 - (OFXMLInternedNameTable)internedNameTableForParser:(OFXMLParser *)parser;
 
 - (void)parser:(OFXMLParser *)parser setSystemID:(NSURL *)systemID publicID:(NSString *)publicID;
@@ -35,7 +43,14 @@ typedef enum {
 - (void)parserEndElement:(OFXMLParser *)parser;
 - (void)parser:(OFXMLParser *)parser endUnparsedElementWithQName:(OFXMLQName *)qname identifier:(NSString *)identifier contents:(NSData *)contents;
 
+// If implemented, this is called instead of the 'contents:' variant when the unparsed block appears byte for byte in the data being parsed (the input is UTF-8) and the document has no internal DTD subset, so the block can be parsed again later on its own given the namespace declarations in effect around it.  Otherwise the 'contents:' variant is called, if implemented.
+- (void)parser:(OFXMLParser *)parser endUnparsedElementWithQName:(OFXMLQName *)qname identifier:(NSString *)identifier sourceRange:(NSRange)sourceRange;
+
 - (void)parser:(OFXMLParser *)parser addWhitespace:(NSString *)whitespace;
 - (void)parser:(OFXMLParser *)parser addString:(NSString *)string;
 
+// Raw variants for targets that build their own compact representation.  If the target implements these, they are called instead of the object-based start element and whitespace/string callbacks, and the parser doesn't create any attribute arrays or strings.  The raw start element callback isn't used if the target implements -parser:behaviorForElementWithQName:attributeQNames:attributeValues:, since that needs the arrays anyway.  Whitespace is only reported when the whitespace behavior says to preserve it, as with -parser:addWhitespace:.
+- (void)parser:(OFXMLParser *)parser startElementWithQName:(OFXMLQName *)qname attributeCount:(NSUInteger)attributeCount attributes:(const OFXMLParserAttribute *)attributes;
+- (void)parser:(OFXMLParser *)parser addCharacters:(const char *)characters length:(size_t)length inSource:(BOOL)inSource whitespace:(BOOL)whitespace;
+
 @end
@@ -14,6 +14,12 @@
 @class NSURL, NSInputStream;
 @class OFXMLQName;
 
+// Borrowed values point at UTF-8 bytes owned by the reader.  They aren't NUL terminated, and are only good until the reader next moves (anything that opens, closes, finds, skips or reads past a node).
+typedef struct {
+    const char *bytes;
+    size_t length;
+} OFXMLReaderSlice;
+
 @interface OFXMLReader : OFObject
 {
     NSURL *_url;
@@ -26,10 +32,19 @@
     BOOL _inEmptyElement; // Allow 'opening' a empty element
     
     NSMutableArray *_errors; // Accumulated from the input stream and structured error handler.
+    
+    // Backing for borrowed values that libxml2 doesn't keep for us until the next move.
+    char *_borrowedStringBuffer;
+    size_t _borrowedStringCapacity;
+    struct _OFXMLArena *_borrowedAttributeArena;
 }
 
 - initWithInputStream:(NSInputStream *)inputStream startingInternedNames:(OFXMLInternedNameTable)startingInternedNames error:(NSError **)outError;
 
+// The 'startingInternedNames' variants copy the table, so the names a reader adds stay with it.  These use 'sharedInternedNames' itself, which may be shared with other readers and parsers on other threads, so they all end up with the same OFXMLQName instances.
+- initWithInputStream:(NSInputStream *)inputStream sharedInternedNames:(OFXMLInternedNameTable)sharedInternedNames error:(NSError **)outError;
+- initWithData:(NSData *)data sharedInternedNames:(OFXMLInternedNameTable)sharedInternedNames error:(NSError **)outError;
+
 - initWithData:(NSData *)data startingInternedNames:(OFXMLInternedNameTable)startingInternedNames error:(NSError **)outError;
 - initWithData:(NSData *)data error:(NSError **)outError;
 
@@ -73,4 +88,26 @@
 
 - (BOOL)copyDateContentsOfElement:(out NSDate **)outDate error:(NSError **)outError;
 
+
+// Borrowed value readers, for callers that only compare or parse values and would throw the copies away.  See OFXMLReaderSlice for how long the results are good.
+
+// Returns NO if not on an element or it has no such attribute.  Names are matched as by -copyValueOfAttribute:named:error:.  Doesn't move the reader.
+- (BOOL)getValueOfAttribute:(OFXMLQName *)name slice:(OFXMLReaderSlice *)outSlice;
+
+// Calls the block with each attribute of the current element, named as by -copyAttributes:error:, in document order.  Doesn't move the reader.
+- (void)enumerateAttributeSlicesUsingBlock:(void (^)(OFXMLQName *name, OFXMLReaderSlice value, BOOL *stop))block;
+
+// Like -copyString:endingElement:error:.
+- (BOOL)borrowString:(OFXMLReaderSlice *)outSlice endingElement:(BOOL *)outElementEnded error:(NSError **)outError;
+
+// Like the simple value readers above: expects to be on an element containing just a string, and reads past the element.  Elements with no text give an empty slice.
+- (BOOL)borrowStringContentsOfElement:(OFXMLReaderSlice *)outSlice error:(NSError **)outError;
+
 @end
+
+extern BOOL OFXMLReaderSliceIsEqualToCString(OFXMLReaderSlice slice, const char *string);
+
+// Parsing borrowed values without making objects.  Leading and trailing XML whitespace is ignored; anything else that isn't part of the value makes these return NO.
+extern BOOL OFXMLReaderSliceGetLong(OFXMLReaderSlice slice, long *outValue); // decimal, as in XML Schema's integer types
+extern BOOL OFXMLReaderSliceGetDouble(OFXMLReaderSlice slice, double *outValue);
+extern BOOL OFXMLReaderSliceGetTimeInterval(OFXMLReaderSlice slice, NSTimeInterval *outTimeIntervalSinceReferenceDate); // XML Schema dateTime, as -[NSDate initWithXMLString:]
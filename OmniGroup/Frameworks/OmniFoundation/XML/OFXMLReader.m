@@ -11,6 +11,7 @@ RCS_ID("$Id$");
 
 #import <Foundation/NSStream.h>
 #import <OmniFoundation/OFErrors.h>
+#import <OmniFoundation/OFXMLArena.h>
 #import <OmniFoundation/OFXMLBuffer.h>
 #import <OmniFoundation/OFXMLError.h>
 #import <OmniFoundation/OFXMLQName.h>
@@ -99,6 +100,12 @@ static BOOL _stepReader(OFXMLReader *self, NSError **outError)
 {
     OBPRECONDITION(self->_inEmptyElement == NO);  // Nothing to step to while inside an empty element.
     
+    // Anything borrowed from the node we're leaving is gone now.
+    if (self->_borrowedAttributeArena) {
+        OFXMLArenaDestroy(self->_borrowedAttributeArena);
+        self->_borrowedAttributeArena = NULL;
+    }
+    
     xmlTextReaderPtr reader = self->_reader;
     if (xmlTextReaderRead(reader) != 1) {
         // Was there an actual error?  Or just at the end of the document?
@@ -156,13 +163,18 @@ static void _errorHandler(void *userData, xmlErrorPtr error)
     [errorObject release];
 }
 
-- initWithInputStream:(NSInputStream *)inputStream startingInternedNames:(OFXMLInternedNameTable)startingInternedNames error:(NSError **)outError;
+// Takes ownership of a reference to 'nameTable'.
+- _initWithInputStream:(NSInputStream *)inputStream nameTable:(OFXMLInternedNameTable)nameTable error:(NSError **)outError;
 {
-    if (!(self = [super init]))
+    if (!(self = [super init])) {
+        OFXMLInternedNameTableFree(nameTable);
         return nil;
+    }
     
     LIBXML_TEST_VERSION
 
+    _nameTable = nameTable;
+
     // Hold a strong reference to this in GC so that it cannot be in the same -finalize cycle as us.
     _inputStream = (id)CFRetain(inputStream);
     
@@ -189,8 +201,6 @@ static void _errorHandler(void *userData, xmlErrorPtr error)
     
     xmlTextReaderSetStructuredErrorHandler(_reader, _errorHandler, self);
     
-    _nameTable = OFXMLInternedNameTableCreate(startingInternedNames);
-    
     // Prime our look ahead.
     if (!_stepReader(self, outError)) {
         [self release];
@@ -232,6 +242,22 @@ static void _errorHandler(void *userData, xmlErrorPtr error)
     return self;
 }
 
+- initWithInputStream:(NSInputStream *)inputStream startingInternedNames:(OFXMLInternedNameTable)startingInternedNames error:(NSError **)outError;
+{
+    return [self _initWithInputStream:inputStream nameTable:OFXMLInternedNameTableCreate(startingInternedNames) error:outError];
+}
+
+- initWithInputStream:(NSInputStream *)inputStream sharedInternedNames:(OFXMLInternedNameTable)sharedInternedNames error:(NSError **)outError;
+{
+    OBPRECONDITION(sharedInternedNames);
+    return [self _initWithInputStream:inputStream nameTable:OFXMLInternedNameTableRetain(sharedInternedNames) error:outError];
+}
+
+- initWithData:(NSData *)data sharedInternedNames:(OFXMLInternedNameTable)sharedInternedNames error:(NSError **)outError;
+{
+    return [self initWithInputStream:[NSInputStream inputStreamWithData:data] sharedInternedNames:sharedInternedNames error:outError];
+}
+
 - initWithData:(NSData *)data startingInternedNames:(OFXMLInternedNameTable)startingInternedNames error:(NSError **)outError;
 {
     return [self initWithInputStream:[NSInputStream inputStreamWithData:data] startingInternedNames:startingInternedNames error:outError];
@@ -297,6 +323,13 @@ static void _finalize(OFXMLReader *self)
         OFXMLInternedNameTableFree(self->_nameTable);
         self->_nameTable = NULL;
     }
+    
+    free(self->_borrowedStringBuffer);
+    self->_borrowedStringBuffer = NULL;
+    if (self->_borrowedAttributeArena) {
+        OFXMLArenaDestroy(self->_borrowedAttributeArena);
+        self->_borrowedAttributeArena = NULL;
+    }
 }
 
 - (void)dealloc;
@@ -952,6 +985,166 @@ static BOOL _prepareSimpleValueReader(OFXMLReader *self, const char **outString,
     SIMPLE_READ_SUFFIX;
 }
 
+#pragma mark - Borrowed values
+
+// Attribute values usually live in a single text node of the element, which stays put until the reader moves.
+static OFXMLReaderSlice _borrowAttributeValue(OFXMLReader *self, xmlAttrPtr attribute)
+{
+    xmlNodePtr children = attribute->children;
+    if (!children)
+        return (OFXMLReaderSlice){.bytes = "", .length = 0};
+    if (children->type == XML_TEXT_NODE && !children->next && children->content)
+        return (OFXMLReaderSlice){.bytes = (const char *)children->content, .length = strlen((const char *)children->content)};
+    
+    // Unexpanded entity references and the like.  Keep our own copy until the reader moves.
+    xmlChar *value = xmlNodeListGetString(attribute->doc, children, 1);
+    if (!value)
+        return (OFXMLReaderSlice){.bytes = "", .length = 0};
+    
+    size_t length = strlen((const char *)value);
+    if (!self->_borrowedAttributeArena)
+        self->_borrowedAttributeArena = OFXMLArenaCreate(0);
+    char *bytes = OFXMLArenaAllocate(self->_borrowedAttributeArena, length);
+    memcpy(bytes, value, length);
+    xmlFree(value);
+    
+    return (OFXMLReaderSlice){.bytes = bytes, .length = length};
+}
+
+static xmlNodePtr _borrowableElement(OFXMLReader *self)
+{
+    OBPRECONDITION(self->_currentNodeType == XML_READER_TYPE_ELEMENT);
+    OBPRECONDITION(self->_inEmptyElement == NO); // If this is YES we are pointing at a virtual 'end' for the empty element.
+    
+    if (self->_currentNodeType != XML_READER_TYPE_ELEMENT || self->_inEmptyElement)
+        return NULL;
+    
+    xmlNodePtr element = xmlTextReaderCurrentNode(self->_reader);
+    OBASSERT(element && element->type == XML_ELEMENT_NODE);
+    return element;
+}
+
+- (BOOL)getValueOfAttribute:(OFXMLQName *)name slice:(OFXMLReaderSlice *)outSlice;
+{
+    OBPRECONDITION(name);
+    OBPRECONDITION(outSlice);
+    
+    xmlNodePtr element = _borrowableElement(self);
+    if (!element)
+        return NO;
+    
+    // Intern the candidates rather than converting 'name' to C strings; the lookups don't allocate once the names have been seen.  Unprefixed attributes also match a name in the element's namespace, as in -copyValueOfAttribute:named:error:.
+    const char *elementNamespace = element->ns ? (const char *)element->ns->href : NULL;
+    for (xmlAttrPtr attribute = element->properties; attribute; attribute = attribute->next) {
+        BOOL matches;
+        if (attribute->ns)
+            matches = [name isEqualToQName:OFXMLInternedNameTableGetInternedName(_nameTable, (const char *)attribute->ns->href, (const char *)attribute->name)];
+        else
+            matches = [name isEqualToQName:OFXMLInternedNameTableGetInternedName(_nameTable, NULL, (const char *)attribute->name)] || (elementNamespace && [name isEqualToQName:OFXMLInternedNameTableGetInternedName(_nameTable, elementNamespace, (const char *)attribute->name)]);
+        
+        if (matches) {
+            *outSlice = _borrowAttributeValue(self, attribute);
+            return YES;
+        }
+    }
+    
+    // Namespace declarations, as libxml2's attribute lookup would find them.
+    for (xmlNsPtr namespace = element->nsDef; namespace; namespace = namespace->next) {
+        if ([name isEqualToQName:OFXMLInternedNameTableGetInternedName(_nameTable, OFXMLNamespaceXMLNSCString, namespace->prefix ? (const char *)namespace->prefix : "xmlns")]) {
+            *outSlice = (OFXMLReaderSlice){.bytes = (const char *)namespace->href, .length = strlen((const char *)namespace->href)};
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+- (void)enumerateAttributeSlicesUsingBlock:(void (^)(OFXMLQName *name, OFXMLReaderSlice value, BOOL *stop))block;
+{
+    OBPRECONDITION(block);
+    
+    xmlNodePtr element = _borrowableElement(self);
+    if (!element)
+        return;
+    
+    // Same order and naming as -copyAttributes:error:, which walks libxml2's attribute list: namespace declarations first, and unprefixed attributes in the element's namespace.
+    BOOL stop = NO;
+    for (xmlNsPtr namespace = element->nsDef; namespace && !stop; namespace = namespace->next) {
+        OFXMLQName *name = OFXMLInternedNameTableGetInternedName(_nameTable, OFXMLNamespaceXMLNSCString, namespace->prefix ? (const char *)namespace->prefix : "xmlns");
+        block(name, (OFXMLReaderSlice){.bytes = (const char *)namespace->href, .length = strlen((const char *)namespace->href)}, &stop);
+    }
+    
+    const char *elementNamespace = element->ns ? (const char *)element->ns->href : NULL;
+    for (xmlAttrPtr attribute = element->properties; attribute && !stop; attribute = attribute->next) {
+        const char *attributeNamespace = attribute->ns ? (const char *)attribute->ns->href : elementNamespace;
+        OFXMLQName *name = OFXMLInternedNameTableGetInternedName(_nameTable, attributeNamespace, (const char *)attribute->name);
+        block(name, _borrowAttributeValue(self, attribute), &stop);
+    }
+}
+
+// libxml2 frees text nodes as the reader steps past them, so text runs are gathered into a buffer we reuse from one borrow to the next.
+static void _appendBorrowedString(OFXMLReader *self, const char *bytes, size_t length, size_t *ioUsed)
+{
+    if (*ioUsed + length > self->_borrowedStringCapacity) {
+        self->_borrowedStringCapacity = MAX(MAX(2 * self->_borrowedStringCapacity, *ioUsed + length), 256U);
+        self->_borrowedStringBuffer = realloc(self->_borrowedStringBuffer, self->_borrowedStringCapacity);
+    }
+    memcpy(self->_borrowedStringBuffer + *ioUsed, bytes, length);
+    *ioUsed += length;
+}
+
+- (BOOL)borrowString:(OFXMLReaderSlice *)outSlice endingElement:(BOOL *)outElementEnded error:(NSError **)outError;
+{
+    OBPRECONDITION(outSlice);
+    
+    BOOL onEndElement = (_currentNodeType == XML_READER_TYPE_END_ELEMENT);
+    BOOL onEmptyElement = (_currentNodeType == XML_READER_TYPE_ELEMENT && _inEmptyElement);
+    
+    OBPRECONDITION([self _isReadableTextXMLReaderType:_currentNodeType] || onEndElement || onEmptyElement);
+    
+    size_t length = 0;
+    while ([self _isReadableTextXMLReaderType:_currentNodeType]) {
+        const char *text = (const char *)xmlTextReaderConstValue(_reader);
+        if (text)
+            _appendBorrowedString(self, text, strlen(text), &length);
+        
+        if (!_stepReader(self, outError))
+            return NO;
+    }
+    
+    if (outElementEnded != NULL)
+        *outElementEnded = onEndElement || onEmptyElement || (_currentNodeType == XML_READER_TYPE_END_ELEMENT);
+    
+    *outSlice = (OFXMLReaderSlice){.bytes = length > 0 ? _borrowedStringBuffer : "", .length = length};
+    return YES;
+}
+
+- (BOOL)borrowStringContentsOfElement:(OFXMLReaderSlice *)outSlice error:(NSError **)outError;
+{
+    OBPRECONDITION(outSlice);
+    
+    *outSlice = (OFXMLReaderSlice){.bytes = "", .length = 0};
+    
+    if (_currentNodeType != XML_READER_TYPE_ELEMENT || _inEmptyElement) {
+        OBASSERT_NOT_REACHED("should only be called on an element");
+        return YES;
+    }
+    if (xmlTextReaderIsEmptyElement(_reader))
+        return _stepReader(self, outError);
+    
+    if (!_stepReader(self, outError))
+        return NO;
+    
+    if ([self _isReadableTextXMLReaderType:_currentNodeType]) {
+        BOOL endedElement = NO;
+        if (![self borrowString:outSlice endingElement:&endedElement error:outError])
+            return NO;
+    }
+    
+    // Skip past the end of the element we entered (and anything unexpected before it).
+    return _skipPastEndOfElement(self, 1, outError);
+}
+
 #pragma mark - Private
 
 - (BOOL)_isReadableTextXMLReaderType:(int)readerType;
@@ -960,3 +1153,85 @@ static BOOL _prepareSimpleValueReader(OFXMLReader *self, const char **outString,
 }
 
 @end
+
+#pragma mark - Borrowed value parsing
+
+BOOL OFXMLReaderSliceIsEqualToCString(OFXMLReaderSlice slice, const char *string)
+{
+    OBPRECONDITION(string);
+    
+    return strlen(string) == slice.length && memcmp(slice.bytes, string, slice.length) == 0;
+}
+
+static BOOL _isXMLWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static OFXMLReaderSlice _trimmedSlice(OFXMLReaderSlice slice)
+{
+    while (slice.length > 0 && _isXMLWhitespace(slice.bytes[0])) {
+        slice.bytes++;
+        slice.length--;
+    }
+    while (slice.length > 0 && _isXMLWhitespace(slice.bytes[slice.length - 1]))
+        slice.length--;
+    return slice;
+}
+
+// strtol() and strtod() want a NUL terminated string.  Anything longer than this isn't a number we'd want.
+#define OFXMLReaderSliceNumberMaximumLength (128)
+
+static BOOL _copyNumberString(OFXMLReaderSlice slice, char buffer[OFXMLReaderSliceNumberMaximumLength + 1])
+{
+    slice = _trimmedSlice(slice);
+    if (slice.length == 0 || slice.length > OFXMLReaderSliceNumberMaximumLength)
+        return NO;
+    
+    memcpy(buffer, slice.bytes, slice.length);
+    buffer[slice.length] = '\0';
+    return YES;
+}
+
+BOOL OFXMLReaderSliceGetLong(OFXMLReaderSlice slice, long *outValue)
+{
+    OBPRECONDITION(outValue);
+    
+    char buffer[OFXMLReaderSliceNumberMaximumLength + 1];
+    if (!_copyNumberString(slice, buffer))
+        return NO;
+    
+    char *end;
+    errno = 0;
+    long value = strtol(buffer, &end, 10);
+    if (end == buffer || *end != '\0' || errno == ERANGE)
+        return NO;
+    
+    *outValue = value;
+    return YES;
+}
+
+BOOL OFXMLReaderSliceGetDouble(OFXMLReaderSlice slice, double *outValue)
+{
+    OBPRECONDITION(outValue);
+    
+    char buffer[OFXMLReaderSliceNumberMaximumLength + 1];
+    if (!_copyNumberString(slice, buffer))
+        return NO;
+    
+    char *end;
+    double value = strtod(buffer, &end);
+    if (end == buffer || *end != '\0')
+        return NO;
+    
+    *outValue = value;
+    return YES;
+}
+
+BOOL OFXMLReaderSliceGetTimeInterval(OFXMLReaderSlice slice, NSTimeInterval *outTimeIntervalSinceReferenceDate)
+{
+    OBPRECONDITION(outTimeIntervalSinceReferenceDate);
+    
+    slice = _trimmedSlice(slice);
+    return OFXMLDateTimeGetTimeInterval(slice.bytes, slice.length, outTimeIntervalSinceReferenceDate);
+}
@@ -23,7 +23,7 @@
 
 #include <libxml/tree.h>
 
-@class NSArray, NSMutableArray;
+@class NSArray, NSMutableArray, NSIndexSet;
 @class NSData, NSMutableData;
 
 /* Namespace */
@@ -99,6 +99,7 @@ enum OFXMLSignatureOperation {
 /* API */
 - (NSUInteger)countOfReferenceNodes;
 - (BOOL)verifyReferenceAtIndex:(NSUInteger)nodeIndex toBuffer:(xmlOutputBuffer *)outBuf error:(NSError **)outError;
+- (BOOL)verifyReferencesAtIndexes:(NSIndexSet *)indexes maximumConcurrency:(NSUInteger)maximumConcurrency error:(NSError **)outError;
 
 /* Convenience routines */
 - (NSData *)verifiedReferenceAtIndex:(NSUInteger)nodeIndex error:(NSError **)outError;
@@ -116,6 +117,7 @@ enum OFXMLSignatureOperation {
 #endif /* OF_ENABLE_CDSA */
 
 - (BOOL)writeReference:(NSString *)externalReference type:(NSString *)referenceType to:(xmlOutputBuffer *)stream error:(NSError **)outError;
+- (BOOL)canWriteExternalReferencesConcurrently;
 - (BOOL)computeReferenceDigests:(NSError **)outError;
 
 @end
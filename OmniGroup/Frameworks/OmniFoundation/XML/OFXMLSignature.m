@@ -17,6 +17,8 @@
 #import <Security/Security.h>
 #import "OFSecSignTransform.h"
 #endif
+#import <dispatch/dispatch.h>
+#import <libkern/OSAtomic.h>
 
 #include <libxml/tree.h>
 
@@ -89,6 +91,14 @@ struct OFXMLSignatureVerifyContinuation {
     void (*cleanup)(void *ctxt);
 };
 
+/* One reference being checked by -verifyReferencesAtIndexes:maximumConcurrency:error: */
+struct referenceVerificationJob {
+    NSUInteger nodeIndex;
+    id <OFDigestionContext, NSObject> digester;  // retained; nil if setting up failed
+    NSData *digestValue;                         // retained
+    NSError *error;                              // retained; set if the reference didn't verify
+};
+
 /* Error-signaling functions */
 
 static BOOL signatureStructuralFailure(NSError **err, NSString *fmt, ...)  __attribute__((format(__NSString__, 2, 3)));
@@ -241,6 +251,8 @@ static BOOL noKeyError(NSError **err, enum OFXMLSignatureOperation op)
 - (BOOL)_writeReference:(xmlNode *)reference to:(struct OFXMLSignatureVerifyContinuation *)stream error:(NSError **)outError;
 
 - (BOOL)_prepareTransform:(const xmlChar *)algid :(xmlNode *)transformNode from:(struct OFXMLSignatureVerifyContinuation *)fromBuf error:(NSError **)outError;
+- (id <OFDigestionContext, NSObject>)_newDigesterForReferenceAtIndex:(NSUInteger)nodeIndex digestValue:(NSData **)outDigestValue error:(NSError **)outError NS_RETURNS_RETAINED;
+- (void)_runReferenceVerificationJob:(struct referenceVerificationJob *)job;
 @end
 
 @implementation OFXMLSignature
@@ -1453,9 +1465,17 @@ static int xmlTransformXPathTest(void *user_data, xmlNodePtr node, xmlNodePtr pa
     }
 #endif
 }
-static BOOL xmlTransformXPathFilter1(struct OFXMLSignatureVerifyContinuation *continuation, xmlDocPtr doc, xmlC14NIsVisibleCallback is_visible_callback, void *is_visible_arg, NSError **outError)
+/* xmlXPathOrderDocElems() writes into every element of the document (numbering them from -1, starting at the root element), so don't redo it on a document that's already ordered: other threads may be reading it. */
+static void orderDocumentElementsOnce(xmlDocPtr doc)
 {
+    xmlNode *rootElement = xmlDocGetRootElement(doc);
+    if (rootElement && rootElement->content == (xmlChar *)(-1L))
+        return;
     xmlXPathOrderDocElems(doc);
+}
+static BOOL xmlTransformXPathFilter1(struct OFXMLSignatureVerifyContinuation *continuation, xmlDocPtr doc, xmlC14NIsVisibleCallback is_visible_callback, void *is_visible_arg, NSError **outError)
+{
+    orderDocumentElementsOnce(doc);
 
     struct xpathFilter ctxt = (struct xpathFilter){
         .filterContext = NULL,
@@ -1583,41 +1603,54 @@ static void xmlTransformXPathFilter1Cleanup(void *ctxt)
     return ok;
 }
 
-/*" If -processSignatureElement: returns success, this method can be used to retrieve and verify one of the signed objects. 'outBuf' is optional but if you pass NULL the verified data won't be stored anywhere. Typically you'd want to pass an XML parser context there. "*/
-- (BOOL)verifyReferenceAtIndex:(NSUInteger)nodeIndex toBuffer:(xmlOutputBuffer *)outBuf error:(NSError **)outError
+/* Looks up the <DigestMethod> and <DigestValue> of a reference and returns a digester that's ready (-verifyInit: has been called) to have the referent's bytes fed into it */
+- (id <OFDigestionContext, NSObject>)_newDigesterForReferenceAtIndex:(NSUInteger)nodeIndex digestValue:(NSData **)outDigestValue error:(NSError **)outError
 {
-    if (!referenceNodes)
-        OBRejectInvalidCall(self, _cmd, @"Signature element has not been processed yet");
-    if (nodeIndex >= referenceNodeCount)
-        OBRejectInvalidCall(self, _cmd, @"Reference index (%"PRIuNS") is out of range (count is %u)", (unsigned long)nodeIndex, referenceNodeCount);
     xmlNode *referenceNode = referenceNodes[nodeIndex];
     
     unsigned int count;
     xmlNode *digestMethodNode = OFLibXMLChildNamed(referenceNode, "DigestMethod", XMLSignatureNamespace, &count);
     if (count != 1) {
         signatureStructuralFailure(outError, @"Found %d <DigestMethod> nodes", count);
-        return NO;
+        return nil;
     }
     xmlNode *digestValueNode = OFLibXMLChildNamed(referenceNode, "DigestValue", XMLSignatureNamespace, &count);
     if (count != 1) {
         signatureStructuralFailure(outError, @"Found %d <DigestValue> nodes", count);
-        return NO;
+        return nil;
     }
     NSData *digestValue = OFLibXMLNodeBase64Content(digestValueNode);
     if (!digestValue) {
         signatureStructuralFailure(outError, @"The <DigestValue> content is not parsable as base64 data");
-        return NO;
+        return nil;
     }
     id <OFDigestionContext, NSObject> digester = [self newDigestContextForMethod:digestMethodNode error:outError];
     if (!digester)
-        return NO;
+        return nil;
     
     if (![digester verifyInit:outError]) {
         [digester release];
-        return NO;
+        return nil;
     }
     
-    BOOL ok = [self _verifyReferenceNode:referenceNode toBuffer:outBuf digester:digester error:outError];
+    *outDigestValue = digestValue;
+    return digester;
+}
+
+/*" If -processSignatureElement: returns success, this method can be used to retrieve and verify one of the signed objects. 'outBuf' is optional but if you pass NULL the verified data won't be stored anywhere. Typically you'd want to pass an XML parser context there. "*/
+- (BOOL)verifyReferenceAtIndex:(NSUInteger)nodeIndex toBuffer:(xmlOutputBuffer *)outBuf error:(NSError **)outError
+{
+    if (!referenceNodes)
+        OBRejectInvalidCall(self, _cmd, @"Signature element has not been processed yet");
+    if (nodeIndex >= referenceNodeCount)
+        OBRejectInvalidCall(self, _cmd, @"Reference index (%"PRIuNS") is out of range (count is %u)", (unsigned long)nodeIndex, referenceNodeCount);
+    
+    NSData *digestValue = nil;
+    id <OFDigestionContext, NSObject> digester = [self _newDigesterForReferenceAtIndex:nodeIndex digestValue:&digestValue error:outError];
+    if (!digester)
+        return NO;
+    
+    BOOL ok = [self _verifyReferenceNode:referenceNodes[nodeIndex] toBuffer:outBuf digester:digester error:outError];
     
     
     if (!ok) {
@@ -1632,6 +1665,121 @@ static void xmlTransformXPathFilter1Cleanup(void *ctxt)
     return ok;
 }
 
+/* Runs on any thread. The canonicalized (or externally written) bytes go straight from libxml's output buffer into the digester, a buffer-load at a time, without the referent ever being held in memory as a whole. */
+- (void)_runReferenceVerificationJob:(struct referenceVerificationJob *)job
+{
+    @autoreleasepool {
+        NSError *error = nil;
+        BOOL ok = [self _verifyReferenceNode:referenceNodes[job->nodeIndex] toBuffer:NULL digester:job->digester error:&error] &&
+                  [job->digester verifyFinal:job->digestValue error:&error];
+        if (!ok) {
+            // Wraps any underlying error, so that callers can tell which reference this was
+            signatureValidationFailure(&error, @"Unable to verify reference %lu", (unsigned long)job->nodeIndex);
+            job->error = [error retain];
+        }
+    }
+}
+
+/*" Verifies the references at 'indexes' (all of them, even after one fails), checking several at once. 'maximumConcurrency' limits the number of threads used; pass 0 for one per active processor. Returns YES if every reference verified; otherwise returns NO and sets *outError to the error for the lowest-numbered reference that failed, whose failure reason names that reference (the error from the digest or transform, if any, is its NSUnderlyingErrorKey). The verified data isn't kept --- use -verifyReferenceAtIndex:toBuffer:error: to get at it.
+ 
+ Digest contexts are made (with -newDigestContextForMethod:error:) on the calling thread. External references are also resolved on the calling thread, one at a time, unless -canWriteExternalReferencesConcurrently returns YES. "*/
+- (BOOL)verifyReferencesAtIndexes:(NSIndexSet *)indexes maximumConcurrency:(NSUInteger)maximumConcurrency error:(NSError **)outError;
+{
+    if (!referenceNodes)
+        OBRejectInvalidCall(self, _cmd, @"Signature element has not been processed yet");
+    if ([indexes count] > 0 && [indexes lastIndex] >= referenceNodeCount)
+        OBRejectInvalidCall(self, _cmd, @"Reference index (%"PRIuNS") is out of range (count is %u)", (unsigned long)[indexes lastIndex], referenceNodeCount);
+    
+    NSUInteger jobCount = [indexes count];
+    if (jobCount == 0)
+        return YES;
+    
+    if (maximumConcurrency == 0)
+        maximumConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    BOOL concurrentExternalReferences = [self canWriteExternalReferencesConcurrently];
+    struct referenceVerificationJob *jobs = calloc(jobCount, sizeof(*jobs));
+    NSUInteger *concurrentJobs = malloc(jobCount * sizeof(*concurrentJobs));
+    NSUInteger concurrentJobCount = 0;
+    
+    /* Set up every job here, and pick out the ones that can go to other threads */
+    NSUInteger jobIndex = 0;
+    for (NSUInteger nodeIndex = [indexes firstIndex]; nodeIndex != NSNotFound; nodeIndex = [indexes indexGreaterThanIndex:nodeIndex]) {
+        struct referenceVerificationJob *job = &jobs[jobIndex];
+        job->nodeIndex = nodeIndex;
+        
+        NSError *error = nil;
+        NSData *digestValue = nil;
+        job->digester = [self _newDigesterForReferenceAtIndex:nodeIndex digestValue:&digestValue error:&error];
+        if (!job->digester) {
+            signatureValidationFailure(&error, @"Unable to verify reference %lu", (unsigned long)nodeIndex);
+            job->error = [error retain];
+        } else {
+            job->digestValue = [digestValue retain];
+            if (concurrentExternalReferences || [self isLocalReferenceAtIndex:nodeIndex])
+                concurrentJobs[concurrentJobCount++] = jobIndex;
+        }
+        
+        jobIndex++;
+    }
+    
+    /* Workers pull the next job from a shared counter, so a few slow references don't hold up a whole stripe of fast ones */
+    NSUInteger workerCount = MIN(maximumConcurrency, concurrentJobCount);
+    if (workerCount > 0) {
+        xmlInitParser(); // Before several threads want libxml's globals at once
+        if (owningDocument)
+            orderDocumentElementsOnce(owningDocument); // XPath Filter transforms would otherwise order the shared document from several threads at once
+        
+        int32_t __block nextJob = 0;
+        dispatch_group_t group = dispatch_group_create();
+        dispatch_queue_t workerQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+        
+        for (NSUInteger workerIndex = 0; workerIndex < workerCount; workerIndex++) {
+            dispatch_group_async(group, workerQueue, ^{
+                while (YES) {
+                    int32_t concurrentJobIndex = OSAtomicIncrement32Barrier(&nextJob) - 1;
+                    if ((NSUInteger)concurrentJobIndex >= concurrentJobCount)
+                        break;
+                    [self _runReferenceVerificationJob:&jobs[concurrentJobs[concurrentJobIndex]]];
+                }
+            });
+        }
+        
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        dispatch_release(group);
+    }
+    
+    /* Whatever couldn't go to another thread */
+    NSUInteger concurrentJobCursor = 0;
+    for (jobIndex = 0; jobIndex < jobCount; jobIndex++) {
+        if (concurrentJobCursor < concurrentJobCount && concurrentJobs[concurrentJobCursor] == jobIndex) {
+            concurrentJobCursor++;
+            continue;
+        }
+        if (jobs[jobIndex].digester)
+            [self _runReferenceVerificationJob:&jobs[jobIndex]];
+    }
+    
+    NSError *firstError = nil;
+    for (jobIndex = 0; jobIndex < jobCount; jobIndex++) {
+        struct referenceVerificationJob *job = &jobs[jobIndex];
+        if (job->error && !firstError)
+            firstError = [[job->error retain] autorelease];
+        [job->digester release];
+        [job->digestValue release];
+        [job->error release];
+    }
+    free(concurrentJobs);
+    free(jobs);
+    
+    if (firstError) {
+        if (outError)
+            *outError = firstError;
+        return NO;
+    }
+    return YES;
+}
+
 /*" Invokes -verifyReferenceAtIndex:toBuffer:error:, accumulating the result in an NSData "*/
 - (NSData *)verifiedReferenceAtIndex:(NSUInteger)nodeIndex error:(NSError **)outError;
 {
@@ -1980,6 +2128,12 @@ static xmlNode *singleNodeFromXptrExpression(const xmlChar *expr, xmlDocPtr inDo
     return NULL;
 }
 
+/*" Subclassers that resolve external references can return YES if -writeReference:type:to:error: is safe to call on several threads at once, letting -verifyReferencesAtIndexes:maximumConcurrency:error: resolve them in parallel. "*/
+- (BOOL)canWriteExternalReferencesConcurrently;
+{
+    return NO;
+}
+
 /*" Subclassers must implement this to resolve any external references (that is, <Reference> nodes pointing outside of the containing document). By default, those references are not resolved. "*/
 - (BOOL)writeReference:(NSString *)externalReference type:(NSString *)referenceType to:(xmlOutputBuffer *)stream error:(NSError **)outError;
 {
@@ -23,6 +23,12 @@
 #import <OmniBase/assertions.h>
 #import <OmniBase/objc.h>
 
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
 RCS_ID("$Id$");
 
 @interface OFXMLString (Private)
@@ -108,88 +114,146 @@ static NSString *CreateQuotedStringForEncoding(OFXMLString *self, CFStringEncodi
 
 @end
 
-static void _OFXMLAppendCharacterEntityWithOptions(CFMutableStringRef result, uint32_t options, unichar c, CFStringRef characterEntity, CFStringRef namedEntity)
+static CFStringRef _OFXMLCharacterEntityWithOptions(uint32_t options, CFStringRef characterEntity, CFStringRef namedEntity)
 {
     switch (options) {
 	case OFXMLCharacterFlagWriteNamedEntity:
-            CFStringAppend(result, namedEntity);
-	    break;
+            return namedEntity;
 	case OFXMLCharacterFlagWriteCharacterEntity:
-            CFStringAppend(result, characterEntity);
-	    break;
+            return characterEntity;
 	case OFXMLCharacterFlagWriteUnquotedCharacter:
-            CFStringAppendCharacters(result, &c, 1);
-	    break;
+            return NULL;
 	default:
 	    OBASSERT_NOT_REACHED("Bad options setting; character dropped");
-	    break;
+	    return (CFStringRef)@"";
+    }
+}
+
+// What to write for a character the scanner below stopped at; NULL if it should be written as is.
+static CFStringRef _OFXMLEntityReplacement(unichar c, unsigned int entityMask, NSString *optionalNewlineString)
+{
+    switch (c) {
+        case '&':
+            return (CFStringRef)@"&amp;";
+        case '<':
+            return (CFStringRef)@"&lt;";
+        case '>':
+            return (entityMask & OFXMLGtEntityMask) == OFXMLGtEntityMask ? (CFStringRef)@"&gt;" : NULL;
+        case '\"':
+            return _OFXMLCharacterEntityWithOptions((entityMask >> OFXMLQuotCharacterOptionsShift) & OFXMLCharacterOptionsMask, (CFStringRef)@"&#34;", (CFStringRef)@"&quot;");
+        case '\'':
+            return _OFXMLCharacterEntityWithOptions((entityMask >> OFXMLAposCharacterOptionsShift) & OFXMLCharacterOptionsMask, (CFStringRef)@"&#39;", (CFStringRef)@"&apos;");
+        case '\n': // 0xA
+            return (optionalNewlineString && (entityMask & OFXMLNewlineEntityMask) == OFXMLNewlineEntityMask) ? (CFStringRef)optionalNewlineString : NULL;
+        default:
+            // This is a low-ascii, non-whitespace character and isn't allowed in XML at all.  Drop it.
+            OBASSERT(c < 0x20 && c != 0x9 && c != 0xA && c != 0xD);
+            return (CFStringRef)@"";
+    }
+}
+
+// Finds the next character at or after charIndex that might need an entity: one of &<>"', or a control character other than tab, return and 'passedNewline'.  Pass '\n' for 'passedNewline' to let newlines through, or '\t' (already let through) to stop at them.  This is the same test as the UTF-8 scanner in OFXMLBuffer.m, a vector of UTF-16 characters at a time.
+//
+// XML doesn't allow low ASCII characters.  See the 'Char' production in section 2.2 of the spec:
+//
+// Char := #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]	/* any Unicode character, excluding the surrogate blocks, FFFE, and FFFF. */
+static inline BOOL _OFXMLCharacterNeedsAttention(unichar c, unichar passedNewline)
+{
+    if (c < 0x20)
+        return c != '\t' && c != '\r' && c != passedNewline;
+    return c == '&' || c == '<' || c == '>' || c == '\"' || c == '\'';
+}
+
+static CFIndex _OFXMLScanForEntityCharacter(const UniChar *characters, CFIndex charIndex, CFIndex charCount, unichar passedNewline)
+{
+#if defined(__SSE2__)
+    const __m128i controlMax = _mm_set1_epi16(0x1F), allowed = _mm_set1_epi16(passedNewline);
+    while (charCount - charIndex >= 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&characters[charIndex]);
+        __m128i control = _mm_cmpeq_epi16(_mm_subs_epu16(v, controlMax), _mm_setzero_si128()); // unsigned v <= 0x1F
+        __m128i allowedControl = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16('\t')), _mm_cmpeq_epi16(v, _mm_set1_epi16('\r'))), _mm_cmpeq_epi16(v, allowed));
+        __m128i markup = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16('&')), _mm_cmpeq_epi16(v, _mm_set1_epi16('<'))),
+                                      _mm_or_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16('>')), _mm_or_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16('\"')), _mm_cmpeq_epi16(v, _mm_set1_epi16('\'')))));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(allowedControl, control), markup));
+        if (mask)
+            return charIndex + __builtin_ctz(mask) / 2;
+        charIndex += 8;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint16x8_t allowed = vdupq_n_u16(passedNewline);
+    while (charCount - charIndex >= 8) {
+        uint16x8_t v = vld1q_u16(&characters[charIndex]);
+        uint16x8_t control = vcltq_u16(v, vdupq_n_u16(0x20));
+        uint16x8_t allowedControl = vorrq_u16(vorrq_u16(vceqq_u16(v, vdupq_n_u16('\t')), vceqq_u16(v, vdupq_n_u16('\r'))), vceqq_u16(v, allowed));
+        uint16x8_t markup = vorrq_u16(vorrq_u16(vceqq_u16(v, vdupq_n_u16('&')), vceqq_u16(v, vdupq_n_u16('<'))),
+                                      vorrq_u16(vceqq_u16(v, vdupq_n_u16('>')), vorrq_u16(vceqq_u16(v, vdupq_n_u16('\"')), vceqq_u16(v, vdupq_n_u16('\'')))));
+        if (vmaxvq_u16(vorrq_u16(vbicq_u16(control, allowedControl), markup)))
+            break; // the loop below finds it
+        charIndex += 8;
     }
+#endif
+    while (charIndex < charCount && !_OFXMLCharacterNeedsAttention(characters[charIndex], passedNewline))
+        charIndex++;
+    return charIndex;
 }
 
+#define ENTITY_SCAN_CHUNK_LENGTH (1024)
+
 // Replace characters with basic entities
 static NSString *_OFXMLCreateStringWithEntityReferences(NSString *sourceString, unsigned int entityMask, NSString *optionalNewlineString) NS_RETURNS_RETAINED;
 static NSString *_OFXMLCreateStringWithEntityReferences(NSString *sourceString, unsigned int entityMask, NSString *optionalNewlineString)
 {
-    // Could maybe build smaller character sets for different entityMask combinations, but this should get most of the benefit (any special character we handle here).
-    static CFCharacterSetRef entityCharacters = NULL;
-    if (!entityCharacters) {
-	// XML doesn't allow low ASCII characters.  See the 'Char' production in section 2.2 of the spec:
-	//
-	// Char := #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]	/* any Unicode character, excluding the surrogate blocks, FFFE, and FFFF. */
-	CFMutableCharacterSetRef set = CFCharacterSetCreateMutable(kCFAllocatorDefault);
-	CFCharacterSetAddCharactersInRange(set, (CFRange){0, 0x20});
-	CFCharacterSetRemoveCharactersInRange(set, (CFRange){0x9, 1});
-	CFCharacterSetRemoveCharactersInRange(set, (CFRange){0xA, 1});
-	CFCharacterSetRemoveCharactersInRange(set, (CFRange){0xD, 1});
-	
-	// Additionally, XML uses a few special characters for elements, entities and quoting.  We'll write character entities for all of these (unless some quoting flags tell us differently)
-	CFCharacterSetAddCharactersInString(set, CFSTR("&<>\"'\n"));
-	
-        entityCharacters = CFCharacterSetCreateCopy(kCFAllocatorDefault, set);
-	CFRelease(set);
-    }
-    
-    CFIndex charIndex, charCount = CFStringGetLength((CFStringRef)sourceString);
-    CFRange fullRange = (CFRange){0, charCount};
+    CFStringRef string = (CFStringRef)sourceString;
+    CFIndex charCount = CFStringGetLength(string);
+    unichar passedNewline = (optionalNewlineString && (entityMask & OFXMLNewlineEntityMask) == OFXMLNewlineEntityMask) ? '\t' : '\n';
+
+    // Work straight from the string's storage if it will let us; otherwise copy a chunk at a time.  Runs that need no entities are appended whole, and the result isn't created at all unless something gets replaced.
+    const UniChar *directCharacters = CFStringGetCharactersPtr(string);
+    UniChar chunk[ENTITY_SCAN_CHUNK_LENGTH];
+    CFMutableStringRef result = NULL;
+
+    CFIndex chunkStart = 0;
+    while (chunkStart < charCount) {
+        const UniChar *characters;
+        CFIndex chunkLength;
+        if (directCharacters) {
+            characters = directCharacters + chunkStart;
+            chunkLength = charCount - chunkStart;
+        } else {
+            chunkLength = MIN(ENTITY_SCAN_CHUNK_LENGTH, charCount - chunkStart);
+            CFStringGetCharacters(string, CFRangeMake(chunkStart, chunkLength), chunk);
+            characters = chunk;
+        }
 
-    // Early out check
-    if (!CFStringFindCharacterFromSet((CFStringRef)sourceString, entityCharacters, fullRange, 0/*options*/, NULL))
-        return [sourceString retain];
-    
-    CFStringInlineBuffer charBuffer;
-    CFStringInitInlineBuffer((CFStringRef)sourceString, &charBuffer, fullRange);
-
-    CFMutableStringRef result = CFStringCreateMutable(kCFAllocatorDefault, 0);
-
-    for (charIndex = 0; charIndex < charCount; charIndex++) {
-        unichar c = CFStringGetCharacterFromInlineBuffer(&charBuffer, charIndex);
-        if (c == '&') {
-            CFStringAppend(result, (CFStringRef)@"&amp;");
-        } else if (c == '<') {
-            CFStringAppend(result, (CFStringRef)@"&lt;");
-        } else if (c == '>' && (entityMask & OFXMLGtEntityMask) == OFXMLGtEntityMask) {
-            CFStringAppend(result, (CFStringRef)@"&gt;");
-	} else if (c == '\"') {
-	    _OFXMLAppendCharacterEntityWithOptions(result, (entityMask >> OFXMLQuotCharacterOptionsShift) & OFXMLCharacterOptionsMask,
-						   c, (CFStringRef)@"&#34;", (CFStringRef)@"&quot;");
-	} else if (c == '\'') {
-	    _OFXMLAppendCharacterEntityWithOptions(result, (entityMask >> OFXMLAposCharacterOptionsShift) & OFXMLCharacterOptionsMask,
-						   c, (CFStringRef)@"&#39;", (CFStringRef)@"&apos;");
-        } else if (c == '\n') { // 0xA
-	    if (optionalNewlineString && (entityMask & OFXMLNewlineEntityMask) == OFXMLNewlineEntityMask)
-                CFStringAppend(result, (CFStringRef)optionalNewlineString);
-	    else
-		CFStringAppendCharacters(result, &c, 1);
-	} else if (c == '\t' || c == '\r') { // 0x9 || 0xD
-            CFStringAppendCharacters(result, &c, 1);
-	} else if (CFCharacterSetIsCharacterMember(entityCharacters, c)) {
-	    // This is a low-ascii, non-whitespace byte and isn't allowed in XML character at all.  Drop it.
-	    OBASSERT(c < 0x20 && c != 0x9 && c != 0xA && c != 0xD);
-        } else
-            // TODO: Might want to have a local buffer of queued characters to append rather than calling this in a loop.  Need to flush the buffer before each append above and after the end of the loop.
-            CFStringAppendCharacters(result, &c, 1);
+        CFIndex runStart = 0;
+        CFIndex charIndex = _OFXMLScanForEntityCharacter(characters, 0, chunkLength, passedNewline);
+        while (charIndex < chunkLength) {
+            CFStringRef replacement = _OFXMLEntityReplacement(characters[charIndex], entityMask, optionalNewlineString);
+            if (replacement) {
+                if (!result) {
+                    result = CFStringCreateMutable(kCFAllocatorDefault, 0);
+                    if (chunkStart > 0) {
+                        CFStringRef prefix = CFStringCreateWithSubstring(kCFAllocatorDefault, string, CFRangeMake(0, chunkStart));
+                        CFStringAppend(result, prefix);
+                        CFRelease(prefix);
+                    }
+                }
+                CFStringAppendCharacters(result, &characters[runStart], charIndex - runStart);
+                CFStringAppend(result, replacement);
+                runStart = charIndex + 1;
+            }
+            // Otherwise the character goes out with the rest of the run.
+
+            charIndex = _OFXMLScanForEntityCharacter(characters, charIndex + 1, chunkLength, passedNewline);
+        }
+
+        if (result && runStart < chunkLength)
+            CFStringAppendCharacters(result, &characters[runStart], chunkLength - runStart);
+        chunkStart += chunkLength;
     }
 
+    if (!result)
+        return [sourceString retain];
     return NSMakeCollectable(result);
 }
 
@@ -351,9 +415,7 @@ NSString *OFStringForEntityName(NSString *entityName)
 - (BOOL)appendXML:(struct _OFXMLBuffer *)xml withParentWhiteSpaceBehavior:(OFXMLWhitespaceBehaviorType)parentBehavior document:(OFXMLDocument *)doc level:(unsigned int)level error:(NSError **)outError;
 {
     // Called when an element has a string as a direct child.
-    NSString *text = OFXMLCreateStringWithEntityReferencesInCFEncoding(self, OFXMLBasicEntityMask, nil/*newlineReplacement*/, [doc stringEncoding]);
-    OFXMLBufferAppendString(xml, (CFStringRef)text);
-    [text release];
+    OFXMLBufferAppendQuotedString(xml, (CFStringRef)self, [doc stringEncoding]);
     return YES;
 }
 @end
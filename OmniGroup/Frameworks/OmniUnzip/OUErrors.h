@@ -14,6 +14,8 @@ enum {
     OmniUnzipUnableToOpenZipFile = 1012,
     OmniUnzipUnableToReadZipFileContents,
     OmniUnzipUnableToCreateZipFile,
+    OmniUnzipEntryChecksumMismatch,
+    OmniUnzipZipFileTooLarge,
 };
 
 extern NSString * const OmniUnzipErrorDomain;
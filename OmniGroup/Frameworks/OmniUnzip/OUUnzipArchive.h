@@ -12,6 +12,8 @@
 @class NSArray, NSData, NSError;
 @class OUUnzipEntry;
 
+typedef void (^OUUnzipArchiveEntryHandler)(OUUnzipEntry *entry, NSData *data, NSError *error);
+
 @interface OUUnzipArchive : OFObject
 {
     NSString *_path;
@@ -23,12 +25,19 @@
 - (NSString *)path;
 - (NSArray *)entries;
 
+// Opening reads the central directory in one go and indexes it without creating any entry objects; entries are created as they are asked for. Name lookups are hashed and prefix lookups binary search a sorted name index, so neither scans the archive's entries.
+- (NSUInteger)entryCount;
 - (OUUnzipEntry *)entryNamed:(NSString *)name;
 - (NSArray *)entriesWithNamePrefix:(NSString *)prefix;
 
+// When the archive could be mapped, deflated entries are inflated straight from the mapping into a single output buffer, and stored (uncompressed) entries and raw reads are returned as views into the mapping without copying. A view retains the mapping, so it stays valid after the archive is deallocated, but its bytes are read from the file on demand: if the file may be truncated or rewritten while you still hold the data, copy it first (-mutableCopy, say), or touching it may crash with SIGBUS.
 - (NSData *)dataForEntry:(OUUnzipEntry *)entry raw:(BOOL)raw error:(NSError **)outError;
 - (NSData *)dataForEntry:(OUUnzipEntry *)entry error:(NSError **)outError;
 
+// Inflates the given entries concurrently. Each worker reads through its own positional reader on a shared descriptor rather than the single unzip cursor, so entries are independent of each other. The handler is called once per entry, on an arbitrary thread, with either the CRC-verified contents or nil and an error (OmniUnzipEntryChecksumMismatch for CRC failures). Pass zero for maximumConcurrency to let the system pick. Returns NO (without calling the handler) only if the archive can't be opened; per-entry failures are reported through the handler.
+- (BOOL)readDataForEntries:(NSArray *)entries maximumConcurrency:(NSUInteger)maximumConcurrency handler:(OUUnzipArchiveEntryHandler)handler error:(NSError **)outError;
+- (BOOL)readDataForAllEntriesWithHandler:(OUUnzipArchiveEntryHandler)handler error:(NSError **)outError;
+
 // Writes all entries prefixed with "name" to temp.
 - (NSURL *)URLByWritingTemporaryCopyOfTopLevelEntryNamed:(NSString *)name error:(NSError **)outError;
 
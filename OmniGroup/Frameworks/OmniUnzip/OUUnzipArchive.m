@@ -10,9 +10,13 @@
 #import <OmniUnzip/OUUnzipEntry.h>
 #import <OmniUnzip/OUErrors.h>
 #import <OmniBase/system.h> // S_IFMT, etc
+#import <libkern/OSAtomic.h>
 #import "unzip.h"
+#import "OUUnzipDirectoryIndex.h"
+#import <zlib.h>
 
 #import <OmniFoundation/NSFileManager-OFTemporaryPath.h>
+#import <OmniFoundation/OFCRC.h>
 
 #if 0 && defined(DEBUG)
     #define DEBUG_UNZIP_ENTRY(format, ...) NSLog((format), ## __VA_ARGS__)
@@ -22,140 +26,393 @@
 
 RCS_ID("$Id$");
 
+// A view onto a range of the mapped archive, retaining the mapping rather than copying out of it. Used for the central directory and for stored entries and raw reads handed to callers, so a view can outlive the archive that made it; the mapping goes away when the last view does. Touching a mapping after the file has been truncated raises SIGBUS, which is the caller's lookout (see -dataForEntry:raw:error:).
+@interface OUMappedSubdata : NSData
+{
+@private
+    NSData *_mappedData;
+    const void *_bytes;
+    NSUInteger _length;
+}
+- initWithMappedData:(NSData *)mappedData range:(NSRange)range;
+@end
+
+@implementation OUMappedSubdata
+
+- initWithMappedData:(NSData *)mappedData range:(NSRange)range;
+{
+    OBPRECONDITION(NSMaxRange(range) <= [mappedData length]);
+    
+    if (!(self = [super init]))
+        return nil;
+    
+    _mappedData = [mappedData retain];
+    _bytes = [mappedData bytes] + range.location;
+    _length = range.length;
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_mappedData release];
+    [super dealloc];
+}
+
+- (NSUInteger)length;
+{
+    return _length;
+}
+
+- (const void *)bytes;
+{
+    return _bytes;
+}
+
+@end
+
 @implementation OUUnzipArchive
+{
+    NSData *_mappedData; // The whole archive, mapped read-only; nil if mapping failed.
+    off_t _archiveStart; // Bytes prepended to the archive proper (a self-extractor stub, say); zip offsets are relative to this.
+    OUUnzipDirectoryIndex *_index;
+    OUUnzipEntry **_entryObjects; // Created on demand, one slot per directory record.
+}
+
+#pragma mark - Positional reading
+
+// Fixed-size portions of the zip headers we need to look at; see APPNOTE.TXT sections 4.3.7 and 4.3.12.
+#define OU_LOCAL_HEADER_SIGNATURE (0x04034b50)
+#define OU_LOCAL_HEADER_SIZE (30)
+#define OU_CENTRAL_HEADER_SIGNATURE (0x02014b50)
+#define OU_CENTRAL_HEADER_SIZE (46)
+
+static inline uint16_t _OUReadLittleShort(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t _OUReadLittleLong(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Copies a range of the archive, either out of the mapping or with pread() when there isn't one.
+static BOOL _OUReadArchiveRange(NSData *mappedData, int fd, void *buffer, size_t length, off_t offset)
+{
+    if (mappedData) {
+        if (offset < 0 || (uint64_t)offset + length > [mappedData length])
+            return NO; // Truncated archive
+        memcpy(buffer, [mappedData bytes] + offset, length);
+        return YES;
+    }
+    
+    while (length > 0) {
+        ssize_t copied = pread(fd, buffer, length, offset);
+        if (copied < 0) {
+            if (errno == EINTR)
+                continue;
+            return NO;
+        }
+        if (copied == 0)
+            return NO; // Truncated archive
+        buffer += copied;
+        length -= copied;
+        offset += copied;
+    }
+    return YES;
+}
+
+static NSData *_OUPositionalReadError(OUUnzipArchive *archive, OUUnzipEntry *entry, NSInteger code, NSString *reason, NSError **outError)
+{
+    NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip data.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
+    NSString *fullReason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"%@ (entry \"%@\" in \"%@\")", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), reason, [entry name], [archive path]];
+    OmniUnzipError(outError, code, description, fullReason);
+    return nil;
+}
+
+// Reads one entry without touching any unzip library state, so any number of these can run at once against the same file. This locates the local header through the central directory record at -positionInFile (which is what unzGetFilePos() hands back), then reads or inflates -compressedSize bytes from just past it. When 'mappedData' is non-nil all access goes through it, and stored or raw contents are returned as OUMappedSubdata views into it (once a stored entry's CRC checks out); otherwise we pread() from 'fd'. Zip offsets are relative to 'archiveStart', the number of bytes (if any) prepended to the archive.
+static NSData *_OUReadEntryDataPositionally(OUUnzipArchive *archive, NSData *mappedData, int fd, off_t archiveStart, OUUnzipEntry *entry, BOOL raw, NSError **outError)
+{
+    uint8_t header[OU_CENTRAL_HEADER_SIZE];
+    
+    if (!_OUReadArchiveRange(mappedData, fd, header, OU_CENTRAL_HEADER_SIZE, archiveStart + (off_t)[entry positionInFile]) || _OUReadLittleLong(header) != OU_CENTRAL_HEADER_SIGNATURE)
+        return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, @"Bad central directory record.", outError);
+    
+    uint16_t flags = _OUReadLittleShort(header + 8);
+    if ((flags & 0x1) && !raw)
+        return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, @"Encrypted entries are not supported.", outError);
+    
+    off_t localHeaderOffset = archiveStart + _OUReadLittleLong(header + 42);
+    if (!_OUReadArchiveRange(mappedData, fd, header, OU_LOCAL_HEADER_SIZE, localHeaderOffset) || _OUReadLittleLong(header) != OU_LOCAL_HEADER_SIGNATURE)
+        return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, @"Bad local file header.", outError);
+    
+    off_t dataOffset = localHeaderOffset + OU_LOCAL_HEADER_SIZE + _OUReadLittleShort(header + 26) + _OUReadLittleShort(header + 28);
+    size_t compressedSize = [entry compressedSize];
+    size_t uncompressedSize = [entry uncompressedSize];
+    unsigned long compressionMethod = [entry compressionMethod];
+    
+    if (!raw && compressionMethod != 0 && compressionMethod != Z_DEFLATED)
+        return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, [NSString stringWithFormat:@"Unsupported compression method %lu.", compressionMethod], outError);
+    
+    // Find the member's bytes: in place if we're mapped, otherwise in a buffer of our own.
+    NSRange mappedRange = NSMakeRange(0, 0);
+    const void *compressed;
+    void *compressedBuffer = NULL;
+    if (mappedData) {
+        if ((uint64_t)dataOffset + compressedSize > [mappedData length])
+            return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, @"Unexpected end of file.", outError);
+        mappedRange = NSMakeRange((NSUInteger)dataOffset, compressedSize);
+        compressed = [mappedData bytes] + dataOffset;
+    } else {
+        // malloc(0) may return NULL; always ask for at least a byte.
+        compressedBuffer = malloc(MAX(compressedSize, 1U));
+        if (!_OUReadArchiveRange(nil, fd, compressedBuffer, compressedSize, dataOffset)) {
+            free(compressedBuffer);
+            return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, @"Unexpected end of file.", outError);
+        }
+        compressed = compressedBuffer;
+    }
+    
+    // Raw reads hand back the member as stored, and (like unzOpenCurrentFile3 in raw mode) don't check the CRC.
+    if (raw) {
+        if (mappedData)
+            return [[[OUMappedSubdata alloc] initWithMappedData:mappedData range:mappedRange] autorelease];
+        return [NSData dataWithBytesNoCopy:compressedBuffer length:compressedSize freeWhenDone:YES];
+    }
+    
+    const void *bytes;
+    void *inflatedBuffer = NULL;
+    if (compressionMethod == 0) {
+        OBASSERT(compressedSize == uncompressedSize);
+        bytes = compressed;
+        uncompressedSize = compressedSize;
+    } else {
+        inflatedBuffer = malloc(MAX(uncompressedSize, 1U));
+        
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        int err = inflateInit2(&stream, -MAX_WBITS); // Raw deflate data; there's no zlib header in a zip member.
+        if (err != Z_OK) {
+            free(compressedBuffer);
+            free(inflatedBuffer);
+            return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, [NSString stringWithFormat:@"inflateInit2 returned %d.", err], outError);
+        }
+        
+        stream.next_in = (Bytef *)compressed;
+        stream.avail_in = (uInt)compressedSize;
+        stream.next_out = inflatedBuffer;
+        stream.avail_out = (uInt)uncompressedSize;
+        
+        err = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        free(compressedBuffer);
+        compressedBuffer = NULL;
+        
+        if (err != Z_STREAM_END || stream.total_out != uncompressedSize) {
+            free(inflatedBuffer);
+            return _OUPositionalReadError(archive, entry, OmniUnzipUnableToReadZipFileContents, [NSString stringWithFormat:@"inflate returned %d.", err], outError);
+        }
+        bytes = inflatedBuffer;
+    }
+    
+    uLong crc = OFCRC32Update(0, bytes, uncompressedSize);
+    if (crc != [entry crc]) {
+        free(compressedBuffer);
+        free(inflatedBuffer);
+        return _OUPositionalReadError(archive, entry, OmniUnzipEntryChecksumMismatch, [NSString stringWithFormat:@"Expected CRC %08lx but computed %08lx.", [entry crc], crc], outError);
+    }
+    
+    if (inflatedBuffer)
+        return [NSData dataWithBytesNoCopy:inflatedBuffer length:uncompressedSize freeWhenDone:YES];
+    if (mappedData)
+        return [[[OUMappedSubdata alloc] initWithMappedData:mappedData range:mappedRange] autorelease];
+    return [NSData dataWithBytesNoCopy:compressedBuffer length:uncompressedSize freeWhenDone:YES];
+}
+
+#pragma mark - Opening
+
+// See APPNOTE.TXT section 4.3.16.
+#define OU_END_OF_CENTRAL_DIRECTORY_SIGNATURE (0x06054b50)
+#define OU_END_OF_CENTRAL_DIRECTORY_SIZE (22)
+#define OU_MAXIMUM_COMMENT_SIZE (0xffff)
 
-static id _unzipError(id self, const char *func, int err, NSError **outError)
+static id _unzipDirectoryError(id self, NSString *reason, NSError **outError)
 {
     NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip file.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
-    NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"The zip library function %s returned %d", @"OmniUnzip", OMNI_BUNDLE, @"error reason"),  func, err];
     OmniUnzipError(outError, OmniUnzipUnableToReadZipFileContents, description, reason);
     
-    NSLog(@"%s returned %d", func, err);
-    
     [self release];
     return nil;
 }
-#define UNZIP_ERROR(f) _unzipError(self, #f, err, outError)
 
 // Zip has no real notion of directories, so we just have a flat list of files, like it does.  Some will have slashes in their names.  Some might end in '/' and have directory flags set in their attributes.  We could probably just ignore those (unless they have interesting properties, like finder info or other custom metadata, once we start handling that).
+// Rather than walking the directory one header at a time with unzGoToNextFile(), we find the end-of-directory record (as unzlocal_SearchCentralDir does), read the whole directory with one copy (or none, if mapped), and index it.
 - initWithPath:(NSString *)path error:(NSError **)outError;
 {
     _path = [path copy];
     
-    unzFile unzip = unzOpen([[NSFileManager defaultManager] fileSystemRepresentationWithPath:path]);
-    if (!unzip) {
-        NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to open zip archive.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
-        NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"The unzip library failed to open %@.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), path];
-        OmniUnzipError(outError, OmniUnzipUnableToOpenZipFile, description, reason);
-        [self release];
-        return nil;
-    }
+    // If mapping fails (say, a huge archive in a 32-bit address space), we fall back to pread() here and the unzip library for entry data.
+    _mappedData = [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedAlways error:NULL];
     
-    NSMutableArray *entries = [NSMutableArray array];
+    int fd = -1;
+    off_t fileSize;
+    if (_mappedData)
+        fileSize = [_mappedData length];
+    else {
+        struct stat statInfo;
+        fd = open([[NSFileManager defaultManager] fileSystemRepresentationWithPath:path], O_RDONLY);
+        if (fd < 0 || fstat(fd, &statInfo) != 0) {
+            if (fd >= 0)
+                close(fd);
+            NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to open zip archive.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
+            NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"The unzip library failed to open %@.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), path];
+            OmniUnzipError(outError, OmniUnzipUnableToOpenZipFile, description, reason);
+            [self release];
+            return nil;
+        }
+        fileSize = statInfo.st_size;
+    }
     
     @try {
-        while (YES) {
-            unz_file_info fileInfo;
-            char fileNameBuffer[PATH_MAX+1];
-#ifdef DEBUG
-            memset(fileNameBuffer, 0xff, sizeof(fileNameBuffer)); // Help make sure we get the size_filename semantics right
-#endif
-
-            int err = unzGetCurrentFileInfo(unzip, &fileInfo, fileNameBuffer, sizeof(fileNameBuffer), NULL, 0, NULL, 0); // extra args for 'extra field' and comment buffer and buffer size
-            if (err != UNZ_OK)
-                return UNZIP_ERROR(unzGetCurrentFileInfo);
-            
-            NSString *fileName = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:fileNameBuffer length:fileInfo.size_filename];
-            if (!fileName) {
-                NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip file.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
-                NSString *reason = NSLocalizedStringFromTableInBundle(@"An entry in the zip file had a name that couldn't be converted to a filesystem path.", @"OmniUnzip", OMNI_BUNDLE, @"error reason");
-                OmniUnzipError(outError, OmniUnzipUnableToReadZipFileContents, description, reason);
-            }
-            
-            unz_file_pos position;
-            memset(&position, 0, sizeof(position));
-            
-            err = unzGetFilePos(unzip, &position);
-            if (err != UNZ_OK)
-                return UNZIP_ERROR(unzGetFilePos);
-                
-            DEBUG_UNZIP_ENTRY(@"File '%@':", fileName);
-            DEBUG_UNZIP_ENTRY(@"  version:%d", fileInfo.version);
-            DEBUG_UNZIP_ENTRY(@"  version_needed:%d", fileInfo.version_needed);
-            DEBUG_UNZIP_ENTRY(@"  flag:%d", fileInfo.flag);
-            DEBUG_UNZIP_ENTRY(@"  compression_method:%d", fileInfo.compression_method);
-            DEBUG_UNZIP_ENTRY(@"  dosDate:%d", fileInfo.dosDate);
-            DEBUG_UNZIP_ENTRY(@"  crc:%x", fileInfo.crc);
-            DEBUG_UNZIP_ENTRY(@"  compressed_size:%d", fileInfo.compressed_size);
-            DEBUG_UNZIP_ENTRY(@"  uncompressed_size:%d", fileInfo.uncompressed_size);
-            DEBUG_UNZIP_ENTRY(@"  size_filename:%d", fileInfo.size_filename);
-            DEBUG_UNZIP_ENTRY(@"  size_file_extra:%d", fileInfo.size_file_extra);
-            DEBUG_UNZIP_ENTRY(@"  size_file_comment:%d", fileInfo.size_file_comment);
-            DEBUG_UNZIP_ENTRY(@"  disk_num_start:%d", fileInfo.disk_num_start);
-            DEBUG_UNZIP_ENTRY(@"  internal_fa:0x%x", fileInfo.internal_fa);
-            DEBUG_UNZIP_ENTRY(@"  external_fa:0x%x", fileInfo.external_fa);
+        // The end-of-directory record is the last thing in the file, followed only by a comment of up to 64K.
+        size_t tailLength = (size_t)MIN(fileSize, (off_t)(OU_END_OF_CENTRAL_DIRECTORY_SIZE + OU_MAXIMUM_COMMENT_SIZE));
+        if (tailLength < OU_END_OF_CENTRAL_DIRECTORY_SIZE)
+            return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"The file is too short to be a zip file.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
         
-            // Don't want to extract the data up front.  May not want to return a data at all, but a NSReadStream...
-            
-            // Not sure what we should do if this happens.  Also of concern is if a zip file has "a" as a file and "a/b".
-#if 0
-            if ([children objectForKey:fileName]) {
-                NSString *description = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"Duplicate zip member name \"%@\".", @"OmniUnzip", OMNI_BUNDLE, @"error description"), fileName];
-                NSString *reason = NSLocalizedStringFromTableInBundle(@"An entry in the zip file had a name that couldn't be converted to a filesystem path.", @"OmniUnzip", OMNI_BUNDLE, @"error reason");
-                OmniUnzipError(outError, OmniUnzipUnableToReadZipFileContents, description, reason);
-                [self release];
-                return nil;
-            }
-#endif
-            
-            NSString *fileType;
-            switch ((fileInfo.external_fa >> 16) & S_IFMT) {
-                case S_IFDIR:
-                    fileType = NSFileTypeDirectory;
-                    break;
-                case S_IFLNK:
-                    fileType = NSFileTypeSymbolicLink;
-                    break;
-                default:
-                    fileType = NSFileTypeRegular;
-                    break;
-            }
-
-            NSDateComponents *components = [[NSDateComponents alloc] init];
-            [components setYear:fileInfo.tmu_date.tm_year];
-            [components setMonth:fileInfo.tmu_date.tm_mon + 1]; // tm_mon is 0-based
-            [components setDay:fileInfo.tmu_date.tm_mday];
-            [components setHour:fileInfo.tmu_date.tm_hour];
-            [components setMinute:fileInfo.tmu_date.tm_min];
-            [components setSecond:fileInfo.tmu_date.tm_sec];
-            NSDate *date = [[NSCalendar currentCalendar] dateFromComponents:components];
-            [components release];
-
-            OUUnzipEntry *entry = [[OUUnzipEntry alloc] initWithName:fileName fileType:fileType date:date positionInFile:position.pos_in_zip_directory fileNumber:position.num_of_file compressionMethod:fileInfo.compression_method compressedSize:fileInfo.compressed_size uncompressedSize:fileInfo.uncompressed_size crc:fileInfo.crc];
-            [entries addObject:entry];
-            [entry release];
-            
-            err = unzGoToNextFile(unzip);
-            if (err == UNZ_END_OF_LIST_OF_FILE)
+        NSMutableData *tailData = [NSMutableData dataWithLength:tailLength];
+        uint8_t *tail = [tailData mutableBytes];
+        if (!_OUReadArchiveRange(_mappedData, fd, tail, tailLength, fileSize - tailLength))
+            return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"Unable to read the end of the zip file.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
+        
+        const uint8_t *endRecord = NULL;
+        for (const uint8_t *candidate = tail + tailLength - OU_END_OF_CENTRAL_DIRECTORY_SIZE; candidate >= tail; candidate--) {
+            if (_OUReadLittleLong(candidate) == OU_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+                endRecord = candidate;
                 break;
-            if (err != UNZ_OK)
-                return UNZIP_ERROR(unzGoToNextFile);
+            }
+        }
+        if (!endRecord)
+            return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"The zip file's central directory could not be found.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
+        
+        off_t endRecordPosition = fileSize - tailLength + (endRecord - tail);
+        NSUInteger entryCount = _OUReadLittleShort(endRecord + 10);
+        uint32_t directorySize = _OUReadLittleLong(endRecord + 12);
+        uint32_t directoryOffset = _OUReadLittleLong(endRecord + 16);
+        
+        // Spanned archives aren't supported (nor were they by unzip.c).
+        if (_OUReadLittleShort(endRecord + 4) != 0 || _OUReadLittleShort(endRecord + 6) != 0 || _OUReadLittleShort(endRecord + 8) != entryCount || endRecordPosition < (off_t)directoryOffset + directorySize)
+            return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"The zip file's central directory is damaged.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
+        
+        _archiveStart = endRecordPosition - ((off_t)directoryOffset + directorySize);
+        
+        NSData *directory;
+        if (_mappedData)
+            directory = [[[OUMappedSubdata alloc] initWithMappedData:_mappedData range:NSMakeRange((NSUInteger)(_archiveStart + directoryOffset), directorySize)] autorelease];
+        else {
+            NSMutableData *directoryBuffer = [NSMutableData dataWithLength:directorySize];
+            if (!_OUReadArchiveRange(nil, fd, [directoryBuffer mutableBytes], directorySize, _archiveStart + directoryOffset))
+                return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"The zip file's central directory is damaged.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
+            directory = directoryBuffer;
         }
+        
+        _index = OUUnzipDirectoryIndexCreate(directory, directoryOffset, entryCount);
+        if (!_index)
+            return _unzipDirectoryError(self, NSLocalizedStringFromTableInBundle(@"The zip file's central directory is damaged.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), outError);
+        
+        _entryObjects = calloc(MAX(entryCount, 1U), sizeof(*_entryObjects));
     } @finally {
-        if (unzip)
-            unzClose(unzip);
+        if (fd >= 0)
+            close(fd);
     }
     
-    _entries = [[NSArray alloc] initWithArray:entries];
-    
     return self;
 }
-#undef UNZIP_ERROR
+
+static void _OUTmuDateFromDosDate(uint32_t dosDate, tm_unz *date)
+{
+    // Same unpacking as unzlocal_DosDateToTmuDate().
+    uint32_t day = dosDate >> 16;
+    date->tm_mday = day & 0x1f;
+    date->tm_mon = ((day & 0x1e0) / 0x20) - 1;
+    date->tm_year = ((day & 0xfe00) / 0x200) + 1980;
+    date->tm_hour = (dosDate & 0xf800) / 0x800;
+    date->tm_min = (dosDate & 0x7e0) / 0x20;
+    date->tm_sec = 2 * (dosDate & 0x1f);
+}
+
+- (OUUnzipEntry *)_entryAtIndex:(NSUInteger)recordIndex;
+{
+    OUUnzipEntry *entry = _entryObjects[recordIndex];
+    if (entry)
+        return entry;
+    
+    const OUUnzipDirectoryRecord *record = OUUnzipDirectoryIndexRecordAtIndex(_index, recordIndex);
+    NSString *fileName = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:OUUnzipDirectoryIndexNameOfRecord(_index, record) length:record->nameLength];
+    if (!fileName) {
+        NSLog(@"Zip entry %lu in %@ has a name that couldn't be converted to a filesystem path.", recordIndex, _path);
+        return nil;
+    }
+    
+    DEBUG_UNZIP_ENTRY(@"File '%@':", fileName);
+    DEBUG_UNZIP_ENTRY(@"  compression_method:%d", record->compressionMethod);
+    DEBUG_UNZIP_ENTRY(@"  dosDate:%d", record->dosDate);
+    DEBUG_UNZIP_ENTRY(@"  crc:%x", record->crc);
+    DEBUG_UNZIP_ENTRY(@"  compressed_size:%d", record->compressedSize);
+    DEBUG_UNZIP_ENTRY(@"  uncompressed_size:%d", record->uncompressedSize);
+    DEBUG_UNZIP_ENTRY(@"  external_fa:0x%x", record->externalAttributes);
+    
+    // Not sure what we should do if there are duplicate names.  Also of concern is if a zip file has "a" as a file and "a/b".  Lookups by name find the first.
+    
+    NSString *fileType;
+    switch ((record->externalAttributes >> 16) & S_IFMT) {
+        case S_IFDIR:
+            fileType = NSFileTypeDirectory;
+            break;
+        case S_IFLNK:
+            fileType = NSFileTypeSymbolicLink;
+            break;
+        default:
+            fileType = NSFileTypeRegular;
+            break;
+    }
+    
+    tm_unz tmuDate;
+    _OUTmuDateFromDosDate(record->dosDate, &tmuDate);
+    
+    NSDateComponents *components = [[NSDateComponents alloc] init];
+    [components setYear:tmuDate.tm_year];
+    [components setMonth:tmuDate.tm_mon + 1]; // tm_mon is 0-based
+    [components setDay:tmuDate.tm_mday];
+    [components setHour:tmuDate.tm_hour];
+    [components setMinute:tmuDate.tm_min];
+    [components setSecond:tmuDate.tm_sec];
+    NSDate *date = [[NSCalendar currentCalendar] dateFromComponents:components];
+    [components release];
+    
+    entry = [[OUUnzipEntry alloc] initWithName:fileName fileType:fileType date:date positionInFile:record->centralHeaderOffset fileNumber:recordIndex compressionMethod:record->compressionMethod compressedSize:record->compressedSize uncompressedSize:record->uncompressedSize crc:record->crc];
+    
+    // Entries may be requested from several threads at once (see -readDataForEntries:...); first one in wins.
+    if (!OSAtomicCompareAndSwapPtrBarrier(nil, entry, (void * volatile *)&_entryObjects[recordIndex])) {
+        [entry release];
+        entry = _entryObjects[recordIndex];
+    }
+    
+    return entry;
+}
 
 - (void)dealloc;
 {
+    if (_entryObjects) {
+        NSUInteger entryCount = OUUnzipDirectoryIndexCount(_index);
+        for (NSUInteger entryIndex = 0; entryIndex < entryCount; entryIndex++)
+            [_entryObjects[entryIndex] release];
+        free(_entryObjects);
+    }
+    OUUnzipDirectoryIndexDestroy(_index);
     [_path release];
     [_entries release];
+    [_mappedData release];
     [super dealloc];
 }
 
@@ -166,16 +423,59 @@ static id _unzipError(id self, const char *func, int err, NSError **outError)
 
 - (NSArray *)entries;
 {
+    if (!_entries) {
+        NSUInteger entryCount = OUUnzipDirectoryIndexCount(_index);
+        NSMutableArray *entries = [[NSMutableArray alloc] initWithCapacity:entryCount];
+        for (NSUInteger entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+            OUUnzipEntry *entry = [self _entryAtIndex:entryIndex];
+            if (entry)
+                [entries addObject:entry];
+        }
+        
+        NSArray *immutableEntries = [[NSArray alloc] initWithArray:entries];
+        [entries release];
+        if (!OSAtomicCompareAndSwapPtrBarrier(nil, immutableEntries, (void * volatile *)&_entries))
+            [immutableEntries release];
+    }
     return _entries;
 }
 
+- (NSUInteger)entryCount;
+{
+    return OUUnzipDirectoryIndexCount(_index);
+}
+
+// Names are stored as written by OUZipArchive, in file system representation. Try that first, and the plain UTF-8 form in case some other tool wrote a different normalization. ASCII names are the same either way, so only non-ASCII names get a second look.
+static BOOL _OUGetNameBytes(NSString *name, BOOL fileSystemRepresentation, char *buffer, size_t bufferSize, size_t *outLength)
+{
+    if (fileSystemRepresentation) {
+        if (![name getFileSystemRepresentation:buffer maxLength:bufferSize])
+            return NO;
+    } else {
+        if (![name getCString:buffer maxLength:bufferSize encoding:NSUTF8StringEncoding])
+            return NO;
+    }
+    *outLength = strlen(buffer);
+    return YES;
+}
+
 // TODO: Add case sensitivity control?
 - (OUUnzipEntry *)entryNamed:(NSString *)name;
 {
-    // Looping from the beginning, assuming that the first entry (typically contents.xml) is what we'll usually want.
-    for (OUUnzipEntry *entry in _entries)
-        if ([[entry name] isEqualToString:name])
-            return entry;
+    char nameBuffer[PATH_MAX+1];
+    size_t nameLength;
+    
+    if (_OUGetNameBytes(name, YES, nameBuffer, sizeof(nameBuffer), &nameLength)) {
+        NSUInteger entryIndex = OUUnzipDirectoryIndexFind(_index, nameBuffer, nameLength);
+        if (entryIndex != NSNotFound)
+            return [self _entryAtIndex:entryIndex];
+    }
+    
+    if (![name canBeConvertedToEncoding:NSASCIIStringEncoding] && _OUGetNameBytes(name, NO, nameBuffer, sizeof(nameBuffer), &nameLength)) {
+        NSUInteger entryIndex = OUUnzipDirectoryIndexFind(_index, nameBuffer, nameLength);
+        if (entryIndex != NSNotFound)
+            return [self _entryAtIndex:entryIndex];
+    }
     
     return nil;
 }
@@ -183,14 +483,26 @@ static id _unzipError(id self, const char *func, int err, NSError **outError)
 - (NSArray *)entriesWithNamePrefix:(NSString *)prefix;
 {
     NSMutableArray *matches = [NSMutableArray array];
+    char prefixBuffer[PATH_MAX+1];
+    size_t prefixLength;
     
-    for (OUUnzipEntry *entry in _entries)
-        if ([[entry name] hasPrefix:prefix])
+    void (^addMatch)(NSUInteger entryIndex) = ^(NSUInteger entryIndex){
+        OUUnzipEntry *entry = [self _entryAtIndex:entryIndex];
+        if (entry)
             [matches addObject:entry];
-            
+    };
+    
+    if (_OUGetNameBytes(prefix, YES, prefixBuffer, sizeof(prefixBuffer), &prefixLength))
+        OUUnzipDirectoryIndexApplyToPrefix(_index, prefixBuffer, prefixLength, addMatch);
+    
+    if ([matches count] == 0 && ![prefix canBeConvertedToEncoding:NSASCIIStringEncoding] && _OUGetNameBytes(prefix, NO, prefixBuffer, sizeof(prefixBuffer), &prefixLength))
+        OUUnzipDirectoryIndexApplyToPrefix(_index, prefixBuffer, prefixLength, addMatch);
+    
     return matches;
 }
 
+#pragma mark - Unzip library reading
+
 static id _unzipDataError(id self, OUUnzipEntry *entry, const char *func, int err, NSError **outError)
 {
     NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip data.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
@@ -207,6 +519,9 @@ static id _unzipDataError(id self, OUUnzipEntry *entry, const char *func, int er
 {
     OBPRECONDITION(entry);
     
+    if (_mappedData)
+        return _OUReadEntryDataPositionally(self, _mappedData, -1, _archiveStart, entry, raw, outError);
+    
     unzFile unzip = unzOpen([[NSFileManager defaultManager] fileSystemRepresentationWithPath:_path]);
     if (!unzip) {
         NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip data.", @"OmniUnzip", OMNI_BUNDLE, @"error reason");
@@ -285,6 +600,60 @@ static id _unzipDataError(id self, OUUnzipEntry *entry, const char *func, int er
     return [self dataForEntry:entry raw:NO error:outError];
 }
 
+#pragma mark - Concurrent extraction
+
+- (BOOL)readDataForEntries:(NSArray *)entries maximumConcurrency:(NSUInteger)maximumConcurrency handler:(OUUnzipArchiveEntryHandler)handler error:(NSError **)outError;
+{
+    OBPRECONDITION(handler);
+    
+    // Without a mapping, workers share a descriptor; pread() doesn't move its offset.
+    int fd = -1;
+    if (!_mappedData) {
+        fd = open([[NSFileManager defaultManager] fileSystemRepresentationWithPath:_path], O_RDONLY);
+        if (fd < 0) {
+            NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to read zip data.", @"OmniUnzip", OMNI_BUNDLE, @"error reason");
+            NSString *reason = [NSString stringWithFormat:@"Unable to open zip file \"%@\".", _path];
+            OmniUnzipError(outError, OmniUnzipUnableToOpenZipFile, description, reason);
+            return NO;
+        }
+    }
+    
+    if (maximumConcurrency == 0)
+        maximumConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    // The semaphore bounds the number of entries being inflated (and thus the number of buffers alive) at once; the group lets us wait for the stragglers.
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_semaphore_t slots = dispatch_semaphore_create((long)maximumConcurrency);
+    NSData *mappedData = _mappedData;
+    off_t archiveStart = _archiveStart;
+    
+    for (OUUnzipEntry *entry in entries) {
+        dispatch_semaphore_wait(slots, DISPATCH_TIME_FOREVER);
+        dispatch_group_async(group, queue, ^{
+            @autoreleasepool {
+                NSError *entryError = nil;
+                NSData *data = _OUReadEntryDataPositionally(self, mappedData, fd, archiveStart, entry, NO, &entryError);
+                handler(entry, data, data ? nil : entryError);
+            }
+            dispatch_semaphore_signal(slots);
+        });
+    }
+    
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    dispatch_release(group);
+    dispatch_release(slots);
+    if (fd >= 0)
+        close(fd);
+    
+    return YES;
+}
+
+- (BOOL)readDataForAllEntriesWithHandler:(OUUnzipArchiveEntryHandler)handler error:(NSError **)outError;
+{
+    return [self readDataForEntries:[self entries] maximumConcurrency:0 handler:handler error:outError];
+}
+
 - (NSURL *)URLByWritingTemporaryCopyOfTopLevelEntryNamed:(NSString *)topLevelEntryName error:(NSError **)outError;
 {
     NSArray *entries = [self entriesWithNamePrefix:topLevelEntryName];
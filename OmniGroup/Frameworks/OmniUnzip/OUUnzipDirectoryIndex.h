@@ -0,0 +1,43 @@
+// Copyright 2008, 2010-2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSObjCRuntime.h>
+#import <Foundation/NSRange.h>
+
+@class NSData;
+
+// A compact, immutable index over a zip file's central directory, built from one bulk read of the directory. Names aren't decoded; they point into the directory bytes. Lookups by exact name go through an open-addressed hash table and prefix lookups binary search a name-sorted permutation, so neither needs per-entry Objective-C objects.
+
+typedef struct {
+    uint32_t centralHeaderOffset; // Archive offset of this record, as unzGetFilePos() would report in pos_in_zip_directory.
+    uint32_t nameOffset;          // Offset of the name within the directory bytes.
+    uint16_t nameLength;
+    uint16_t compressionMethod;
+    uint32_t dosDate;
+    uint32_t crc;
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+    uint32_t externalAttributes;
+} OUUnzipDirectoryRecord;
+
+typedef struct _OUUnzipDirectoryIndex OUUnzipDirectoryIndex;
+
+// 'directory' holds exactly the central directory (it is retained, not copied) and 'directoryOffset' is where it starts in the archive. Returns NULL if the directory doesn't contain 'entryCount' well-formed records.
+extern OUUnzipDirectoryIndex *OUUnzipDirectoryIndexCreate(NSData *directory, uint32_t directoryOffset, NSUInteger entryCount);
+extern void OUUnzipDirectoryIndexDestroy(OUUnzipDirectoryIndex *index);
+
+extern NSUInteger OUUnzipDirectoryIndexCount(const OUUnzipDirectoryIndex *index);
+extern const OUUnzipDirectoryRecord *OUUnzipDirectoryIndexRecordAtIndex(const OUUnzipDirectoryIndex *index, NSUInteger recordIndex);
+extern const char *OUUnzipDirectoryIndexNameOfRecord(const OUUnzipDirectoryIndex *index, const OUUnzipDirectoryRecord *record);
+
+// Returns the archive-order index of the first record whose name is exactly these bytes, or NSNotFound.
+extern NSUInteger OUUnzipDirectoryIndexFind(const OUUnzipDirectoryIndex *index, const char *name, size_t nameLength);
+
+// Calls 'applier' with the archive-order index of every record whose name starts with these bytes, in ascending order.
+extern void OUUnzipDirectoryIndexApplyToPrefix(const OUUnzipDirectoryIndex *index, const char *prefix, size_t prefixLength, void (^applier)(NSUInteger recordIndex));
@@ -0,0 +1,235 @@
+// Copyright 2008, 2010-2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OUUnzipDirectoryIndex.h"
+
+RCS_ID("$Id$");
+
+#define OU_CENTRAL_HEADER_SIGNATURE (0x02014b50)
+#define OU_CENTRAL_HEADER_SIZE (46)
+
+typedef struct {
+    const char *name;
+    uint32_t nameLength;
+    uint32_t recordIndex;
+} OUUnzipSortedName;
+
+struct _OUUnzipDirectoryIndex {
+    NSData *directory;
+    NSUInteger count;
+    OUUnzipDirectoryRecord *records;
+    
+    // Slots hold recordIndex+1 so that zero can mean empty. Always a power of two, and at least twice 'count'.
+    uint32_t *hashSlots;
+    uint32_t hashMask;
+    
+    OUUnzipSortedName *sortedNames;
+};
+
+static inline uint16_t _readShort(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t _readLong(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// FNV-1a; names are short and this keeps the hash independent of any CF string representation.
+static inline uint32_t _hashName(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261U;
+    while (length--) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static int _compareNames(const char *name1, size_t length1, const char *name2, size_t length2)
+{
+    int result = memcmp(name1, name2, MIN(length1, length2));
+    if (result)
+        return result;
+    if (length1 < length2)
+        return -1;
+    if (length1 > length2)
+        return 1;
+    return 0;
+}
+
+static int _compareSortedNames(const void *a, const void *b)
+{
+    const OUUnzipSortedName *name1 = a, *name2 = b;
+    int result = _compareNames(name1->name, name1->nameLength, name2->name, name2->nameLength);
+    if (result)
+        return result;
+    // Keep duplicates in archive order.
+    return (name1->recordIndex < name2->recordIndex) ? -1 : (name1->recordIndex > name2->recordIndex);
+}
+
+OUUnzipDirectoryIndex *OUUnzipDirectoryIndexCreate(NSData *directory, uint32_t directoryOffset, NSUInteger entryCount)
+{
+    const uint8_t *bytes = [directory bytes];
+    NSUInteger length = [directory length];
+    
+    if (entryCount > UINT32_MAX / 2)
+        return NULL;
+    
+    OUUnzipDirectoryIndex *index = calloc(1, sizeof(*index));
+    index->count = entryCount;
+    index->records = malloc(MAX(entryCount, 1U) * sizeof(*index->records));
+    
+    NSUInteger position = 0;
+    for (NSUInteger recordIndex = 0; recordIndex < entryCount; recordIndex++) {
+        if (position + OU_CENTRAL_HEADER_SIZE > length || _readLong(bytes + position) != OU_CENTRAL_HEADER_SIGNATURE)
+            goto fail;
+        
+        const uint8_t *header = bytes + position;
+        uint16_t nameLength = _readShort(header + 28);
+        uint16_t extraLength = _readShort(header + 30);
+        uint16_t commentLength = _readShort(header + 32);
+        NSUInteger recordLength = OU_CENTRAL_HEADER_SIZE + nameLength + extraLength + commentLength;
+        if (position + recordLength > length)
+            goto fail;
+        
+        OUUnzipDirectoryRecord *record = &index->records[recordIndex];
+        record->centralHeaderOffset = directoryOffset + (uint32_t)position;
+        record->nameOffset = (uint32_t)(position + OU_CENTRAL_HEADER_SIZE);
+        record->nameLength = nameLength;
+        record->compressionMethod = _readShort(header + 10);
+        record->dosDate = _readLong(header + 12);
+        record->crc = _readLong(header + 16);
+        record->compressedSize = _readLong(header + 20);
+        record->uncompressedSize = _readLong(header + 24);
+        record->externalAttributes = _readLong(header + 38);
+        
+        position += recordLength;
+    }
+    
+    index->directory = [directory retain];
+    
+    // Exact-name table. The first record with a given name wins, matching the old linear search.
+    uint32_t slotCount = 16;
+    while (slotCount < 2 * entryCount)
+        slotCount <<= 1;
+    index->hashSlots = calloc(slotCount, sizeof(*index->hashSlots));
+    index->hashMask = slotCount - 1;
+    
+    for (NSUInteger recordIndex = 0; recordIndex < entryCount; recordIndex++) {
+        const OUUnzipDirectoryRecord *record = &index->records[recordIndex];
+        const char *name = (const char *)bytes + record->nameOffset;
+        
+        uint32_t slot = _hashName(name, record->nameLength) & index->hashMask;
+        BOOL duplicate = NO;
+        while (index->hashSlots[slot]) {
+            const OUUnzipDirectoryRecord *other = &index->records[index->hashSlots[slot] - 1];
+            if (_compareNames(name, record->nameLength, (const char *)bytes + other->nameOffset, other->nameLength) == 0) {
+                duplicate = YES;
+                break;
+            }
+            slot = (slot + 1) & index->hashMask;
+        }
+        if (!duplicate)
+            index->hashSlots[slot] = (uint32_t)recordIndex + 1;
+    }
+    
+    // Name-sorted permutation for prefix queries.
+    index->sortedNames = malloc(MAX(entryCount, 1U) * sizeof(*index->sortedNames));
+    for (NSUInteger recordIndex = 0; recordIndex < entryCount; recordIndex++) {
+        const OUUnzipDirectoryRecord *record = &index->records[recordIndex];
+        index->sortedNames[recordIndex] = (OUUnzipSortedName){(const char *)bytes + record->nameOffset, record->nameLength, (uint32_t)recordIndex};
+    }
+    qsort(index->sortedNames, entryCount, sizeof(*index->sortedNames), _compareSortedNames);
+    
+    return index;
+    
+fail:
+    free(index->records);
+    free(index);
+    return NULL;
+}
+
+void OUUnzipDirectoryIndexDestroy(OUUnzipDirectoryIndex *index)
+{
+    if (!index)
+        return;
+    [index->directory release];
+    free(index->records);
+    free(index->hashSlots);
+    free(index->sortedNames);
+    free(index);
+}
+
+NSUInteger OUUnzipDirectoryIndexCount(const OUUnzipDirectoryIndex *index)
+{
+    return index->count;
+}
+
+const OUUnzipDirectoryRecord *OUUnzipDirectoryIndexRecordAtIndex(const OUUnzipDirectoryIndex *index, NSUInteger recordIndex)
+{
+    OBPRECONDITION(recordIndex < index->count);
+    return &index->records[recordIndex];
+}
+
+const char *OUUnzipDirectoryIndexNameOfRecord(const OUUnzipDirectoryIndex *index, const OUUnzipDirectoryRecord *record)
+{
+    return (const char *)[index->directory bytes] + record->nameOffset;
+}
+
+NSUInteger OUUnzipDirectoryIndexFind(const OUUnzipDirectoryIndex *index, const char *name, size_t nameLength)
+{
+    const char *bytes = [index->directory bytes];
+    uint32_t slot = _hashName(name, nameLength) & index->hashMask;
+    
+    while (index->hashSlots[slot]) {
+        NSUInteger recordIndex = index->hashSlots[slot] - 1;
+        const OUUnzipDirectoryRecord *record = &index->records[recordIndex];
+        if (_compareNames(name, nameLength, bytes + record->nameOffset, record->nameLength) == 0)
+            return recordIndex;
+        slot = (slot + 1) & index->hashMask;
+    }
+    
+    return NSNotFound;
+}
+
+void OUUnzipDirectoryIndexApplyToPrefix(const OUUnzipDirectoryIndex *index, const char *prefix, size_t prefixLength, void (^applier)(NSUInteger recordIndex))
+{
+    // Lower bound: the first sorted name that isn't less than the prefix.
+    NSUInteger low = 0, high = index->count;
+    while (low < high) {
+        NSUInteger middle = low + (high - low) / 2;
+        const OUUnzipSortedName *sortedName = &index->sortedNames[middle];
+        if (_compareNames(sortedName->name, sortedName->nameLength, prefix, prefixLength) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    
+    // Everything with the prefix is contiguous from there. Gather it so we can report in archive order, like the old linear scan.
+    NSUInteger end = low;
+    while (end < index->count && index->sortedNames[end].nameLength >= prefixLength && memcmp(index->sortedNames[end].name, prefix, prefixLength) == 0)
+        end++;
+    
+    NSUInteger matchCount = end - low;
+    if (matchCount == 0)
+        return;
+    
+    uint32_t *matches = malloc(matchCount * sizeof(*matches));
+    for (NSUInteger matchIndex = 0; matchIndex < matchCount; matchIndex++)
+        matches[matchIndex] = index->sortedNames[low + matchIndex].recordIndex;
+    qsort_b(matches, matchCount, sizeof(*matches), ^int(const void *a, const void *b) {
+        uint32_t index1 = *(const uint32_t *)a, index2 = *(const uint32_t *)b;
+        return (index1 < index2) ? -1 : (index1 > index2);
+    });
+    
+    for (NSUInteger matchIndex = 0; matchIndex < matchCount; matchIndex++)
+        applier(matches[matchIndex]);
+    
+    free(matches);
+}
@@ -19,6 +19,11 @@
 - (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contents:(NSData *)contents raw:(BOOL)raw compressionMethod:(unsigned long)comparessionMethod uncompressedSize:(size_t)uncompressedSize crc:(unsigned long)crc date:(NSDate *)date error:(NSError **)outError;
 - (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contents:(NSData *)contents date:(NSDate *)date error:(NSError **)outError;
 
+// These deflate the member in fixed-size chunks as it is read (zip.c keeps the CRC as it goes), so peak memory doesn't depend on the size of the member. The stream is opened if needed and read to its end but not closed; the descriptor is read from its current offset and not closed.
+// Zip files are limited to 4 GB; a member that would carry the archive past that fails with OmniUnzipZipFileTooLarge. A streamed member can fail partway through, after which the archive should be closed and discarded.
+- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contentsOfInputStream:(NSInputStream *)inputStream date:(NSDate *)date error:(NSError **)outError;
+- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contentsOfFileDescriptor:(int)fd date:(NSDate *)date error:(NSError **)outError;
+
 - (BOOL)close:(NSError **)outError;
 
 @end
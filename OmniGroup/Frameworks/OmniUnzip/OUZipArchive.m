@@ -108,7 +108,16 @@ static BOOL _zipError(id self, const char *func, int err, NSError **outError)
 }
 #define ZIP_ERROR(f) _zipError(self, #f, err, outError)
 
-- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contents:(NSData *)contents raw:(BOOL)raw compressionMethod:(unsigned long)comparessionMethod uncompressedSize:(size_t)uncompressedSize crc:(unsigned long)crc date:(NSDate *)date error:(NSError **)outError;
+// The zip format (without the zip64 extensions, which zip.c doesn't write) stores sizes and offsets in 32 bits. Past that the archive would silently wrap, so refuse instead.
+static BOOL _zipTooLargeError(id self, NSString *name, NSError **outError)
+{
+    NSString *description = NSLocalizedStringFromTableInBundle(@"Unable to write zip file.", @"OmniUnzip", OMNI_BUNDLE, @"error description");
+    NSString *reason = [NSString stringWithFormat:NSLocalizedStringFromTableInBundle(@"Adding \"%@\" would make the zip file larger than 4 GB.", @"OmniUnzip", OMNI_BUNDLE, @"error reason"), name];
+    OmniUnzipError(outError, OmniUnzipZipFileTooLarge, description, reason);
+    return NO;
+}
+
+- (BOOL)_openNewEntryNamed:(NSString *)name fileType:(NSString *)fileType raw:(BOOL)raw compressionMethod:(unsigned long)comparessionMethod date:(NSDate *)date error:(NSError **)outError;
 {
     if (date == nil)
         date = [NSDate date];
@@ -148,10 +157,18 @@ static BOOL _zipError(id self, const char *func, int err, NSError **outError)
     if (err != ZIP_OK)
         return ZIP_ERROR(zipOpenNewFileInZip3);
     
-    // Not going to handle large files this way.  Unclear if zip even handles them at all.
-    OBASSERT([contents length] < UINT_MAX);
+    return YES;
+}
 
-    err = zipWriteInFileInZip(_zip, [contents bytes], (unsigned)[contents length]);
+- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contents:(NSData *)contents raw:(BOOL)raw compressionMethod:(unsigned long)comparessionMethod uncompressedSize:(size_t)uncompressedSize crc:(unsigned long)crc date:(NSDate *)date error:(NSError **)outError;
+{
+    if ([contents length] > UINT32_MAX || uncompressedSize > UINT32_MAX)
+        return _zipTooLargeError(self, name, outError);
+    
+    if (![self _openNewEntryNamed:name fileType:fileType raw:raw compressionMethod:comparessionMethod date:date error:outError])
+        return NO;
+    
+    int err = zipWriteInFileInZip(_zip, [contents bytes], (unsigned)[contents length]);
     if (err != ZIP_OK)
         return ZIP_ERROR(zipWriteInFileInZip);
     
@@ -165,6 +182,9 @@ static BOOL _zipError(id self, const char *func, int err, NSError **outError)
             return ZIP_ERROR(zipCloseFileInZip);
     }
     
+    if (zipGetCurrentOffset(_zip) > UINT32_MAX)
+        return _zipTooLargeError(self, name, outError);
+    
     return YES;
 }
 
@@ -174,6 +194,93 @@ static BOOL _zipError(id self, const char *func, int err, NSError **outError)
     return [self appendEntryNamed:name fileType:fileType contents:contents raw:NO compressionMethod:Z_DEFLATED uncompressedSize:0 crc:0 date:date error:outError];
 }
 
+#define OU_STREAMING_CHUNK_SIZE (256*1024)
+
+// Common loop for the streaming appenders. 'readChunk' fills the buffer and returns the number of bytes read, zero at the end, or -1 after filling in outError.
+- (BOOL)_appendEntryNamed:(NSString *)name fileType:(NSString *)fileType date:(NSDate *)date error:(NSError **)outError readingChunksWithBlock:(NSInteger (^)(uint8_t *buffer, NSUInteger bufferSize, NSError **outError))readChunk;
+{
+    if (![self _openNewEntryNamed:name fileType:fileType raw:NO compressionMethod:Z_DEFLATED date:date error:outError])
+        return NO;
+    
+    uint8_t *buffer = malloc(OU_STREAMING_CHUNK_SIZE);
+    uint64_t uncompressedSize = 0;
+    BOOL success = YES;
+    int err;
+    
+    while (YES) {
+        NSInteger bytesRead = readChunk(buffer, OU_STREAMING_CHUNK_SIZE, outError);
+        if (bytesRead < 0) {
+            success = NO;
+            break;
+        }
+        if (bytesRead == 0)
+            break;
+        
+        uncompressedSize += bytesRead;
+        if (uncompressedSize > UINT32_MAX) {
+            success = _zipTooLargeError(self, name, outError);
+            break;
+        }
+        
+        err = zipWriteInFileInZip(_zip, buffer, (unsigned)bytesRead);
+        if (err != ZIP_OK) {
+            success = ZIP_ERROR(zipWriteInFileInZip);
+            break;
+        }
+        
+        // Incompressible input can push the compressed data past the limit before the uncompressed count gets there.
+        if (zipGetCurrentOffset(_zip) > UINT32_MAX) {
+            success = _zipTooLargeError(self, name, outError);
+            break;
+        }
+    }
+    
+    free(buffer);
+    
+    // Close the entry even on failure so that the archive's structure stays consistent; the caller's error is the one we report.
+    err = zipCloseFileInZip(_zip);
+    if (success && err != ZIP_OK)
+        return ZIP_ERROR(zipCloseFileInZip);
+    
+    // The compressor's final flush can carry the archive over, too.
+    if (success && zipGetCurrentOffset(_zip) > UINT32_MAX)
+        return _zipTooLargeError(self, name, outError);
+    
+    return success;
+}
+
+- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contentsOfInputStream:(NSInputStream *)inputStream date:(NSDate *)date error:(NSError **)outError;
+{
+    OBPRECONDITION(inputStream);
+    
+    if ([inputStream streamStatus] == NSStreamStatusNotOpen)
+        [inputStream open];
+    
+    return [self _appendEntryNamed:name fileType:fileType date:date error:outError readingChunksWithBlock:^NSInteger(uint8_t *buffer, NSUInteger bufferSize, NSError **outReadError) {
+        NSInteger bytesRead = [inputStream read:buffer maxLength:bufferSize];
+        if (bytesRead < 0 && outReadError)
+            *outReadError = [inputStream streamError];
+        return bytesRead;
+    }];
+}
+
+- (BOOL)appendEntryNamed:(NSString *)name fileType:(NSString *)fileType contentsOfFileDescriptor:(int)fd date:(NSDate *)date error:(NSError **)outError;
+{
+    OBPRECONDITION(fd >= 0);
+    
+    return [self _appendEntryNamed:name fileType:fileType date:date error:outError readingChunksWithBlock:^NSInteger(uint8_t *buffer, NSUInteger bufferSize, NSError **outReadError) {
+        while (YES) {
+            ssize_t bytesRead = read(fd, buffer, bufferSize);
+            if (bytesRead >= 0)
+                return bytesRead;
+            if (errno != EINTR) {
+                OBErrorWithErrno(outReadError, errno, "read", nil, nil);
+                return -1;
+            }
+        }
+    }];
+}
+
 - (BOOL)close:(NSError **)outError;
 {
     OBPRECONDITION(_zip);
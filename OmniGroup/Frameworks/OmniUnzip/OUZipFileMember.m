@@ -10,6 +10,7 @@
 #import <OmniUnzip/OUZipArchive.h>
 #import <OmniUnzip/OUErrors.h>
 #import <Foundation/NSFileWrapper.h>
+#import <OmniBase/system.h>
 
 RCS_ID("$Id$");
 
@@ -74,7 +75,19 @@ RCS_ID("$Id$");
     if (![NSString isEmptyString:fileNamePrefix])
         name = [fileNamePrefix stringByAppendingFormat:@"/%@", name];
     
-    return [zip appendEntryNamed:name fileType:NSFileTypeRegular contents:[self contents] date:[self date] error:outError];
+    if (_contents != nil)
+        return [zip appendEntryNamed:name fileType:NSFileTypeRegular contents:_contents date:[self date] error:outError];
+    
+    // Stream files from disk rather than mapping the whole thing, so archiving huge files doesn't need address space (or memory) proportional to their size.
+    int fd = open([[NSFileManager defaultManager] fileSystemRepresentationWithPath:_filePath], O_RDONLY);
+    if (fd < 0) {
+        OBErrorWithErrno(outError, errno, "open", _filePath, nil);
+        return NO;
+    }
+    
+    BOOL success = [zip appendEntryNamed:name fileType:NSFileTypeRegular contentsOfFileDescriptor:fd date:[self date] error:outError];
+    close(fd);
+    return success;
 }
 
 @end
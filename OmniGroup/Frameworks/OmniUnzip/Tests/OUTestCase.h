@@ -0,0 +1,36 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#define STEnableDeprecatedAssertionMacros
+#import "OFTestCase.h"
+
+#import <OmniBase/rcsid.h>
+#import <OmniBase/OBUtilities.h>
+#import <OmniBase/NSError-OBExtensions.h>
+
+@class OUZipArchive;
+
+@interface OUTestCase : OFTestCase
+{
+    NSString *_scratchDirectory;
+}
+
+// A path in a directory of this test's own, which is removed again in -tearDown.
+- (NSString *)scratchPathNamed:(NSString *)name;
+
+// Writes an archive holding 'memberCount' members named by OUTestMemberName() with the contents from OUTestMemberContents(). Even-numbered members are stored, odd ones deflated.
+- (NSString *)writeArchiveNamed:(NSString *)name memberCount:(NSUInteger)memberCount;
+
+@end
+
+extern NSString *OUTestMemberName(NSUInteger memberIndex);
+extern NSData *OUTestMemberContents(NSUInteger memberIndex);
+
+// Appends a member with compression method 0 (stored), which OUZipArchive only writes in raw mode. Pass a CRC other than the contents' own to write a damaged member.
+extern BOOL OUTestAppendStoredMember(OUZipArchive *zip, NSString *name, NSData *contents, unsigned long crc, NSError **outError);
@@ -0,0 +1,88 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OUTestCase.h"
+
+#import <OmniFoundation/OFCRC.h>
+#import <OmniFoundation/OFXMLIdentifier.h>
+#import <OmniUnzip/OUZipArchive.h>
+
+RCS_ID("$Id$");
+
+@implementation OUTestCase
+
+- (void)setUp;
+{
+    [super setUp];
+    
+    _scratchDirectory = [[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"%@-%@", NSStringFromClass([self class]), [OFXMLCreateID() autorelease]]] copy];
+    
+    NSError *error = nil;
+    if (![[NSFileManager defaultManager] createDirectoryAtPath:_scratchDirectory withIntermediateDirectories:YES attributes:nil error:&error]) {
+        NSLog(@"Unable to create scratch directory at '%@': %@", _scratchDirectory, [error toPropertyList]);
+        exit(1);
+    }
+}
+
+- (void)tearDown;
+{
+    [[NSFileManager defaultManager] removeItemAtPath:_scratchDirectory error:NULL];
+    [_scratchDirectory release];
+    _scratchDirectory = nil;
+    
+    [super tearDown];
+}
+
+- (NSString *)scratchPathNamed:(NSString *)name;
+{
+    return [_scratchDirectory stringByAppendingPathComponent:name];
+}
+
+- (NSString *)writeArchiveNamed:(NSString *)name memberCount:(NSUInteger)memberCount;
+{
+    NSString *path = [self scratchPathNamed:name];
+    NSError *error = nil;
+    
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(zip, @"Creating %@: %@", path, [error toPropertyList]);
+    
+    for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+        NSString *memberName = OUTestMemberName(memberIndex);
+        NSData *contents = OUTestMemberContents(memberIndex);
+        BOOL appended;
+        if (memberIndex % 2 == 0)
+            appended = OUTestAppendStoredMember(zip, memberName, contents, OFCRC32Update(0, [contents bytes], [contents length]), &error);
+        else
+            appended = [zip appendEntryNamed:memberName fileType:NSFileTypeRegular contents:contents date:nil error:&error];
+        STAssertTrue(appended, @"Appending %@: %@", memberName, [error toPropertyList]);
+    }
+    
+    OBShouldNotError([zip close:&error]);
+    return path;
+}
+
+@end
+
+NSString *OUTestMemberName(NSUInteger memberIndex)
+{
+    return [NSString stringWithFormat:@"folder-%lu/member-%05lu.txt", memberIndex / 100, memberIndex];
+}
+
+// A few hundred bytes to a few kilobytes of compressible text, different for every member.
+NSData *OUTestMemberContents(NSUInteger memberIndex)
+{
+    NSMutableString *contents = [NSMutableString string];
+    NSUInteger lineCount = 1 + (memberIndex * 7) % 97;
+    for (NSUInteger lineIndex = 0; lineIndex < lineCount; lineIndex++)
+        [contents appendFormat:@"Member %lu, line %lu of %lu.\n", memberIndex, lineIndex, lineCount];
+    return [contents dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+BOOL OUTestAppendStoredMember(OUZipArchive *zip, NSString *name, NSData *contents, unsigned long crc, NSError **outError)
+{
+    return [zip appendEntryNamed:name fileType:NSFileTypeRegular contents:contents raw:YES compressionMethod:0 uncompressedSize:[contents length] crc:crc date:nil error:outError];
+}
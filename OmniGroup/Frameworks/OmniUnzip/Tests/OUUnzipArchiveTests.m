@@ -0,0 +1,269 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OUTestCase.h"
+
+#import <OmniFoundation/OFCRC.h>
+#import <OmniUnzip/OUErrors.h>
+#import <OmniUnzip/OUUnzipArchive.h>
+#import <OmniUnzip/OUUnzipEntry.h>
+#import <OmniUnzip/OUZipArchive.h>
+#import <libkern/OSAtomic.h>
+#import <mach/mach.h>
+#import <malloc/malloc.h>
+
+RCS_ID("$Id$");
+
+@interface OUUnzipArchiveTests : OUTestCase
+@end
+
+@implementation OUUnzipArchiveTests
+
+// Every entry is handed to the handler exactly once, with the same contents a serial read gives.
+- (void)testConcurrentReadsMatchSerial;
+{
+    NSError *error = nil;
+    NSUInteger memberCount = 300;
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:[self writeArchiveNamed:@"members.zip" memberCount:memberCount] error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    
+    for (NSUInteger maximumConcurrency = 0; maximumConcurrency <= 4; maximumConcurrency += 2) {
+        NSMutableDictionary *results = [NSMutableDictionary dictionary];
+        NSMutableArray *errors = [NSMutableArray array];
+        OBShouldNotError([archive readDataForEntries:[archive entries] maximumConcurrency:maximumConcurrency handler:^(OUUnzipEntry *entry, NSData *data, NSError *entryError) {
+            @synchronized(results) {
+                if (data) {
+                    STAssertNil([results objectForKey:[entry name]], @"%@ was read twice", [entry name]);
+                    [results setObject:data forKey:[entry name]];
+                } else
+                    [errors addObject:entryError];
+            }
+        } error:&error]);
+        
+        shouldBeEqual(errors, [NSArray array]);
+        STAssertEquals([results count], memberCount, nil);
+        for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+            NSString *name = OUTestMemberName(memberIndex);
+            shouldBeEqual([results objectForKey:name], OUTestMemberContents(memberIndex));
+            shouldBeEqual([results objectForKey:name], [archive dataForEntry:[archive entryNamed:name] error:NULL]);
+        }
+    }
+}
+
+- (void)testChecksumMismatchIsReported;
+{
+    NSError *error = nil;
+    NSString *path = [self scratchPathNamed:@"damaged.zip"];
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    
+    NSData *contents = OUTestMemberContents(1);
+    unsigned long crc = OFCRC32Update(0, [contents bytes], [contents length]);
+    OBShouldNotError(OUTestAppendStoredMember(zip, @"good-stored", contents, crc, &error));
+    OBShouldNotError(OUTestAppendStoredMember(zip, @"bad-stored", contents, crc ^ 1, &error));
+    OBShouldNotError([zip appendEntryNamed:@"good-deflated" fileType:NSFileTypeRegular contents:contents date:nil error:&error]);
+    OBShouldNotError([zip close:&error]);
+    
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    
+    NSMutableDictionary *results = [NSMutableDictionary dictionary];
+    OBShouldNotError([archive readDataForAllEntriesWithHandler:^(OUUnzipEntry *entry, NSData *data, NSError *entryError) {
+        @synchronized(results) {
+            [results setObject:(data ? (id)data : (id)entryError) forKey:[entry name]];
+        }
+    } error:&error]);
+    
+    STAssertEquals([results count], (NSUInteger)3, nil);
+    shouldBeEqual([results objectForKey:@"good-stored"], contents);
+    shouldBeEqual([results objectForKey:@"good-deflated"], contents);
+    
+    NSError *mismatch = [results objectForKey:@"bad-stored"];
+    STAssertTrue([mismatch isKindOfClass:[NSError class]], @"Damaged entry should be reported with an error, not data");
+    shouldBeEqual([mismatch domain], OmniUnzipErrorDomain);
+    STAssertEquals([mismatch code], (NSInteger)OmniUnzipEntryChecksumMismatch, nil);
+    
+    // The single-entry read agrees
+    error = nil;
+    STAssertNil([archive dataForEntry:[archive entryNamed:@"bad-stored"] error:&error], nil);
+    STAssertEquals([error code], (NSInteger)OmniUnzipEntryChecksumMismatch, nil);
+}
+
+typedef struct {
+    int32_t active;
+    int32_t peak;
+    int32_t handled;
+} ConcurrencyCounts;
+
+- (void)testConcurrencyIsBounded;
+{
+    NSError *error = nil;
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:[self writeArchiveNamed:@"members.zip" memberCount:200] error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    
+    for (NSUInteger maximumConcurrency = 1; maximumConcurrency <= 3; maximumConcurrency++) {
+        __block ConcurrencyCounts counts = {0, 0, 0};
+        OBShouldNotError([archive readDataForEntries:[archive entries] maximumConcurrency:maximumConcurrency handler:^(OUUnzipEntry *entry, NSData *data, NSError *entryError) {
+            int32_t active = OSAtomicIncrement32Barrier(&counts.active);
+            int32_t peak;
+            while (active > (peak = counts.peak) && !OSAtomicCompareAndSwap32Barrier(peak, active, &counts.peak))
+                ;
+            usleep(200); // Give the other workers a chance to pile up
+            OSAtomicIncrement32Barrier(&counts.handled);
+            OSAtomicDecrement32Barrier(&counts.active);
+        } error:&error]);
+        
+        STAssertEquals(counts.handled, (int32_t)200, nil);
+        STAssertTrue(counts.peak >= 1 && (NSUInteger)counts.peak <= maximumConcurrency, @"At most %lu entries should be in flight at once, but saw %d", maximumConcurrency, counts.peak);
+    }
+}
+
+- (void)testConcurrentExtractionScaling;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    NSError *error = nil;
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:[self writeArchiveNamed:@"members.zip" memberCount:5000] error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    NSArray *entries = [archive entries];
+    
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSTimeInterval serialTime = 0;
+    for (NSUInteger maximumConcurrency = 1; maximumConcurrency <= processorCount; maximumConcurrency *= 2) {
+        __block int32_t bytesRead = 0;
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        OBShouldNotError([archive readDataForEntries:entries maximumConcurrency:maximumConcurrency handler:^(OUUnzipEntry *entry, NSData *data, NSError *entryError) {
+            OSAtomicAdd32(data ? (int32_t)[data length] : 0, &bytesRead);
+        } error:&error]);
+        NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+        if (maximumConcurrency == 1)
+            serialTime = elapsed;
+        
+        NSLog(@"%2lu workers: %lu entries (%d bytes) in %.3f s, %.2fx", maximumConcurrency, [entries count], bytesRead, elapsed, serialTime / elapsed);
+    }
+}
+
+// Stored entries and raw reads come back as views into the mapped archive rather than copies, and stay usable after the archive is gone.
+- (void)testStoredEntriesAreNotCopied;
+{
+    NSError *error = nil;
+    NSString *path = [self writeArchiveNamed:@"members.zip" memberCount:4];
+    NSData *stored, *storedAgain, *raw, *deflated, *deflatedAgain;
+    
+    @autoreleasepool {
+        OUUnzipArchive *archive = [[OUUnzipArchive alloc] initWithPath:path error:&error];
+        STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+        
+        OUUnzipEntry *storedEntry = [archive entryNamed:OUTestMemberName(2)];
+        OUUnzipEntry *deflatedEntry = [archive entryNamed:OUTestMemberName(3)];
+        STAssertEquals([storedEntry compressionMethod], 0UL, nil);
+        
+        stored = [[archive dataForEntry:storedEntry error:NULL] retain];
+        storedAgain = [[archive dataForEntry:storedEntry error:NULL] retain];
+        raw = [[archive dataForEntry:storedEntry raw:YES error:NULL] retain];
+        deflated = [[archive dataForEntry:deflatedEntry error:NULL] retain];
+        deflatedAgain = [[archive dataForEntry:deflatedEntry error:NULL] retain];
+        
+        [archive release];
+    }
+    
+    // Copies would each have bytes of their own.
+    STAssertTrue([stored bytes] == [storedAgain bytes], @"Stored entries should be read in place");
+    STAssertTrue([stored bytes] == [raw bytes], @"Raw reads should be read in place");
+    STAssertTrue([deflated bytes] != [deflatedAgain bytes], @"Inflated entries need buffers of their own");
+    
+    shouldBeEqual(stored, OUTestMemberContents(2));
+    shouldBeEqual(raw, OUTestMemberContents(2));
+    shouldBeEqual(deflated, OUTestMemberContents(3));
+    
+    [stored release];
+    [storedAgain release];
+    [raw release];
+    [deflated release];
+    [deflatedAgain release];
+}
+
+static void _fillLargeMember(NSMutableData *data, NSUInteger memberIndex)
+{
+    uint32_t *words = [data mutableBytes];
+    NSUInteger wordCount = [data length] / sizeof(*words);
+    for (NSUInteger wordIndex = 0; wordIndex < wordCount; wordIndex++)
+        words[wordIndex] = (uint32_t)(wordIndex * 0x9e3779b9 + memberIndex);
+}
+
+static size_t _mallocBytesInUse(void)
+{
+    malloc_statistics_t statistics;
+    malloc_zone_statistics(NULL, &statistics);
+    return statistics.size_in_use;
+}
+
+static mach_vm_size_t _residentSize(void)
+{
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+}
+
+// Reading big stored members shouldn't allocate their size again. Resident size still grows as the CRC check faults in the file's pages, but those are clean and the system can drop them under pressure, unlike a malloc'd copy.
+- (void)testLargeStoredEntries;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    NSError *error = nil;
+    NSUInteger memberCount = 4;
+    NSUInteger memberLength = 256*1024*1024;
+    NSString *path = [self scratchPathNamed:@"large.zip"];
+    
+    @autoreleasepool {
+        OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+        NSMutableData *contents = [NSMutableData dataWithLength:memberLength];
+        for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+            _fillLargeMember(contents, memberIndex);
+            OBShouldNotError(OUTestAppendStoredMember(zip, OUTestMemberName(memberIndex), contents, OFCRC32Update(0, [contents bytes], [contents length]), &error));
+        }
+        OBShouldNotError([zip close:&error]);
+    }
+    
+    NSMutableArray *results = [NSMutableArray array];
+    size_t mallocBefore = _mallocBytesInUse();
+    mach_vm_size_t residentBefore = _residentSize();
+    
+    @autoreleasepool {
+        OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:path error:&error] autorelease];
+        STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+        
+        for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+            NSData *data = [archive dataForEntry:[archive entryNamed:OUTestMemberName(memberIndex)] error:&error];
+            STAssertNotNil(data, @"Reading: %@", [error toPropertyList]);
+            if (data)
+                [results addObject:data];
+        }
+    }
+    
+    size_t mallocAfter = _mallocBytesInUse();
+    mach_vm_size_t residentAfter = _residentSize();
+    NSLog(@"Read %lu stored members of %lu bytes: malloc in use grew by %ld bytes, resident size by %lld bytes", memberCount, memberLength, (long)(mallocAfter - mallocBefore), (long long)(residentAfter - residentBefore));
+    STAssertTrue(mallocAfter < mallocBefore + memberLength / 16, @"Stored members should not be copied");
+    
+    // The archive is gone, but the data is still good.
+    STAssertEquals([results count], memberCount, nil);
+    NSMutableData *expected = [NSMutableData dataWithLength:memberLength];
+    for (NSUInteger memberIndex = 0; memberIndex < [results count]; memberIndex++) {
+        _fillLargeMember(expected, memberIndex);
+        STAssertTrue([[results objectAtIndex:memberIndex] isEqualToData:expected], @"Contents of member %lu", memberIndex);
+    }
+}
+
+@end
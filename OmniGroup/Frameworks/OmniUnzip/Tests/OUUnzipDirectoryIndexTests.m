@@ -0,0 +1,235 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OUTestCase.h"
+
+#import <OmniUnzip/OUErrors.h>
+#import <OmniUnzip/OUUnzipArchive.h>
+#import <OmniUnzip/OUUnzipEntry.h>
+#import <OmniUnzip/OUZipArchive.h>
+#import <zlib.h>
+
+RCS_ID("$Id$");
+
+// Exercises the central directory index behind OUUnzipArchive's lookups (see OUUnzipDirectoryIndex.h) through the archive's own API.
+@interface OUUnzipDirectoryIndexTests : OUTestCase
+@end
+
+// What -entryNamed: and -entriesWithNamePrefix: did before the index: a walk over every entry, in archive order.
+static OUUnzipEntry *_linearEntryNamed(OUUnzipArchive *archive, NSString *name)
+{
+    for (OUUnzipEntry *entry in [archive entries])
+        if ([[entry name] isEqualToString:name])
+            return entry;
+    return nil;
+}
+
+static NSArray *_linearEntriesWithNamePrefix(OUUnzipArchive *archive, NSString *prefix)
+{
+    NSMutableArray *matches = [NSMutableArray array];
+    for (OUUnzipEntry *entry in [archive entries])
+        if ([[entry name] hasPrefix:prefix])
+            [matches addObject:entry];
+    return matches;
+}
+
+static void _putLittleShort(NSMutableData *data, NSUInteger offset, uint16_t value)
+{
+    uint8_t bytes[2] = {value & 0xff, value >> 8};
+    [data replaceBytesInRange:NSMakeRange(offset, 2) withBytes:bytes];
+}
+
+static void _putLittleLong(NSMutableData *data, NSUInteger offset, uint32_t value)
+{
+    uint8_t bytes[4] = {value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24};
+    [data replaceBytesInRange:NSMakeRange(offset, 4) withBytes:bytes];
+}
+
+static uint32_t _getLittleLong(NSData *data, NSUInteger offset)
+{
+    const uint8_t *bytes = (const uint8_t *)[data bytes] + offset;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// OUZipArchive writes no archive comment, so the end-of-directory record is the last 22 bytes.
+#define END_RECORD_SIZE (22)
+
+@implementation OUUnzipDirectoryIndexTests
+
+- (OUUnzipArchive *)_openArchiveWithData:(NSData *)data named:(NSString *)name error:(NSError **)outError;
+{
+    NSString *path = [self scratchPathNamed:name];
+    STAssertTrue([data writeToFile:path atomically:NO], nil);
+    return [[[OUUnzipArchive alloc] initWithPath:path error:outError] autorelease];
+}
+
+- (void)testLookupsMatchLinearScan;
+{
+    NSError *error = nil;
+    NSUInteger memberCount = 1000;
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:[self writeArchiveNamed:@"members.zip" memberCount:memberCount] error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    STAssertEquals([archive entryCount], memberCount, nil);
+    
+    for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+        NSString *name = OUTestMemberName(memberIndex);
+        OUUnzipEntry *entry = [archive entryNamed:name];
+        STAssertNotNil(entry, @"Looking up %@", name);
+        STAssertTrue(entry == _linearEntryNamed(archive, name), @"Looking up %@", name);
+    }
+    STAssertNil([archive entryNamed:@"folder-0"], nil);
+    STAssertNil([archive entryNamed:@"folder-0/member-00000.tx"], nil);
+    STAssertNil([archive entryNamed:@"folder-0/member-00000.txt2"], nil);
+    STAssertNil([archive entryNamed:@""], nil);
+    
+    NSArray *prefixes = [NSArray arrayWithObjects:@"", @"f", @"folder-1", @"folder-1/", @"folder-9/member-0099", @"folder-9/member-00999.txt", @"folder-9/member-00999.txt/", @"folder-10", @"zzz", @"a", nil];
+    for (NSString *prefix in prefixes) {
+        NSArray *matches = [archive entriesWithNamePrefix:prefix];
+        NSArray *expected = _linearEntriesWithNamePrefix(archive, prefix);
+        STAssertEquals([matches count], [expected count], @"Prefix \"%@\"", prefix);
+        STAssertTrue([matches isEqualToArray:expected], @"Prefix \"%@\" should match the same entries in archive order", prefix);
+    }
+    STAssertEquals([[archive entriesWithNamePrefix:@"folder-1/"] count], (NSUInteger)100, nil);
+}
+
+- (void)testNonASCIINames;
+{
+    NSError *error = nil;
+    NSString *path = [self scratchPathNamed:@"names.zip"];
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    NSData *contents = OUTestMemberContents(0);
+    OBShouldNotError([zip appendEntryNamed:@"café/menu.txt" fileType:NSFileTypeRegular contents:contents date:nil error:&error]);
+    OBShouldNotError([zip appendEntryNamed:@"cafe/menu.txt" fileType:NSFileTypeRegular contents:contents date:nil error:&error]);
+    OBShouldNotError([zip close:&error]);
+    
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    
+    // Precomposed or decomposed, the name finds the same entry, and only that one.
+    OUUnzipEntry *entry = [archive entryNamed:@"café/menu.txt"];
+    STAssertNotNil(entry, nil);
+    STAssertTrue([archive entryNamed:@"cafe\u0301/menu.txt"] == entry, nil);
+    STAssertTrue([archive entryNamed:@"cafe/menu.txt"] != entry, nil);
+    shouldBeEqual([archive entriesWithNamePrefix:@"café"], [NSArray arrayWithObject:entry]);
+    shouldBeEqual([archive entriesWithNamePrefix:@"cafe\u0301/"], [NSArray arrayWithObject:entry]);
+}
+
+// Lookups by name find the first of several entries with the same name; prefix lookups find them all.
+- (void)testDuplicateNames;
+{
+    NSError *error = nil;
+    NSString *path = [self scratchPathNamed:@"duplicates.zip"];
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    OBShouldNotError([zip appendEntryNamed:@"dup.txt" fileType:NSFileTypeRegular contents:OUTestMemberContents(1) date:nil error:&error]);
+    OBShouldNotError([zip appendEntryNamed:@"other.txt" fileType:NSFileTypeRegular contents:OUTestMemberContents(2) date:nil error:&error]);
+    OBShouldNotError([zip appendEntryNamed:@"dup.txt" fileType:NSFileTypeRegular contents:OUTestMemberContents(3) date:nil error:&error]);
+    OBShouldNotError([zip appendEntryNamed:@"dup.txt/child" fileType:NSFileTypeRegular contents:OUTestMemberContents(4) date:nil error:&error]);
+    OBShouldNotError([zip close:&error]);
+    
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    STAssertEquals([archive entryCount], (NSUInteger)4, nil);
+    
+    NSArray *entries = [archive entries];
+    OUUnzipEntry *entry = [archive entryNamed:@"dup.txt"];
+    STAssertTrue(entry == [entries objectAtIndex:0], @"The first entry with the name should win");
+    shouldBeEqual([archive dataForEntry:entry error:NULL], OUTestMemberContents(1));
+    
+    NSArray *expected = [NSArray arrayWithObjects:[entries objectAtIndex:0], [entries objectAtIndex:2], [entries objectAtIndex:3], nil];
+    shouldBeEqual([archive entriesWithNamePrefix:@"dup.txt"], expected);
+    shouldBeEqual([archive entriesWithNamePrefix:@"dup.txt"], _linearEntriesWithNamePrefix(archive, @"dup.txt"));
+}
+
+// Entry objects are made on demand, once per record, however they are asked for and from however many threads.
+- (void)testEntriesAreCreatedLazily;
+{
+    NSError *error = nil;
+    NSUInteger memberCount = 2000;
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:[self writeArchiveNamed:@"members.zip" memberCount:memberCount] error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    
+    OUUnzipEntry *firstLookups[memberCount];
+    OUUnzipEntry **lookups = firstLookups;
+    dispatch_apply(memberCount * 4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iteration) {
+        NSUInteger memberIndex = iteration / 4;
+        OUUnzipEntry *entry = [archive entryNamed:OUTestMemberName(memberIndex)];
+        if (iteration % 4 == 0)
+            lookups[memberIndex] = entry;
+    });
+    
+    NSArray *entries = [archive entries];
+    STAssertEquals([entries count], memberCount, nil);
+    for (NSUInteger memberIndex = 0; memberIndex < memberCount; memberIndex++) {
+        OUUnzipEntry *entry = [entries objectAtIndex:memberIndex];
+        shouldBeEqual([entry name], OUTestMemberName(memberIndex));
+        STAssertTrue(firstLookups[memberIndex] == entry, @"Every lookup of %@ should give the same object", [entry name]);
+        STAssertTrue([archive entryNamed:[entry name]] == entry, nil);
+        STAssertEquals([entry uncompressedSize], [OUTestMemberContents(memberIndex) length], nil);
+        STAssertEquals([entry compressionMethod], (unsigned long)((memberIndex % 2) ? Z_DEFLATED : 0), nil);
+    }
+}
+
+- (void)_checkDamagedArchive:(NSData *)data description:(NSString *)description;
+{
+    NSError *error = nil;
+    OUUnzipArchive *archive = [self _openArchiveWithData:data named:[description stringByAppendingPathExtension:@"zip"] error:&error];
+    STAssertNil(archive, @"Opening an archive with %@ should fail", description);
+    shouldBeEqual([error domain], OmniUnzipErrorDomain);
+    STAssertEquals([error code], (NSInteger)OmniUnzipUnableToReadZipFileContents, @"Opening an archive with %@", description);
+}
+
+- (void)testMalformedDirectories;
+{
+    NSError *error = nil;
+    NSData *valid = [NSData dataWithContentsOfFile:[self writeArchiveNamed:@"valid.zip" memberCount:3]];
+    NSUInteger endRecord = [valid length] - END_RECORD_SIZE;
+    uint32_t directoryOffset = _getLittleLong(valid, endRecord + 16);
+    
+    [self _checkDamagedArchive:[valid subdataWithRange:NSMakeRange(0, 10)] description:@"too few bytes for an end record"];
+    [self _checkDamagedArchive:[valid subdataWithRange:NSMakeRange(0, endRecord)] description:@"no end record"];
+    [self _checkDamagedArchive:[valid subdataWithRange:NSMakeRange(0, endRecord + END_RECORD_SIZE - 1)] description:@"a truncated end record"];
+    
+    NSMutableData *data = [[valid mutableCopy] autorelease];
+    _putLittleShort(data, endRecord + 8, 4);
+    _putLittleShort(data, endRecord + 10, 4);
+    [self _checkDamagedArchive:data description:@"more entries than directory records"];
+    
+    data = [[valid mutableCopy] autorelease];
+    _putLittleShort(data, endRecord + 8, 2);
+    [self _checkDamagedArchive:data description:@"disagreeing entry counts"];
+    
+    data = [[valid mutableCopy] autorelease];
+    _putLittleLong(data, endRecord + 12, _getLittleLong(valid, endRecord + 12) + 1);
+    [self _checkDamagedArchive:data description:@"a directory running into the end record"];
+    
+    data = [[valid mutableCopy] autorelease];
+    _putLittleLong(data, endRecord + 12, _getLittleLong(valid, endRecord + 12) - 1);
+    [self _checkDamagedArchive:data description:@"a directory size disagreeing with its offset"];
+    
+    // The second record's signature; the first record is 46 bytes plus its name, extra field and comment.
+    const uint8_t *firstRecord = (const uint8_t *)[valid bytes] + directoryOffset;
+    NSUInteger secondRecord = directoryOffset + 46 + (firstRecord[28] | (firstRecord[29] << 8)) + (firstRecord[30] | (firstRecord[31] << 8)) + (firstRecord[32] | (firstRecord[33] << 8));
+    STAssertEquals(_getLittleLong(valid, secondRecord), (uint32_t)0x02014b50, nil);
+    data = [[valid mutableCopy] autorelease];
+    _putLittleLong(data, secondRecord, 0x12345678);
+    [self _checkDamagedArchive:data description:@"a bad central header signature"];
+    
+    // A name length running past the end of the directory
+    data = [[valid mutableCopy] autorelease];
+    _putLittleShort(data, directoryOffset + 28, 0xffff);
+    [self _checkDamagedArchive:data description:@"an oversized name"];
+    
+    // Bytes in front of the archive (as in a self-extractor) are fine; offsets are taken relative to the archive proper.
+    data = [NSMutableData dataWithLength:1000];
+    [data appendData:valid];
+    OUUnzipArchive *archive = [self _openArchiveWithData:data named:@"prefixed.zip" error:&error];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    for (NSUInteger memberIndex = 0; memberIndex < 3; memberIndex++)
+        shouldBeEqual([archive dataForEntry:[archive entryNamed:OUTestMemberName(memberIndex)] error:NULL], OUTestMemberContents(memberIndex));
+}
+
+@end
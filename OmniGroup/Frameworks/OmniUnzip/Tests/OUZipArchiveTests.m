@@ -0,0 +1,91 @@
+// Copyright 2013 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OUTestCase.h"
+
+#import <OmniUnzip/OUErrors.h>
+#import <OmniUnzip/OUUnzipArchive.h>
+#import <OmniUnzip/OUUnzipEntry.h>
+#import <OmniUnzip/OUZipArchive.h>
+#include <fcntl.h>
+
+RCS_ID("$Id$");
+
+@interface OUZipArchiveTests : OUTestCase
+@end
+
+// Claims to be one byte over the 4 GB limit without backing it with any memory; OUZipArchive should refuse it before looking at the bytes.
+@interface OUTestOversizedData : NSData
+@end
+
+@implementation OUTestOversizedData
+
+- (NSUInteger)length;
+{
+    return (NSUInteger)UINT32_MAX + 1;
+}
+
+- (const void *)bytes;
+{
+    OBASSERT_NOT_REACHED("The contents of an oversized member should never be read");
+    return NULL;
+}
+
+@end
+
+@implementation OUZipArchiveTests
+
+- (void)testOversizedDataIsRefused;
+{
+    NSError *error = nil;
+    NSString *path = [self scratchPathNamed:@"oversized.zip"];
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(zip, @"Creating: %@", [error toPropertyList]);
+    
+    NSData *oversized = [[[OUTestOversizedData alloc] init] autorelease];
+    STAssertFalse([zip appendEntryNamed:@"oversized" fileType:NSFileTypeRegular contents:oversized date:nil error:&error], nil);
+    shouldBeEqual([error domain], OmniUnzipErrorDomain);
+    STAssertEquals([error code], (NSInteger)OmniUnzipZipFileTooLarge, nil);
+    
+    // Nothing was written for the refused member, so the archive is still good.
+    NSData *contents = OUTestMemberContents(1);
+    OBShouldNotError([zip appendEntryNamed:@"small" fileType:NSFileTypeRegular contents:contents date:nil error:&error]);
+    OBShouldNotError([zip close:&error]);
+    
+    OUUnzipArchive *archive = [[[OUUnzipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(archive, @"Opening: %@", [error toPropertyList]);
+    STAssertEquals([archive entryCount], (NSUInteger)1, nil);
+    shouldBeEqual([archive dataForEntry:[archive entryNamed:@"small"] error:NULL], contents);
+}
+
+// /dev/zero never runs out; the 4 GB limit is the only thing that stops this append.
+- (void)testStreamingPastFourGigabytesFails;
+{
+    if (![[self class] shouldRunSlowUnitTests]) {
+        NSLog(@"*** SKIPPING slow test [%@ %@]", [self class], NSStringFromSelector(_cmd));
+        return;
+    }
+    
+    NSError *error = nil;
+    NSString *path = [self scratchPathNamed:@"endless.zip"];
+    OUZipArchive *zip = [[[OUZipArchive alloc] initWithPath:path error:&error] autorelease];
+    STAssertNotNil(zip, @"Creating: %@", [error toPropertyList]);
+    
+    int fd = open("/dev/zero", O_RDONLY);
+    STAssertTrue(fd >= 0, nil);
+    
+    STAssertFalse([zip appendEntryNamed:@"endless" fileType:NSFileTypeRegular contentsOfFileDescriptor:fd date:nil error:&error], nil);
+    shouldBeEqual([error domain], OmniUnzipErrorDomain);
+    STAssertEquals([error code], (NSInteger)OmniUnzipZipFileTooLarge, nil);
+    
+    close(fd);
+    
+    // The archive can still be closed (and then thrown away).
+    OBShouldNotError([zip close:&error]);
+}
+
+@end
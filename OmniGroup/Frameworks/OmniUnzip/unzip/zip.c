@@ -16,6 +16,7 @@
 #include <time.h>
 #include "zlib.h"
 #include "zip.h"
+#include <OmniFoundation/OFCRC.h>
 
 #ifdef STDC
 #  include <stddef.h>
@@ -983,7 +984,7 @@ extern int ZEXPORT zipWriteInFileInZip (file, buf, len)
 
     zi->ci.stream.next_in = (void*)buf;
     zi->ci.stream.avail_in = len;
-    zi->ci.crc32 = crc32(zi->ci.crc32,buf,len);
+    zi->ci.crc32 = OFCRC32Update(zi->ci.crc32,buf,len);
 
     while ((err==ZIP_OK) && (zi->ci.stream.avail_in>0))
     {
@@ -1136,6 +1137,25 @@ extern int ZEXPORT zipCloseFileInZip (file)
     return zipCloseFileInZipRaw (file,0,0);
 }
 
+extern uLong ZEXPORT zipGetCurrentOffset (file)
+    zipFile file;
+{
+    zip_internal* zi;
+    long pos;
+
+    if (file == NULL)
+        return 0;
+    zi = (zip_internal*)file;
+
+    pos = ZTELL(zi->z_filefunc,zi->filestream);
+    if (pos < 0)
+        return 0;
+    if (zi->in_opened_file_inzip == 1)
+        pos += zi->ci.pos_in_buffered_data;
+
+    return (uLong)pos - zi->add_position_when_writting_offset;
+}
+
 extern int ZEXPORT zipClose (file, global_comment)
     zipFile file;
     const char* global_comment;
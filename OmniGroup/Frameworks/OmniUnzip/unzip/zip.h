@@ -222,6 +222,13 @@ extern int ZEXPORT zipCloseFileInZipRaw OF((zipFile file,
   uncompressed_size and crc32 are value for the uncompressed size
 */
 
+extern uLong ZEXPORT zipGetCurrentOffset OF((zipFile file));
+/*
+  Return the offset in the zipfile at which the next byte will be written,
+    counting data still buffered for the current file (but not data still
+    held by the compressor)
+*/
+
 extern int ZEXPORT zipClose OF((zipFile file,
                 const char* global_comment));
 /*